@@ -0,0 +1,767 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "aiowr.h"
+
+enum aiowr_op {
+    AIOWR_OP_OPEN = 0,
+    AIOWR_OP_WRITE,
+    AIOWR_OP_CLOSE,
+    AIOWR_OP_QUIT,
+    AIOWR_OPS = AIOWR_OP_QUIT
+};
+
+static const char *aiowr_op_names[AIOWR_OPS] = { "open", "write", "close" };
+
+struct aiowr_op_stats {
+    uint64_t count;
+    uint64_t errors;
+    int64_t total_us;
+    int64_t max_us;
+    uint32_t hist[AIOWR_HIST_BUCKETS];
+};
+
+struct aiowr_slot {
+    int32_t busy;
+    int32_t pending;            /* io_uring completions still to come */
+    int32_t failed;
+    unsigned char *buf;
+    size_t size;
+    char path[AIOWR_PATH_MAX];
+    int64_t submit_us;
+    int64_t last_us;            /* previous completion in the chain */
+    unsigned sq_pos;            /* SQ position of the chain's first SQE */
+};
+
+struct aiowr_ring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    int32_t fixed_bufs;
+};
+
+struct aiowr {
+    int32_t backend;
+    int32_t nslots;
+    int32_t blocking;           /* wait for a slot instead of dropping */
+    size_t slot_size;
+    struct aiowr_slot slots[AIOWR_MAX_SLOTS];
+    struct aiowr_ring ring;
+    pthread_t thread;           /* reaper or writer */
+    int32_t thread_running;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int32_t quit;
+    int32_t failed;             /* io_uring unusable: new files are written inline */
+    int32_t dead;               /* the reaper is gone, nothing completes any more */
+    int32_t inflight;
+    unsigned sq_queued;         /* SQ tail including chains not yet entered */
+    int32_t unsubmitted;        /* files queued in the SQ, not entered */
+    int32_t ring_files;         /* files entered, not completed */
+    int32_t queue[AIOWR_MAX_SLOTS];     /* thread backend, FIFO of slots */
+    uint32_t queue_head, queue_tail;
+
+    /* statistics, under lock */
+    struct aiowr_op_stats ops[AIOWR_OPS];
+    uint64_t submitted;
+    uint64_t batches;           /* io_uring_enter calls that submitted files */
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t sync_writes;
+    int32_t max_inflight;
+    int64_t submit_us;
+};
+
+static int64_t aiowr_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void aiowr_account(struct aiowr *wr, int32_t op, int64_t us, int32_t failed)
+{
+    struct aiowr_op_stats *st = &wr->ops[op];
+    int32_t bucket = 0;
+
+    if (us < 0)
+        us = 0;
+    while (bucket < AIOWR_HIST_BUCKETS - 1 && (1LL << bucket) <= us)
+        bucket++;
+    st->count++;
+    st->errors += failed;
+    st->total_us += us;
+    if (us > st->max_us)
+        st->max_us = us;
+    st->hist[bucket]++;
+}
+
+static void aiowr_release_slot(struct aiowr *wr, struct aiowr_slot *slot)
+{
+    if (!slot->failed) {
+        wr->files++;
+        wr->bytes += slot->size;
+    }
+    slot->busy = 0;
+    wr->inflight--;
+    pthread_cond_broadcast(&wr->cond);
+}
+
+/* Synchronous path for files that do not fit a slot. */
+static int32_t aiowr_write_sync(const char *path, const struct iovec *iov, int32_t iovcnt)
+{
+    size_t total = 0;
+    int32_t i;
+    int fd;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return -1;
+    }
+    if (pwritev(fd, iov, iovcnt, 0) != (ssize_t)total) {
+        fprintf(stderr, "Unable to write %s\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* ---- io_uring backend ---- */
+
+static int aiowr_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aiowr_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int aiowr_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void aiowr_ring_close(struct aiowr_ring *ring)
+{
+    if (ring->sqes && MAP_FAILED != (void *)ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr && MAP_FAILED != ring->cq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr && MAP_FAILED != ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static int32_t aiowr_uring_supported(int fd)
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITE_FIXED,
+                               IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_NOP };
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int32_t ok = 1, i;
+
+    probe = (struct io_uring_probe *)calloc(1, len);
+    if (!probe)
+        return 0;
+    if (aiowr_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (i = 0; i < (int32_t)(sizeof(ops) / sizeof(ops[0])); i++)
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    free(probe);
+    return ok;
+}
+
+static int32_t aiowr_ring_open(struct aiowr *wr)
+{
+    struct aiowr_ring *ring = &wr->ring;
+    struct io_uring_params p;
+    struct io_uring_rsrc_register files;
+    struct iovec iov[AIOWR_MAX_SLOTS];
+    int32_t i;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = aiowr_uring_setup(wr->nslots * 3 + 1, &p);
+    if (ring->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_NODROP) || !aiowr_uring_supported(ring->fd))
+        goto err;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sq_ptr)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == ring->cq_ptr)
+        goto err;
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                                             IORING_OFF_SQES);
+    if (MAP_FAILED == (void *)ring->sqes)
+        goto err;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    /* one direct descriptor per slot, opened and closed by the chain */
+    memset(&files, 0, sizeof(files));
+    files.nr = wr->nslots;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (aiowr_uring_register(ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0)
+        goto err;
+
+    /* pinned once, may fail against RLIMIT_MEMLOCK: plain writes then */
+    for (i = 0; i < wr->nslots; i++) {
+        iov[i].iov_base = wr->slots[i].buf;
+        iov[i].iov_len = wr->slot_size;
+    }
+    ring->fixed_bufs = (aiowr_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+                                             iov, wr->nslots) == 0);
+    return 0;
+
+err:
+    aiowr_ring_close(ring);
+    return -1;
+}
+
+static struct io_uring_sqe *aiowr_get_sqe(struct aiowr_ring *ring, unsigned tail)
+{
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    ring->sq_array[index] = index;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Push count prepared SQEs starting at tail, caller holds the lock. */
+static int32_t aiowr_ring_submit(struct aiowr_ring *ring, unsigned tail, unsigned count)
+{
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+    while (count) {
+        ret = aiowr_uring_enter(ring->fd, count, 0, 0);
+        if (ret < 0) {
+            if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+                continue;
+            fprintf(stderr, "io_uring submit failed (%s)\n", strerror(errno));
+            return -1;
+        }
+        count -= ret;
+    }
+    return 0;
+}
+
+/*
+ * The SQ could not take every queued SQE: chains the kernel consumed still
+ * complete through the reaper, the rest never will. Slots are released only
+ * once nothing of theirs is left in flight, and io_uring is not used again.
+ */
+static void aiowr_uring_fail(struct aiowr *wr)
+{
+    struct aiowr_ring *ring = &wr->ring;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct aiowr_slot *slot;
+    int32_t i, consumed;
+
+    for (i = 0; i < wr->nslots; i++) {
+        slot = &wr->slots[i];
+        if (!slot->busy || !slot->pending)
+            continue;
+        consumed = (int32_t)(head - slot->sq_pos);
+        if (consumed >= 3)
+            continue;           /* entered earlier, completes as usual */
+        if (consumed < 0)
+            consumed = 0;
+        slot->failed = 1;
+        slot->pending -= 3 - consumed;
+        if (consumed)
+            wr->ring_files++;
+        else
+            aiowr_release_slot(wr, slot);
+    }
+    /* the tail is ours, unconsumed SQEs are taken back */
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    wr->sq_queued = head;
+    wr->unsubmitted = 0;
+    if (!wr->failed)
+        fprintf(stderr, "Async writer: io_uring failed, writing inline from now on\n");
+    wr->failed = 1;
+    pthread_cond_broadcast(&wr->cond);
+}
+
+/* Enter every queued chain with one io_uring_enter, caller holds the lock. */
+static int32_t aiowr_uring_submit_queued(struct aiowr *wr)
+{
+    struct aiowr_ring *ring = &wr->ring;
+    unsigned tail = *ring->sq_tail;
+
+    if (!wr->unsubmitted)
+        return 0;
+    if (aiowr_ring_submit(ring, tail, wr->sq_queued - tail) < 0) {
+        aiowr_uring_fail(wr);
+        return -1;
+    }
+    wr->ring_files += wr->unsubmitted;
+    wr->unsubmitted = 0;
+    wr->batches++;
+    return 0;
+}
+
+/* Put a file's chain in the SQ; it is entered with the next batch. */
+static void aiowr_uring_queue(struct aiowr *wr, int32_t index)
+{
+    struct aiowr_ring *ring = &wr->ring;
+    struct aiowr_slot *slot = &wr->slots[index];
+    struct io_uring_sqe *sqe;
+    unsigned tail = wr->sq_queued;
+
+    sqe = aiowr_get_sqe(ring, tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)slot->path;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0644;
+    sqe->file_index = index + 1;
+    sqe->user_data = ((uint64_t)index << 2) | AIOWR_OP_OPEN;
+
+    /* hard link: the descriptor is closed even after a short write */
+    sqe = aiowr_get_sqe(ring, tail + 1);
+    sqe->opcode = ring->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd = index;
+    sqe->addr = (uint64_t)(uintptr_t)slot->buf;
+    sqe->len = slot->size;
+    sqe->off = 0;
+    sqe->buf_index = ring->fixed_bufs ? index : 0;
+    sqe->user_data = ((uint64_t)index << 2) | AIOWR_OP_WRITE;
+
+    sqe = aiowr_get_sqe(ring, tail + 2);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = index + 1;
+    sqe->user_data = ((uint64_t)index << 2) | AIOWR_OP_CLOSE;
+
+    slot->pending = 3;
+    slot->sq_pos = tail;
+    wr->sq_queued = tail + 3;
+    wr->unsubmitted++;
+}
+
+static void *aiowr_reaper_main(void *data)
+{
+    struct aiowr *wr = (struct aiowr *)data;
+    struct aiowr_ring *ring = &wr->ring;
+
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        struct io_uring_cqe *cqe;
+        struct aiowr_slot *slot;
+        int32_t op, index, failed;
+        int64_t now;
+
+        if (head == tail) {
+            /* files queued while the ring was busy go in together */
+            pthread_mutex_lock(&wr->lock);
+            if (!wr->failed)
+                aiowr_uring_submit_queued(wr);
+            pthread_mutex_unlock(&wr->lock);
+            if (aiowr_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                EINTR != errno) {
+                fprintf(stderr, "io_uring wait failed (%s)\n", strerror(errno));
+                /* nothing completes any more, let flush and writers go */
+                pthread_mutex_lock(&wr->lock);
+                wr->failed = 1;
+                wr->dead = 1;
+                pthread_cond_broadcast(&wr->cond);
+                pthread_mutex_unlock(&wr->lock);
+                break;
+            }
+            continue;
+        }
+
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        op = cqe->user_data & 3;
+        index = cqe->user_data >> 2;
+        now = aiowr_now_us();
+        if (AIOWR_OP_QUIT == op) {
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        slot = &wr->slots[index];
+        failed = cqe->res < 0 ||
+                 (AIOWR_OP_WRITE == op && (size_t)cqe->res != slot->size);
+        if (failed && !slot->failed && cqe->res != -ECANCELED)
+            fprintf(stderr, "Async %s of %s failed (%s)\n", aiowr_op_names[op],
+                    slot->path, cqe->res < 0 ? strerror(-cqe->res) : "short write");
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&wr->lock);
+        aiowr_account(wr, op, now - slot->last_us, failed);
+        slot->last_us = now;
+        slot->failed |= failed;
+        if (0 == --slot->pending) {
+            wr->ring_files--;
+            aiowr_release_slot(wr, slot);
+        }
+        pthread_mutex_unlock(&wr->lock);
+    }
+
+    return NULL;
+}
+
+/* ---- writer thread backend ---- */
+
+static void *aiowr_writer_main(void *data)
+{
+    struct aiowr *wr = (struct aiowr *)data;
+
+    pthread_mutex_lock(&wr->lock);
+    for (;;) {
+        struct aiowr_slot *slot;
+        struct iovec iov;
+        int64_t t1, t2, t3;
+        int fd, write_failed = 0;
+
+        while (!wr->quit && wr->queue_head == wr->queue_tail)
+            pthread_cond_wait(&wr->cond, &wr->lock);
+        if (wr->queue_head == wr->queue_tail)
+            break;
+        slot = &wr->slots[wr->queue[wr->queue_head % AIOWR_MAX_SLOTS]];
+        wr->queue_head++;
+        pthread_mutex_unlock(&wr->lock);
+
+        fd = open(slot->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        t1 = aiowr_now_us();
+        if (fd >= 0) {
+            iov.iov_base = slot->buf;
+            iov.iov_len = slot->size;
+            write_failed = (pwritev(fd, &iov, 1, 0) != (ssize_t)slot->size);
+            t2 = aiowr_now_us();
+            close(fd);
+            t3 = aiowr_now_us();
+        } else {
+            t2 = t3 = t1;
+        }
+        if (fd < 0 || write_failed)
+            fprintf(stderr, "Async %s of %s failed (%s)\n", fd < 0 ? "open" : "write",
+                    slot->path, strerror(errno));
+
+        pthread_mutex_lock(&wr->lock);
+        aiowr_account(wr, AIOWR_OP_OPEN, t1 - slot->submit_us, fd < 0);
+        if (fd >= 0) {
+            aiowr_account(wr, AIOWR_OP_WRITE, t2 - t1, write_failed);
+            aiowr_account(wr, AIOWR_OP_CLOSE, t3 - t2, 0);
+        }
+        slot->failed = (fd < 0 || write_failed);
+        aiowr_release_slot(wr, slot);
+    }
+    pthread_mutex_unlock(&wr->lock);
+
+    return NULL;
+}
+
+/* ---- common ---- */
+
+struct aiowr *aiowr_create(int32_t slots, size_t slot_size, int32_t force_thread)
+{
+    struct aiowr *wr;
+    int32_t i;
+
+    if (slots <= 0)
+        slots = AIOWR_DEFAULT_SLOTS;
+    if (slots > AIOWR_MAX_SLOTS)
+        slots = AIOWR_MAX_SLOTS;
+
+    wr = (struct aiowr *)calloc(1, sizeof(struct aiowr));
+    if (!wr)
+        return NULL;
+
+    wr->nslots = slots;
+    wr->slot_size = (slot_size + 4095) & ~(size_t)4095;
+    wr->ring.fd = -1;
+    pthread_mutex_init(&wr->lock, NULL);
+    pthread_cond_init(&wr->cond, NULL);
+
+    for (i = 0; i < slots; i++) {
+        if (posix_memalign((void **)&wr->slots[i].buf, 4096, wr->slot_size)) {
+            wr->slots[i].buf = NULL;
+            aiowr_destroy(wr);
+            return NULL;
+        }
+    }
+
+    wr->backend = AIOWR_BACKEND_THREAD;
+    if (!force_thread && aiowr_ring_open(wr) == 0)
+        wr->backend = AIOWR_BACKEND_URING;
+
+    if (pthread_create(&wr->thread, NULL, AIOWR_BACKEND_URING == wr->backend ?
+                       aiowr_reaper_main : aiowr_writer_main, wr)) {
+        fprintf(stderr, "Unable to create async writer thread\n");
+        aiowr_destroy(wr);
+        return NULL;
+    }
+    wr->thread_running = 1;
+
+    return wr;
+}
+
+void aiowr_destroy(struct aiowr *wr)
+{
+    int32_t i;
+
+    if (!wr)
+        return;
+
+    if (wr->thread_running) {
+        aiowr_flush(wr);
+        pthread_mutex_lock(&wr->lock);
+        wr->quit = 1;
+        pthread_cond_broadcast(&wr->cond);
+        if ((AIOWR_BACKEND_URING == wr->backend) && !wr->dead) {
+            struct io_uring_sqe *sqe = aiowr_get_sqe(&wr->ring, *wr->ring.sq_tail);
+
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = AIOWR_OP_QUIT;
+            aiowr_ring_submit(&wr->ring, *wr->ring.sq_tail, 1);
+        }
+        pthread_mutex_unlock(&wr->lock);
+        pthread_join(wr->thread, NULL);
+    }
+    if (wr->ring.fd >= 0)
+        aiowr_ring_close(&wr->ring);
+    for (i = 0; i < wr->nslots; i++)
+        free(wr->slots[i].buf);
+    pthread_cond_destroy(&wr->cond);
+    pthread_mutex_destroy(&wr->lock);
+    free(wr);
+}
+
+int32_t aiowr_write_file(struct aiowr *wr, const char *path,
+        const struct iovec *iov, int32_t iovcnt)
+{
+    struct aiowr_slot *slot = NULL;
+    size_t total = 0, off = 0;
+    int32_t i, index, ret;
+    int64_t start;
+
+    if (!wr || !path || !iov)
+        return -1;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    start = aiowr_now_us();
+    pthread_mutex_lock(&wr->lock);
+    for (;;) {
+        if (wr->failed || total > wr->slot_size || strlen(path) >= AIOWR_PATH_MAX) {
+            wr->sync_writes++;
+            pthread_mutex_unlock(&wr->lock);
+            return aiowr_write_sync(path, iov, iovcnt);
+        }
+        for (index = 0; index < wr->nslots; index++) {
+            if (!wr->slots[index].busy) {
+                slot = &wr->slots[index];
+                break;
+            }
+        }
+        if (slot || !wr->blocking)
+            break;
+        pthread_cond_wait(&wr->cond, &wr->lock);
+    }
+    if (!slot) {
+        /* the storage is behind, keep capturing */
+        if (!wr->dropped)
+            fprintf(stderr, "Async writer full, dropping %s\n", path);
+        wr->dropped++;
+        pthread_mutex_unlock(&wr->lock);
+        return 1;
+    }
+    slot->busy = 1;
+    wr->inflight++;
+    if (wr->inflight > wr->max_inflight)
+        wr->max_inflight = wr->inflight;
+    pthread_mutex_unlock(&wr->lock);
+
+    /* the slot is ours until it is queued */
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(slot->buf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    slot->size = total;
+    slot->failed = 0;
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+
+    pthread_mutex_lock(&wr->lock);
+    slot->submit_us = slot->last_us = aiowr_now_us();
+    if (wr->failed) {
+        /* io_uring went away while the slot was filled */
+        slot->failed = 1;
+        aiowr_release_slot(wr, slot);
+        wr->sync_writes++;
+        pthread_mutex_unlock(&wr->lock);
+        return aiowr_write_sync(path, iov, iovcnt);
+    }
+    if (AIOWR_BACKEND_URING == wr->backend) {
+        aiowr_uring_queue(wr, index);
+        /* an idle ring takes the file now, a busy one collects a batch */
+        ret = 0;
+        if ((0 == wr->ring_files) || (wr->unsubmitted >= AIOWR_BATCH_FILES))
+            ret = aiowr_uring_submit_queued(wr);
+    } else {
+        wr->queue[wr->queue_tail % AIOWR_MAX_SLOTS] = index;
+        wr->queue_tail++;
+        pthread_cond_broadcast(&wr->cond);
+        ret = 0;
+    }
+    wr->submitted++;
+    wr->submit_us += aiowr_now_us() - start;
+    pthread_mutex_unlock(&wr->lock);
+
+    return ret;
+}
+
+void aiowr_set_blocking(struct aiowr *wr, int32_t blocking)
+{
+    if (!wr)
+        return;
+
+    pthread_mutex_lock(&wr->lock);
+    wr->blocking = blocking;
+    pthread_mutex_unlock(&wr->lock);
+}
+
+void aiowr_flush(struct aiowr *wr)
+{
+    if (!wr)
+        return;
+
+    pthread_mutex_lock(&wr->lock);
+    if ((AIOWR_BACKEND_URING == wr->backend) && !wr->failed)
+        aiowr_uring_submit_queued(wr);
+    while (wr->inflight && !wr->dead)
+        pthread_cond_wait(&wr->cond, &wr->lock);
+    pthread_mutex_unlock(&wr->lock);
+}
+
+int32_t aiowr_backend(struct aiowr *wr)
+{
+    return wr ? wr->backend : -1;
+}
+
+/* upper bound of the histogram bucket holding the pct-th percentile */
+static int64_t aiowr_percentile(const struct aiowr_op_stats *st, int32_t pct)
+{
+    uint64_t want = (st->count * pct + 99) / 100, seen = 0;
+    int32_t bucket;
+
+    for (bucket = 0; bucket < AIOWR_HIST_BUCKETS; bucket++) {
+        seen += st->hist[bucket];
+        if (seen >= want)
+            return 1LL << bucket;
+    }
+    return st->max_us;
+}
+
+void aiowr_print_stats(struct aiowr *wr)
+{
+    int32_t op;
+
+    if (!wr)
+        return;
+
+    pthread_mutex_lock(&wr->lock);
+    fprintf(stderr, "Async writer (%s%s, %d slots of %zu bytes): %llu files, %llu bytes, "
+            "%llu dropped, %llu written inline, max %d in flight, submit %lld us/file\n",
+            AIOWR_BACKEND_URING == wr->backend ? "io_uring" : "writer thread",
+            AIOWR_BACKEND_URING == wr->backend && !wr->ring.fixed_bufs ? ", unregistered buffers" : "",
+            wr->nslots, wr->slot_size, (unsigned long long)wr->files,
+            (unsigned long long)wr->bytes, (unsigned long long)wr->dropped,
+            (unsigned long long)wr->sync_writes, wr->max_inflight,
+            (long long)(wr->submitted ? wr->submit_us / (int64_t)wr->submitted : 0));
+    if (wr->batches)
+        fprintf(stderr, "  %llu files entered in %llu io_uring_enter calls\n",
+                (unsigned long long)wr->files, (unsigned long long)wr->batches);
+    for (op = 0; op < AIOWR_OPS; op++) {
+        const struct aiowr_op_stats *st = &wr->ops[op];
+
+        if (!st->count)
+            continue;
+        fprintf(stderr, "  %-5s %llu ops, %llu errors, avg %lld us, p50 <%lld us, "
+                "p99 <%lld us, max %lld us\n", aiowr_op_names[op],
+                (unsigned long long)st->count, (unsigned long long)st->errors,
+                (long long)(st->total_us / (int64_t)st->count),
+                (long long)aiowr_percentile(st, 50), (long long)aiowr_percentile(st, 99),
+                (long long)st->max_us);
+    }
+    pthread_mutex_unlock(&wr->lock);
+}
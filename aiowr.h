@@ -0,0 +1,74 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __AIOWR_H__
+#define __AIOWR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Asynchronous whole-file writer for snapshot output. A file is gathered
+ * into one of a fixed set of slot buffers and handed off, the capture
+ * thread never waits on open/write/close:
+ *
+ *  - io_uring (raw syscalls): each file is a linked OPENAT -> WRITE_FIXED
+ *    -> CLOSE chain on a direct descriptor, the slot buffers are registered
+ *    once and a reaper thread collects completions. A file is entered at
+ *    once when the ring is idle; while earlier files are in flight chains
+ *    collect in the SQ and go in with one io_uring_enter, on the next
+ *    completion or every AIOWR_BATCH_FILES files. If io_uring fails, files
+ *    are written inline from then on.
+ *  - otherwise a writer thread does open/pwritev/close per slot.
+ *
+ * When every slot is still in flight the file is dropped and counted
+ * rather than stalling capture. Files larger than a slot are written
+ * synchronously.
+ */
+#define AIOWR_DEFAULT_SLOTS     (8)
+#define AIOWR_MAX_SLOTS         (64)
+#define AIOWR_BATCH_FILES       (4)
+#define AIOWR_PATH_MAX          (256)
+#define AIOWR_HIST_BUCKETS      (26)    /* log2 us, up to ~33 s */
+
+#define AIOWR_BACKEND_URING     (0)
+#define AIOWR_BACKEND_THREAD    (1)
+
+struct aiowr;
+
+/* force_thread skips the io_uring probe. */
+struct aiowr *aiowr_create(int32_t slots, size_t slot_size, int32_t force_thread);
+void aiowr_destroy(struct aiowr *wr);
+
+/* Copy the iovecs into a free slot and queue the file, 0 if queued or
+   written, 1 if dropped, -1 on error. */
+int32_t aiowr_write_file(struct aiowr *wr, const char *path,
+        const struct iovec *iov, int32_t iovcnt);
+
+/* Wait for a free slot rather than drop, for output that is not live. */
+void aiowr_set_blocking(struct aiowr *wr, int32_t blocking);
+
+/* Wait until every queued file is closed. */
+void aiowr_flush(struct aiowr *wr);
+
+int32_t aiowr_backend(struct aiowr *wr);
+void aiowr_print_stats(struct aiowr *wr);
+
+#endif
@@ -0,0 +1,442 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "dwrite.h"
+
+#define ARCHIVE_READER_MAPS     (4)     /* data segments kept mapped */
+#define ARCHIVE_PREALLOC_STEP   (64ULL * 1024 * 1024)
+
+struct archive {
+    char path[ARCHIVE_PATH_MAX];
+    uint64_t segment_bytes;
+
+    int index_fd;
+    struct dwrite *data;
+    uint64_t count;             /* records in the index */
+    uint32_t segment;
+    uint64_t offset;            /* end of the open segment */
+    int64_t last_time_us;
+
+    /* statistics */
+    uint64_t frames;
+    uint64_t bytes;
+    uint32_t errors;
+};
+
+struct archive_map {
+    int64_t segment;            /* -1 when unused */
+    unsigned char *data;
+    size_t size;
+};
+
+struct archive_reader {
+    char path[ARCHIVE_PATH_MAX];
+    unsigned char *index;
+    size_t index_size;
+    uint64_t count;
+    const struct archive_record *records;
+    struct archive_map maps[ARCHIVE_READER_MAPS];
+    int32_t next_map;
+};
+
+static void archive_segment_name(char *name, size_t size, const char *path,
+        uint32_t segment)
+{
+    snprintf(name, size, "%s.%06u", path, segment);
+}
+
+/* Open segment for appending at offset, dropping anything past it. */
+static int32_t archive_open_segment(struct archive *ar, uint32_t segment,
+        uint64_t offset)
+{
+    char name[ARCHIVE_PATH_MAX + 8];
+
+    dwrite_close(ar->data);
+    archive_segment_name(name, sizeof(name), ar->path, segment);
+    ar->data = dwrite_open(name, offset, ARCHIVE_PREALLOC_STEP);
+    if (!ar->data)
+        return -1;
+    ar->segment = segment;
+    ar->offset = offset;
+    return 0;
+}
+
+struct archive *archive_open(const char *path, uint64_t segment_bytes)
+{
+    struct archive_header hdr;
+    struct archive_record last;
+    struct archive *ar;
+    char name[ARCHIVE_PATH_MAX + 8];
+    struct stat st;
+
+    ar = (struct archive *)calloc(1, sizeof(struct archive));
+    if (!ar)
+        return NULL;
+
+    snprintf(ar->path, sizeof(ar->path), "%s", path);
+    ar->segment_bytes = segment_bytes ? segment_bytes : ARCHIVE_SEGMENT_BYTES;
+
+    snprintf(name, sizeof(name), "%s.idx", path);
+    ar->index_fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (ar->index_fd < 0 || fstat(ar->index_fd, &st) < 0) {
+        fprintf(stderr, "Unable to open %s\n", name);
+        goto err;
+    }
+
+    if (st.st_size < (off_t)sizeof(hdr)) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic));
+        hdr.header_size = sizeof(hdr);
+        hdr.record_size = sizeof(struct archive_record);
+        hdr.segment_bytes = ar->segment_bytes;
+        if (ftruncate(ar->index_fd, 0) < 0 ||
+            pwrite(ar->index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto err;
+        if (archive_open_segment(ar, 0, 0) < 0)
+            goto err;
+        return ar;
+    }
+
+    /* resume: the last whole record tells where the data ends */
+    if (pread(ar->index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, ARCHIVE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.header_size != sizeof(hdr) ||
+        hdr.record_size != sizeof(struct archive_record)) {
+        fprintf(stderr, "%s is not a cam_cap archive index\n", name);
+        goto err;
+    }
+    ar->count = (st.st_size - sizeof(hdr)) / sizeof(struct archive_record);
+    /* records of data that never reached the disk (unsynced O_DIRECT) */
+    while (ar->count) {
+        if (pread(ar->index_fd, &last, sizeof(last),
+                  sizeof(hdr) + (ar->count - 1) * sizeof(last)) != sizeof(last))
+            goto err;
+        archive_segment_name(name, sizeof(name), path, last.segment);
+        if (!stat(name, &st) && last.offset + last.size <= (uint64_t)st.st_size)
+            break;
+        ar->count--;
+    }
+    if (ftruncate(ar->index_fd, sizeof(hdr) + ar->count * sizeof(struct archive_record)) < 0)
+        goto err;
+    if (!ar->count) {
+        if (archive_open_segment(ar, 0, 0) < 0)
+            goto err;
+        return ar;
+    }
+    ar->last_time_us = last.time_us;
+    if (archive_open_segment(ar, last.segment, last.offset + last.size) < 0)
+        goto err;
+    return ar;
+
+err:
+    if (ar->index_fd >= 0)
+        close(ar->index_fd);
+    free(ar);
+    return NULL;
+}
+
+void archive_close(struct archive *ar)
+{
+    if (!ar)
+        return;
+
+    dwrite_close(ar->data);
+    if (ar->index_fd >= 0)
+        close(ar->index_fd);
+    free(ar);
+}
+
+static int64_t archive_clock_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int32_t archive_append(struct archive *ar, const unsigned char *data, size_t size,
+        const struct timeval *timestamp, uint32_t sequence, uint32_t flags)
+{
+    struct archive_record rec;
+    int64_t now_mono, now_real;
+
+    if (!ar || !data || !size || size > UINT32_MAX)
+        return -1;
+
+    if (ar->offset && ar->offset + size > ar->segment_bytes) {
+        if (archive_open_segment(ar, ar->segment + 1, 0) < 0) {
+            ar->errors++;
+            return -1;
+        }
+    }
+    if (dwrite_write(ar->data, data, size) < 0) {
+        /* cut the partial frame so the next one lands where indexed */
+        ar->errors++;
+        archive_open_segment(ar, ar->segment, ar->offset);
+        return -1;
+    }
+
+    /* V4L2 timestamps are CLOCK_MONOTONIC, carried over to wall clock */
+    now_mono = archive_clock_us(CLOCK_MONOTONIC);
+    now_real = archive_clock_us(CLOCK_REALTIME);
+    memset(&rec, 0, sizeof(rec));
+    rec.capture_us = timestamp ?
+        (int64_t)timestamp->tv_sec * 1000000 + timestamp->tv_usec : now_mono;
+    rec.time_us = now_real;
+    if (rec.capture_us <= now_mono && now_mono - rec.capture_us < 10000000)
+        rec.time_us -= now_mono - rec.capture_us;
+    rec.flags = flags;
+    if (rec.time_us < ar->last_time_us) {
+        rec.time_us = ar->last_time_us;
+        rec.flags |= ARCHIVE_FLAG_CLOCK_STEP;
+    }
+    rec.offset = ar->offset;
+    rec.size = size;
+    rec.sequence = sequence;
+    rec.segment = ar->segment;
+
+    if (pwrite(ar->index_fd, &rec, sizeof(rec),
+               sizeof(struct archive_header) + ar->count * sizeof(rec)) != sizeof(rec)) {
+        ar->errors++;
+        archive_open_segment(ar, ar->segment, ar->offset);
+        return -1;
+    }
+    ar->count++;
+    ar->offset += size;
+    /* the index follows the data to disk */
+    switch (dwrite_frame_end(ar->data)) {
+    case 1:
+        if (fdatasync(ar->index_fd) < 0)
+            ar->errors++;
+        break;
+    case -1:
+        ar->errors++;
+        break;
+    default:
+        break;
+    }
+    ar->last_time_us = rec.time_us;
+    ar->frames++;
+    ar->bytes += size;
+    return 0;
+}
+
+/* "<bytes>[k|M|G]", 0 selects the default segment size */
+int32_t archive_parse(const char *arg, uint64_t *segment_bytes)
+{
+    char *end = (char *)arg;
+    unsigned long long value;
+
+    *segment_bytes = 0;
+    if (!*arg)
+        return 0;
+    value = strtoull(arg, &end, 10);
+    if (end == arg)
+        return -1;
+    switch (*end) {
+    case 'k':
+    case 'K':
+        value *= 1000;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1000000;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1000000000;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end)
+        return -1;
+    *segment_bytes = value;
+    return 0;
+}
+
+void archive_print_stats(struct archive *ar)
+{
+    if (!ar)
+        return;
+
+    fprintf(stderr, "Archive %s: %llu frames, %llu bytes appended, %llu indexed, "
+            "segment %u, %u errors\n", ar->path, (unsigned long long)ar->frames,
+            (unsigned long long)ar->bytes, (unsigned long long)ar->count,
+            ar->segment, ar->errors);
+}
+
+struct archive_reader *archive_reader_open(const char *path)
+{
+    const struct archive_header *hdr;
+    struct archive_reader *rd;
+    char name[ARCHIVE_PATH_MAX + 8];
+    struct stat st;
+    int fd, i;
+
+    rd = (struct archive_reader *)calloc(1, sizeof(struct archive_reader));
+    if (!rd)
+        return NULL;
+
+    snprintf(rd->path, sizeof(rd->path), "%s", path);
+    for (i = 0; i < ARCHIVE_READER_MAPS; i++)
+        rd->maps[i].segment = -1;
+
+    snprintf(name, sizeof(name), "%s.idx", path);
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+        fprintf(stderr, "Unable to open %s\n", name);
+        if (fd >= 0)
+            close(fd);
+        free(rd);
+        return NULL;
+    }
+    rd->index_size = st.st_size;
+    rd->index = (unsigned char *)mmap(NULL, rd->index_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == rd->index) {
+        free(rd);
+        return NULL;
+    }
+
+    hdr = (const struct archive_header *)rd->index;
+    if (memcmp(hdr->magic, ARCHIVE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->header_size != sizeof(*hdr) ||
+        hdr->record_size != sizeof(struct archive_record)) {
+        fprintf(stderr, "%s is not a cam_cap archive index\n", name);
+        munmap(rd->index, rd->index_size);
+        free(rd);
+        return NULL;
+    }
+    rd->records = (const struct archive_record *)(rd->index + sizeof(*hdr));
+    rd->count = (rd->index_size - sizeof(*hdr)) / sizeof(struct archive_record);
+
+    return rd;
+}
+
+void archive_reader_close(struct archive_reader *rd)
+{
+    int32_t i;
+
+    if (!rd)
+        return;
+
+    for (i = 0; i < ARCHIVE_READER_MAPS; i++)
+        if (rd->maps[i].segment >= 0)
+            munmap(rd->maps[i].data, rd->maps[i].size);
+    munmap(rd->index, rd->index_size);
+    free(rd);
+}
+
+uint64_t archive_reader_count(struct archive_reader *rd)
+{
+    return rd ? rd->count : 0;
+}
+
+const struct archive_record *archive_reader_record(struct archive_reader *rd,
+        uint64_t index)
+{
+    if (!rd || index >= rd->count)
+        return NULL;
+    return &rd->records[index];
+}
+
+uint64_t archive_reader_find(struct archive_reader *rd, int64_t time_us)
+{
+    uint64_t lo = 0, hi;
+
+    if (!rd)
+        return 0;
+
+    hi = rd->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (rd->records[mid].time_us < time_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct archive_map *archive_reader_map(struct archive_reader *rd,
+        uint32_t segment)
+{
+    struct archive_map *map;
+    char name[ARCHIVE_PATH_MAX + 8];
+    struct stat st;
+    int32_t i;
+    int fd;
+
+    for (i = 0; i < ARCHIVE_READER_MAPS; i++)
+        if (rd->maps[i].segment == segment)
+            return &rd->maps[i];
+
+    /* replace the mappings round-robin, extraction walks segments in order */
+    map = &rd->maps[rd->next_map];
+    rd->next_map = (rd->next_map + 1) % ARCHIVE_READER_MAPS;
+    if (map->segment >= 0)
+        munmap(map->data, map->size);
+    map->segment = -1;
+
+    archive_segment_name(name, sizeof(name), rd->path, segment);
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    map->data = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map->data)
+        return NULL;
+    map->size = st.st_size;
+    map->segment = segment;
+    return map;
+}
+
+const unsigned char *archive_reader_frame(struct archive_reader *rd,
+        uint64_t index, size_t *size)
+{
+    const struct archive_record *rec = archive_reader_record(rd, index);
+    struct archive_map *map;
+
+    if (!rec)
+        return NULL;
+    map = archive_reader_map(rd, rec->segment);
+    if (!map || rec->offset + rec->size > map->size)
+        return NULL;
+    *size = rec->size;
+    return map->data + rec->offset;
+}
@@ -0,0 +1,90 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Append-only frame archive. Compressed frames are stored byte for byte in
+ * data segments <path>.000000, <path>.000001, ... and described by
+ * fixed-size records in <path>.idx. Records are appended in capture order
+ * with a non-decreasing wall clock time, so a reader can mmap the index
+ * and binary search it. Data is written before its record, so the index
+ * never points past the data after a crash; unindexed data is dropped when
+ * the archive is opened again. Host byte order (little-endian targets).
+ */
+#define ARCHIVE_MAGIC           "CAMARCH1"
+#define ARCHIVE_SEGMENT_BYTES   (1024ULL * 1024 * 1024)
+#define ARCHIVE_PATH_MAX        (256)
+
+#define ARCHIVE_FLAG_PASSTHROUGH    (0x1)   /* camera MJPEG, may lack DHT */
+#define ARCHIVE_FLAG_CLOCK_STEP     (0x2)   /* wall clock went back, time held */
+
+struct archive_header {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t record_size;
+    uint64_t segment_bytes;
+    uint8_t reserved[40];
+};
+
+struct archive_record {
+    int64_t time_us;            /* wall clock, search key */
+    int64_t capture_us;         /* V4L2 buffer timestamp */
+    uint64_t offset;            /* in the data segment */
+    uint32_t size;
+    uint32_t sequence;          /* V4L2 buffer sequence */
+    uint32_t segment;
+    uint32_t flags;
+};
+
+struct archive;
+struct archive_reader;
+
+/* Open or resume the archive at path, segments rotate at segment_bytes. */
+struct archive *archive_open(const char *path, uint64_t segment_bytes);
+void archive_close(struct archive *ar);
+
+int32_t archive_append(struct archive *ar, const unsigned char *data, size_t size,
+        const struct timeval *timestamp, uint32_t sequence, uint32_t flags);
+
+/* Parse the -a argument "[bytes[k|M|G]]". */
+int32_t archive_parse(const char *arg, uint64_t *segment_bytes);
+
+void archive_print_stats(struct archive *ar);
+
+struct archive_reader *archive_reader_open(const char *path);
+void archive_reader_close(struct archive_reader *rd);
+
+uint64_t archive_reader_count(struct archive_reader *rd);
+const struct archive_record *archive_reader_record(struct archive_reader *rd,
+        uint64_t index);
+
+/* Index of the first frame at or after time_us, count if there is none. */
+uint64_t archive_reader_find(struct archive_reader *rd, int64_t time_us);
+
+/* The stored bytes of a frame, mapped read-only; NULL if unavailable. */
+const unsigned char *archive_reader_frame(struct archive_reader *rd,
+        uint64_t index, size_t *size);
+
+#endif
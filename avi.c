@@ -0,0 +1,588 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "utils.h"
+#include "dwrite.h"
+#include "avi.h"
+
+#define AVI_NAME_MAX            (128)
+#define AVI_IX_HEADER           (8 + 24)
+#define AVI_DMLH_SIZE           (248)
+#define AVIF_HASINDEX           (0x10)
+#define AVIIF_KEYFRAME          (0x10)
+#define AVI_INDEX_OF_INDEXES    (0x00)
+#define AVI_INDEX_OF_CHUNKS     (0x01)
+
+/* RIFF, hdrl, avih, strl, strh, strf, indx, odml and dmlh; movi follows */
+#define AVI_STRL_END            (12 + 12 + 64 + 12 + 64 + 48 + AVI_IX_HEADER + \
+                                 AVI_SUPERINDEX_ENTRIES * 16)
+#define AVI_HEADER_SIZE         (AVI_STRL_END + 12 + 8 + AVI_DMLH_SIZE)
+
+struct avi_super {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t duration;
+};
+
+struct avi {
+    const char *name_prefix;
+    int32_t width;
+    int32_t height;
+    uint64_t max_bytes;
+    int64_t max_us;
+
+    /* the open segment, NULL between segments */
+    struct dwrite *dw;
+    char name[AVI_NAME_MAX];
+    char last_name[AVI_NAME_MAX];
+    uint64_t offset;            /* end of the file */
+    uint64_t riff_start;
+    uint64_t movi_start;
+    int32_t riffs;
+    uint32_t frames;
+    uint32_t riff0_frames;      /* frames in the first RIFF, once it is closed */
+    uint64_t riff0_end;
+    uint32_t max_frame;
+    int64_t start_us;
+    int64_t last_us;
+
+    /* ix00 entries not yet written: offset from riff_start, size */
+    uint32_t ix[AVI_IX_ENTRIES][2];
+    int32_t nix;
+    struct avi_super super[AVI_SUPERINDEX_ENTRIES];
+    int32_t nsuper;
+
+    /* idx1 entries of the first RIFF: offset from movi, size */
+    uint32_t (*idx1)[2];
+    uint32_t nidx1;
+    uint32_t idx1_alloc;
+
+    /* statistics */
+    uint32_t segments;
+    uint64_t total_frames;
+    uint64_t total_bytes;
+    uint32_t write_errors;
+};
+
+static int64_t avi_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned char *avi_put16(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static unsigned char *avi_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static unsigned char *avi_put64(unsigned char *p, uint64_t v)
+{
+    p = avi_put32(p, (uint32_t)v);
+    return avi_put32(p, (uint32_t)(v >> 32));
+}
+
+static unsigned char *avi_put4cc(unsigned char *p, const char *fourcc)
+{
+    memcpy(p, fourcc, 4);
+    return p + 4;
+}
+
+static int32_t avi_pwrite32(struct avi *avi, uint64_t offset, uint32_t v)
+{
+    unsigned char buf[4];
+
+    avi_put32(buf, v);
+    return dwrite_pwrite(avi->dw, buf, 4, offset);
+}
+
+static int32_t avi_write(struct avi *avi, const void *data, size_t size)
+{
+    if (dwrite_write(avi->dw, data, size) < 0) {
+        avi->write_errors++;
+        return -1;
+    }
+    avi->offset += size;
+    return 0;
+}
+
+/* Rewrite the whole header: frame counts, timing and the super index. */
+static int32_t avi_write_header(struct avi *avi)
+{
+    unsigned char hdr[AVI_HEADER_SIZE], *p = hdr;
+    uint32_t us_per_frame = 33333, riff0_frames;
+    int32_t i;
+
+    if (avi->frames > 1 && avi->last_us > avi->start_us)
+        us_per_frame = (avi->last_us - avi->start_us) / (avi->frames - 1);
+    if (!us_per_frame)
+        us_per_frame = 1;
+    riff0_frames = avi->riffs > 1 ? avi->riff0_frames : avi->frames;
+    memset(hdr, 0, sizeof(hdr));
+
+    p = avi_put4cc(p, "RIFF");
+    p = avi_put32(p, (uint32_t)((avi->riffs > 1 ? avi->riff0_end : avi->offset) - 8));
+    p = avi_put4cc(p, "AVI ");
+    p = avi_put4cc(p, "LIST");
+    p = avi_put32(p, AVI_HEADER_SIZE - 20);
+    p = avi_put4cc(p, "hdrl");
+
+    p = avi_put4cc(p, "avih");
+    p = avi_put32(p, 56);
+    p = avi_put32(p, us_per_frame);
+    p = avi_put32(p, (uint32_t)((uint64_t)avi->max_frame * 1000000 / us_per_frame));
+    p = avi_put32(p, 0);
+    p = avi_put32(p, AVIF_HASINDEX);
+    p = avi_put32(p, riff0_frames);
+    p = avi_put32(p, 0);
+    p = avi_put32(p, 1);
+    p = avi_put32(p, avi->max_frame + 8);
+    p = avi_put32(p, avi->width);
+    p = avi_put32(p, avi->height);
+    p += 16;
+
+    p = avi_put4cc(p, "LIST");
+    p = avi_put32(p, AVI_STRL_END - 96);
+    p = avi_put4cc(p, "strl");
+
+    p = avi_put4cc(p, "strh");
+    p = avi_put32(p, 56);
+    p = avi_put4cc(p, "vids");
+    p = avi_put4cc(p, "MJPG");
+    p = avi_put32(p, 0);
+    p = avi_put16(p, 0);
+    p = avi_put16(p, 0);
+    p = avi_put32(p, 0);
+    p = avi_put32(p, us_per_frame);     /* dwScale / dwRate = seconds per frame */
+    p = avi_put32(p, 1000000);
+    p = avi_put32(p, 0);
+    p = avi_put32(p, avi->frames);
+    p = avi_put32(p, avi->max_frame + 8);
+    p = avi_put32(p, 0xffffffff);
+    p = avi_put32(p, 0);
+    p = avi_put16(p, 0);
+    p = avi_put16(p, 0);
+    p = avi_put16(p, avi->width);
+    p = avi_put16(p, avi->height);
+
+    p = avi_put4cc(p, "strf");
+    p = avi_put32(p, 40);
+    p = avi_put32(p, 40);
+    p = avi_put32(p, avi->width);
+    p = avi_put32(p, avi->height);
+    p = avi_put16(p, 1);
+    p = avi_put16(p, 24);
+    p = avi_put4cc(p, "MJPG");
+    p = avi_put32(p, (uint32_t)avi->width * avi->height * 3);
+    p += 16;
+
+    /* OpenDML super index, one entry per ix00 chunk */
+    p = avi_put4cc(p, "indx");
+    p = avi_put32(p, 24 + AVI_SUPERINDEX_ENTRIES * 16);
+    p = avi_put16(p, 4);
+    *(p++) = 0;
+    *(p++) = AVI_INDEX_OF_INDEXES;
+    p = avi_put32(p, avi->nsuper);
+    p = avi_put4cc(p, "00dc");
+    p += 12;
+    for (i = 0; i < avi->nsuper; i++) {
+        p = avi_put64(p, avi->super[i].offset);
+        p = avi_put32(p, avi->super[i].size);
+        p = avi_put32(p, avi->super[i].duration);
+    }
+    p = hdr + AVI_STRL_END;
+
+    p = avi_put4cc(p, "LIST");
+    p = avi_put32(p, 4 + 8 + AVI_DMLH_SIZE);
+    p = avi_put4cc(p, "odml");
+    p = avi_put4cc(p, "dmlh");
+    p = avi_put32(p, AVI_DMLH_SIZE);
+    avi_put32(p, avi->frames);
+
+    if (dwrite_pwrite(avi->dw, hdr, sizeof(hdr), 0) < 0) {
+        avi->write_errors++;
+        return -1;
+    }
+    return 0;
+}
+
+/* Sizes of the open RIFF and its movi list as if it ended here. */
+static void avi_update_sizes(struct avi *avi, uint64_t movi_end)
+{
+    if (avi_pwrite32(avi, avi->movi_start + 4,
+                     (uint32_t)(movi_end - avi->movi_start - 8)) < 0 ||
+        avi_pwrite32(avi, avi->riff_start + 4,
+                     (uint32_t)(avi->offset - avi->riff_start - 8)) < 0)
+        avi->write_errors++;
+}
+
+/* Write the pending ix00 chunk and publish it in the header. */
+static int32_t avi_flush_index(struct avi *avi)
+{
+    unsigned char hdr[AVI_IX_HEADER], *p = hdr;
+    unsigned char entries[AVI_IX_ENTRIES * 8], *e = entries;
+    uint64_t offset = avi->offset;
+    int32_t i;
+
+    if (!avi->nix)
+        return 0;
+    if (avi->nsuper == AVI_SUPERINDEX_ENTRIES)
+        return -1;
+
+    p = avi_put4cc(p, "ix00");
+    p = avi_put32(p, 24 + avi->nix * 8);
+    p = avi_put16(p, 2);
+    *(p++) = 0;
+    *(p++) = AVI_INDEX_OF_CHUNKS;
+    p = avi_put32(p, avi->nix);
+    p = avi_put4cc(p, "00dc");
+    p = avi_put64(p, avi->riff_start);
+    avi_put32(p, 0);
+    for (i = 0; i < avi->nix; i++) {
+        e = avi_put32(e, avi->ix[i][0]);
+        e = avi_put32(e, avi->ix[i][1]);    /* bit 31 clear: key frame */
+    }
+    if (avi_write(avi, hdr, sizeof(hdr)) < 0 ||
+        avi_write(avi, entries, e - entries) < 0)
+        return -1;
+
+    avi->super[avi->nsuper].offset = offset;
+    avi->super[avi->nsuper].size = avi->offset - offset;
+    avi->super[avi->nsuper].duration = avi->nix;
+    avi->nsuper++;
+    avi->nix = 0;
+
+    avi_update_sizes(avi, avi->offset);
+    return avi_write_header(avi);
+}
+
+static int32_t avi_start_riff(struct avi *avi)
+{
+    unsigned char hdr[24], *p = hdr;
+
+    avi->riff_start = avi->offset;
+    avi->movi_start = avi->offset + 12;
+    p = avi_put4cc(p, "RIFF");
+    p = avi_put32(p, 16);
+    p = avi_put4cc(p, "AVIX");
+    p = avi_put4cc(p, "LIST");
+    p = avi_put32(p, 4);
+    avi_put4cc(p, "movi");
+    avi->riffs++;
+    return avi_write(avi, hdr, sizeof(hdr));
+}
+
+/* Close the open RIFF; the first one also gets the legacy idx1. */
+static int32_t avi_end_riff(struct avi *avi)
+{
+    unsigned char entry[16];
+    uint64_t movi_end;
+    uint32_t i;
+
+    if (avi_flush_index(avi) < 0)
+        return -1;
+    movi_end = avi->offset;
+
+    if (1 == avi->riffs) {
+        unsigned char hdr[8];
+
+        avi_put32(avi_put4cc(hdr, "idx1"), avi->nidx1 * 16);
+        if (avi_write(avi, hdr, sizeof(hdr)) < 0)
+            return -1;
+        for (i = 0; i < avi->nidx1; i++) {
+            unsigned char *p = entry;
+
+            p = avi_put4cc(p, "00dc");
+            p = avi_put32(p, AVIIF_KEYFRAME);
+            p = avi_put32(p, avi->idx1[i][0]);
+            avi_put32(p, avi->idx1[i][1]);
+            if (avi_write(avi, entry, sizeof(entry)) < 0)
+                return -1;
+        }
+        avi->riff0_frames = avi->frames;
+        avi->riff0_end = avi->offset;
+    }
+    avi_update_sizes(avi, movi_end);
+    return 0;
+}
+
+/* Bytes the open RIFF would have with one more chunk and its indexes. */
+static uint64_t avi_riff_size(struct avi *avi, size_t chunk)
+{
+    uint64_t size = avi->offset + chunk - avi->riff_start;
+
+    size += AVI_IX_HEADER + (avi->nix + 1) * 8;
+    if (1 == avi->riffs)
+        size += 8 + (uint64_t)(avi->nidx1 + 1) * 16;
+    return size;
+}
+
+static int32_t avi_open_segment(struct avi *avi, int64_t now)
+{
+    unsigned char movi[12];
+    char name[AVI_NAME_MAX] = { 0 };
+
+    /* avi extension; size based rotation may start two in the same second */
+    utils_get_picture_name(name, sizeof(name), avi->name_prefix, 3);
+    if (!strcmp(name, avi->last_name))
+        snprintf(avi->name, sizeof(avi->name), "%.*s_%u.avi",
+                 (int)strlen(name) - 4, name, avi->segments);
+    else
+        snprintf(avi->name, sizeof(avi->name), "%s", name);
+    snprintf(avi->last_name, sizeof(avi->last_name), "%s", name);
+
+    /* blocks are reserved ahead without changing the visible file size */
+    avi->dw = dwrite_open(avi->name, 0,
+                          avi->max_bytes ? avi->max_bytes : AVI_PREALLOC_STEP);
+    if (!avi->dw)
+        return -1;
+
+    avi->offset = 0;
+    avi->riffs = 1;
+    avi->riff_start = 0;
+    avi->movi_start = AVI_HEADER_SIZE;
+    avi->frames = 0;
+    avi->riff0_frames = 0;
+    avi->max_frame = 0;
+    avi->start_us = avi->last_us = now;
+    avi->nix = 0;
+    avi->nsuper = 0;
+    avi->nidx1 = 0;
+
+    /* the file is empty: the header is appended */
+    if (avi_write_header(avi) < 0) {
+        dwrite_close(avi->dw);
+        avi->dw = NULL;
+        return -1;
+    }
+    avi->offset = AVI_HEADER_SIZE;
+    avi_put4cc(avi_put32(avi_put4cc(movi, "LIST"), 4), "movi");
+    if (avi_write(avi, movi, sizeof(movi)) < 0) {
+        dwrite_close(avi->dw);
+        avi->dw = NULL;
+        return -1;
+    }
+    avi->segments++;
+    return 0;
+}
+
+static void avi_close_segment(struct avi *avi)
+{
+    if (!avi->dw)
+        return;
+
+    avi_end_riff(avi);
+    avi_write_header(avi);
+    /* hands back the preallocated blocks past the end */
+    if (dwrite_close(avi->dw) < 0)
+        avi->write_errors++;
+    avi->dw = NULL;
+}
+
+struct avi *avi_create(const char *name_prefix, int32_t width, int32_t height,
+        uint64_t max_bytes, int32_t max_seconds)
+{
+    struct avi *avi;
+
+    avi = (struct avi *)calloc(1, sizeof(struct avi));
+    if (!avi)
+        return NULL;
+
+    avi->name_prefix = name_prefix;
+    avi->width = width;
+    avi->height = height;
+    avi->max_bytes = max_bytes;
+    avi->max_us = (int64_t)max_seconds * 1000000;
+
+    return avi;
+}
+
+void avi_destroy(struct avi *avi)
+{
+    if (!avi)
+        return;
+
+    avi_close_segment(avi);
+    free(avi->idx1);
+    free(avi);
+}
+
+int32_t avi_write_frame(struct avi *avi, unsigned char *jpeg, size_t size)
+{
+    struct iovec iov[5];
+    unsigned char hdr[8], pad = 0;
+    const unsigned char *dht = NULL;
+    size_t payload = size, chunk, sof = size, i;
+    int dht_size = 0;
+    int64_t now = avi_now_us();
+    int32_t n = 0;
+
+    if (!avi || !jpeg || size < 4)
+        return -1;
+
+    /* MJPEG frames usually omit DHT, insert the standard one before SOF0 */
+    if (!utils_is_huffman(jpeg)) {
+        for (i = 2; i + 1 < size; i++)
+            if (jpeg[i] == 0xff && jpeg[i + 1] == 0xc0)
+                break;
+        if (i + 1 < size) {
+            sof = i;
+            dht = utils_get_dht(&dht_size);
+            payload += dht_size;
+        }
+    }
+    chunk = 8 + payload + (payload & 1);
+
+    if (avi->dw && avi->frames &&
+        ((avi->max_bytes && avi->offset + chunk + AVI_IX_HEADER +
+          (avi->nix + 1) * 8 > avi->max_bytes) ||
+         (avi->max_us && now - avi->start_us >= avi->max_us) ||
+         (avi->nsuper >= AVI_SUPERINDEX_ENTRIES - 1)))
+        avi_close_segment(avi);
+    if (!avi->dw && avi_open_segment(avi, now) < 0)
+        return -1;
+    /* any RIFF holding a chunk, its ix00 may just have been flushed */
+    if ((avi->offset > avi->movi_start + 12) && avi_riff_size(avi, chunk) > AVI_RIFF_MAX) {
+        if (avi_end_riff(avi) < 0 || avi_start_riff(avi) < 0)
+            return -1;
+    }
+
+    avi_put32(avi_put4cc(hdr, "00dc"), (uint32_t)payload);
+    iov[n].iov_base = hdr;
+    iov[n++].iov_len = sizeof(hdr);
+    iov[n].iov_base = jpeg;
+    iov[n++].iov_len = sof;
+    if (sof < size) {
+        iov[n].iov_base = (void *)dht;
+        iov[n++].iov_len = dht_size;
+        iov[n].iov_base = jpeg + sof;
+        iov[n++].iov_len = size - sof;
+    }
+    if (payload & 1) {
+        iov[n].iov_base = &pad;
+        iov[n++].iov_len = 1;
+    }
+    if (dwrite_writev(avi->dw, iov, n) < 0) {
+        avi->write_errors++;
+        return -1;
+    }
+
+    avi->ix[avi->nix][0] = (uint32_t)(avi->offset + 8 - avi->riff_start);
+    avi->ix[avi->nix][1] = (uint32_t)payload;
+    avi->nix++;
+    if (1 == avi->riffs) {
+        if (avi->nidx1 == avi->idx1_alloc) {
+            uint32_t alloc = avi->idx1_alloc ? avi->idx1_alloc * 2 : AVI_IX_ENTRIES;
+            void *idx1 = realloc(avi->idx1, alloc * sizeof(*avi->idx1));
+
+            if (!idx1)
+                return -1;
+            avi->idx1 = idx1;
+            avi->idx1_alloc = alloc;
+        }
+        /* idx1 offsets count from the 'movi' fourcc */
+        avi->idx1[avi->nidx1][0] = (uint32_t)(avi->offset - avi->movi_start - 8);
+        avi->idx1[avi->nidx1][1] = (uint32_t)payload;
+        avi->nidx1++;
+    }
+    avi->offset += chunk;
+    avi->frames++;
+    avi->last_us = now;
+    if (payload > avi->max_frame)
+        avi->max_frame = payload;
+    avi->total_frames++;
+    avi->total_bytes += chunk;
+
+    if (AVI_IX_ENTRIES == avi->nix && avi_flush_index(avi) < 0)
+        return -1;
+    return dwrite_frame_end(avi->dw) < 0 ? -1 : 0;
+}
+
+int32_t avi_parse(const char *arg, uint64_t *max_bytes, int32_t *max_seconds)
+{
+    char *end = (char *)arg;
+    unsigned long long value = 0;
+
+    *max_bytes = 0;
+    *max_seconds = 0;
+    if (*arg && *arg != ':') {
+        value = strtoull(arg, &end, 10);
+        if (end == arg)
+            return -1;
+        switch (*end) {
+        case 'k':
+        case 'K':
+            value *= 1000;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            value *= 1000000;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            value *= 1000000000;
+            end++;
+            break;
+        default:
+            break;
+        }
+        *max_bytes = value;
+    }
+    if (':' == *end) {
+        *max_seconds = atoi(end + 1);
+        if (*max_seconds <= 0)
+            return -1;
+    } else if (*end) {
+        return -1;
+    }
+    /* room for the header and one index at least */
+    if (*max_bytes && *max_bytes < 1000000)
+        return -1;
+    return 0;
+}
+
+void avi_print_stats(struct avi *avi)
+{
+    if (!avi)
+        return;
+
+    fprintf(stderr, "AVI: %u segments, %llu frames, %llu bytes, %u write errors\n",
+            avi->segments, (unsigned long long)avi->total_frames,
+            (unsigned long long)avi->total_bytes, avi->write_errors);
+}
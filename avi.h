@@ -0,0 +1,59 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __AVI_H__
+#define __AVI_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Streaming MJPEG AVI writer. Frames are appended to one preallocated file
+ * per segment instead of one file per frame. Past the first 1 GB RIFF the
+ * file continues as OpenDML (AVIX) RIFFs; the ix00 chunk indexes are written
+ * as the movie grows and the indx super index and frame counts in the
+ * header are rewritten with them, so a cut-off segment stays playable up
+ * to the last index. The legacy idx1 covers the first RIFF.
+ */
+#define AVI_RIFF_MAX            (1024ULL * 1024 * 1024)
+#define AVI_IX_ENTRIES          (1024)      /* frames per ix00 chunk */
+#define AVI_SUPERINDEX_ENTRIES  (256)
+#define AVI_PREALLOC_STEP       (256ULL * 1024 * 1024)
+
+struct avi;
+
+/*
+ * Segments are named like the snapshots, with an .avi extension, and
+ * rotate once max_bytes or max_seconds is reached (0 for no limit).
+ */
+struct avi *avi_create(const char *name_prefix, int32_t width, int32_t height,
+        uint64_t max_bytes, int32_t max_seconds);
+
+/* Close the open segment and free the writer. */
+void avi_destroy(struct avi *avi);
+
+/* Append one JPEG frame, the standard DHT is inserted when it has none. */
+int32_t avi_write_frame(struct avi *avi, unsigned char *jpeg, size_t size);
+
+/* Parse "[<bytes>[k|M|G]][:<seconds>]", returns -1 on bad input. */
+int32_t avi_parse(const char *arg, uint64_t *max_bytes, int32_t *max_seconds);
+
+void avi_print_stats(struct avi *avi);
+
+#endif
@@ -0,0 +1,585 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <jpeglib.h>
+#include <linux/videodev2.h>
+
+#include "v4l2uvc.h"
+#include "cam_cap.h"
+#include "utils.h"
+#include "color.h"
+#include "threadpool.h"
+#include "jpegenc.h"
+#include "encpool.h"
+#include "huffopt.h"
+#include "qoi.h"
+#include "dwrite.h"
+#include "framepool.h"
+#include "bench.h"
+
+struct bench_ctx {
+    int32_t width;
+    int32_t height;
+    int32_t max_threads;
+    int32_t frames;
+    unsigned char *yuyv;        /* synthetic capture frame */
+    unsigned char *mjpeg;       /* the same frame as camera style MJPEG */
+    unsigned long mjpeg_size;
+    unsigned char *rgb;
+    unsigned char *decoded;
+};
+
+static double bench_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Smooth gradients plus some texture, roughly what a real scene costs. */
+static void bench_fill_yuyv(unsigned char *yuyv, int32_t width, int32_t height)
+{
+    int32_t x, y;
+    uint32_t seed = 0x12345678;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x += 2) {
+            unsigned char *p = yuyv + ((size_t)y * width + x) * 2;
+
+            seed = seed * 1103515245 + 12345;
+            p[0] = (unsigned char)((x + y) / 4 + ((seed >> 16) & 15));
+            p[1] = (unsigned char)(128 + (x * 64) / width - 32);
+            p[2] = (unsigned char)((x + 1 + y) / 4 + ((seed >> 20) & 15));
+            p[3] = (unsigned char)(128 + (y * 64) / height - 32);
+        }
+    }
+}
+
+/* Encode the YUYV frame like a UVC camera would: baseline 4:2:2 with DHT. */
+static int32_t bench_make_mjpeg(struct bench_ctx *ctx)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    unsigned char *line;
+    int32_t x;
+
+    line = malloc((size_t)ctx->width * 3);
+    if (!line)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    ctx->mjpeg = NULL;
+    ctx->mjpeg_size = 0;
+    jpeg_mem_dest(&cinfo, &ctx->mjpeg, &ctx->mjpeg_size);
+    cinfo.image_width = ctx->width;
+    cinfo.image_height = ctx->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        unsigned char *src = ctx->yuyv + (size_t)cinfo.next_scanline * ctx->width * 2;
+
+        for (x = 0; x < ctx->width; x++) {
+            line[x * 3] = src[x * 2];
+            line[x * 3 + 1] = src[(x & ~1) * 2 + 1];
+            line[x * 3 + 2] = src[(x & ~1) * 2 + 3];
+        }
+        row_pointer[0] = line;
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(line);
+
+    return 0;
+}
+
+static double bench_yuyv_to_rgb(struct bench_ctx *ctx)
+{
+    double start = bench_now_ms();
+    int32_t i;
+
+    for (i = 0; i < ctx->frames; i++)
+        utils_yuv422p_to_rgb24(ctx->yuyv, ctx->rgb, ctx->width, ctx->height);
+    return (bench_now_ms() - start) / ctx->frames;
+}
+
+static double bench_mjpeg_decode(struct bench_ctx *ctx)
+{
+    double start = bench_now_ms();
+    int32_t i, w = ctx->width, h = ctx->height;
+
+    for (i = 0; i < ctx->frames; i++) {
+        if (jpeg_decode(&ctx->decoded, ctx->mjpeg, &w, &h) != 0) {
+            fprintf(stderr, "bench: jpeg decode failed\n");
+            return -1;
+        }
+    }
+    return (bench_now_ms() - start) / ctx->frames;
+}
+
+static double bench_yuyv_to_jpeg(struct bench_ctx *ctx)
+{
+    struct jpegenc *enc;
+    unsigned char *out;
+    size_t size;
+    double start;
+    int32_t i;
+
+    enc = jpegenc_create(ctx->width, ctx->height, 85, JPEGENC_BACKEND_LIBJPEG);
+    if (!enc)
+        return -1;
+
+    start = bench_now_ms();
+    for (i = 0; i < ctx->frames; i++)
+        jpegenc_encode_yuyv(enc, ctx->yuyv, &out, &size);
+    start = (bench_now_ms() - start) / ctx->frames;
+    jpegenc_destroy(enc);
+    return start;
+}
+
+struct bench_stage {
+    const char *name;
+    double (*run)(struct bench_ctx *ctx);
+};
+
+static const struct bench_stage bench_scaling_stages[] = {
+    { "yuyv->rgb24",  bench_yuyv_to_rgb },
+    { "mjpeg decode", bench_mjpeg_decode },
+    { "yuyv->jpeg",   bench_yuyv_to_jpeg },
+};
+
+#define BENCH_SCALING_STAGES \
+    ((int32_t)(sizeof(bench_scaling_stages) / sizeof(bench_scaling_stages[0])))
+
+static void bench_scaling(struct bench_ctx *ctx)
+{
+    double base[BENCH_SCALING_STAGES];
+    int32_t threads, i;
+
+    fprintf(stderr, "Row-parallel scaling, ms/frame (speedup vs 1 thread):\n");
+    fprintf(stderr, "%-8s", "threads");
+    for (i = 0; i < BENCH_SCALING_STAGES; i++)
+        fprintf(stderr, "  %-20s", bench_scaling_stages[i].name);
+    fprintf(stderr, "\n");
+
+    for (threads = 1; threads <= ctx->max_threads; threads++) {
+        struct threadpool *pool = threadpool_create(threads);
+
+        threadpool_set_default(pool);
+        fprintf(stderr, "%-8d", threadpool_get_threads(pool));
+        for (i = 0; i < BENCH_SCALING_STAGES; i++) {
+            double ms = bench_scaling_stages[i].run(ctx);
+
+            if (threads == 1)
+                base[i] = ms;
+            fprintf(stderr, "  %8.2f (x%5.2f)     ", ms, ms > 0 ? base[i] / ms : 0);
+        }
+        fprintf(stderr, "\n");
+        threadpool_set_default(NULL);
+        threadpool_destroy(pool);
+    }
+}
+
+/* libjpeg against the in-tree encoder on the same frame. */
+static void bench_encoders(struct bench_ctx *ctx)
+{
+    static const char *names[] = { "libjpeg", "fastjpeg" };
+    int32_t backend, i;
+    double base = 0;
+
+    fprintf(stderr, "YUYV->JPEG encoders, quality 85:\n");
+    for (backend = JPEGENC_BACKEND_LIBJPEG; backend <= JPEGENC_BACKEND_FAST; backend++) {
+        struct jpegenc *enc;
+        unsigned char *out = NULL;
+        size_t size = 0;
+        double start, ms;
+
+        enc = jpegenc_create(ctx->width, ctx->height, 85, backend);
+        if (!enc)
+            return;
+        start = bench_now_ms();
+        for (i = 0; i < ctx->frames; i++)
+            jpegenc_encode_yuyv(enc, ctx->yuyv, &out, &size);
+        ms = (bench_now_ms() - start) / ctx->frames;
+        if (backend == JPEGENC_BACKEND_LIBJPEG)
+            base = ms;
+        fprintf(stderr, "  %-10s %8.2f ms/frame (x%5.2f), %zu bytes\n",
+                names[backend], ms, base / ms, size);
+        jpegenc_destroy(enc);
+    }
+}
+
+/* Optimized Huffman tables: size gain in the encoder and MJPEG re-coding cost. */
+static void bench_huffopt(struct bench_ctx *ctx)
+{
+    struct huffopt *opt;
+    struct jpegenc *enc;
+    unsigned char *out = NULL;
+    size_t std_size = 0, size = 0;
+    double start, ms;
+    int32_t i;
+
+    opt = huffopt_create(ctx->width, ctx->height, 1, 0);
+    enc = jpegenc_create(ctx->width, ctx->height, 85, JPEGENC_BACKEND_LIBJPEG);
+    if (!opt || !enc)
+        goto out;
+
+    fprintf(stderr, "Optimized Huffman tables, quality 85:\n");
+    jpegenc_encode_yuyv(enc, ctx->yuyv, &out, &std_size);
+    huffopt_feed(opt, out, std_size);
+    jpegenc_set_huffopt(enc, opt);
+    jpegenc_encode_yuyv(enc, ctx->yuyv, &out, &size);
+    fprintf(stderr, "  libjpeg    %zu -> %zu bytes (%.1f%%)\n",
+            std_size, size, size * 100.0 / std_size);
+
+    start = bench_now_ms();
+    for (i = 0; i < ctx->frames; i++)
+        if (huffopt_transcode(opt, ctx->mjpeg, ctx->mjpeg_size, &out, &size) < 0)
+            goto out;
+    ms = (bench_now_ms() - start) / ctx->frames;
+    fprintf(stderr, "  MJPEG re-code %6.2f ms/frame, %lu -> %zu bytes (%.1f%%)\n",
+            ms, ctx->mjpeg_size, size, size * 100.0 / ctx->mjpeg_size);
+
+out:
+    jpegenc_destroy(enc);
+    huffopt_destroy(opt);
+}
+
+/* Lossless QOI output: ratio against 24-bit RGB and single core throughput. */
+static void bench_qoi(struct bench_ctx *ctx)
+{
+    size_t rgb_size = (size_t)ctx->width * ctx->height * 3;
+    struct qoienc *enc;
+    unsigned char *out = NULL, *decoded = NULL;
+    size_t size = 0;
+    int32_t width, height, i;
+    double start, enc_ms, dec_ms;
+
+    enc = qoienc_create(ctx->width, ctx->height);
+    if (!enc)
+        return;
+
+    /* the RGB conversion is measured in the scaling stage, time QOI alone */
+    utils_yuv422p_to_rgb24(ctx->yuyv, ctx->rgb, ctx->width, ctx->height);
+    start = bench_now_ms();
+    for (i = 0; i < ctx->frames; i++)
+        qoienc_encode_rgb(enc, ctx->rgb, &out, &size);
+    enc_ms = (bench_now_ms() - start) / ctx->frames;
+
+    start = bench_now_ms();
+    for (i = 0; i < ctx->frames; i++) {
+        free(decoded);
+        decoded = qoi_decode(out, size, &width, &height);
+    }
+    dec_ms = (bench_now_ms() - start) / ctx->frames;
+
+    fprintf(stderr, "QOI lossless, one core:\n");
+    fprintf(stderr, "  %zu -> %zu bytes (%.1f%%), encode %6.2f ms/frame (%.0f MB/s), "
+            "decode %6.2f ms/frame (%.0f MB/s)%s\n", rgb_size, size, size * 100.0 / rgb_size,
+            enc_ms, rgb_size / 1000.0 / enc_ms, dec_ms, rgb_size / 1000.0 / dec_ms,
+            decoded && !memcmp(decoded, ctx->rgb, rgb_size) ? "" : ", MISMATCH");
+    free(decoded);
+    qoienc_destroy(enc);
+}
+
+#define BENCH_OUTPUT_MODES      (6)
+
+static const char *bench_output_names[BENCH_OUTPUT_MODES] = {
+    "stdio files", "buffered files", "O_DIRECT files",
+    "stdio stream", "O_DIRECT stream", "O_DIRECT n10",
+};
+
+/*
+ * One output mode over frames copies of the MJPEG frame, in dir. Returns the
+ * elapsed ms, the slowest frame in max_ms; closing is part of the last frame.
+ */
+static double bench_output_mode(struct bench_ctx *ctx, const char *dir, int32_t mode,
+        int32_t frames, double *max_ms)
+{
+    struct dwrite_policy policy = { mode == 2 || mode >= 4, mode == 5 ? 10 : 0, 0 };
+    struct iovec iov;
+    struct dwrite *dw = NULL;
+    FILE *file = NULL;
+    char name[256];
+    double start, frame_start, ms, total = -1;
+    int32_t i;
+
+    dwrite_set_policy(&policy);
+    iov.iov_base = ctx->mjpeg;
+    iov.iov_len = ctx->mjpeg_size;
+    *max_ms = 0;
+
+    snprintf(name, sizeof(name), "%s/stream", dir);
+    start = bench_now_ms();
+    if (3 == mode)
+        file = fopen(name, "wb");
+    else if (mode >= 4)
+        dw = dwrite_open(name, 0, DWRITE_BUF_SIZE * 16);
+    if (mode >= 3 && !file && !dw)
+        goto out;
+
+    for (i = 0; i < frames; i++) {
+        frame_start = bench_now_ms();
+        snprintf(name, sizeof(name), "%s/frame_%d.jpg", dir, i);
+        switch (mode) {
+        case 0:
+            file = fopen(name, "wb");
+            if (!file) {
+                frames = i;     /* the files written so far are removed */
+                goto out;
+            }
+            fwrite(ctx->mjpeg, 1, ctx->mjpeg_size, file);
+            fclose(file);
+            file = NULL;
+            break;
+        case 1:
+        case 2:
+            dwrite_write_file(name, &iov, 1);
+            break;
+        case 3:
+            fwrite(ctx->mjpeg, 1, ctx->mjpeg_size, file);
+            break;
+        default:
+            dwrite_write(dw, ctx->mjpeg, ctx->mjpeg_size);
+            dwrite_frame_end(dw);
+            break;
+        }
+        if (i == frames - 1) {
+            if (file)
+                fclose(file);
+            file = NULL;
+            dwrite_close(dw);
+            dw = NULL;
+        }
+        ms = bench_now_ms() - frame_start;
+        if (ms > *max_ms)
+            *max_ms = ms;
+    }
+    total = bench_now_ms() - start;
+
+out:
+    if (file)
+        fclose(file);
+    dwrite_close(dw);
+    for (i = 0; i < frames && mode < 3; i++) {
+        snprintf(name, sizeof(name), "%s/frame_%d.jpg", dir, i);
+        unlink(name);
+    }
+    snprintf(name, sizeof(name), "%s/stream", dir);
+    unlink(name);
+    return total;
+}
+
+/* Frame output in the current directory: stdio against the dwrite layer. */
+static void bench_output(struct bench_ctx *ctx)
+{
+    char dir[] = "cam_cap_bench.XXXXXX";
+    int32_t frames = ctx->frames * 10, mode;
+    double ms, max_ms;
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "bench: unable to create a scratch directory here\n");
+        return;
+    }
+    fprintf(stderr, "Frame output, %d mjpeg frames:\n", frames);
+    for (mode = 0; mode < BENCH_OUTPUT_MODES; mode++) {
+        ms = bench_output_mode(ctx, dir, mode, frames, &max_ms);
+        if (ms < 0) {
+            fprintf(stderr, "  %-16s failed\n", bench_output_names[mode]);
+            continue;
+        }
+        fprintf(stderr, "  %-16s %8.1f MB/s, %7.1f fps, slowest frame %7.2f ms\n",
+                bench_output_names[mode], frames * (double)ctx->mjpeg_size / 1000.0 / ms,
+                frames * 1000.0 / ms, max_ms);
+    }
+    dwrite_set_policy(NULL);
+    rmdir(dir);
+}
+
+#define BENCH_HUGE_SIZES 4
+
+static const int32_t bench_huge_sizes[BENCH_HUGE_SIZES][2] = {
+    { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 },
+};
+
+static const char *bench_huge_names[] = { "4k pages", "thp", "hugetlb" };
+
+/*
+ * One full-frame conversion plus one frame copy per pass, on buffers
+ * backed the given way. Returns ms per pass, or -1 when mapping failed.
+ */
+static double bench_huge_mode(struct bench_ctx *ctx, int32_t width, int32_t height,
+        int32_t mode, int32_t *kind)
+{
+    size_t yuyv_size = (size_t)width * height * 2;
+    unsigned char *src, *copy, *rgb;
+    double start, ms = -1;
+    int32_t i;
+
+    framepool_set_huge(mode);
+    src = framepool_map(yuyv_size);
+    copy = framepool_map(yuyv_size);
+    rgb = framepool_map((size_t)width * height * 3);
+    framepool_set_huge(FRAMEPOOL_HUGE_OFF);
+    if (!src || !copy || !rgb)
+        goto out;
+    /* Keep the baseline on 4k pages even with THP set to "always". */
+    if (mode == FRAMEPOOL_HUGE_OFF) {
+        madvise(src, yuyv_size, MADV_NOHUGEPAGE);
+        madvise(copy, yuyv_size, MADV_NOHUGEPAGE);
+        madvise(rgb, (size_t)width * height * 3, MADV_NOHUGEPAGE);
+    }
+    *kind = framepool_map_kind(src);
+    /* Fault everything in up front, only the steady state is timed. */
+    bench_fill_yuyv(src, width, height);
+    memset(copy, 0, yuyv_size);
+    memset(rgb, 0, (size_t)width * height * 3);
+
+    start = bench_now_ms();
+    for (i = 0; i < ctx->frames; i++) {
+        memcpy(copy, src, yuyv_size);
+        utils_yuv422p_to_rgb24(copy, rgb, width, height);
+    }
+    ms = (bench_now_ms() - start) / ctx->frames;
+out:
+    framepool_unmap(src);
+    framepool_unmap(copy);
+    framepool_unmap(rgb);
+    return ms;
+}
+
+/* TLB pressure: the same single-threaded pass on 4k and huge pages. */
+static void bench_hugepages(struct bench_ctx *ctx)
+{
+    int32_t i, mode, kind;
+    double ms, base;
+
+    fprintf(stderr, "Huge page backing, copy+YUYV->RGB ms/frame (gain vs 4k pages):\n");
+    for (i = 0; i < BENCH_HUGE_SIZES; i++) {
+        int32_t width = bench_huge_sizes[i][0], height = bench_huge_sizes[i][1];
+
+        fprintf(stderr, "  %4dx%-4d", width, height);
+        base = 0;
+        for (mode = FRAMEPOOL_HUGE_OFF; mode <= FRAMEPOOL_HUGE_TLB; mode++) {
+            kind = FRAMEPOOL_HUGE_OFF;
+            ms = bench_huge_mode(ctx, width, height, mode, &kind);
+            if (ms < 0) {
+                fprintf(stderr, "  %-8s failed             ", bench_huge_names[mode]);
+                continue;
+            }
+            if (mode == FRAMEPOOL_HUGE_OFF)
+                base = ms;
+            /* hugetlb without reserved pages lands on thp, say so */
+            fprintf(stderr, "  %-8s %7.2f (%+5.1f%%)", bench_huge_names[kind], ms,
+                    base > 0 ? (base - ms) * 100.0 / base : 0);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+/* Frame-parallel encoding: frames per second through an encpool. */
+static void bench_encpool(struct bench_ctx *ctx)
+{
+    int32_t workers, i, frames = ctx->frames * 2;
+    double base = 0;
+
+    fprintf(stderr, "Frame-parallel YUYV->JPEG encoding:\n");
+    for (workers = 1; workers <= ctx->max_threads && workers <= ENCPOOL_MAX_WORKERS; workers++) {
+        struct encpool *pool;
+        double start, fps;
+
+        pool = encpool_create(workers, ctx->width, ctx->height, 85,
+                              JPEGENC_BACKEND_LIBJPEG, NULL, NULL);
+        if (!pool)
+            return;
+        start = bench_now_ms();
+        for (i = 0; i < frames; i++)
+            encpool_submit(pool, ctx->yuyv, NULL, NULL, i);
+        encpool_flush(pool);
+        fps = frames * 1000.0 / (bench_now_ms() - start);
+        if (workers == 1)
+            base = fps;
+        fprintf(stderr, "  %2d workers: %7.2f fps (x%5.2f)\n", workers, fps, fps / base);
+        encpool_destroy(pool);
+    }
+}
+
+int32_t bench_run(int32_t width, int32_t height, int32_t max_threads,
+        int32_t frames)
+{
+    struct bench_ctx ctx;
+    int32_t ret = -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.width = width & ~15;
+    ctx.height = height & ~7;
+    ctx.max_threads = max_threads > 0 ? max_threads : threadpool_online_cpus();
+    ctx.frames = frames > 0 ? frames : 10;
+    if (ctx.width <= 0 || ctx.height <= 0) {
+        fprintf(stderr, "bench: bad frame size %dx%d\n", width, height);
+        return -1;
+    }
+
+    ctx.yuyv = malloc((size_t)ctx.width * ctx.height * 2);
+    ctx.rgb = malloc((size_t)ctx.width * ctx.height * 3);
+    if (!ctx.yuyv || !ctx.rgb)
+        goto out;
+    bench_fill_yuyv(ctx.yuyv, ctx.width, ctx.height);
+    if (bench_make_mjpeg(&ctx) < 0)
+        goto out;
+
+    fprintf(stderr, "Benchmark %dx%d, %d frames per stage, mjpeg frame %lu bytes\n",
+            ctx.width, ctx.height, ctx.frames, ctx.mjpeg_size);
+
+    initLut();
+    framepool_init(ctx.width, ctx.height);
+    jpeg_decode_init(ctx.width, ctx.height);
+    bench_scaling(&ctx);
+    bench_encoders(&ctx);
+    bench_huffopt(&ctx);
+    bench_qoi(&ctx);
+    bench_encpool(&ctx);
+    bench_output(&ctx);
+    bench_hugepages(&ctx);
+    freeLut();
+    jpeg_decode_cleanup();
+    framepool_cleanup();
+    ret = 0;
+
+out:
+    free(ctx.yuyv);
+    free(ctx.rgb);
+    free(ctx.mjpeg);
+    free(ctx.decoded);
+    return ret;
+}
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -34,11 +35,32 @@
 #include "cam_cap.h"
 #include "utils.h"
 #include "color.h"
+#include "threadpool.h"
+#include "bench.h"
+#include "jpegenc.h"
+#include "encpool.h"
+#include "ratectl.h"
+#include "huffopt.h"
+#include "avi.h"
+#include "archive.h"
+#include "rawout.h"
+#include "qoi.h"
+#include "aiowr.h"
+#include "dwrite.h"
+#include "fname.h"
+#include "framepool.h"
+#include "pretrig.h"
+#include "snapd.h"
+#include "shmring.h"
+#include "httpd.h"
+#include "pipeout.h"
+#include "sink.h"
 
 static const char version[] = VERSION;
 int32_t run = 1;
 
 #define CAM_V4L2_PARAMS_NUM     (13)
+#define CAM_CAP_ALLOC_WARMUP    (5)     /* frames before heap allocations are counted */
 
 typedef struct {
     char *param_name;
@@ -73,7 +95,7 @@ void usage (void)
     fprintf(stderr, "Usage is: cam_cap [options]\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "-v\t\tVerbose (add more v's to be more verbose)\n");
-    fprintf(stderr, "-o<filename>\tOutput filename prefix(default: cam_cap_snap_xxx.jpg).\n");
+    fprintf(stderr, "-o<filename>\tOutput filename prefix(default: cam_cap_snap-YYYYMMDD-HHMMSS.<usec>-<sequence>.jpg), - streams -f0/-f3/-f4 to stdout (dropping frames while a pipe reader is behind, not with -A/-a).\n");
     fprintf(stderr, "-d<device>\tV4L2 Device (default: /dev/video1)\n");
     fprintf(stderr,
              "-x<width>\tImage Width (must be supported by device), default 640x480\n");
@@ -90,10 +112,53 @@ void usage (void)
     fprintf(stderr,
              "-q<percentage>\tJPEG Quality Compression Level (activates YUYV capture), default 95\n");
     fprintf(stderr, "-r\t\tUse read instead of mmap for image capture\n");
+    fprintf(stderr, "-U\t\tCapture into user buffers (V4L2 USERPTR) instead of driver mmap buffers\n");
+    fprintf(stderr,
+             "-L[t]\t\tBack frame buffers with huge pages: MAP_HUGETLB, falling back to transparent huge pages (t: transparent only)\n");
     fprintf(stderr,
              "-w\t\tWait for capture command to finish before starting next capture\n");
     fprintf(stderr, "-m\t\tToggles capture mode to YUYV capture\n");
-    fprintf(stderr, "-f<format>\tChange output format, 0-JPEG, 1-YUYV, 2-BMP, default is JPEG\n");
+    fprintf(stderr, "-f<format>[,...]\tOutput formats, 0-JPEG, 1-YUYV, 2-BMP, 3-raw YUYV stream, 4-Y4M stream, 5-QOI lossless, 6-JPEG thumbnail (1/%d size), default is JPEG; several formats share one decode\n",
+             SINK_THUMB_DIV);
+    fprintf(stderr,
+             "-P<integer>\tWorker threads for row-parallel conversions, default is online CPUs\n");
+    fprintf(stderr,
+             "-E<integer>\tYUYV->JPEG encoder worker threads, frames are encoded in parallel, default is 1\n");
+    fprintf(stderr,
+             "-J<backend>\tYUYV->JPEG encoder, 0-libjpeg, 1-in-tree fast encoder, default is libjpeg\n");
+    fprintf(stderr,
+             "-R<b|t><value>\tAdapt JPEG quality (at most -q) to hold b<bytes per second> or t<encode us per frame>, k/M suffixes allowed\n");
+    fprintf(stderr,
+             "-H[frames][:period]\tOptimized Huffman tables learned from the first frames (default %d), rebuilt every period frames or on scene change\n",
+             HUFFOPT_LEARN_FRAMES);
+    fprintf(stderr,
+             "-A[size][:sec]\tAppend JPEG frames to MJPEG AVI segments rotated at size bytes (k/M/G) or sec seconds\n");
+    fprintf(stderr,
+             "-a[size]\tAppend JPEG frames to the indexed archive at the -o prefix, data segments rotated at size bytes (k/M/G), default 1G; read it with cam_extract\n");
+    fprintf(stderr,
+             "-W[slots]\tWrite JPEG/BMP/QOI files asynchronously (io_uring, or a writer thread), %d slots by default; files are dropped when all are in flight\n",
+             AIOWR_DEFAULT_SLOTS);
+    fprintf(stderr,
+             "-s<h|m>\t\tShard per-frame files into YYYYMMDD/HH (h) or YYYYMMDD/HH/MM (m) directories\n");
+    fprintf(stderr,
+             "-p[pre][:post][,size]\tPre-trigger capture: keep the last pre seconds (default %d) of JPEG frames in a size byte ring (k/M/G, default 64M), write them and the next post seconds (default pre) on SIGUSR1\n",
+             PRETRIG_DEFAULT_MS / 1000);
+    fprintf(stderr,
+             "-c<path>\tControl socket for -p, a \"trigger\" datagram starts an event\n");
+    fprintf(stderr,
+             "-K<path>\tDaemon: keep streaming and serve JPEG snapshots and camera settings on a UNIX socket (see snapd.h)\n");
+    fprintf(stderr,
+             "-Z<name>[,slots][,p]\tPublish every frame to /dev/shm/<name> for local readers (see shmring.h), %d slots by default, p adds the decoded YUYV plane\n",
+             SHMRING_DEFAULT_SLOTS);
+    fprintf(stderr,
+             "-l[addr:]port\tServe an MJPEG stream (GET /) and snapshots (GET /snapshot) over HTTP, up to %d viewers\n",
+             HTTPD_MAX_CLIENTS);
+    fprintf(stderr,
+             "-M<frames>\tBurst: capture frames to memory at sensor rate, then write them all out (every CPU encoding, async writes)\n");
+    fprintf(stderr,
+             "-D[n<frames>|t<ms>]\tWrite files and streams with O_DIRECT, fdatasync every n frames or t ms (default never)\n");
+    fprintf(stderr,
+             "-b\t\tRun the offline benchmark on a synthetic -x/-y frame (-n frames per stage, -P max threads) and exit\n");
     fprintf(stderr, "Camera Settings:\n");
     fprintf(stderr, "-B<integer>\tBrightness\n");
     fprintf(stderr, "-C<integer>\tContrast\n");
@@ -102,75 +167,428 @@ void usage (void)
     exit (8);
 }
 
-int32_t compress_yuyv_to_jpeg (struct vdIn *vd, FILE * file, int32_t quality)
+struct cam_cap_jpeg_out {
+    struct encpool *encpool;
+    struct ratectl *ratectl;
+    struct huffopt *huffopt;
+    struct avi *avi;
+    struct archive *archive;
+    struct aiowr *aiowr;
+    struct pretrig *pretrig;
+    struct fname *fname;        /* names event frames on the pretrig thread */
+    struct httpd *httpd;        /* viewers get the JPEG that is saved */
+    struct pipeout *pipeout;    /* -o -: concatenated JPEGs on stdout */
+};
+
+/* one whole frame file, through the async writer when there is one */
+static void cam_cap_write_file(struct cam_cap_jpeg_out *jpeg_out, const char *name,
+        const struct iovec *iov, int32_t iovcnt)
+{
+    if (jpeg_out->aiowr)
+        aiowr_write_file(jpeg_out->aiowr, name, iov, iovcnt);
+    else
+        dwrite_write_file(name, iov, iovcnt);
+}
+
+/* one JPEG frame: appended to the AVI segment and/or archive, or a file of its own */
+static void cam_cap_commit_jpeg(struct cam_cap_jpeg_out *jpeg_out, const char *name,
+        unsigned char *data, size_t size, const struct timeval *timestamp,
+        uint32_t sequence, uint32_t flags)
+{
+    struct iovec iov[3];
+
+    if (jpeg_out->pipeout) {
+        if (pipeout_writev(jpeg_out->pipeout, iov, utils_get_picture_jpg_iov(iov, data, size)) < 0)
+            run = 0;    /* the reader is gone */
+        return;
+    }
+    if (jpeg_out->avi || jpeg_out->archive) {
+        if (jpeg_out->avi)
+            avi_write_frame(jpeg_out->avi, data, size);
+        if (jpeg_out->archive)
+            archive_append(jpeg_out->archive, data, size, timestamp, sequence, flags);
+        return;
+    }
+
+    cam_cap_write_file(jpeg_out, name, iov, utils_get_picture_jpg_iov(iov, data, size));
+}
+
+/* pre-trigger writer thread: event frames are named as they go out */
+static void cam_cap_write_event(void *arg, const struct pretrig_frame *frame)
+{
+    struct cam_cap_jpeg_out *jpeg_out = (struct cam_cap_jpeg_out *)arg;
+    char name[FNAME_MAX] = { 0 };
+
+    if (!jpeg_out->avi && !jpeg_out->archive && !jpeg_out->pipeout &&
+        (fname_frame(jpeg_out->fname, name, &frame->timestamp, frame->sequence, "jpg") < 0))
+        return;
+    cam_cap_commit_jpeg(jpeg_out, name, (unsigned char *)frame->data, frame->size,
+                        &frame->timestamp, frame->sequence, frame->flags);
+}
+
+/* with -p every frame waits in the ring, only events reach the outputs */
+static void cam_cap_store_jpeg(struct cam_cap_jpeg_out *jpeg_out, const char *name,
+        unsigned char *data, size_t size, const struct timeval *timestamp,
+        uint32_t sequence, uint32_t flags)
+{
+    struct iovec iov[3];
+
+    if (httpd_clients(jpeg_out->httpd) > 0)
+        httpd_publish(jpeg_out->httpd, iov, utils_get_picture_jpg_iov(iov, data, size), sequence);
+    if (jpeg_out->pretrig)
+        pretrig_push(jpeg_out->pretrig, data, size, timestamp, sequence, flags);
+    else
+        cam_cap_commit_jpeg(jpeg_out, name, data, size, timestamp, sequence, flags);
+}
+
+/* encoder pool output: frames arrive here in capture order */
+static void cam_cap_write_jpeg(void *arg, const struct encpool_result *result)
+{
+    struct cam_cap_jpeg_out *jpeg_out = (struct cam_cap_jpeg_out *)arg;
+
+    if (jpeg_out->ratectl)
+        encpool_set_quality(jpeg_out->encpool,
+                ratectl_update(jpeg_out->ratectl, result->size, result->encode_us));
+    huffopt_feed(jpeg_out->huffopt, result->data, result->size);
+
+    cam_cap_store_jpeg(jpeg_out, result->name, result->data, result->size,
+                       &result->timestamp, result->sequence, 0);
+}
+
+/*
+ * -Z: every frame goes to shared memory straight from the driver buffer, or
+ * from our buffers once materialized; a frame the outputs decoded is not
+ * decoded again, its YUYV is copied.
+ */
+static void cam_cap_publish(struct shmring *shm, struct vdIn *vd)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
-    int32_t z;
-
-    fprintf(stderr, "Compressing YUYV frame to JPEG image.\n");
-
-    line_buffer = calloc (vd->width * 3, 1);
-    yuyv = vd->framebuffer;
-
-    cinfo.err = jpeg_std_error (&jerr);
-    jpeg_create_compress (&cinfo);
-    jpeg_stdio_dest (&cinfo, file);
-
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-
-    jpeg_set_defaults (&cinfo);
-    jpeg_set_quality (&cinfo, quality, TRUE);
-
-    jpeg_start_compress (&cinfo, TRUE);
-
-    z = 0;
-    while (cinfo.next_scanline < cinfo.image_height) {
-        int32_t x;
-        unsigned char *ptr = line_buffer;
-
-        for (x = 0; x < vd->width; x++) {
-            int32_t r, g, b;
-            int32_t y, u, v;
-
-            if (!z)
-                y = yuyv[0] << 8;
-            else
-                y = yuyv[2] << 8;
-            u = yuyv[1] - 128;
-            v = yuyv[3] - 128;
-
-            r = (y + (359 * v)) >> 8;
-            g = (y - (88 * u) - (183 * v)) >> 8;
-            b = (y + (454 * u)) >> 8;
-
-            *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-            *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-            *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-            if (z++) {
-                z = 0;
-                yuyv += 4;
+    const struct shmring_header *hdr = shmring_info(shm);
+    unsigned char *src = uvcFrameData(vd), *jpeg, *plane, *pic;
+    size_t size = vd->buf.bytesused, jpeg_size = 0, plane_size = 0;
+    uint32_t flags = 0;
+    int w, h;
+
+    if (vd->materialized) {
+        src = V4L2_PIX_FMT_MJPEG == vd->formatIn ? vd->tmpbuffer : vd->framebuffer;
+        size = V4L2_PIX_FMT_MJPEG == vd->formatIn ? (size_t)vd->tmpbuf_byteused :
+            (size_t)vd->framesizeIn;
+    }
+    if (!src || shmring_begin(shm, &jpeg, &plane) < 0)
+        return;
+    if (V4L2_PIX_FMT_MJPEG == vd->formatIn) {
+        if (size > shmring_jpeg_max(shm))
+            size = 0;
+        memcpy(jpeg, src, size);
+        jpeg_size = size;
+        if (size && !utils_is_huffman(jpeg))
+            flags |= SHMRING_FLAG_NO_DHT;
+        /* decoded in place; a size change would make jpeg_decode() realloc */
+        pic = plane;
+        if (plane && size && vd->materialized && vd->decode) {
+            if (((uint32_t)vd->width == hdr->width) && ((uint32_t)vd->height == hdr->height)) {
+                plane_size = (size_t)vd->width * vd->height * 2;
+                memcpy(plane, vd->framebuffer, plane_size);
             }
+        } else if (plane && size &&
+            (utils_jpeg_dims(jpeg, size, &w, &h) == 0) &&
+            (w == vd->width) && (h == vd->height) &&
+            (jpeg_decode(&pic, jpeg, &w, &h) == 0))
+            plane_size = (size_t)w * h * 2;
+    } else if (plane) {
+        plane_size = size < (size_t)vd->framesizeIn ? size : (size_t)vd->framesizeIn;
+        memcpy(plane, src, plane_size);
+    }
+    shmring_commit(shm, jpeg_size, plane_size, &vd->buf.timestamp, vd->buf.sequence, flags);
+}
+
+/* daemon mode "set": a camera control by name ('_' for ' ') or the JPEG quality */
+static void cam_cap_serve_set(struct snapd *snapd, struct snapd_req *req,
+        struct vdIn *vd, struct jpegenc *encoder)
+{
+    char *p;
+    int tmp;
+
+    if (!strcasecmp(req->name, "quality")) {
+        if (jpegenc_set_quality(encoder, req->value) < 0)
+            snapd_reply_error(snapd, req, "no encoder, the camera compresses");
+        else
+            snapd_reply_ok(snapd, req);
+        return;
+    }
+    for (p = req->name; *p; p++)
+        if (*p == '_')
+            *p = ' ';
+    for (tmp = 0; tmp < CAM_V4L2_PARAMS_NUM; ++tmp) {
+        if (strcasecmp(req->name, cam_v4l2_param_group[tmp].param_name))
+            continue;
+        if (v4l2SetControl(vd, cam_v4l2_param_group[tmp].param_cid, req->value) < 0)
+            snapd_reply_error(snapd, req, "control rejected");
+        else
+            snapd_reply_ok(snapd, req);
+        return;
+    }
+    snapd_reply_error(snapd, req, "unknown control");
+}
+
+/* -l: frames nobody saves as JPEG are encoded for the viewers, only while there are any */
+static int32_t cam_cap_stream(struct httpd *httpd, struct vdIn *vd, struct jpegenc *encoder)
+{
+    struct iovec iov[3];
+    unsigned char *src, *jpeg_buf;
+    size_t jpeg_size;
+    int32_t ret;
+
+    if (httpd_clients(httpd) <= 0)
+        return 0;
+    if (V4L2_PIX_FMT_MJPEG == vd->formatIn) {
+        /* straight from the driver buffer, the server keeps the only copy */
+        if (vd->materialized) {
+            if (vd->tmpbuf_byteused > 0)
+                httpd_publish(httpd, iov,
+                              utils_get_picture_jpg_iov(iov, vd->tmpbuffer, vd->tmpbuf_byteused),
+                              vd->buf.sequence);
+            return 0;
         }
+        src = uvcFrameData(vd);
+        if (src && (vd->buf.bytesused > 0))
+            httpd_publish(httpd, iov, utils_get_picture_jpg_iov(iov, src, vd->buf.bytesused),
+                          vd->buf.sequence);
+        return 0;
+    }
+    ret = uvcMaterialize(vd);
+    if (ret)
+        return ret < 0 ? -1 : 0;
+    if (jpegenc_encode_yuyv(encoder, vd->framebuffer, &jpeg_buf, &jpeg_size) == 0) {
+        iov[0].iov_base = jpeg_buf;
+        iov[0].iov_len = jpeg_size;
+        httpd_publish(httpd, iov, 1, vd->buf.sequence);
+    }
+    return 0;
+}
 
-        row_pointer[0] = line_buffer;
-        jpeg_write_scanlines (&cinfo, row_pointer, 1);
+/* daemon mode: every waiting request is answered from the frame just grabbed */
+static int32_t cam_cap_serve(struct snapd *snapd, struct vdIn *vd,
+        struct jpegenc *encoder, struct fname *fname)
+{
+    struct snapd_req *req;
+    struct iovec iov[3];
+    int32_t iovcnt = 0, ret;
+    unsigned char *jpeg_buf;
+    size_t jpeg_size;
+    char name[FNAME_MAX] = { 0 };
+
+    if (snapd_poll(snapd) <= 0)
+        return 0;
+    while ((req = snapd_next(snapd))) {
+        if (SNAPD_REQ_SET == req->type) {
+            cam_cap_serve_set(snapd, req, vd, encoder);
+            continue;
+        }
+        /* one copy and encode, however many clients asked */
+        if (!iovcnt) {
+            ret = uvcMaterialize(vd);
+            if (ret < 0)
+                return -1;
+            if (UVC_FRAME_EMPTY == ret)
+                return 0;       /* answered from the next frame */
+            if (V4L2_PIX_FMT_MJPEG == vd->formatIn) {
+                iovcnt = utils_get_picture_jpg_iov(iov, vd->tmpbuffer, vd->tmpbuf_byteused);
+            } else if (jpegenc_encode_yuyv(encoder, vd->framebuffer,
+                                           &jpeg_buf, &jpeg_size) == 0) {
+                iov[0].iov_base = jpeg_buf;
+                iov[0].iov_len = jpeg_size;
+                iovcnt = 1;
+            }
+            if (iovcnt <= 0) {
+                iovcnt = 0;
+                snapd_reply_error(snapd, req, "encode failed");
+                continue;
+            }
+        }
+        if (SNAPD_REQ_SNAP_PATH != req->type) {
+            snapd_reply_data(snapd, req, iov, iovcnt);
+        } else if (!name[0] && ((NULL == fname) ||
+                   (fname_frame(fname, name, &vd->buf.timestamp, vd->buf.sequence, "jpg") < 0) ||
+                   (dwrite_write_file(name, iov, iovcnt) < 0))) {
+            name[0] = '\0';
+            snapd_reply_error(snapd, req, "write failed");
+        } else {
+            snapd_reply_path(snapd, req, name);
+        }
     }
+    return 0;
+}
 
-    jpeg_finish_compress (&cinfo);
-    jpeg_destroy_compress (&cinfo);
+/* what the output sinks share, set up once before the capture loop */
+struct cam_cap_out {
+    struct cam_cap_jpeg_out *jpeg_out;
+    struct jpegenc *encoder;
+    struct encpool *encpool;
+    struct ratectl *ratectl;
+    struct huffopt *huffopt;
+    struct fname *fname;
+    struct rawout *rawout;
+    struct qoienc *qoienc;
+    struct jpegenc *thumbenc;
+    unsigned char *bmp_rows;
+    size_t bmp_rows_size;
+    int32_t jpeg_named;         /* JPEG frames get a file of their own */
+    int32_t verbose;
+};
 
-    free (line_buffer);
+/* the next per-frame file name, 0 if there is one */
+static int32_t cam_cap_sink_name(struct cam_cap_out *out, char *name,
+        const struct sink_frame *frame, const char *ext)
+{
+    if (fname_frame(out->fname, name, frame->timestamp, frame->sequence, ext) < 0)
+        return -1;
+    if (out->verbose >= 1)
+        fprintf(stderr, "Saving image to: %s\n", name);
+    return 0;
+}
+
+/* -f0: the captured JPEG, or the YUYV frame encoded once */
+static int32_t cam_cap_sink_jpeg(void *arg, const struct sink_frame *frame)
+{
+    struct cam_cap_out *out = (struct cam_cap_out *)arg;
+    char name[FNAME_MAX] = { 0 };
+    struct timeval enc_start_time, enc_end_time;
+    unsigned char *jpeg_buf;
+    size_t jpeg_size;
+    int32_t time_dur;
+
+    /* frames going to the AVI segment, archive, event ring or stdout have no name */
+    if (out->jpeg_named && (cam_cap_sink_name(out, name, frame, "jpg") < 0))
+        return 0;
 
-    return (0);
+    if (frame->jpeg) {
+        /* re-coded with the stream's tables once they are built */
+        if ((NULL != out->huffopt) &&
+            (huffopt_transcode(out->huffopt, frame->jpeg, frame->jpeg_size,
+                               &jpeg_buf, &jpeg_size) == 0))
+            cam_cap_store_jpeg(out->jpeg_out, name, jpeg_buf, jpeg_size,
+                               frame->timestamp, frame->sequence, 0);
+        else
+            cam_cap_store_jpeg(out->jpeg_out, name, frame->jpeg, frame->jpeg_size,
+                               frame->timestamp, frame->sequence, ARCHIVE_FLAG_PASSTHROUGH);
+        return 0;
+    }
+
+    if (NULL != out->encpool) {
+        /* the pool copies the frame, encodes and writes it */
+        encpool_submit(out->encpool, frame->yuyv, name, frame->timestamp, frame->sequence);
+        return 0;
+    }
+    gettimeofday(&enc_start_time, NULL);
+    if (jpegenc_encode_yuyv(out->encoder, frame->yuyv, &jpeg_buf, &jpeg_size) < 0)
+        return 0;
+    gettimeofday(&enc_end_time, NULL);
+    cam_cap_store_jpeg(out->jpeg_out, name, jpeg_buf, jpeg_size,
+                       frame->timestamp, frame->sequence, 0);
+    huffopt_feed(out->huffopt, jpeg_buf, jpeg_size);
+    if (out->ratectl) {
+        time_dur = (enc_end_time.tv_sec - enc_start_time.tv_sec) * 1000000 + (enc_end_time.tv_usec - enc_start_time.tv_usec);
+        jpegenc_set_quality(out->encoder, ratectl_update(out->ratectl, jpeg_size, time_dur));
+        if (out->verbose >= 2)
+            fprintf(stderr, "JPEG %zu bytes in %dus, next quality %d\n",
+                    jpeg_size, time_dur, out->ratectl->quality);
+    }
+    return 0;
+}
+
+/* -f1: YUYV capture as PNM from the shared RGB, MJPEG capture as it came */
+static int32_t cam_cap_sink_pnm(void *arg, const struct sink_frame *frame)
+{
+    struct cam_cap_out *out = (struct cam_cap_out *)arg;
+    char name[FNAME_MAX] = { 0 };
+    char ppm_hdr[UTILS_PPM_HDR_SIZE];
+    struct iovec iov[3];
+
+    if (frame->jpeg) {
+        if (cam_cap_sink_name(out, name, frame, "jpg") == 0)
+            cam_cap_write_file(out->jpeg_out, name, iov,
+                               utils_get_picture_jpg_iov(iov, frame->jpeg, frame->jpeg_size));
+    } else if (frame->rgb && (cam_cap_sink_name(out, name, frame, "pnm") == 0)) {
+        cam_cap_write_file(out->jpeg_out, name, iov,
+                           utils_get_picture_ppm_iov(iov, ppm_hdr, frame->rgb,
+                                                     frame->width, frame->height));
+    }
+    return 0;
+}
+
+static int32_t cam_cap_sink_bmp(void *arg, const struct sink_frame *frame)
+{
+    struct cam_cap_out *out = (struct cam_cap_out *)arg;
+    char name[FNAME_MAX] = { 0 };
+    unsigned char bmp_hdr[UTILS_BMP_HDR_SIZE];
+    struct iovec iov[2];
+
+    if ((cam_cap_sink_name(out, name, frame, "bmp") == 0) &&
+        (utils_get_picture_bmp_iov(iov, bmp_hdr, frame->yuyv, frame->width, frame->height,
+                                   &out->bmp_rows, &out->bmp_rows_size) > 0))
+        cam_cap_write_file(out->jpeg_out, name, iov, 2);
+    return 0;
+}
+
+/* -f3/-f4 */
+static int32_t cam_cap_sink_raw(void *arg, const struct sink_frame *frame)
+{
+    struct cam_cap_out *out = (struct cam_cap_out *)arg;
+
+    return rawout_write_frame(out->rawout, frame->yuyv);
+}
+
+static int32_t cam_cap_sink_qoi(void *arg, const struct sink_frame *frame)
+{
+    struct cam_cap_out *out = (struct cam_cap_out *)arg;
+    char name[FNAME_MAX] = { 0 };
+    struct iovec iov;
+    unsigned char *qoi_buf;
+    size_t qoi_size;
+
+    if ((cam_cap_sink_name(out, name, frame, "qoi") < 0) ||
+        (qoienc_encode_rgb(out->qoienc, frame->rgb, &qoi_buf, &qoi_size) < 0))
+        return 0;
+    iov.iov_base = qoi_buf;
+    iov.iov_len = qoi_size;
+    cam_cap_write_file(out->jpeg_out, name, &iov, 1);
+    return 0;
+}
+
+/* -f6: a JPEG of the shared scaled-down frame */
+static int32_t cam_cap_sink_thumb(void *arg, const struct sink_frame *frame)
+{
+    struct cam_cap_out *out = (struct cam_cap_out *)arg;
+    char name[FNAME_MAX] = { 0 };
+    struct iovec iov;
+    unsigned char *jpeg_buf;
+    size_t jpeg_size;
+
+    if ((cam_cap_sink_name(out, name, frame, "thumb.jpg") < 0) ||
+        (jpegenc_encode_yuyv(out->thumbenc, (unsigned char *)frame->thumb,
+                             &jpeg_buf, &jpeg_size) < 0))
+        return 0;
+    iov.iov_base = jpeg_buf;
+    iov.iov_len = jpeg_size;
+    cam_cap_write_file(out->jpeg_out, name, &iov, 1);
+    return 0;
 }
 
+/* one sink per -f format, in CAM_CAP_PIX_OUT_FMT_* order */
+static const struct {
+    const char *name;
+    uint32_t needs;
+    sink_write_fn write;
+} cam_cap_sinks[CAM_CAP_PIX_OUT_FMTS] = {
+    { "jpeg",      0,               cam_cap_sink_jpeg },
+    { "pnm",       0,               cam_cap_sink_pnm },
+    { "bmp",       SINK_NEED_YUYV,  cam_cap_sink_bmp },
+    { "raw",       SINK_NEED_YUYV,  cam_cap_sink_raw },
+    { "y4m",       SINK_NEED_YUYV,  cam_cap_sink_raw },
+    { "qoi",       SINK_NEED_RGB,   cam_cap_sink_qoi },
+    { "thumbnail", SINK_NEED_THUMB, cam_cap_sink_thumb },
+};
+
 static int32_t cam_cap_print_cam_parameters(struct vdIn *vd)
 {
     int tmp = 0;
@@ -192,10 +610,11 @@ int32_t main (int32_t argc, char *argv[])
 {
     char *videodevice = "/dev/video0";
     char *outputfile_prefix = "cam_cap_snap";
-    char  thisfile[200] = { 0 }; /* used as filename buffer in multi-file seq. */
+    char  thisfile[FNAME_MAX] = { 0 }; /* used as filename buffer in multi-file seq. */
     int32_t formatIn = V4L2_PIX_FMT_MJPEG;
     int32_t formatOut = CAM_CAP_PIX_OUT_FMT_JPEG;
-    int32_t grabmethod = 1;
+    uint32_t outputs = CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG);
+    int32_t grabmethod = V4L2UVC_GRAB_MMAP;
     int32_t width = 640;
     int32_t height = 480;
     int32_t brightness = 0, contrast = 0, saturation = 0, gain = 0;
@@ -205,14 +624,60 @@ int32_t main (int32_t argc, char *argv[])
     int32_t skip = 0;
     int32_t quality = 95;
     int32_t frame_num = 0;
+    int32_t ret = 0;
     struct timeval delay_ref_time, delay_end_time;
     struct timeval spd_tst_start_time, spd_tst_end_time;
     int32_t time_dur = 0;
     int32_t query = 0;
     int32_t speed_tst= 0;
+    int32_t threads = 0;
+    int32_t enc_workers = 0;    /* 0: 1, or every CPU to flush a burst */
+    int32_t enc_backend = JPEGENC_BACKEND_LIBJPEG;
+    int32_t bench = 0;
+    int32_t huff_opt = 0, huff_learn = 0, huff_period = 0;
 
     struct vdIn *videoIn;
-    FILE *file;
+    struct threadpool *pool;
+    struct jpegenc *encoder = NULL;
+    struct encpool *encpool = NULL;
+    struct huffopt *huffopt = NULL;
+    struct cam_cap_jpeg_out jpeg_out = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+    int32_t avi_out = 0, avi_seconds = 0;
+    uint64_t avi_bytes = 0;
+    int32_t archive_out = 0;
+    uint64_t archive_bytes = 0;
+    struct rawout *rawout = NULL;
+    struct qoienc *qoienc = NULL;
+    int32_t aio_out = 0, aio_slots = 0;
+    struct dwrite_policy dwrite_policy;
+    int32_t direct_out = 0;
+    struct fname *fname = NULL;
+    uint64_t heap_allocs = 0;
+    int32_t huge = FRAMEPOOL_HUGE_OFF;
+    int32_t shard = FNAME_SHARD_NONE;
+    int32_t pretrig_out = 0, pretrig_pre_ms = 0, pretrig_post_ms = 0;
+    uint64_t pretrig_bytes = 0;
+    char *ctl_path = NULL;
+    int32_t burst_frames = 0;
+    int32_t burst_short = 0;    /* the burst stopped early, exit status 1 */
+    char *snapd_path = NULL;
+    char shm_name[SHMRING_NAME_MAX] = { 0 };
+    int32_t shm_slots = 0, shm_plane = 0;
+    struct shmring *shm = NULL;
+    struct snapd *snapd = NULL;
+    char *httpd_addr = NULL;
+    struct httpd *httpd = NULL;
+    struct jpegenc *stream_enc = NULL;
+    int32_t save;
+    struct timeval burst_start, burst_end, flush_end;
+    struct ratectl ratectl;
+    int32_t rate_mode = RATECTL_MODE_NONE;
+    int64_t rate_target = 0;
+    struct jpegenc *thumbenc = NULL;
+    struct cam_cap_out out = { NULL };
+    struct sink_graph *graph = NULL;
+    struct sink_frame frame;
+    int32_t fmt;
 
     (void)signal (SIGINT, sigcatch);
     (void)signal (SIGQUIT, sigcatch);
@@ -245,7 +710,18 @@ int32_t main (int32_t argc, char *argv[])
             break;
 
         case 'r':
-            grabmethod = 0;
+            grabmethod = V4L2UVC_GRAB_READ;
+            break;
+
+        case 'U':
+            grabmethod = V4L2UVC_GRAB_USERPTR;
+            break;
+
+        case 'L':
+            if (framepool_parse_huge(&argv[1][2], &huge) < 0) {
+                printf("Unsupported huge page mode: %s\n", &argv[1][2]);
+                return -1;
+            }
             break;
 
         case 'm':
@@ -262,14 +738,23 @@ int32_t main (int32_t argc, char *argv[])
 
         case 'f':
             {
-                int32_t fmtOut = atoi(&argv[1][2]);
-                switch (fmtOut) {
-                case CAM_CAP_PIX_OUT_FMT_YUYV:
-                case CAM_CAP_PIX_OUT_FMT_JPEG:
-                case CAM_CAP_PIX_OUT_FMT_BMP:
-                    formatOut = fmtOut;
-                    break;
-                default:
+                char *fmt = &argv[1][2], *end;
+                int32_t fmtOut;
+
+                /* a comma separated list, the first one is the main format */
+                outputs = 0;
+                do {
+                    fmtOut = strtol(fmt, &end, 10);
+                    if ((end == fmt) || (fmtOut < 0) || (fmtOut >= CAM_CAP_PIX_OUT_FMTS)) {
+                        printf("Unrecognized output format!\n");
+                        return 1;
+                    }
+                    if (!outputs)
+                        formatOut = fmtOut;
+                    outputs |= CAM_CAP_OUT(fmtOut);
+                    fmt = end + 1;
+                } while (*end == ',');
+                if (*end) {
                     printf("Unrecognized output format!\n");
                     return 1;
                 }
@@ -318,6 +803,133 @@ int32_t main (int32_t argc, char *argv[])
             quality = atoi(&argv[1][2]);
             break;
 
+        case 'P':
+            threads = atoi(&argv[1][2]);
+            if (threads < 0) {
+                printf("Unsupported thread count: %d\n", threads);
+                return -1;
+            }
+            break;
+
+        case 'E':
+            enc_workers = atoi(&argv[1][2]);
+            if (enc_workers < 1 || enc_workers > ENCPOOL_MAX_WORKERS) {
+                printf("Unsupported encoder worker count: %d\n", enc_workers);
+                return -1;
+            }
+            break;
+
+        case 'J':
+            enc_backend = atoi(&argv[1][2]);
+            if (enc_backend != JPEGENC_BACKEND_LIBJPEG &&
+                enc_backend != JPEGENC_BACKEND_FAST) {
+                printf("Unsupported JPEG encoder: %d\n", enc_backend);
+                return -1;
+            }
+            break;
+
+        case 'R':
+            if (ratectl_parse(&argv[1][2], &rate_mode, &rate_target) < 0) {
+                printf("Unsupported rate target: %s\n", &argv[1][2]);
+                return -1;
+            }
+            break;
+
+        case 'H':
+        {
+            char *end;
+
+            huff_opt = 1;
+            huff_learn = strtol(&argv[1][2], &end, 10);
+            if (':' == *end)
+                huff_period = atoi(end + 1);
+            if (huff_learn < 0 || huff_period < 0) {
+                printf("Unsupported Huffman table setting: %s\n", &argv[1][2]);
+                return -1;
+            }
+        }
+            break;
+
+        case 'A':
+            if (avi_parse(&argv[1][2], &avi_bytes, &avi_seconds) < 0) {
+                printf("Unsupported AVI segment limit: %s\n", &argv[1][2]);
+                return -1;
+            }
+            avi_out = 1;
+            break;
+
+        case 'a':
+            if (archive_parse(&argv[1][2], &archive_bytes) < 0) {
+                printf("Unsupported archive segment size: %s\n", &argv[1][2]);
+                return -1;
+            }
+            archive_out = 1;
+            break;
+
+        case 'W':
+            aio_out = 1;
+            aio_slots = atoi(&argv[1][2]);
+            if (aio_slots < 0 || aio_slots > AIOWR_MAX_SLOTS) {
+                printf("Unsupported async writer slot count: %d\n", aio_slots);
+                return -1;
+            }
+            break;
+
+        case 's':
+            if (fname_parse(&argv[1][2], &shard) < 0) {
+                printf("Unsupported directory sharding: %s\n", &argv[1][2]);
+                return -1;
+            }
+            break;
+
+        case 'p':
+            if (pretrig_parse(&argv[1][2], &pretrig_pre_ms, &pretrig_post_ms,
+                              &pretrig_bytes) < 0) {
+                printf("Unsupported pre-trigger setting: %s\n", &argv[1][2]);
+                return -1;
+            }
+            pretrig_out = 1;
+            break;
+
+        case 'c':
+            ctl_path = &argv[1][2];
+            break;
+
+        case 'K':
+            snapd_path = &argv[1][2];
+            break;
+
+        case 'l':
+            httpd_addr = &argv[1][2];
+            break;
+
+        case 'Z':
+            if (shmring_parse(&argv[1][2], shm_name, &shm_slots, &shm_plane) < 0) {
+                printf("Unsupported shared memory setting: %s\n", &argv[1][2]);
+                return -1;
+            }
+            break;
+
+        case 'M':
+            burst_frames = atoi(&argv[1][2]);
+            if (burst_frames < 1) {
+                printf("Unsupported burst frame count: %d\n", burst_frames);
+                return -1;
+            }
+            break;
+
+        case 'D':
+            if (dwrite_parse(&argv[1][2], &dwrite_policy) < 0) {
+                printf("Unsupported sync policy: %s\n", &argv[1][2]);
+                return -1;
+            }
+            direct_out = 1;
+            break;
+
+        case 'b':
+            bench = 1;
+            break;
+
         case 'h':
             usage();
             break;
@@ -330,11 +942,50 @@ int32_t main (int32_t argc, char *argv[])
         --argc;
     }
 
+    /* the daemon answers with one JPEG per request, encoded on the spot */
+    if (snapd_path) {
+        formatOut = CAM_CAP_PIX_OUT_FMT_JPEG;
+        outputs = CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG);
+        enc_workers = 1;
+    }
+
+    /* one raw stream file, and stdout carries a single format; stdout may
+       already be the reader's pipe, errors go to stderr from here on */
+    if ((outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_RAW)) &&
+        (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_Y4M))) {
+        fprintf(stderr, "Only one of -f3 and -f4 at a time\n");
+        return 1;
+    }
+    if (!strcmp(outputfile_prefix, "-") && (outputs & (outputs - 1))) {
+        fprintf(stderr, "Only one output format can stream to stdout\n");
+        return 1;
+    }
+    /* the frames go to the pipe, a container would only be left empty */
+    if (!strcmp(outputfile_prefix, "-") && (avi_out || archive_out)) {
+        fprintf(stderr, "-A and -a write files, they cannot stream to stdout\n");
+        return 1;
+    }
+
+    if (direct_out)
+        dwrite_set_policy(&dwrite_policy);
+    /* before the capture buffers and the pool are set up */
+    framepool_set_huge(huge);
+
+    if (1 == bench)
+        return bench_run(width, height, threads, num) < 0 ? 1 : 0;
 
     /* user requrested quality activates YUYV mode */
     if (quality > 95)
         formatIn = V4L2_PIX_FMT_YUYV;
 
+    /* an MJPEG capture is saved as it came by both, to the same file name */
+    if ((V4L2_PIX_FMT_MJPEG == formatIn) &&
+        (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG)) &&
+        (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_YUYV))) {
+        fprintf(stderr, "-f0 and -f1 save the same MJPEG frame, use one of them\n");
+        return 1;
+    }
+
     if (verbose >= 1) {
         fprintf(stderr, "Using videodevice: %s\n", videodevice);
         fprintf(stderr, "Saving images with prefix: %s\n", outputfile_prefix);
@@ -345,11 +996,18 @@ int32_t main (int32_t argc, char *argv[])
             fprintf(stderr, "Taking single snapshot\n");
         else
             fprintf(stderr, "Invalid delay value: %d\n", delay); 
-        if (grabmethod == 1)
+        if (grabmethod == V4L2UVC_GRAB_MMAP)
             fprintf(stderr, "Taking images using mmap\n");
+        else if (grabmethod == V4L2UVC_GRAB_USERPTR)
+            fprintf(stderr, "Taking images using user pointers\n");
         else
             fprintf(stderr, "Taking images using read\n");
     }
+    pool = threadpool_create(threads > 0 ? threads : threadpool_online_cpus());
+    threadpool_set_default(pool);
+    if (verbose >= 1)
+        fprintf(stderr, "Using %d conversion threads\n", threadpool_get_threads(pool));
+
     videoIn = (struct vdIn *) calloc(1, sizeof (struct vdIn));
     if (init_videoIn
         (videoIn, (char *) videodevice, width, height, formatIn, formatOut, grabmethod) < 0)
@@ -367,8 +1025,10 @@ int32_t main (int32_t argc, char *argv[])
             fprintf(stderr, "Taking single snapshot\n");
         else
             fprintf(stderr, "Invalid delay value: %d\n", delay); 
-        if (grabmethod == 1)
+        if (grabmethod == V4L2UVC_GRAB_MMAP)
             fprintf(stderr, "Taking images using mmap\n");
+        else if (grabmethod == V4L2UVC_GRAB_USERPTR)
+            fprintf(stderr, "Taking images using user pointers\n");
         else
             fprintf(stderr, "Taking images using read\n");
 
@@ -450,6 +1110,285 @@ int32_t main (int32_t argc, char *argv[])
 
     initLut();
 
+    /* frame sized buffers and decoder scratch for the negotiated size */
+    if (framepool_init(videoIn->width, videoIn->height) < 0 ||
+        jpeg_decode_init(videoIn->width, videoIn->height) < 0)
+        fprintf(stderr, "Unable to prime the frame pool, frames will be allocated\n");
+
+    /* a burst is flushed with every encoder and write in flight at once */
+    if (0 == enc_workers)
+        enc_workers = burst_frames > 0 ? threadpool_online_cpus() : 1;
+    if (enc_workers > ENCPOOL_MAX_WORKERS)
+        enc_workers = ENCPOOL_MAX_WORKERS;
+    if (burst_frames > 0)
+        aio_out = 1;
+
+    if (aio_out && (outputs & (CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG) |
+                               CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_BMP) |
+                               CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_QOI) |
+                               CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_THUMB)))) {
+        size_t slot_size;
+
+        /* larger files (rare QOI or JPEG outliers) are written inline */
+        if (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_BMP))
+            slot_size = UTILS_BMP_HDR_SIZE +
+                (((size_t)videoIn->width * 3 + 3) & ~(size_t)3) * videoIn->height;
+        else if (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_QOI))
+            slot_size = (size_t)videoIn->width * videoIn->height * 3;
+        else
+            slot_size = (size_t)videoIn->width * videoIn->height * 2;
+        jpeg_out.aiowr = aiowr_create(aio_slots, slot_size, 0);
+        if (!jpeg_out.aiowr)
+            fprintf(stderr, "Unable to set up the async writer, writing inline\n");
+        /* nothing is live during a burst flush, never drop a file */
+        aiowr_set_blocking(jpeg_out.aiowr, burst_frames > 0);
+        if (jpeg_out.aiowr && (verbose >= 1))
+            fprintf(stderr, "Async writer: %s\n",
+                    AIOWR_BACKEND_URING == aiowr_backend(jpeg_out.aiowr) ?
+                    "io_uring" : "writer thread");
+    }
+
+    if ((outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG)) && !strcmp(outputfile_prefix, "-")) {
+        /* ffmpeg -f mjpeg -i -, the reader sets the pace or frames are dropped */
+        jpeg_out.pipeout = pipeout_create(STDOUT_FILENO, PIPEOUT_DEFAULT_SLOTS,
+                                          (size_t)videoIn->width * videoIn->height * 2);
+        if (!jpeg_out.pipeout) {
+            fprintf(stderr, "Unable to stream to stdout\n");
+            goto grab_err;
+        }
+        pipeout_set_blocking(jpeg_out.pipeout, burst_frames > 0);
+    }
+
+    if (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_QOI)) {
+        qoienc = qoienc_create(videoIn->width, videoIn->height);
+        if (!qoienc) {
+            fprintf(stderr, "Unable to create QOI encoder\n");
+            close_v4l2(videoIn);
+            free(videoIn);
+            freeLut();
+            threadpool_destroy(pool);
+            exit (1);
+        }
+    }
+
+    if (outputs & (CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_RAW) | CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_Y4M))) {
+        int32_t y4m = !!(outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_Y4M));
+        unsigned int fps_num = 0, fps_den = 0;
+
+        if (delay > 0) {
+            fps_num = 1000000;
+            fps_den = delay;
+        } else {
+            v4l2GetFrameRate(videoIn, &fps_num, &fps_den);
+        }
+        if (strcmp(outputfile_prefix, "-"))
+            snprintf(thisfile, sizeof(thisfile), "%s.%s", outputfile_prefix,
+                     y4m ? "y4m" : "yuv");
+        else
+            snprintf(thisfile, sizeof(thisfile), "-");
+        rawout = rawout_create(thisfile,
+                y4m ? RAWOUT_FMT_Y4M : RAWOUT_FMT_YUYV,
+                videoIn->width, videoIn->height, fps_num, fps_den);
+        if (!rawout) {
+            fprintf(stderr, "Unable to set up raw video output\n");
+            close_v4l2(videoIn);
+            free(videoIn);
+            freeLut();
+            threadpool_destroy(pool);
+            exit (1);
+        }
+        rawout_set_blocking(rawout, burst_frames > 0);
+    }
+
+    if (avi_out && (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) {
+        jpeg_out.avi = avi_create(outputfile_prefix, videoIn->width, videoIn->height,
+                                  avi_bytes, avi_seconds);
+        if (!jpeg_out.avi)
+            fprintf(stderr, "Unable to set up AVI output\n");
+        videoIn->toggleAvi = (NULL != jpeg_out.avi);
+    }
+
+    if (archive_out && (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) {
+        jpeg_out.archive = archive_open(outputfile_prefix, archive_bytes);
+        if (!jpeg_out.archive)
+            fprintf(stderr, "Unable to set up archive output\n");
+        else
+            videoIn->toggleAvi = 1;
+    }
+
+    /* per-frame files; the stream and container outputs name their own */
+    if ((outputs & ~(CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_RAW) | CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_Y4M) |
+                     CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) ||
+        ((outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG)) && !videoIn->toggleAvi)) {
+        fname = fname_create(outputfile_prefix, shard);
+        if (!fname) {
+            fprintf(stderr, "Output filename prefix too long: %s\n", outputfile_prefix);
+            close_v4l2(videoIn);
+            free(videoIn);
+            freeLut();
+            avi_destroy(jpeg_out.avi);
+            archive_close(jpeg_out.archive);
+            threadpool_destroy(pool);
+            exit (1);
+        }
+    }
+
+    if (shm_name[0]) {
+        /* YUYV input is published as its plane */
+        shm = shmring_create(shm_name, shm_slots, videoIn->width, videoIn->height,
+                             V4L2_PIX_FMT_MJPEG == videoIn->formatIn ? videoIn->framesizeIn : 0,
+                             shm_plane || (V4L2_PIX_FMT_YUYV == videoIn->formatIn));
+        if (!shm)
+            fprintf(stderr, "Unable to set up shared memory output %s\n", shm_name);
+        else if (verbose >= 1)
+            fprintf(stderr, "Publishing frames to /dev/shm/%s\n",
+                    shm_name[0] == '/' ? shm_name + 1 : shm_name);
+    }
+
+    if (snapd_path) {
+        snapd = snapd_create(snapd_path);
+        if (!snapd) {
+            fprintf(stderr, "Unable to set up the snapshot socket %s\n", snapd_path);
+            close_v4l2(videoIn);
+            free(videoIn);
+            freeLut();
+            avi_destroy(jpeg_out.avi);
+            archive_close(jpeg_out.archive);
+            fname_destroy(fname);
+            threadpool_destroy(pool);
+            exit (1);
+        }
+        if (verbose >= 1)
+            fprintf(stderr, "Serving snapshots on %s\n", snapd_path);
+    }
+
+    if (pretrig_out && (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) {
+        jpeg_out.fname = fname;
+        jpeg_out.pretrig = pretrig_create(pretrig_bytes, pretrig_pre_ms, pretrig_post_ms,
+                                          ctl_path, cam_cap_write_event, &jpeg_out);
+        if (!jpeg_out.pretrig)
+            fprintf(stderr, "Unable to set up pre-trigger capture\n");
+        else if (verbose >= 1)
+            fprintf(stderr, "Pre-trigger capture armed: SIGUSR1 (pid %d)%s%s\n",
+                    (int)getpid(), ctl_path ? " or \"trigger\" to " : "",
+                    ctl_path ? ctl_path : "");
+    }
+
+    if (huff_opt && (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) {
+        huffopt = huffopt_create(videoIn->width, videoIn->height,
+                                 huff_learn, huff_period);
+        if (!huffopt)
+            fprintf(stderr, "Unable to set up Huffman table optimization\n");
+        jpeg_out.huffopt = huffopt;
+    }
+
+    if ((V4L2_PIX_FMT_YUYV == videoIn->formatIn) &&
+        (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) {
+        /* pool feedback arrives one pool depth late, hold that long; inline
+           encoding reports the next frame at the new quality already */
+        ratectl_init(&ratectl, rate_mode, rate_target, quality,
+                     RATECTL_Q_MIN, enc_workers > 1 ? enc_workers : 0);
+        if (RATECTL_MODE_NONE != ratectl.mode)
+            jpeg_out.ratectl = &ratectl;
+        if (enc_workers > 1)
+            encpool = encpool_create(enc_workers, videoIn->width, videoIn->height,
+                                     quality, enc_backend, cam_cap_write_jpeg, &jpeg_out);
+        else
+            encoder = jpegenc_create(videoIn->width, videoIn->height, quality,
+                                     enc_backend);
+        jpeg_out.encpool = encpool;
+        if (!encoder && !encpool) {
+            fprintf(stderr, "Unable to create JPEG encoder\n");
+            close_v4l2(videoIn);
+            free(videoIn);
+            freeLut();
+            huffopt_destroy(huffopt);
+            threadpool_destroy(pool);
+            exit (1);
+        }
+        jpegenc_set_huffopt(encoder, huffopt);
+        encpool_set_huffopt(encpool, huffopt);
+    }
+
+    if (httpd_addr) {
+        httpd = httpd_create(httpd_addr);
+        if (!httpd) {
+            fprintf(stderr, "Unable to serve HTTP on %s\n", httpd_addr);
+            goto grab_err;
+        }
+        jpeg_out.httpd = httpd;
+        /* YUYV frames that are not saved as JPEG still need one for the viewers */
+        if ((V4L2_PIX_FMT_YUYV == videoIn->formatIn) && (NULL == encoder)) {
+            stream_enc = jpegenc_create(videoIn->width, videoIn->height, quality,
+                                        enc_backend);
+            if (!stream_enc) {
+                fprintf(stderr, "Unable to create JPEG encoder\n");
+                goto grab_err;
+            }
+        }
+        if (verbose >= 1)
+            fprintf(stderr, "Serving MJPEG over HTTP on %s\n", httpd_addr);
+    }
+
+    if (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_THUMB)) {
+        int32_t thumb_width, thumb_height;
+
+        sink_thumb_size(videoIn->width, videoIn->height, &thumb_width, &thumb_height);
+        thumbenc = jpegenc_create(thumb_width, thumb_height, quality, enc_backend);
+        if (!thumbenc) {
+            fprintf(stderr, "Unable to create thumbnail encoder\n");
+            goto grab_err;
+        }
+    }
+
+    out.jpeg_out = &jpeg_out;
+    out.encoder = encoder;
+    out.encpool = encpool;
+    out.ratectl = jpeg_out.ratectl;
+    out.huffopt = huffopt;
+    out.fname = fname;
+    out.rawout = rawout;
+    out.qoienc = qoienc;
+    out.thumbenc = thumbenc;
+    out.jpeg_named = !videoIn->toggleAvi && !jpeg_out.pretrig && !jpeg_out.pipeout;
+    out.verbose = verbose;
+    graph = sink_graph_create();
+    if (!graph)
+        goto grab_err;
+    for (fmt = 0; fmt < CAM_CAP_PIX_OUT_FMTS; fmt++) {
+        uint32_t needs = cam_cap_sinks[fmt].needs;
+
+        if (!(outputs & CAM_CAP_OUT(fmt)))
+            continue;
+        /* -f1 keeps a compressed capture as it came, only YUYV is converted */
+        if ((CAM_CAP_PIX_OUT_FMT_YUYV == fmt) && (V4L2_PIX_FMT_YUYV == videoIn->formatIn))
+            needs |= SINK_NEED_RGB;
+        sink_graph_add(graph, cam_cap_sinks[fmt].name, needs, cam_cap_sinks[fmt].write, &out);
+    }
+    /* a compressed capture is decoded only for sinks that read pixels */
+    videoIn->decode = (0 != sink_graph_needs(graph));
+
+    if (burst_frames > 0) {
+        /* -j frames are not worth the memory, drop them first */
+        for (; skip > 0; skip--)
+            if ((uvcGrab(videoIn) < 0) || (uvcRelease(videoIn) < 0))
+                goto grab_err;
+        if (verbose >= 1)
+            fprintf(stderr, "Capturing a burst of %d frames to memory\n", burst_frames);
+        gettimeofday(&burst_start, NULL);
+        if (uvcBurst(videoIn, burst_frames) < 0) {
+            if (!videoIn->burst || (videoIn->burst_count <= 0))
+                goto grab_err;
+            /* what was captured is still written out */
+            fprintf(stderr, "Burst stopped after %d of %d frames, saving those\n",
+                    videoIn->burst_count, burst_frames);
+            burst_short = 1;
+        }
+        gettimeofday(&burst_end, NULL);
+        /* then every stored frame goes through the outputs below */
+        num = videoIn->burst_count - 1;
+    }
+
     gettimeofday(&delay_ref_time, NULL);
     while (run) {
         if (verbose >= 2)
@@ -463,112 +1402,78 @@ int32_t main (int32_t argc, char *argv[])
 
         if (1 == speed_tst)
             gettimeofday(&spd_tst_start_time, NULL);
-        if (uvcGrab (videoIn) < 0) {
-            fprintf(stderr, "Error grabbing\n");
-            close_v4l2(videoIn);
-            free(videoIn);
-            freeLut();
-            exit (1);
+        /* only a descriptor: frames nobody saves are never copied or decoded */
+        if (uvcGrab (videoIn) < 0)
+            goto grab_err;
+
+        if (skip > 0) {
+            skip--;
+            if (uvcRelease(videoIn) < 0)
+                goto grab_err;
+            continue;
         }
 
-        if (skip > 0) { skip--; continue; }
-
         gettimeofday(&delay_end_time, NULL);
         time_dur = (delay_end_time.tv_sec - delay_ref_time.tv_sec) * 1000000 + (delay_end_time.tv_usec - delay_ref_time.tv_usec);
-        if ((time_dur > delay * 1000) || (frame_num < num)) {
-            switch (formatOut) {
-            case CAM_CAP_PIX_OUT_FMT_JPEG:
-            {
-                if (delay > 0) {
-                    sprintf(thisfile, "%s_%d", outputfile_prefix, frame_num);
-                    if (verbose >= 1)
-                        fprintf(stderr, "Saving image to: %s\n", thisfile);
-                } else {
-                    utils_get_picture_name(thisfile, outputfile_prefix, 1);
-                    if (verbose >= 1)
-                        fprintf(stderr, "Saving image to: %s\n", thisfile);
-                }
-                file = fopen (thisfile, "wb");
-
-                if (NULL != file) {
-                    switch (videoIn->formatIn) {
-                    case V4L2_PIX_FMT_YUYV:
-                        compress_yuyv_to_jpeg(videoIn, file, quality);
-                        return 0;
-                        break;
-                    case V4L2_PIX_FMT_MJPEG:
-#if 0
-                        fwrite(videoIn->tmpbuffer, videoIn->tmpbuf_byteused + DHT_SIZE, 1,
-                               file);
-#endif
-                        utils_get_picture_jpg(file, videoIn->tmpbuffer, videoIn->tmpbuf_byteused);
-                        break;
-                    default:
-                        fprintf(stderr, "Unrecgnized input format!\n");
-                        break;
-                    }
-                }
-            }
-            fclose(file);
-            break;
-            case CAM_CAP_PIX_OUT_FMT_YUYV:
-            {
-                switch (videoIn->formatIn) {
-                case V4L2_PIX_FMT_YUYV:
-                    utils_get_picture_yv2(outputfile_prefix, videoIn->framebuffer,
-                             videoIn->width, videoIn->height);
-                    break;
-                case V4L2_PIX_FMT_MJPEG:
-                    /* Compress to mjpg */
-                    utils_get_picture_mjpg(outputfile_prefix, videoIn->tmpbuffer,
-                             videoIn->tmpbuf_byteused);
-                    break;
-                default:
-                    fprintf(stderr, "Unrecgnized input format!\n");
-                    break;
-                }                      
+        save = !snapd && ((time_dur > delay * 1000) || (frame_num < num) || videoIn->burst);
+
+        if (NULL != shm) {
+            /* the sinks' decode is done first and shared with the plane */
+            if (save && videoIn->decode) {
+                ret = uvcMaterialize(videoIn);
+                if (ret < 0)
+                    goto grab_err;
+                if (UVC_FRAME_EMPTY == ret)
+                    save = 0;
             }
-            break;
-            case CAM_CAP_PIX_OUT_FMT_BMP:
-            {
-                switch (videoIn->formatIn) {
-                case V4L2_PIX_FMT_YUYV:
-                {
-#if 0
-                    if (delay > 0) {
-                        sprintf(thisfile, "%s_%d", outputfile_prefix, frame_num);
-                        if (verbose >= 1)
-                            fprintf(stderr, "Saving image to: %s\n", thisfile);
-                    } else {
-                        utils_get_picture_name(thisfile, outputfile_prefix, 2);
-                        if (verbose >= 1)
-                            fprintf(stderr, "Saving image to: %s\n", thisfile);
-                    }
-#endif
-                    fprintf(stderr, "not supported yet!\n");
-                }
-                break;
-                case V4L2_PIX_FMT_MJPEG:
-                    fprintf(stderr, "not supported yet!\n");
-                    break;
-                default:
-                    fprintf(stderr, "Unrecgnized input format!\n");
-                    break;
-                }
-            }
-            break;
-            default:
-                fprintf(stderr, "Unrecgnized output format!\n");
-                break;
+            cam_cap_publish(shm, videoIn);
+        }
+        /* a frame saved as JPEG reaches the viewers from cam_cap_store_jpeg() */
+        if ((NULL != httpd) && !(save && (outputs & CAM_CAP_OUT(CAM_CAP_PIX_OUT_FMT_JPEG))) &&
+            (cam_cap_stream(httpd, videoIn, encoder ? encoder : stream_enc) < 0))
+            goto grab_err;
+
+        /* daemon: the stream stays hot, frames are only touched on request */
+        if (NULL != snapd) {
+            if ((cam_cap_serve(snapd, videoIn, encoder, fname) < 0) ||
+                (uvcRelease(videoIn) < 0))
+                goto grab_err;
+            continue;
+        }
+
+        if (save) {
+            ret = uvcMaterialize(videoIn);
+            if (ret < 0)
+                goto grab_err;
+        }
+        /* an empty frame has nothing to save */
+        if (save && (UVC_FRAME_EMPTY != ret)) {
+            /* decoded at most once, whatever number of sinks read it */
+            memset(&frame, 0, sizeof(frame));
+            frame.width = videoIn->width;
+            frame.height = videoIn->height;
+            if (V4L2_PIX_FMT_MJPEG == videoIn->formatIn) {
+                frame.jpeg = videoIn->tmpbuffer;
+                frame.jpeg_size = videoIn->tmpbuf_byteused;
             }
+            if ((V4L2_PIX_FMT_YUYV == videoIn->formatIn) || videoIn->decode)
+                frame.yuyv = videoIn->framebuffer;
+            frame.timestamp = &videoIn->buf.timestamp;
+            frame.sequence = videoIn->buf.sequence;
+            if (sink_graph_run(graph, &frame) < 0)
+                run = 0;
 
             gettimeofday(&delay_ref_time, NULL);
+        } else if (uvcRelease(videoIn) < 0) {
+            goto grab_err;
         }
         if (1 == speed_tst) {
             gettimeofday(&spd_tst_end_time, NULL);
             time_dur = (spd_tst_end_time.tv_sec - spd_tst_start_time.tv_sec) * 1000000 + (spd_tst_end_time.tv_usec - spd_tst_start_time.tv_usec);
             fprintf(stderr, "Frame %d time consume: %dus\n", frame_num, time_dur);
         }
+        if (CAM_CAP_ALLOC_WARMUP == frame_num)
+            heap_allocs = framepool_heap_allocs();
         if ((delay == 0) && (num <= 0))
             break;
         if (num == frame_num)
@@ -577,9 +1482,109 @@ int32_t main (int32_t argc, char *argv[])
         frame_num++;
 
     }
+    if (((verbose >= 1) || (1 == speed_tst)) && (frame_num > CAM_CAP_ALLOC_WARMUP)) {
+        fprintf(stderr, "Heap allocations after warm-up: %llu in %d frames\n",
+                (unsigned long long)(framepool_heap_allocs() - heap_allocs),
+                frame_num - CAM_CAP_ALLOC_WARMUP);
+        framepool_print_stats();
+    }
+    if (NULL != encpool) {
+        encpool_flush(encpool);
+        if ((verbose >= 1) || (1 == speed_tst))
+            encpool_print_stats(encpool);
+        encpool_destroy(encpool);
+    }
+    if ((NULL != huffopt) && ((verbose >= 1) || (1 == speed_tst)))
+        huffopt_print_stats(huffopt);
+    /* after the encoder pool, writes what is left of an event */
+    pretrig_flush(jpeg_out.pretrig);
+    if ((NULL != jpeg_out.pretrig) && ((verbose >= 1) || (1 == speed_tst)))
+        pretrig_print_stats(jpeg_out.pretrig);
+    pretrig_destroy(jpeg_out.pretrig);
+    /* after the encoder pool and event ring, whose output may still be queued here */
+    aiowr_flush(jpeg_out.aiowr);
+    if ((NULL != jpeg_out.aiowr) && ((verbose >= 1) || (1 == speed_tst)))
+        aiowr_print_stats(jpeg_out.aiowr);
+    aiowr_destroy(jpeg_out.aiowr);
+    if ((NULL != jpeg_out.pipeout) && ((verbose >= 1) || (1 == speed_tst)))
+        pipeout_print_stats(jpeg_out.pipeout);
+    pipeout_destroy(jpeg_out.pipeout);
+    if ((NULL != jpeg_out.avi) && ((verbose >= 1) || (1 == speed_tst)))
+        avi_print_stats(jpeg_out.avi);
+    avi_destroy(jpeg_out.avi);
+    if ((NULL != jpeg_out.archive) && ((verbose >= 1) || (1 == speed_tst)))
+        archive_print_stats(jpeg_out.archive);
+    archive_close(jpeg_out.archive);
+    if ((NULL != rawout) && ((verbose >= 1) || (1 == speed_tst)))
+        rawout_print_stats(rawout);
+    rawout_destroy(rawout);
+    /* after the closes: they write the tails and the last syncs */
+    if (direct_out && ((verbose >= 1) || (1 == speed_tst)))
+        dwrite_print_stats();
+    if ((NULL != snapd) && ((verbose >= 1) || (1 == speed_tst)))
+        snapd_print_stats(snapd);
+    snapd_destroy(snapd);
+    if ((NULL != shm) && ((verbose >= 1) || (1 == speed_tst)))
+        shmring_print_stats(shm);
+    shmring_destroy(shm);
+    if ((NULL != httpd) && ((verbose >= 1) || (1 == speed_tst)))
+        httpd_print_stats(httpd);
+    httpd_destroy(httpd);
+    if ((NULL != videoIn->burst) && ((verbose >= 1) || (1 == speed_tst))) {
+        /* the sensor-rate capture and the write-out are separate numbers */
+        gettimeofday(&flush_end, NULL);
+        time_dur = (burst_end.tv_sec - burst_start.tv_sec) * 1000000 + (burst_end.tv_usec - burst_start.tv_usec);
+        fprintf(stderr, "Burst capture: %d frames, %llu bytes in %d us, %.2f fps, %.1f MB/s\n",
+                videoIn->burst_count, videoIn->burst_bytes, time_dur,
+                time_dur > 0 ? videoIn->burst_count * 1000000.0 / time_dur : 0,
+                time_dur > 0 ? videoIn->burst_bytes / (double)time_dur : 0);
+        time_dur = (flush_end.tv_sec - burst_end.tv_sec) * 1000000 + (flush_end.tv_usec - burst_end.tv_usec);
+        fprintf(stderr, "Burst flush: %d frames in %d us, %.2f fps\n",
+                frame_num + 1, time_dur,
+                time_dur > 0 ? (frame_num + 1) * 1000000.0 / time_dur : 0);
+    }
+    if ((verbose >= 1) || (1 == speed_tst))
+        sink_graph_print_stats(graph);
+    sink_graph_destroy(graph);
+    jpegenc_destroy(thumbenc);
+    free(out.bmp_rows);
+    qoienc_destroy(qoienc);
+    fname_destroy(fname);
     close_v4l2 (videoIn);
     free (videoIn);
     freeLut();
-
-    return 0;
+    jpeg_decode_cleanup();
+    framepool_cleanup();
+    jpegenc_destroy(encoder);
+    jpegenc_destroy(stream_enc);
+    huffopt_destroy(huffopt);
+    threadpool_destroy(pool);
+
+    return burst_short;
+
+grab_err:
+    fprintf(stderr, "Error grabbing\n");
+    close_v4l2(videoIn);
+    free(videoIn);
+    freeLut();
+    encpool_destroy(encpool);
+    pretrig_destroy(jpeg_out.pretrig);
+    snapd_destroy(snapd);
+    shmring_destroy(shm);
+    httpd_destroy(httpd);
+    jpegenc_destroy(encoder);
+    jpegenc_destroy(stream_enc);
+    huffopt_destroy(huffopt);
+    avi_destroy(jpeg_out.avi);
+    archive_close(jpeg_out.archive);
+    rawout_destroy(rawout);
+    sink_graph_destroy(graph);
+    jpegenc_destroy(thumbenc);
+    free(out.bmp_rows);
+    qoienc_destroy(qoienc);
+    aiowr_destroy(jpeg_out.aiowr);
+    pipeout_destroy(jpeg_out.pipeout);
+    fname_destroy(fname);
+    threadpool_destroy(pool);
+    exit (1);
 }
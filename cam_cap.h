@@ -10,5 +10,13 @@
 #define CAM_CAP_PIX_OUT_FMT_JPEG          (0)
 #define CAM_CAP_PIX_OUT_FMT_YUYV           (1)
 #define CAM_CAP_PIX_OUT_FMT_BMP            (2)
+#define CAM_CAP_PIX_OUT_FMT_RAW            (3)  /* packed YUYV stream */
+#define CAM_CAP_PIX_OUT_FMT_Y4M            (4)  /* YUV4MPEG2 4:2:2 stream */
+#define CAM_CAP_PIX_OUT_FMT_QOI            (5)  /* lossless RGB, QOI format */
+#define CAM_CAP_PIX_OUT_FMT_THUMB          (6)  /* JPEG thumbnail, 1/4 per side */
+#define CAM_CAP_PIX_OUT_FMTS               (7)
+
+/* -f takes several formats, kept as a mask of these bits */
+#define CAM_CAP_OUT(fmt)                   (1u << (fmt))
 
 #endif
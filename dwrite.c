@@ -0,0 +1,589 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#define _GNU_SOURCE             /* O_DIRECT, fallocate(), syncfs() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dwrite.h"
+
+#define DWRITE_ALIGN_DOWN(x)    ((x) & ~(uint64_t)(DWRITE_ALIGN - 1))
+#define DWRITE_ALIGN_UP(x)      DWRITE_ALIGN_DOWN((x) + DWRITE_ALIGN - 1)
+
+struct dwrite {
+    int fd;
+    int32_t owned;              /* opened here: truncate and close */
+    int32_t direct;
+    int32_t regular;
+
+    /* direct mode: staging[0..fill) is the file from base on */
+    unsigned char *staging;
+    uint64_t base;
+    size_t fill;
+
+    uint64_t size;              /* logical end of the file */
+    uint64_t prealloc;
+    uint64_t prealloc_end;
+
+    uint32_t frames_since_sync;
+    int64_t last_sync_us;
+};
+
+/* process wide state, under dwrite_lock */
+static pthread_mutex_t dwrite_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dwrite_policy dwrite_policy;
+static unsigned char *dwrite_pool[DWRITE_POOL_MAX];
+static int32_t dwrite_pool_count;
+static int32_t dwrite_file_frames;
+static int64_t dwrite_file_sync_us;
+
+static struct {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t writes;
+    uint64_t rmw;               /* read-modify-write rewrites */
+    uint64_t syncs;
+    uint64_t buffered_fallbacks;
+    int64_t write_us;
+    int64_t write_max_us;
+    int64_t sync_us;
+    int64_t sync_max_us;
+} dwrite_stats;
+
+static int64_t dwrite_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void dwrite_account(int64_t *total, int64_t *max, int64_t us)
+{
+    pthread_mutex_lock(&dwrite_lock);
+    *total += us;
+    if (us > *max)
+        *max = us;
+    pthread_mutex_unlock(&dwrite_lock);
+}
+
+static unsigned char *dwrite_buf_get(void)
+{
+    unsigned char *buf = NULL;
+
+    pthread_mutex_lock(&dwrite_lock);
+    if (dwrite_pool_count)
+        buf = dwrite_pool[--dwrite_pool_count];
+    pthread_mutex_unlock(&dwrite_lock);
+    if (!buf && posix_memalign((void **)&buf, DWRITE_ALIGN, DWRITE_BUF_SIZE))
+        buf = NULL;
+    return buf;
+}
+
+static void dwrite_buf_put(unsigned char *buf)
+{
+    if (!buf)
+        return;
+
+    pthread_mutex_lock(&dwrite_lock);
+    if (dwrite_pool_count < DWRITE_POOL_MAX) {
+        dwrite_pool[dwrite_pool_count++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&dwrite_lock);
+    free(buf);
+}
+
+void dwrite_set_policy(const struct dwrite_policy *policy)
+{
+    pthread_mutex_lock(&dwrite_lock);
+    if (policy)
+        dwrite_policy = *policy;
+    else
+        memset(&dwrite_policy, 0, sizeof(dwrite_policy));
+    dwrite_file_frames = 0;
+    dwrite_file_sync_us = dwrite_now_us();
+    pthread_mutex_unlock(&dwrite_lock);
+}
+
+int32_t dwrite_parse(const char *arg, struct dwrite_policy *policy)
+{
+    char *end;
+    long value;
+
+    memset(policy, 0, sizeof(*policy));
+    policy->direct = 1;
+    if (!*arg)
+        return 0;
+
+    value = strtol(arg + 1, &end, 10);
+    if (value <= 0 || end == arg + 1 || *end)
+        return -1;
+    switch (arg[0]) {
+    case 'n':
+        policy->sync_frames = value;
+        break;
+    case 't':
+        policy->sync_ms = value;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/* pwrite everything, direct buffers and offsets are block aligned */
+static int32_t dwrite_pwrite_all(int fd, const unsigned char *data, size_t size,
+        uint64_t offset)
+{
+    int64_t start = dwrite_now_us();
+
+    while (size) {
+        ssize_t ret = pwrite(fd, data, size, offset);
+
+        if (ret < 0 && EINTR == errno)
+            continue;
+        if (ret <= 0)
+            return -1;
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    dwrite_account(&dwrite_stats.write_us, &dwrite_stats.write_max_us,
+                   dwrite_now_us() - start);
+    pthread_mutex_lock(&dwrite_lock);
+    dwrite_stats.writes++;
+    pthread_mutex_unlock(&dwrite_lock);
+    return 0;
+}
+
+static void dwrite_reserve(struct dwrite *dw, uint64_t end)
+{
+    while (dw->prealloc && end > dw->prealloc_end) {
+        if (fallocate(dw->fd, FALLOC_FL_KEEP_SIZE, dw->prealloc_end, dw->prealloc) < 0) {
+            dw->prealloc = 0;
+            break;
+        }
+        dw->prealloc_end += dw->prealloc;
+    }
+}
+
+/* Open into a zeroed dw, not freed on failure. */
+static int32_t dwrite_init(struct dwrite *dw, const char *path, uint64_t start,
+        uint64_t prealloc)
+{
+    struct dwrite_policy policy;
+    struct stat st;
+
+    pthread_mutex_lock(&dwrite_lock);
+    policy = dwrite_policy;
+    pthread_mutex_unlock(&dwrite_lock);
+
+    dw->owned = 1;
+    dw->direct = policy.direct;
+    dw->fd = open(path, O_CREAT | (dw->direct ? O_RDWR | O_DIRECT : O_WRONLY), 0644);
+    if (dw->fd < 0 && dw->direct && EINVAL == errno) {
+        /* tmpfs and friends: keep going through the page cache */
+        pthread_mutex_lock(&dwrite_lock);
+        dwrite_stats.buffered_fallbacks++;
+        pthread_mutex_unlock(&dwrite_lock);
+        dw->direct = 0;
+        dw->fd = open(path, O_WRONLY | O_CREAT, 0644);
+    }
+    if (dw->fd < 0) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return -1;
+    }
+    if (ftruncate(dw->fd, start) < 0 || fstat(dw->fd, &st) < 0) {
+        fprintf(stderr, "Unable to truncate %s\n", path);
+        close(dw->fd);
+        return -1;
+    }
+    dw->regular = S_ISREG(st.st_mode);
+    dw->size = start;
+    dw->prealloc = prealloc;
+    dw->prealloc_end = start;
+    dw->last_sync_us = dwrite_now_us();
+
+    if (dw->direct) {
+        dw->staging = dwrite_buf_get();
+        dw->base = DWRITE_ALIGN_DOWN(start);
+        dw->fill = start - dw->base;
+        /* resuming inside a block: stage what is already there */
+        if (!dw->staging ||
+            (dw->fill && pread(dw->fd, dw->staging, DWRITE_ALIGN, dw->base) < (ssize_t)dw->fill)) {
+            fprintf(stderr, "Unable to set up direct writes to %s\n", path);
+            dwrite_buf_put(dw->staging);
+            close(dw->fd);
+            return -1;
+        }
+    } else if (lseek(dw->fd, start, SEEK_SET) < 0) {
+        close(dw->fd);
+        return -1;
+    }
+    dwrite_reserve(dw, start + 1);
+    return 0;
+}
+
+struct dwrite *dwrite_open(const char *path, uint64_t start, uint64_t prealloc)
+{
+    struct dwrite *dw;
+
+    dw = (struct dwrite *)calloc(1, sizeof(struct dwrite));
+    if (!dw)
+        return NULL;
+    if (dwrite_init(dw, path, start, prealloc) < 0) {
+        free(dw);
+        return NULL;
+    }
+    return dw;
+}
+
+struct dwrite *dwrite_fdopen(int fd)
+{
+    struct dwrite *dw;
+    struct stat st;
+
+    dw = (struct dwrite *)calloc(1, sizeof(struct dwrite));
+    if (!dw)
+        return NULL;
+
+    dw->fd = fd;
+    dw->regular = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    dw->last_sync_us = dwrite_now_us();
+    return dw;
+}
+
+/* Write the staged bytes, the tail block zero padded; keep them staged. */
+static int32_t dwrite_flush_tail(struct dwrite *dw)
+{
+    size_t len = DWRITE_ALIGN_UP(dw->fill);
+
+    if (!dw->direct || !dw->fill)
+        return 0;
+    memset(dw->staging + dw->fill, 0, len - dw->fill);
+    return dwrite_pwrite_all(dw->fd, dw->staging, len, dw->base);
+}
+
+static int32_t dwrite_sync(struct dwrite *dw, int32_t flush)
+{
+    int64_t start = dwrite_now_us();
+    int32_t ret = 0;
+
+    if (!dw->regular)
+        return 0;
+    if ((flush && dwrite_flush_tail(dw) < 0) || fdatasync(dw->fd) < 0)
+        ret = -1;
+    dw->frames_since_sync = 0;
+    dw->last_sync_us = dwrite_now_us();
+    dwrite_account(&dwrite_stats.sync_us, &dwrite_stats.sync_max_us,
+                   dw->last_sync_us - start);
+    pthread_mutex_lock(&dwrite_lock);
+    dwrite_stats.syncs++;
+    pthread_mutex_unlock(&dwrite_lock);
+    return ret;
+}
+
+int32_t dwrite_close(struct dwrite *dw)
+{
+    struct dwrite_policy policy;
+    int32_t ret = 0;
+
+    if (!dw)
+        return 0;
+
+    pthread_mutex_lock(&dwrite_lock);
+    policy = dwrite_policy;
+    dwrite_stats.bytes += dw->size;
+    pthread_mutex_unlock(&dwrite_lock);
+
+    if (dwrite_flush_tail(dw) < 0)
+        ret = -1;
+    if (dw->owned) {
+        /* drops the padding and the blocks reserved past the end */
+        if (ftruncate(dw->fd, dw->size) < 0)
+            ret = -1;
+        if ((policy.sync_frames || policy.sync_ms) && dwrite_sync(dw, 0) < 0)
+            ret = -1;
+        close(dw->fd);
+    }
+    dwrite_buf_put(dw->staging);
+    free(dw);
+    return ret;
+}
+
+int32_t dwrite_writev(struct dwrite *dw, const struct iovec *iov, int32_t iovcnt)
+{
+    size_t total = 0;
+    int32_t i;
+
+    if (!dw)
+        return -1;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    dwrite_reserve(dw, dw->size + total);
+
+    if (!dw->direct) {
+        struct iovec local[8];
+        const struct iovec *cur = iov;
+        int64_t start = dwrite_now_us();
+        size_t left = total;
+
+        /* short writes: continue from a private copy of the vector */
+        if (iovcnt > (int32_t)(sizeof(local) / sizeof(local[0]))) {
+            for (i = 0; i < iovcnt; i++)
+                if (dwrite_write(dw, iov[i].iov_base, iov[i].iov_len) < 0)
+                    return -1;
+            return 0;
+        }
+        memcpy(local, iov, iovcnt * sizeof(*iov));
+        cur = local;
+        while (left) {
+            ssize_t ret = writev(dw->fd, cur, iovcnt);
+
+            if (ret < 0 && EINTR == errno)
+                continue;
+            if (ret <= 0)
+                return -1;
+            left -= ret;
+            while (iovcnt && (size_t)ret >= cur->iov_len) {
+                ret -= cur->iov_len;
+                cur++;
+                iovcnt--;
+            }
+            if (iovcnt) {
+                local[cur - local].iov_base = (unsigned char *)cur->iov_base + ret;
+                local[cur - local].iov_len -= ret;
+            }
+        }
+        dw->size += total;
+        dwrite_account(&dwrite_stats.write_us, &dwrite_stats.write_max_us,
+                       dwrite_now_us() - start);
+        pthread_mutex_lock(&dwrite_lock);
+        dwrite_stats.writes++;
+        pthread_mutex_unlock(&dwrite_lock);
+        return 0;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        const unsigned char *p = (const unsigned char *)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len) {
+            size_t n = DWRITE_BUF_SIZE - dw->fill;
+
+            if (n > len)
+                n = len;
+            memcpy(dw->staging + dw->fill, p, n);
+            dw->fill += n;
+            dw->size += n;
+            p += n;
+            len -= n;
+            if (DWRITE_BUF_SIZE == dw->fill) {
+                if (dwrite_pwrite_all(dw->fd, dw->staging, DWRITE_BUF_SIZE, dw->base) < 0)
+                    return -1;
+                dw->base += DWRITE_BUF_SIZE;
+                dw->fill = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+int32_t dwrite_write(struct dwrite *dw, const void *data, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+    return dwrite_writev(dw, &iov, 1);
+}
+
+/* Patch [offset, offset + size) below the staging buffer, whole blocks at a time. */
+static int32_t dwrite_rewrite(struct dwrite *dw, const unsigned char *data, size_t size,
+        uint64_t offset)
+{
+    unsigned char *tmp = dwrite_buf_get();
+    int32_t ret = 0;
+
+    if (!tmp)
+        return -1;
+    while (size && !ret) {
+        uint64_t start = DWRITE_ALIGN_DOWN(offset);
+        uint64_t end = DWRITE_ALIGN_UP(offset + size);
+        size_t n;
+
+        if (end - start > DWRITE_BUF_SIZE)
+            end = start + DWRITE_BUF_SIZE;
+        n = end - offset < size ? end - offset : size;
+        if (pread(dw->fd, tmp, end - start, start) != (ssize_t)(end - start)) {
+            ret = -1;
+            break;
+        }
+        memcpy(tmp + (offset - start), data, n);
+        ret = dwrite_pwrite_all(dw->fd, tmp, end - start, start);
+        data += n;
+        size -= n;
+        offset += n;
+        pthread_mutex_lock(&dwrite_lock);
+        dwrite_stats.rmw++;
+        pthread_mutex_unlock(&dwrite_lock);
+    }
+    dwrite_buf_put(tmp);
+    return ret;
+}
+
+int32_t dwrite_pwrite(struct dwrite *dw, const void *data, size_t size, uint64_t offset)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (!dw || offset > dw->size)
+        return -1;
+    if (offset == dw->size)
+        return dwrite_write(dw, data, size);
+    if (offset + size > dw->size) {
+        size_t inside = dw->size - offset;
+
+        return (dwrite_pwrite(dw, p, inside, offset) < 0 ||
+                dwrite_write(dw, p + inside, size - inside) < 0) ? -1 : 0;
+    }
+
+    if (!dw->direct)
+        return dwrite_pwrite_all(dw->fd, p, size, offset);
+
+    if (offset < dw->base) {
+        size_t below = offset + size <= dw->base ? size : dw->base - offset;
+
+        if (dwrite_rewrite(dw, p, below, offset) < 0)
+            return -1;
+        p += below;
+        size -= below;
+        offset += below;
+    }
+    if (size)
+        memcpy(dw->staging + (offset - dw->base), p, size);
+    return 0;
+}
+
+uint64_t dwrite_size(struct dwrite *dw)
+{
+    return dw ? dw->size : 0;
+}
+
+int32_t dwrite_frame_end(struct dwrite *dw)
+{
+    struct dwrite_policy policy;
+
+    if (!dw)
+        return -1;
+
+    pthread_mutex_lock(&dwrite_lock);
+    policy = dwrite_policy;
+    pthread_mutex_unlock(&dwrite_lock);
+
+    dw->frames_since_sync++;
+    if ((policy.sync_frames && dw->frames_since_sync >= (uint32_t)policy.sync_frames) ||
+        (policy.sync_ms && dwrite_now_us() - dw->last_sync_us >= policy.sync_ms * 1000LL))
+        return dwrite_sync(dw, 1) < 0 ? -1 : 1;
+    return 0;
+}
+
+int32_t dwrite_write_file(const char *path, const struct iovec *iov, int32_t iovcnt)
+{
+    struct dwrite_policy policy;
+    struct dwrite file, *dw = &file;
+    size_t total = 0;
+    int32_t i, ret, sync = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    /* on the stack: no heap allocation per frame file */
+    memset(dw, 0, sizeof(*dw));
+    if (dwrite_init(dw, path, 0, total) < 0)
+        return -1;
+    ret = dwrite_writev(dw, iov, iovcnt);
+    if (dwrite_flush_tail(dw) < 0)
+        ret = -1;
+    if (ftruncate(dw->fd, dw->size) < 0)
+        ret = -1;
+
+    /* one syncfs covers every file written since the last one */
+    pthread_mutex_lock(&dwrite_lock);
+    policy = dwrite_policy;
+    dwrite_stats.files++;
+    dwrite_stats.bytes += dw->size;
+    dwrite_file_frames++;
+    if ((policy.sync_frames && dwrite_file_frames >= policy.sync_frames) ||
+        (policy.sync_ms && dwrite_now_us() - dwrite_file_sync_us >= policy.sync_ms * 1000LL)) {
+        dwrite_file_frames = 0;
+        dwrite_file_sync_us = dwrite_now_us();
+        sync = 1;
+    }
+    pthread_mutex_unlock(&dwrite_lock);
+
+    if (sync) {
+        int64_t start = dwrite_now_us();
+
+        if (syncfs(dw->fd) < 0)
+            ret = -1;
+        dwrite_account(&dwrite_stats.sync_us, &dwrite_stats.sync_max_us,
+                       dwrite_now_us() - start);
+        pthread_mutex_lock(&dwrite_lock);
+        dwrite_stats.syncs++;
+        pthread_mutex_unlock(&dwrite_lock);
+    }
+
+    close(dw->fd);
+    dwrite_buf_put(dw->staging);
+    if (ret < 0)
+        fprintf(stderr, "Unable to write %s\n", path);
+    return ret;
+}
+
+void dwrite_print_stats(void)
+{
+    pthread_mutex_lock(&dwrite_lock);
+    fprintf(stderr, "Output (%s, sync %s", dwrite_policy.direct ? "O_DIRECT" : "buffered",
+            dwrite_policy.sync_frames ? "every" : dwrite_policy.sync_ms ? "every" : "none");
+    if (dwrite_policy.sync_frames)
+        fprintf(stderr, " %d frames", dwrite_policy.sync_frames);
+    else if (dwrite_policy.sync_ms)
+        fprintf(stderr, " %d ms", dwrite_policy.sync_ms);
+    fprintf(stderr, "): %llu files, %llu bytes, %llu writes (avg %lld us, max %lld us), "
+            "%llu block rewrites, %llu syncs (avg %lld us, max %lld us), %llu buffered fallbacks\n",
+            (unsigned long long)dwrite_stats.files, (unsigned long long)dwrite_stats.bytes,
+            (unsigned long long)dwrite_stats.writes,
+            (long long)(dwrite_stats.writes ? dwrite_stats.write_us / (int64_t)dwrite_stats.writes : 0),
+            (long long)dwrite_stats.write_max_us, (unsigned long long)dwrite_stats.rmw,
+            (unsigned long long)dwrite_stats.syncs,
+            (long long)(dwrite_stats.syncs ? dwrite_stats.sync_us / (int64_t)dwrite_stats.syncs : 0),
+            (long long)dwrite_stats.sync_max_us,
+            (unsigned long long)dwrite_stats.buffered_fallbacks);
+    pthread_mutex_unlock(&dwrite_lock);
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __DWRITE_H__
+#define __DWRITE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Output file layer shared by the frame files and the container writers.
+ * By default it is a thin wrapper over write/pwrite. With a policy that
+ * sets direct, files are opened O_DIRECT: appended bytes are staged in a
+ * 4 KiB aligned buffer from a process wide pool and written in whole
+ * buffers, the unaligned tail is padded on sync/close and the file is
+ * truncated to its real length at close. This keeps long streams out of
+ * the page cache. Rewrites behind the staged region (AVI headers, sizes)
+ * are done read-modify-write on whole blocks.
+ *
+ * Durability is applied per stream: fdatasync every sync_frames frames
+ * (dwrite_frame_end) or every sync_ms. For per-frame files the same
+ * policy counts files and flushes the filesystem with syncfs().
+ */
+#define DWRITE_ALIGN            (4096)
+#define DWRITE_BUF_SIZE         (1024 * 1024)
+#define DWRITE_POOL_MAX         (8)         /* idle buffers kept */
+
+struct dwrite_policy {
+    int32_t direct;
+    int32_t sync_frames;        /* 0: no frame based sync */
+    int32_t sync_ms;            /* 0: no time based sync */
+};
+
+struct dwrite;
+
+/* Process wide policy for every dwrite opened afterwards, NULL resets. */
+void dwrite_set_policy(const struct dwrite_policy *policy);
+/* Parse the -D argument "[n<frames>|t<ms>]". */
+int32_t dwrite_parse(const char *arg, struct dwrite_policy *policy);
+
+/*
+ * Open path for writing, keeping (and truncating to) the first start bytes.
+ * Blocks are reserved prealloc bytes at a time ahead of the data, 0 for none.
+ */
+struct dwrite *dwrite_open(const char *path, uint64_t start, uint64_t prealloc);
+/* Wrap an open descriptor (stdout, pipes): plain writes, never closed. */
+struct dwrite *dwrite_fdopen(int fd);
+/* Flush, apply the policy, drop the reserved blocks and close. */
+int32_t dwrite_close(struct dwrite *dw);
+
+int32_t dwrite_write(struct dwrite *dw, const void *data, size_t size);
+int32_t dwrite_writev(struct dwrite *dw, const struct iovec *iov, int32_t iovcnt);
+/* Overwrite bytes already written, or append when offset is the end. */
+int32_t dwrite_pwrite(struct dwrite *dw, const void *data, size_t size, uint64_t offset);
+uint64_t dwrite_size(struct dwrite *dw);
+
+/* One frame is complete: sync if the policy says so, 1 when it did. */
+int32_t dwrite_frame_end(struct dwrite *dw);
+
+/* A whole file in one call, preallocated to its size. */
+int32_t dwrite_write_file(const char *path, const struct iovec *iov, int32_t iovcnt);
+
+void dwrite_print_stats(void);
+
+#endif
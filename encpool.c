@@ -0,0 +1,353 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "jpegenc.h"
+#include "encpool.h"
+
+enum encpool_slot_state {
+    ENCPOOL_SLOT_FREE = 0,
+    ENCPOOL_SLOT_QUEUED,
+    ENCPOOL_SLOT_BUSY,
+    ENCPOOL_SLOT_DONE
+};
+
+struct encpool_worker {
+    struct encpool *pool;
+    int32_t index;
+    pthread_t thread;
+    struct jpegenc *enc;
+
+    /* the frame this worker owns, guarded by state */
+    int32_t state;
+    unsigned char *frame;
+    char name[ENCPOOL_NAME_MAX];
+    struct timeval timestamp;
+    uint32_t sequence;
+    uint32_t seq;
+    int32_t quality;
+    int64_t submit_us;
+    struct encpool_result result;
+    int32_t failed;
+
+    /* statistics */
+    uint32_t frames;
+    int64_t busy_us;
+    int64_t queue_wait_us;
+    int64_t idle_us;
+};
+
+struct encpool {
+    int32_t nworkers;
+    struct encpool_worker workers[ENCPOOL_MAX_WORKERS];
+    pthread_t deliver_thread;
+    size_t frame_size;
+
+    encpool_output_fn output;
+    void *output_arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int32_t quit;
+    int32_t quality;
+    uint32_t submitted;
+    uint32_t delivered;
+
+    int64_t start_us;
+    int64_t submit_block_us;
+    uint32_t submit_blocked;
+};
+
+static int64_t encpool_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *encpool_worker_main(void *data)
+{
+    struct encpool_worker *worker = (struct encpool_worker *)data;
+    struct encpool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        int64_t idle_start = encpool_now_us(), start, end;
+        unsigned char *out = NULL;
+        size_t size = 0;
+        int32_t ret;
+
+        while (!pool->quit && worker->state != ENCPOOL_SLOT_QUEUED)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (worker->state != ENCPOOL_SLOT_QUEUED)
+            break;
+        worker->state = ENCPOOL_SLOT_BUSY;
+        pthread_mutex_unlock(&pool->lock);
+
+        start = encpool_now_us();
+        jpegenc_set_quality(worker->enc, worker->quality);
+        ret = jpegenc_encode_yuyv(worker->enc, worker->frame, &out, &size);
+        end = encpool_now_us();
+
+        pthread_mutex_lock(&pool->lock);
+        worker->idle_us += start - idle_start;
+        worker->queue_wait_us += start - worker->submit_us;
+        worker->busy_us += end - start;
+        worker->frames++;
+        worker->failed = (ret < 0);
+        worker->result.seq = worker->seq;
+        worker->result.name = worker->name;
+        worker->result.timestamp = worker->timestamp;
+        worker->result.sequence = worker->sequence;
+        worker->result.data = out;
+        worker->result.size = size;
+        worker->result.quality = worker->quality;
+        worker->result.encode_us = end - start;
+        worker->state = ENCPOOL_SLOT_DONE;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Frames are handed out round-robin, so capture order is worker order. */
+static void *encpool_deliver_main(void *data)
+{
+    struct encpool *pool = (struct encpool *)data;
+    uint32_t next = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct encpool_worker *worker = &pool->workers[next % pool->nworkers];
+
+        while (worker->state != ENCPOOL_SLOT_DONE &&
+               !(pool->quit && pool->delivered == pool->submitted))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (worker->state != ENCPOOL_SLOT_DONE)
+            break;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!worker->failed && pool->output)
+            pool->output(pool->output_arg, &worker->result);
+
+        pthread_mutex_lock(&pool->lock);
+        worker->state = ENCPOOL_SLOT_FREE;
+        pool->delivered++;
+        next++;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct encpool *encpool_create(int32_t workers, int32_t width, int32_t height,
+        int32_t quality, int32_t backend, encpool_output_fn output, void *arg)
+{
+    struct encpool *pool;
+    int32_t i;
+
+    if (workers < 1)
+        workers = 1;
+    if (workers > ENCPOOL_MAX_WORKERS)
+        workers = ENCPOOL_MAX_WORKERS;
+
+    pool = (struct encpool *)calloc(1, sizeof(struct encpool));
+    if (!pool)
+        return NULL;
+
+    pool->frame_size = (size_t)width * height * 2;
+    pool->output = output;
+    pool->output_arg = arg;
+    pool->quality = quality;
+    pool->start_us = encpool_now_us();
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (i = 0; i < workers; i++) {
+        struct encpool_worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->index = i;
+        worker->enc = jpegenc_create(width, height, quality, backend);
+        worker->frame = (unsigned char *)malloc(pool->frame_size);
+        if (!worker->enc || !worker->frame) {
+            fprintf(stderr, "Not enough memory for encoder worker %d\n", i);
+            jpegenc_destroy(worker->enc);
+            free(worker->frame);
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, encpool_worker_main, worker)) {
+            fprintf(stderr, "Unable to create encoder worker %d\n", i);
+            jpegenc_destroy(worker->enc);
+            free(worker->frame);
+            break;
+        }
+        pool->nworkers++;
+    }
+
+    if (!pool->nworkers ||
+        pthread_create(&pool->deliver_thread, NULL, encpool_deliver_main, pool)) {
+        pool->nworkers = -pool->nworkers;
+        encpool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void encpool_destroy(struct encpool *pool)
+{
+    int32_t i, nworkers;
+
+    if (!pool)
+        return;
+
+    /* a negative count means creation failed before the delivery thread */
+    nworkers = pool->nworkers < 0 ? -pool->nworkers : pool->nworkers;
+    if (pool->nworkers > 0)
+        encpool_flush(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        jpegenc_destroy(pool->workers[i].enc);
+        free(pool->workers[i].frame);
+    }
+    if (pool->nworkers > 0)
+        pthread_join(pool->deliver_thread, NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+int32_t encpool_submit(struct encpool *pool, unsigned char *yuyv,
+        const char *name, const struct timeval *timestamp, uint32_t sequence)
+{
+    struct encpool_worker *worker;
+    int64_t wait_start;
+
+    if (!pool || !yuyv)
+        return -1;
+
+    pthread_mutex_lock(&pool->lock);
+    worker = &pool->workers[pool->submitted % pool->nworkers];
+    if (worker->state != ENCPOOL_SLOT_FREE) {
+        wait_start = encpool_now_us();
+        while (worker->state != ENCPOOL_SLOT_FREE)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        pool->submit_block_us += encpool_now_us() - wait_start;
+        pool->submit_blocked++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* the slot is free, nobody else touches it until it is queued */
+    memcpy(worker->frame, yuyv, pool->frame_size);
+    snprintf(worker->name, sizeof(worker->name), "%s", name ? name : "");
+    if (timestamp)
+        worker->timestamp = *timestamp;
+    else
+        timerclear(&worker->timestamp);
+    worker->sequence = sequence;
+
+    pthread_mutex_lock(&pool->lock);
+    worker->seq = pool->submitted++;
+    worker->quality = pool->quality;
+    worker->submit_us = encpool_now_us();
+    worker->state = ENCPOOL_SLOT_QUEUED;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void encpool_set_quality(struct encpool *pool, int32_t quality)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quality = quality;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* The workers poll the tables themselves, see jpegenc_set_huffopt(). */
+void encpool_set_huffopt(struct encpool *pool, struct huffopt *opt)
+{
+    int32_t i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nworkers; i++)
+        jpegenc_set_huffopt(pool->workers[i].enc, opt);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void encpool_flush(struct encpool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->delivered != pool->submitted)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void encpool_print_stats(struct encpool *pool)
+{
+    int64_t wall;
+    int32_t i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    wall = encpool_now_us() - pool->start_us;
+    if (wall <= 0)
+        wall = 1;
+    fprintf(stderr, "Encoder pool: %d workers, %u frames, capture blocked %u times (%lld us)\n",
+            pool->nworkers, pool->delivered, pool->submit_blocked,
+            (long long)pool->submit_block_us);
+    for (i = 0; i < pool->nworkers; i++) {
+        struct encpool_worker *worker = &pool->workers[i];
+        uint32_t frames = worker->frames ? worker->frames : 1;
+
+        fprintf(stderr, "  worker %d: %u frames, utilization %5.1f%%, "
+                "encode %lld us/frame, queue wait %lld us/frame\n",
+                i, worker->frames, worker->busy_us * 100.0 / wall,
+                (long long)(worker->busy_us / frames),
+                (long long)(worker->queue_wait_us / frames));
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
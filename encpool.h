@@ -0,0 +1,76 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __ENCPOOL_H__
+#define __ENCPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Frame-parallel YUYV -> JPEG encoding. Each worker owns a jpegenc (libjpeg
+ * context and output buffer) and a copy of the frame it is encoding. Frames
+ * are handed out round-robin, and a delivery thread passes the compressed
+ * frames to the output callback in capture order.
+ */
+
+#define ENCPOOL_MAX_WORKERS     (16)
+#define ENCPOOL_NAME_MAX        (256)
+
+struct encpool_result {
+    uint32_t seq;               /* submit order */
+    const char *name;           /* name given at submit time */
+    struct timeval timestamp;   /* capture time given at submit time */
+    uint32_t sequence;          /* capture sequence given at submit time */
+    unsigned char *data;        /* valid during the callback only */
+    size_t size;
+    int32_t quality;
+    int64_t encode_us;
+};
+
+typedef void (*encpool_output_fn)(void *arg, const struct encpool_result *result);
+
+struct encpool;
+struct huffopt;
+
+struct encpool *encpool_create(int32_t workers, int32_t width, int32_t height,
+        int32_t quality, int32_t backend, encpool_output_fn output, void *arg);
+void encpool_destroy(struct encpool *pool);
+
+/*
+ * Copy the frame into the next worker and return. Blocks only while that
+ * worker still holds an earlier frame, i.e. when encoding is the bottleneck.
+ */
+int32_t encpool_submit(struct encpool *pool, unsigned char *yuyv,
+        const char *name, const struct timeval *timestamp, uint32_t sequence);
+
+/* Quality used for frames submitted from now on. */
+void encpool_set_quality(struct encpool *pool, int32_t quality);
+
+/* Share the stream's optimized Huffman tables with every worker, call
+   before the first frame is submitted. */
+void encpool_set_huffopt(struct encpool *pool, struct huffopt *opt);
+
+/* Wait until every submitted frame has been delivered. */
+void encpool_flush(struct encpool *pool);
+
+void encpool_print_stats(struct encpool *pool);
+
+#endif
@@ -0,0 +1,203 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "archive.h"
+#include "utils.h"
+
+static const char version[] = VERSION;
+
+static void usage(void)
+{
+    fprintf(stderr, "cam_extract version %s\n", version);
+    fprintf(stderr, "Usage is: cam_extract [options] <archive>\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "-l\t\tList the frames in the range instead of extracting them\n");
+    fprintf(stderr,
+             "-s<time>\tFirst frame at or after <time>: \"YYYY-MM-DD HH:MM:SS[.mmm]\", \"HH:MM:SS[.mmm]\" (day of the first frame) or @<epoch us>\n");
+    fprintf(stderr, "-e<time>\tStop before <time>, same formats as -s\n");
+    fprintf(stderr, "-n<integer>\tExtract at most <integer> frames\n");
+    fprintf(stderr, "-o<prefix>\tOutput filename prefix, default is extract\n");
+    exit(8);
+}
+
+/* Local time string to epoch microseconds, day_us supplies a missing date. */
+static int32_t extract_parse_time(const char *arg, int64_t day_us, int64_t *time_us)
+{
+    struct tm tm;
+    const char *rest;
+    char *end;
+    time_t day;
+    int64_t frac = 0, scale = 100000;
+
+    if ('@' == arg[0]) {
+        *time_us = strtoll(arg + 1, &end, 10);
+        return (end == arg + 1 || *end) ? -1 : 0;
+    }
+
+    day = day_us / 1000000;
+    localtime_r(&day, &tm);
+    rest = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+    if (!rest) {
+        localtime_r(&day, &tm);
+        rest = strptime(arg, "%H:%M:%S", &tm);
+    }
+    if (!rest)
+        return -1;
+    if ('.' == *rest) {
+        for (rest++; *rest >= '0' && *rest <= '9'; rest++, scale /= 10)
+            frac += (*rest - '0') * scale;
+    }
+    if (*rest)
+        return -1;
+    tm.tm_isdst = -1;
+    *time_us = (int64_t)mktime(&tm) * 1000000 + frac;
+    return 0;
+}
+
+static void extract_format_time(char *buf, size_t size, int64_t time_us)
+{
+    time_t sec = time_us / 1000000;
+    struct tm tm;
+    size_t len;
+
+    localtime_r(&sec, &tm);
+    len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%06lld", (long long)(time_us % 1000000));
+}
+
+int main(int argc, char *argv[])
+{
+    const char *start_arg = NULL, *end_arg = NULL;
+    const char *prefix = "extract";
+    struct archive_reader *rd;
+    int64_t start_us = INT64_MIN, end_us = INT64_MAX;
+    uint64_t first, count, i;
+    int32_t list = 0, num = -1, written = 0, failed = 0;
+
+    while ((argc > 1) && (argv[1][0] == '-')) {
+        switch (argv[1][1]) {
+        case 'l':
+            list = 1;
+            break;
+
+        case 's':
+            start_arg = &argv[1][2];
+            break;
+
+        case 'e':
+            end_arg = &argv[1][2];
+            break;
+
+        case 'n':
+            num = atoi(&argv[1][2]);
+            break;
+
+        case 'o':
+            prefix = &argv[1][2];
+            break;
+
+        default:
+            usage();
+        }
+        ++argv;
+        --argc;
+    }
+    if (argc != 2)
+        usage();
+
+    rd = archive_reader_open(argv[1]);
+    if (!rd)
+        return 1;
+    count = archive_reader_count(rd);
+    if (!count) {
+        fprintf(stderr, "%s: no frames\n", argv[1]);
+        archive_reader_close(rd);
+        return 0;
+    }
+
+    if ((start_arg && extract_parse_time(start_arg,
+                archive_reader_record(rd, 0)->time_us, &start_us) < 0) ||
+        (end_arg && extract_parse_time(end_arg,
+                archive_reader_record(rd, 0)->time_us, &end_us) < 0)) {
+        fprintf(stderr, "Unsupported time: %s\n",
+                start_arg && start_us == INT64_MIN ? start_arg : end_arg);
+        archive_reader_close(rd);
+        return 1;
+    }
+
+    first = start_arg ? archive_reader_find(rd, start_us) : 0;
+    for (i = first; i < count && num != 0; i++) {
+        const struct archive_record *rec = archive_reader_record(rd, i);
+        const unsigned char *data;
+        char name[ARCHIVE_PATH_MAX + 64];
+        char stamp[64];
+        size_t size;
+        FILE *file;
+
+        if (rec->time_us >= end_us)
+            break;
+        if (num > 0)
+            num--;
+
+        extract_format_time(stamp, sizeof(stamp), rec->time_us);
+        if (list) {
+            printf("%8llu %s seq %u segment %u offset %llu size %u%s%s\n",
+                   (unsigned long long)i, stamp, rec->sequence, rec->segment,
+                   (unsigned long long)rec->offset, rec->size,
+                   rec->flags & ARCHIVE_FLAG_PASSTHROUGH ? " passthrough" : "",
+                   rec->flags & ARCHIVE_FLAG_CLOCK_STEP ? " clock-step" : "");
+            continue;
+        }
+
+        data = archive_reader_frame(rd, i, &size);
+        if (!data) {
+            fprintf(stderr, "Frame %llu is not in the data segments\n",
+                    (unsigned long long)i);
+            failed++;
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s_%lld_%06u.jpg", prefix,
+                 (long long)rec->time_us, rec->sequence);
+        file = fopen(name, "wb");
+        if (NULL == file) {
+            fprintf(stderr, "Unable to open %s\n", name);
+            failed++;
+            continue;
+        }
+        /* passthrough frames get the standard DHT, nothing is decoded */
+        utils_get_picture_jpg(file, (unsigned char *)data, size);
+        fclose(file);
+        written++;
+    }
+
+    if (!list)
+        fprintf(stderr, "Extracted %d frames from %llu (%d failed)\n", written,
+                (unsigned long long)(i - first), failed);
+    archive_reader_close(rd);
+
+    return failed ? 1 : 0;
+}
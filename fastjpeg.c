@@ -0,0 +1,1101 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "fastjpeg.h"
+
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+typedef unsigned char v8qu __attribute__((vector_size(8)));
+
+/*
+ * Blocks are transformed eight at a time, one block per vector lane: the
+ * two Y blocks, Cb and Cr of two neighbouring 4:2:2 MCUs. Both DCT passes
+ * are then plain lane-wise arithmetic and need no transpose.
+ */
+#define FASTJPEG_LANES          (8)
+
+/* worst case bytes of one 4:2:2 MCU: 4 blocks of 64 x 27 bits, all stuffed */
+#define FASTJPEG_MCU_MAX        (4 * 64 * 27 * 2 / 8 + 16)
+#define FASTJPEG_HEADER_MAX     (1024)
+
+/* Annex K tables, natural order */
+static const unsigned char fastjpeg_std_luma[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const unsigned char fastjpeg_std_chroma[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+/* zigzag index -> natural index */
+static const unsigned char fastjpeg_natural_order[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/* AAN scale factors: 1 for k = 0, cos(k * pi / 16) * sqrt(2) otherwise */
+static const float fastjpeg_aan_scale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+    1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+struct fastjpeg_huff {
+    unsigned char bits[17];     /* bits[k] = number of codes of length k */
+    unsigned char vals[256];
+    int32_t nvals;
+    uint16_t code[256];         /* symbol -> code, precomputed */
+    unsigned char size[256];
+};
+
+struct fastjpeg_bits {
+    uint64_t acc;
+    int32_t n;
+    unsigned char *p;
+};
+
+struct fastjpeg {
+    int32_t width;
+    int32_t height;
+    int32_t quality;
+
+    unsigned char *out;
+    size_t out_size;
+
+    unsigned char qtbl[2][64];  /* natural order, for DQT */
+    float qrecip[64][FASTJPEG_LANES];   /* per lane reciprocal divisors */
+
+    struct fastjpeg_huff dc[2];
+    struct fastjpeg_huff ac[2];
+};
+
+static struct fastjpeg_huff fastjpeg_std_huff[4];    /* dc0, ac0, dc1, ac1 */
+static int32_t fastjpeg_tables_ready = 0;
+
+static void fastjpeg_make_codes(struct fastjpeg_huff *huff)
+{
+    int32_t len, i, k = 0;
+    uint32_t code = 0;
+
+    memset(huff->size, 0, sizeof(huff->size));
+    for (len = 1; len <= 16; len++) {
+        for (i = 0; i < huff->bits[len]; i++, k++) {
+            huff->code[huff->vals[k]] = code++;
+            huff->size[huff->vals[k]] = len;
+        }
+        code <<= 1;
+    }
+}
+
+/* Build the per-symbol code tables once from the shared DHT segments. */
+static void fastjpeg_init_tables(void)
+{
+    const unsigned char *dht;
+    int size, pos = 0;
+
+    if (fastjpeg_tables_ready)
+        return;
+
+    dht = utils_get_dht(&size);
+    while (pos + 4 < size && dht[pos] == 0xff && dht[pos + 1] == 0xc4) {
+        int len = (dht[pos + 2] << 8) | dht[pos + 3];
+        int tc = dht[pos + 4] >> 4, th = dht[pos + 4] & 15;
+        struct fastjpeg_huff *huff = &fastjpeg_std_huff[th * 2 + tc];
+        int k;
+
+        huff->bits[0] = 0;
+        huff->nvals = 0;
+        for (k = 1; k <= 16; k++) {
+            huff->bits[k] = dht[pos + 4 + k];
+            huff->nvals += huff->bits[k];
+        }
+        memcpy(huff->vals, dht + pos + 21, huff->nvals);
+        fastjpeg_make_codes(huff);
+        pos += 2 + len;
+    }
+
+    fastjpeg_tables_ready = 1;
+}
+
+struct fastjpeg *fastjpeg_create(int32_t width, int32_t height, int32_t quality)
+{
+    struct fastjpeg *enc;
+
+    if (width <= 0 || height <= 0 || width > 65535 || height > 65535)
+        return NULL;
+
+    fastjpeg_init_tables();
+
+    enc = (struct fastjpeg *)calloc(1, sizeof(struct fastjpeg));
+    if (!enc)
+        return NULL;
+
+    enc->width = width;
+    enc->height = height;
+    enc->out_size = (size_t)width * height + FASTJPEG_HEADER_MAX;
+    enc->out = (unsigned char *)malloc(enc->out_size);
+    if (!enc->out) {
+        free(enc);
+        return NULL;
+    }
+    enc->dc[0] = fastjpeg_std_huff[0];
+    enc->ac[0] = fastjpeg_std_huff[1];
+    enc->dc[1] = fastjpeg_std_huff[2];
+    enc->ac[1] = fastjpeg_std_huff[3];
+
+    enc->quality = -1;
+    fastjpeg_set_quality(enc, quality);
+
+    return enc;
+}
+
+void fastjpeg_destroy(struct fastjpeg *enc)
+{
+    if (!enc)
+        return;
+
+    free(enc->out);
+    free(enc);
+}
+
+/* Same scaling as libjpeg's jpeg_set_quality(), forced to baseline. */
+int32_t fastjpeg_set_quality(struct fastjpeg *enc, int32_t quality)
+{
+    int32_t scale, i, u, v, lane;
+
+    if (!enc)
+        return -1;
+
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+    if (quality == enc->quality)
+        return 0;
+    enc->quality = quality;
+
+    scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (i = 0; i < 64; i++) {
+        int32_t q;
+
+        q = (fastjpeg_std_luma[i] * scale + 50) / 100;
+        enc->qtbl[0][i] = q < 1 ? 1 : (q > 255 ? 255 : q);
+        q = (fastjpeg_std_chroma[i] * scale + 50) / 100;
+        enc->qtbl[1][i] = q < 1 ? 1 : (q > 255 ? 255 : q);
+    }
+
+    /* fold the AAN output scaling and the overall x8 into the divisors,
+       lanes 2, 3, 6 and 7 hold chroma blocks */
+    for (v = 0; v < 8; v++)
+        for (u = 0; u < 8; u++)
+            for (lane = 0; lane < FASTJPEG_LANES; lane++)
+                enc->qrecip[v * 8 + u][lane] = 1.0f /
+                    (enc->qtbl[(lane >> 1) & 1][v * 8 + u] *
+                     fastjpeg_aan_scale[v] * fastjpeg_aan_scale[u] * 8.0f);
+    return 0;
+}
+
+/* 1-D AAN forward DCT over eight vectors d[0], d[st], ... d[7 * st]. */
+#define FASTJPEG_FDCT8(d, st) do {                                      \
+    v8sf tmp0 = d[0] + d[7 * st], tmp7 = d[0] - d[7 * st];              \
+    v8sf tmp1 = d[st] + d[6 * st], tmp6 = d[st] - d[6 * st];            \
+    v8sf tmp2 = d[2 * st] + d[5 * st], tmp5 = d[2 * st] - d[5 * st];    \
+    v8sf tmp3 = d[3 * st] + d[4 * st], tmp4 = d[3 * st] - d[4 * st];    \
+    v8sf tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;                      \
+    v8sf tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;                      \
+    v8sf z1, z2, z3, z4, z5, z11, z13;                                  \
+    d[0] = tmp10 + tmp11;                                               \
+    d[4 * st] = tmp10 - tmp11;                                          \
+    z1 = (tmp12 + tmp13) * 0.707106781f;                                \
+    d[2 * st] = tmp13 + z1;                                             \
+    d[6 * st] = tmp13 - z1;                                             \
+    tmp10 = tmp4 + tmp5;                                                \
+    tmp11 = tmp5 + tmp6;                                                \
+    tmp12 = tmp6 + tmp7;                                                \
+    z5 = (tmp10 - tmp12) * 0.382683433f;                                \
+    z2 = tmp10 * 0.541196100f + z5;                                     \
+    z4 = tmp12 * 1.306562965f + z5;                                     \
+    z3 = tmp11 * 0.707106781f;                                          \
+    z11 = tmp7 + z3;                                                    \
+    z13 = tmp7 - z3;                                                    \
+    d[5 * st] = z13 + z2;                                               \
+    d[3 * st] = z13 - z2;                                               \
+    d[st] = z11 + z4;                                                   \
+    d[7 * st] = z11 - z4;                                               \
+} while (0)
+
+/*
+ * Forward DCT and quantization of eight blocks. samples[r * 8 + c] holds
+ * pixel (r, c) of every block, one block per lane; coef[v * 8 + u] receives
+ * the quantized coefficients in the same layout. Quantization multiplies
+ * by reciprocals and rounds half away from zero.
+ */
+static void fastjpeg_fdct_quant(const struct fastjpeg *enc,
+        unsigned char samples[64][FASTJPEG_LANES], int32_t coef[64][FASTJPEG_LANES])
+{
+    v8sf d[64];
+    int32_t i;
+
+    for (i = 0; i < 64; i++) {
+        v8qu b;
+
+        memcpy(&b, samples[i], sizeof(b));
+        d[i] = __builtin_convertvector(b, v8sf) - 128.0f;
+    }
+    for (i = 0; i < 8; i++)
+        FASTJPEG_FDCT8((d + i * 8), 1);
+    for (i = 0; i < 8; i++)
+        FASTJPEG_FDCT8((d + i), 8);
+
+    for (i = 0; i < 64; i++) {
+        v8sf q;
+        v8si r;
+
+        memcpy(&q, enc->qrecip[i], sizeof(q));
+        q = d[i] * q + 16384.5f;
+        r = __builtin_convertvector(q, v8si) - 16384;
+        memcpy(coef[i], &r, sizeof(r));
+    }
+}
+
+/* Emit up to 32 bits from the accumulator, stuffing 0x00 after 0xff. */
+static inline void fastjpeg_put(struct fastjpeg_bits *bw, uint32_t code, int32_t size)
+{
+    bw->acc = (bw->acc << size) | code;
+    bw->n += size;
+    if (bw->n >= 32) {
+        uint32_t w = (uint32_t)(bw->acc >> (bw->n - 32));
+        uint32_t nw = ~w;
+
+        bw->n -= 32;
+        if (((nw - 0x01010101u) & ~nw & 0x80808080u) == 0) {
+            bw->p[0] = w >> 24;
+            bw->p[1] = w >> 16;
+            bw->p[2] = w >> 8;
+            bw->p[3] = w;
+            bw->p += 4;
+        } else {
+            int32_t k;
+
+            for (k = 24; k >= 0; k -= 8) {
+                unsigned char b = w >> k;
+
+                *(bw->p++) = b;
+                if (b == 0xff)
+                    *(bw->p++) = 0;
+            }
+        }
+    }
+}
+
+static void fastjpeg_flush_bits(struct fastjpeg_bits *bw)
+{
+    /* pad the last byte with ones */
+    if (bw->n & 7)
+        fastjpeg_put(bw, (1u << (8 - (bw->n & 7))) - 1, 8 - (bw->n & 7));
+    while (bw->n > 0) {
+        unsigned char b = (unsigned char)(bw->acc >> (bw->n - 8));
+
+        *(bw->p++) = b;
+        if (b == 0xff)
+            *(bw->p++) = 0;
+        bw->n -= 8;
+    }
+}
+
+static inline int32_t fastjpeg_nbits(int32_t v)
+{
+    return v ? 32 - __builtin_clz((uint32_t)v) : 0;
+}
+
+static void fastjpeg_encode_block(struct fastjpeg_bits *bw,
+        int32_t coef[64][FASTJPEG_LANES], int32_t lane, int32_t *last_dc,
+        const struct fastjpeg_huff *dc, const struct fastjpeg_huff *ac)
+{
+    int32_t diff = coef[0][lane] - *last_dc;
+    int32_t zz[64];
+    int32_t v, nb, k, run;
+    uint64_t mask;
+
+    *last_dc = coef[0][lane];
+    v = diff < 0 ? -diff : diff;
+    nb = fastjpeg_nbits(v);
+    if (diff < 0)
+        diff--;
+    fastjpeg_put(bw, ((uint32_t)dc->code[nb] << nb) | (diff & ((1 << nb) - 1)),
+                 dc->size[nb] + nb);
+
+    /* zigzag the block and note its nonzero coefficients, then jump
+       from one nonzero to the next instead of testing all 63 */
+    mask = 0;
+    for (k = 1; k < 64; k++) {
+        zz[k] = coef[fastjpeg_natural_order[k]][lane];
+        mask |= (uint64_t)(zz[k] != 0) << k;
+    }
+    for (k = 0; mask; mask &= mask - 1) {
+        int32_t next = __builtin_ctzll(mask);
+        int32_t c = zz[next];
+        int32_t sym;
+
+        run = next - k - 1;
+        k = next;
+        while (run > 15) {
+            fastjpeg_put(bw, ac->code[0xf0], ac->size[0xf0]);
+            run -= 16;
+        }
+        v = c < 0 ? -c : c;
+        nb = fastjpeg_nbits(v);
+        if (c < 0)
+            c--;
+        sym = (run << 4) | nb;
+        fastjpeg_put(bw, ((uint32_t)ac->code[sym] << nb) | (c & ((1 << nb) - 1)),
+                     ac->size[sym] + nb);
+    }
+    run = k < 63;
+    if (run)
+        fastjpeg_put(bw, ac->code[0x00], ac->size[0x00]);
+}
+
+static unsigned char *fastjpeg_put_dht(unsigned char *p, const struct fastjpeg_huff *huff,
+        int32_t tc_th)
+{
+    int32_t len = 2 + 1 + 16 + huff->nvals;
+
+    *(p++) = 0xff;
+    *(p++) = 0xc4;
+    *(p++) = len >> 8;
+    *(p++) = len;
+    *(p++) = tc_th;
+    memcpy(p, huff->bits + 1, 16);
+    p += 16;
+    memcpy(p, huff->vals, huff->nvals);
+    return p + huff->nvals;
+}
+
+static size_t fastjpeg_write_header(struct fastjpeg *enc, unsigned char *p)
+{
+    static const unsigned char app0[] = {
+        0xff, 0xd8,
+        0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+        0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00
+    };
+    static const unsigned char sos[] = {
+        0xff, 0xda, 0x00, 0x0c, 0x03,
+        0x01, 0x00, 0x02, 0x11, 0x03, 0x11,
+        0x00, 0x3f, 0x00
+    };
+    unsigned char *start = p;
+    int32_t t, i;
+
+    memcpy(p, app0, sizeof(app0));
+    p += sizeof(app0);
+
+    *(p++) = 0xff;
+    *(p++) = 0xdb;
+    *(p++) = 0x00;
+    *(p++) = 0x84;
+    for (t = 0; t < 2; t++) {
+        *(p++) = t;
+        for (i = 0; i < 64; i++)
+            *(p++) = enc->qtbl[t][fastjpeg_natural_order[i]];
+    }
+
+    /* SOF0: Y 2x1 with table 0, Cb and Cr 1x1 with table 1 */
+    *(p++) = 0xff;
+    *(p++) = 0xc0;
+    *(p++) = 0x00;
+    *(p++) = 0x11;
+    *(p++) = 0x08;
+    *(p++) = enc->height >> 8;
+    *(p++) = enc->height;
+    *(p++) = enc->width >> 8;
+    *(p++) = enc->width;
+    *(p++) = 0x03;
+    *(p++) = 0x01; *(p++) = 0x21; *(p++) = 0x00;
+    *(p++) = 0x02; *(p++) = 0x11; *(p++) = 0x01;
+    *(p++) = 0x03; *(p++) = 0x11; *(p++) = 0x01;
+
+    p = fastjpeg_put_dht(p, &enc->dc[0], 0x00);
+    p = fastjpeg_put_dht(p, &enc->ac[0], 0x10);
+    p = fastjpeg_put_dht(p, &enc->dc[1], 0x01);
+    p = fastjpeg_put_dht(p, &enc->ac[1], 0x11);
+
+    memcpy(p, sos, sizeof(sos));
+    p += sizeof(sos);
+
+    return p - start;
+}
+
+/*
+ * Load the 16x8 pixel MCU at (x0, y0) into lanes base..base + 3: two Y
+ * blocks, then Cb and Cr. Edge MCUs replicate the last column and row.
+ */
+static void fastjpeg_load_mcu(const struct fastjpeg *enc, const unsigned char *yuyv,
+        int32_t x0, int32_t y0, unsigned char samples[64][FASTJPEG_LANES],
+        int32_t base)
+{
+    int32_t r, c;
+
+    for (r = 0; r < 8; r++) {
+        int32_t y = y0 + r < enc->height ? y0 + r : enc->height - 1;
+        const unsigned char *row = yuyv + (size_t)y * enc->width * 2;
+        unsigned char (*s)[FASTJPEG_LANES] = samples + r * 8;
+
+        if (x0 + 16 <= enc->width) {
+            const unsigned char *px = row + x0 * 2;
+
+            for (c = 0; c < 8; c++) {
+                s[c][base] = px[c * 2];
+                s[c][base + 1] = px[16 + c * 2];
+                s[c][base + 2] = px[c * 4 + 1];
+                s[c][base + 3] = px[c * 4 + 3];
+            }
+        } else {
+            for (c = 0; c < 16; c++) {
+                int32_t x = x0 + c < enc->width ? x0 + c : enc->width - 1;
+                int32_t pair = (x & ~1) * 2;
+
+                s[c & 7][base + (c >> 3)] = row[x * 2];
+                if (!(c & 1)) {
+                    s[c >> 1][base + 2] = row[pair + 1];
+                    s[c >> 1][base + 3] = row[pair + 3];
+                }
+            }
+        }
+    }
+}
+
+static int32_t fastjpeg_reserve(struct fastjpeg *enc, size_t used, size_t more)
+{
+    unsigned char *out;
+    size_t size = enc->out_size;
+
+    if (used + more <= size)
+        return 0;
+    while (used + more > size)
+        size *= 2;
+    out = (unsigned char *)realloc(enc->out, size);
+    if (!out)
+        return -1;
+    enc->out = out;
+    enc->out_size = size;
+    return 0;
+}
+
+int32_t fastjpeg_encode_yuyv(struct fastjpeg *enc, const unsigned char *yuyv,
+        unsigned char **out, size_t *size)
+{
+    struct fastjpeg_bits bw;
+    unsigned char samples[64][FASTJPEG_LANES];
+    int32_t coef[64][FASTJPEG_LANES];
+    int32_t last_dc[3] = { 0, 0, 0 };
+    int32_t mcusx, mcusy, mx, my, m, n;
+    size_t used;
+
+    if (!enc || !yuyv)
+        return -1;
+
+    mcusx = (enc->width + 15) >> 4;
+    mcusy = (enc->height + 7) >> 3;
+
+    used = fastjpeg_write_header(enc, enc->out);
+    bw.acc = 0;
+    bw.n = 0;
+    for (my = 0; my < mcusy; my++) {
+        /* make room for a worst case MCU row before encoding it */
+        if (fastjpeg_reserve(enc, used, (size_t)mcusx * FASTJPEG_MCU_MAX + 16) < 0) {
+            fprintf(stderr, "Not enough memory for the JPEG frame\n");
+            return -1;
+        }
+        bw.p = enc->out + used;
+        for (mx = 0; mx < mcusx; mx += 2) {
+            /* an odd last MCU is transformed twice, encoded once */
+            n = mx + 1 < mcusx ? 2 : 1;
+            fastjpeg_load_mcu(enc, yuyv, mx * 16, my * 8, samples, 0);
+            fastjpeg_load_mcu(enc, yuyv, (mx + n - 1) * 16, my * 8, samples, 4);
+            fastjpeg_fdct_quant(enc, samples, coef);
+            for (m = 0; m < n * 4; m += 4) {
+                fastjpeg_encode_block(&bw, coef, m, &last_dc[0], &enc->dc[0], &enc->ac[0]);
+                fastjpeg_encode_block(&bw, coef, m + 1, &last_dc[0], &enc->dc[0], &enc->ac[0]);
+                fastjpeg_encode_block(&bw, coef, m + 2, &last_dc[1], &enc->dc[1], &enc->ac[1]);
+                fastjpeg_encode_block(&bw, coef, m + 3, &last_dc[2], &enc->dc[1], &enc->ac[1]);
+            }
+        }
+        used = bw.p - enc->out;
+    }
+    fastjpeg_flush_bits(&bw);
+    *(bw.p++) = 0xff;
+    *(bw.p++) = 0xd9;
+
+    *out = enc->out;
+    *size = bw.p - enc->out;
+    return 0;
+}
+
+/* Symbols 8-bit baseline coding can produce, see fastjpeg_build_tables() */
+static int32_t fastjpeg_symbol_valid(int32_t ac, int32_t sym)
+{
+    if (!ac)
+        return sym <= 11;
+    return sym == 0x00 || sym == 0xf0 || ((sym & 15) >= 1 && (sym & 15) <= 10);
+}
+
+/* Annex K.2 code lengths, K.3 length limit, the same steps as libjpeg. */
+static void fastjpeg_gen_table(const uint32_t *count, int32_t ac,
+        unsigned char *bits, unsigned char *vals)
+{
+    uint64_t freq[257];
+    int32_t codesize[257], others[257], nbits[33];
+    int32_t c1, c2, i, j, k;
+    uint64_t v;
+
+    for (i = 0; i < 256; i++)
+        /* one extra count keeps a code for every possible symbol */
+        freq[i] = fastjpeg_symbol_valid(ac, i) ? (uint64_t)count[i] + 1 : 0;
+    freq[256] = 1;      /* reserves the all-ones code point */
+    for (i = 0; i < 257; i++) {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    for (;;) {
+        /* the two least frequent trees, ties broken toward larger symbols */
+        c1 = -1;
+        v = UINT64_MAX;
+        for (i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        c2 = -1;
+        v = UINT64_MAX;
+        for (i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0)
+            break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    memset(nbits, 0, sizeof(nbits));
+    for (i = 0; i <= 256; i++)
+        if (codesize[i])
+            nbits[codesize[i]]++;
+
+    /* move codes longer than 16 bits up the tree */
+    for (i = 32; i > 16; i--) {
+        while (nbits[i] > 0) {
+            j = i - 2;
+            while (nbits[j] == 0)
+                j--;
+            nbits[i] -= 2;
+            nbits[i - 1]++;
+            nbits[j + 1] += 2;
+            nbits[j]--;
+        }
+    }
+    /* drop the reserved code point from the longest length */
+    while (nbits[i] == 0)
+        i--;
+    nbits[i]--;
+
+    bits[0] = 0;
+    for (i = 1; i <= 16; i++)
+        bits[i] = nbits[i];
+    k = 0;
+    for (i = 1; i <= 32; i++)
+        for (j = 0; j < 256; j++)
+            if (codesize[j] == i)
+                vals[k++] = j;
+}
+
+void fastjpeg_build_tables(const struct fastjpeg_stats *stats,
+        struct fastjpeg_tables *tables)
+{
+    int32_t t;
+
+    memset(tables, 0, sizeof(*tables));
+    for (t = 0; t < FASTJPEG_TABLES; t++)
+        fastjpeg_gen_table(stats->freq[t], t & 1, tables->bits[t], tables->vals[t]);
+}
+
+uint64_t fastjpeg_tables_cost(const struct fastjpeg_stats *stats,
+        const struct fastjpeg_tables *tables)
+{
+    struct fastjpeg_huff huff;
+    uint64_t cost = 0;
+    int32_t t, sym;
+
+    fastjpeg_init_tables();
+    for (t = 0; t < FASTJPEG_TABLES; t++) {
+        if (tables) {
+            memcpy(huff.bits, tables->bits[t], sizeof(huff.bits));
+            memcpy(huff.vals, tables->vals[t], sizeof(huff.vals));
+            fastjpeg_make_codes(&huff);
+        } else {
+            huff = fastjpeg_std_huff[t];
+        }
+        for (sym = 0; sym < 256; sym++) {
+            /* a symbol without code would not be encodable at all */
+            int32_t size = huff.size[sym] ? huff.size[sym] : 16;
+
+            cost += (uint64_t)stats->freq[t][sym] *
+                    (size + ((t & 1) ? (sym & 15) : sym));
+        }
+    }
+    return cost;
+}
+
+void fastjpeg_set_tables(struct fastjpeg *enc, const struct fastjpeg_tables *tables)
+{
+    struct fastjpeg_huff *huff[FASTJPEG_TABLES];
+    int32_t t, k;
+
+    if (!enc)
+        return;
+
+    huff[0] = &enc->dc[0];
+    huff[1] = &enc->ac[0];
+    huff[2] = &enc->dc[1];
+    huff[3] = &enc->ac[1];
+    for (t = 0; t < FASTJPEG_TABLES; t++) {
+        if (!tables) {
+            *huff[t] = fastjpeg_std_huff[t];
+            continue;
+        }
+        memcpy(huff[t]->bits, tables->bits[t], sizeof(huff[t]->bits));
+        memcpy(huff[t]->vals, tables->vals[t], sizeof(huff[t]->vals));
+        huff[t]->nvals = 0;
+        for (k = 1; k <= 16; k++)
+            huff[t]->nvals += huff[t]->bits[k];
+        fastjpeg_make_codes(huff[t]);
+    }
+}
+
+/* Huffman decoding for fastjpeg_transcode() */
+#define FASTJPEG_LOOKAHEAD      (9)
+#define FASTJPEG_MAX_COMPS      (4)
+#define FASTJPEG_MAX_BLOCKS     (10)    /* blocks per MCU, 8-bit baseline */
+
+struct fastjpeg_dhuff {
+    int32_t valid;
+    int32_t maxcode[17];        /* largest code of each length, -1 if none */
+    int32_t valoff[17];         /* vals index minus code, per length */
+    unsigned char vals[256];
+    uint16_t look[1 << FASTJPEG_LOOKAHEAD];     /* (length << 8) | symbol */
+};
+
+struct fastjpeg_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t acc;               /* next bits, MSB first */
+    int32_t n;
+    int32_t marker;             /* set once a marker ends the entropy data */
+    int32_t pad;                /* zero bytes fed after the marker */
+};
+
+static void fastjpeg_make_dhuff(struct fastjpeg_dhuff *dh, const unsigned char *bits,
+        const unsigned char *vals)
+{
+    int32_t len, i, j, k = 0, code = 0;
+
+    memset(dh->look, 0, sizeof(dh->look));
+    for (len = 1; len <= 16; len++) {
+        dh->valoff[len] = k - code;
+        for (i = 0; i < bits[len]; i++, k++, code++) {
+            dh->vals[k] = vals[k];
+            if (len <= FASTJPEG_LOOKAHEAD) {
+                int32_t shift = FASTJPEG_LOOKAHEAD - len;
+
+                for (j = 0; j < (1 << shift); j++)
+                    dh->look[(code << shift) | j] = (len << 8) | vals[k];
+            }
+        }
+        dh->maxcode[len] = bits[len] ? code - 1 : -1;
+        code <<= 1;
+    }
+    dh->valid = 1;
+}
+
+static inline void fastjpeg_fill(struct fastjpeg_reader *br)
+{
+    while (br->n <= 56) {
+        uint32_t b = 0;
+
+        if (!br->marker && br->p < br->end) {
+            b = *(br->p++);
+            if (b == 0xff) {
+                if (br->p < br->end && *br->p == 0x00) {
+                    br->p++;
+                } else {
+                    br->marker = 1;
+                    br->p--;
+                    b = 0;
+                }
+            }
+        }
+        if (br->marker)
+            br->pad++;
+        br->acc |= (uint64_t)b << (56 - br->n);
+        br->n += 8;
+    }
+}
+
+static inline uint32_t fastjpeg_get_bits(struct fastjpeg_reader *br, int32_t size)
+{
+    uint32_t v;
+
+    if (!size)
+        return 0;
+    v = (uint32_t)(br->acc >> (64 - size));
+    br->acc <<= size;
+    br->n -= size;
+    return v;
+}
+
+/* Decode one symbol, the reader holds at least 57 bits. */
+static inline int32_t fastjpeg_decode_sym(struct fastjpeg_reader *br,
+        const struct fastjpeg_dhuff *dh)
+{
+    int32_t look = dh->look[br->acc >> (64 - FASTJPEG_LOOKAHEAD)];
+    int32_t len;
+
+    if (look) {
+        fastjpeg_get_bits(br, look >> 8);
+        return look & 0xff;
+    }
+    for (len = FASTJPEG_LOOKAHEAD + 1; len <= 16; len++) {
+        int32_t code = (int32_t)(br->acc >> (64 - len));
+
+        if (code <= dh->maxcode[len]) {
+            fastjpeg_get_bits(br, len);
+            return dh->vals[dh->valoff[len] + code];
+        }
+    }
+    return -1;
+}
+
+/* Move the symbols of one block from the reader to the writer. */
+static int32_t fastjpeg_transcode_block(struct fastjpeg_reader *br,
+        struct fastjpeg_bits *bw, const struct fastjpeg_dhuff *ddc,
+        const struct fastjpeg_dhuff *dac, const struct fastjpeg_huff *dc,
+        const struct fastjpeg_huff *ac, uint32_t *dc_freq, uint32_t *ac_freq)
+{
+    int32_t sym, s, k;
+    uint32_t extra;
+
+    fastjpeg_fill(br);
+    sym = fastjpeg_decode_sym(br, ddc);
+    if (sym < 0 || sym > 11)
+        return -1;
+    extra = fastjpeg_get_bits(br, sym);
+    if (dc_freq)
+        dc_freq[sym]++;
+    if (bw)
+        fastjpeg_put(bw, ((uint32_t)dc->code[sym] << sym) | extra, dc->size[sym] + sym);
+
+    for (k = 1; k < 64; ) {
+        fastjpeg_fill(br);
+        sym = fastjpeg_decode_sym(br, dac);
+        /* a corrupt run/size pair has no code in the tables we write */
+        if (sym < 0 || !fastjpeg_symbol_valid(1, sym))
+            return -1;
+        s = sym & 15;
+        extra = fastjpeg_get_bits(br, s);
+        if (ac_freq)
+            ac_freq[sym]++;
+        if (bw)
+            fastjpeg_put(bw, ((uint32_t)ac->code[sym] << s) | extra, ac->size[sym] + s);
+        if (s)
+            k += (sym >> 4) + 1;
+        else if (sym == 0xf0)
+            k += 16;
+        else
+            break;
+    }
+    return k > 64 ? -1 : 0;
+}
+
+int32_t fastjpeg_transcode(struct fastjpeg *enc, const unsigned char *jpeg,
+        size_t size, struct fastjpeg_stats *stats, unsigned char **out,
+        size_t *out_size)
+{
+    static const unsigned char sos_tail[] = { 0x00, 0x3f, 0x00 };
+    struct fastjpeg_dhuff dhuff[2][4];
+    struct fastjpeg_reader br;
+    struct fastjpeg_bits bw;
+    const unsigned char *p = jpeg, *end = jpeg + size;
+    int32_t comp_id[FASTJPEG_MAX_COMPS], comp_hv[FASTJPEG_MAX_COMPS];
+    int32_t block_comp[FASTJPEG_MAX_BLOCKS], comp_tables[FASTJPEG_MAX_COMPS];
+    int32_t ncomps = 0, nblocks = 0, width = 0, height = 0, restart = 0;
+    int32_t hmax = 1, vmax = 1, mcusx, mcusy, mcu, b, i, rst = 0;
+    size_t used = 0;
+
+    if (!enc || !jpeg || size < 4 || p[0] != 0xff || p[1] != 0xd8)
+        return -1;
+    fastjpeg_init_tables();
+    memset(dhuff, 0, sizeof(dhuff));
+
+    if (out && fastjpeg_reserve(enc, 0, 2) < 0)
+        return -1;
+    if (out) {
+        enc->out[used++] = 0xff;
+        enc->out[used++] = 0xd8;
+    }
+    p += 2;
+
+    /* the header up to SOS, copied except for the Huffman tables */
+    for (;;) {
+        const unsigned char *seg;
+        int32_t marker, len;
+
+        while (p < end && p[0] == 0xff && p + 1 < end && p[1] == 0xff)
+            p++;
+        if (p + 4 > end || p[0] != 0xff)
+            return -1;
+        marker = p[1];
+        len = (p[2] << 8) | p[3];
+        if (len < 2 || p + 2 + len > end)
+            return -1;
+        seg = p + 4;
+
+        if (0xda == marker)
+            break;
+        switch (marker) {
+        case 0xc0:
+        case 0xc1:
+            if (len < 8 || seg[0] != 8)
+                return -1;
+            height = (seg[1] << 8) | seg[2];
+            width = (seg[3] << 8) | seg[4];
+            ncomps = seg[5];
+            if (!width || !height || ncomps < 1 || ncomps > FASTJPEG_MAX_COMPS ||
+                len < 8 + ncomps * 3)
+                return -1;
+            for (i = 0; i < ncomps; i++) {
+                comp_id[i] = seg[6 + i * 3];
+                comp_hv[i] = seg[7 + i * 3];
+                if ((comp_hv[i] >> 4) > hmax)
+                    hmax = comp_hv[i] >> 4;
+                if ((comp_hv[i] & 15) > vmax)
+                    vmax = comp_hv[i] & 15;
+            }
+            break;
+        case 0xc4:
+            for (i = 0; i < len - 2; ) {
+                int32_t tc = seg[i] >> 4, th = seg[i] & 15, n = 0, k;
+
+                if (tc > 1 || th > 3 || i + 17 > len - 2)
+                    return -1;
+                for (k = 1; k <= 16; k++)
+                    n += seg[i + k];
+                if (n > 256 || i + 17 + n > len - 2)
+                    return -1;
+                {
+                    unsigned char bits[17];
+
+                    bits[0] = 0;
+                    memcpy(bits + 1, seg + i + 1, 16);
+                    fastjpeg_make_dhuff(&dhuff[tc][th], bits, seg + i + 17);
+                }
+                i += 17 + n;
+            }
+            p += 2 + len;
+            continue;
+        case 0xdd:
+            if (len != 4)
+                return -1;
+            restart = (seg[0] << 8) | seg[1];
+            break;
+        default:
+            /* progressive, lossless and arithmetic coding are not handled */
+            if (marker >= 0xc2 && marker <= 0xcf)
+                return -1;
+            break;
+        }
+        if (out) {
+            if (fastjpeg_reserve(enc, used, 2 + len) < 0)
+                return -1;
+            memcpy(enc->out + used, p, 2 + len);
+            used += 2 + len;
+        }
+        p += 2 + len;
+    }
+
+    /* SOS: a single scan over every component */
+    {
+        const unsigned char *seg = p + 4;
+        int32_t len = (p[2] << 8) | p[3];
+        int32_t ns = seg[0];
+
+        if (!ncomps || ns != ncomps || len != 6 + ns * 2 ||
+            memcmp(seg + 1 + ns * 2, sos_tail, sizeof(sos_tail)))
+            return -1;
+        if (ncomps == 1)
+            hmax = vmax = 1, comp_hv[0] = 0x11;
+        for (i = 0; i < ns; i++) {
+            int32_t c, td = seg[2 + i * 2] >> 4, ta = seg[2 + i * 2] & 15;
+
+            for (c = 0; c < ncomps && comp_id[c] != seg[1 + i * 2]; c++)
+                ;
+            if (c != i || td > 3 || ta > 3)
+                return -1;
+            /* default to the standard tables, as MJPEG frames omit DHT */
+            if (!dhuff[0][td].valid && td < 2)
+                fastjpeg_make_dhuff(&dhuff[0][td], fastjpeg_std_huff[td * 2].bits,
+                                    fastjpeg_std_huff[td * 2].vals);
+            if (!dhuff[1][ta].valid && ta < 2)
+                fastjpeg_make_dhuff(&dhuff[1][ta], fastjpeg_std_huff[ta * 2 + 1].bits,
+                                    fastjpeg_std_huff[ta * 2 + 1].vals);
+            if (!dhuff[0][td].valid || !dhuff[1][ta].valid)
+                return -1;
+            comp_tables[i] = (td << 4) | ta;
+            for (b = 0; b < (comp_hv[i] >> 4) * (comp_hv[i] & 15); b++) {
+                if (nblocks == FASTJPEG_MAX_BLOCKS)
+                    return -1;
+                block_comp[nblocks++] = i;
+            }
+        }
+        p += 2 + len;
+
+        if (out) {
+            if (fastjpeg_reserve(enc, used, 4 * (5 + 16 + 256) + len + 2) < 0)
+                return -1;
+            bw.p = enc->out + used;
+            bw.p = fastjpeg_put_dht(bw.p, &enc->dc[0], 0x00);
+            bw.p = fastjpeg_put_dht(bw.p, &enc->ac[0], 0x10);
+            bw.p = fastjpeg_put_dht(bw.p, &enc->dc[1], 0x01);
+            bw.p = fastjpeg_put_dht(bw.p, &enc->ac[1], 0x11);
+            *(bw.p++) = 0xff;
+            *(bw.p++) = 0xda;
+            *(bw.p++) = len >> 8;
+            *(bw.p++) = len;
+            *(bw.p++) = ns;
+            /* first component on the luma tables, the rest on chroma */
+            for (i = 0; i < ns; i++) {
+                *(bw.p++) = comp_id[i];
+                *(bw.p++) = i ? 0x11 : 0x00;
+            }
+            memcpy(bw.p, sos_tail, sizeof(sos_tail));
+            bw.p += sizeof(sos_tail);
+            used = bw.p - enc->out;
+        }
+    }
+
+    mcusx = (width + hmax * 8 - 1) / (hmax * 8);
+    mcusy = (height + vmax * 8 - 1) / (vmax * 8);
+    br.p = p;
+    br.end = end;
+    br.acc = 0;
+    br.n = 0;
+    br.marker = 0;
+    br.pad = 0;
+    bw.acc = 0;
+    bw.n = 0;
+
+    for (mcu = 0; mcu < mcusx * mcusy; mcu++) {
+        if (out && 0 == mcu % mcusx) {
+            if (fastjpeg_reserve(enc, used, (size_t)mcusx * nblocks * 64 * 27 * 2 / 8 +
+                                 (size_t)mcusx * 2 + 16) < 0)
+                return -1;
+            bw.p = enc->out + used;
+        }
+        if (restart && mcu && 0 == mcu % restart) {
+            /* skip the padding and the RSTn marker of the input */
+            while (br.p + 1 < br.end && !(br.p[0] == 0xff && br.p[1] >= 0xd0 &&
+                                          br.p[1] <= 0xd7))
+                br.p++;
+            br.p += 2;
+            br.acc = 0;
+            br.n = 0;
+            br.marker = 0;
+            br.pad = 0;
+            if (out) {
+                fastjpeg_flush_bits(&bw);
+                *(bw.p++) = 0xff;
+                *(bw.p++) = 0xd0 + (rst++ & 7);
+            }
+        }
+        for (b = 0; b < nblocks; b++) {
+            int32_t c = block_comp[b], t = c ? 2 : 0;
+
+            if (fastjpeg_transcode_block(&br, out ? &bw : NULL,
+                    &dhuff[0][comp_tables[c] >> 4], &dhuff[1][comp_tables[c] & 15],
+                    &enc->dc[c ? 1 : 0], &enc->ac[c ? 1 : 0],
+                    stats ? stats->freq[t] : NULL,
+                    stats ? stats->freq[t + 1] : NULL) < 0)
+                return -1;
+        }
+        /* more than a few bytes past the end means corrupt entropy data */
+        if (br.pad > 16)
+            return -1;
+        if (out)
+            used = bw.p - enc->out;
+    }
+
+    if (out) {
+        fastjpeg_flush_bits(&bw);
+        *(bw.p++) = 0xff;
+        *(bw.p++) = 0xd9;
+        *out = enc->out;
+        *out_size = bw.p - enc->out;
+    }
+    return 0;
+}
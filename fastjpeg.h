@@ -0,0 +1,84 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __FASTJPEG_H__
+#define __FASTJPEG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * In-tree baseline JPEG encoder for packed YUYV, the counterpart of the
+ * decoder in utils.c. It only does what the capture path needs: 4:2:2
+ * sampling, Annex K quantization tables scaled like libjpeg's quality
+ * setting, and the standard Huffman tables. The forward DCT and the
+ * quantization work on 8 lanes at a time through GCC vector extensions,
+ * which map to SSE/AVX or NEON.
+ */
+
+/* Huffman table order: luma DC, luma AC, chroma DC, chroma AC */
+#define FASTJPEG_TABLES         (4)
+
+struct fastjpeg_stats {
+    uint32_t freq[FASTJPEG_TABLES][256];
+};
+
+/* Huffman tables as carried in DHT: code counts per length and symbols. */
+struct fastjpeg_tables {
+    unsigned char bits[FASTJPEG_TABLES][17];
+    unsigned char vals[FASTJPEG_TABLES][256];
+};
+
+struct fastjpeg;
+
+struct fastjpeg *fastjpeg_create(int32_t width, int32_t height, int32_t quality);
+void fastjpeg_destroy(struct fastjpeg *enc);
+
+int32_t fastjpeg_set_quality(struct fastjpeg *enc, int32_t quality);
+
+/* Encode one packed YUYV frame, *out points into the encoder's buffer. */
+int32_t fastjpeg_encode_yuyv(struct fastjpeg *enc, const unsigned char *yuyv,
+        unsigned char **out, size_t *size);
+
+/*
+ * Build length-limited optimal tables from symbol statistics (Annex K.2).
+ * Every symbol of 8-bit baseline coding gets a code, so the tables stay
+ * usable for frames that were not part of the statistics.
+ */
+void fastjpeg_build_tables(const struct fastjpeg_stats *stats,
+        struct fastjpeg_tables *tables);
+
+/* Entropy-coded bits the statistics cost with tables, NULL for the standard ones. */
+uint64_t fastjpeg_tables_cost(const struct fastjpeg_stats *stats,
+        const struct fastjpeg_tables *tables);
+
+/* Code the following frames with tables, NULL restores the standard ones. */
+void fastjpeg_set_tables(struct fastjpeg *enc, const struct fastjpeg_tables *tables);
+
+/*
+ * Re-code the entropy data of a baseline Huffman JPEG, e.g. a camera MJPEG
+ * frame, with the encoder's tables. Coefficients are untouched, so this is
+ * lossless. Frames without DHT use the standard tables. The frame's symbols
+ * are added to stats when it is set; with out == NULL it is only counted.
+ */
+int32_t fastjpeg_transcode(struct fastjpeg *enc, const unsigned char *jpeg,
+        size_t size, struct fastjpeg_stats *stats, unsigned char **out,
+        size_t *out_size);
+
+#endif
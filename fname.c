@@ -0,0 +1,207 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "fname.h"
+
+struct fname {
+    char dir[FNAME_MAX];        /* prefix up to its last '/', may be empty */
+    char base[FNAME_MAX];
+    int32_t shard;
+
+    /* everything before the microseconds, valid for one wall second */
+    char head[FNAME_MAX];
+    size_t head_len;
+    int64_t second;
+    int64_t shard_key;          /* local hour or minute the shard directory is for */
+    int64_t mono_to_real_us;
+};
+
+static int64_t fname_clock_us(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* mkdir -p, path is modified and restored */
+static int32_t fname_mkdirs(char *path)
+{
+    char *p;
+
+    for (p = path + 1; ; p++) {
+        if (*p && *p != '/')
+            continue;
+        if (p[-1] != '/') {
+            char c = *p;
+
+            *p = '\0';
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                fprintf(stderr, "Unable to create %s\n", path);
+                *p = c;
+                return -1;
+            }
+            *p = c;
+        }
+        if (!*p)
+            return 0;
+    }
+}
+
+struct fname *fname_create(const char *prefix, int32_t shard)
+{
+    struct fname *fn;
+    const char *slash;
+    size_t dir_len;
+
+    if (strlen(prefix) >= FNAME_MAX - 64)
+        return NULL;
+    fn = (struct fname *)calloc(1, sizeof(struct fname));
+    if (!fn)
+        return NULL;
+
+    slash = strrchr(prefix, '/');
+    dir_len = slash ? (size_t)(slash - prefix + 1) : 0;
+    memcpy(fn->dir, prefix, dir_len);
+    snprintf(fn->base, sizeof(fn->base), "%s", *(prefix + dir_len) ? prefix + dir_len : "P");
+    fn->shard = shard;
+    fn->second = -1;
+    fn->shard_key = -1;
+    fn->mono_to_real_us = fname_clock_us(CLOCK_REALTIME) - fname_clock_us(CLOCK_MONOTONIC);
+
+    return fn;
+}
+
+void fname_destroy(struct fname *fn)
+{
+    free(fn);
+}
+
+/* A new second: render the directories, prefix and date once. */
+static int32_t fname_set_second(struct fname *fn, int64_t second)
+{
+    time_t t = (time_t)second;
+    struct tm tm;
+    int64_t key;
+    int len;
+
+    localtime_r(&t, &tm);
+    if (FNAME_SHARD_MINUTE == fn->shard)
+        len = snprintf(fn->head, sizeof(fn->head), "%s%04d%02d%02d/%02d/%02d/", fn->dir,
+                       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
+    else if (FNAME_SHARD_HOUR == fn->shard)
+        len = snprintf(fn->head, sizeof(fn->head), "%s%04d%02d%02d/%02d/", fn->dir,
+                       tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour);
+    else
+        len = snprintf(fn->head, sizeof(fn->head), "%s", fn->dir);
+
+    /* local time, half and quarter hour zones roll over off the UTC hour */
+    key = (((int64_t)tm.tm_year * 12 + tm.tm_mon) * 31 + tm.tm_mday) * 24 + tm.tm_hour;
+    if (FNAME_SHARD_MINUTE == fn->shard)
+        key = key * 60 + tm.tm_min;
+    if (fn->shard != FNAME_SHARD_NONE && key != fn->shard_key) {
+        if (fname_mkdirs(fn->head) < 0)
+            return -1;
+        fn->shard_key = key;
+    }
+
+    len += snprintf(fn->head + len, sizeof(fn->head) - len,
+                    "%s-%04d%02d%02d-%02d%02d%02d.", fn->base,
+                    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                    tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if (len >= (int)sizeof(fn->head))
+        return -1;
+    fn->head_len = len;
+    fn->second = second;
+    return 0;
+}
+
+/* Right aligned decimal, at least width digits; returns the end. */
+static char *fname_put_digits(char *p, uint32_t v, int32_t width)
+{
+    char tmp[10];
+    int32_t n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (width-- > n)
+        *p++ = '0';
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+int32_t fname_frame(struct fname *fn, char *name, const struct timeval *timestamp,
+        uint32_t sequence, const char *ext)
+{
+    int64_t capture_us, now_mono, wall_us;
+    size_t ext_len = strlen(ext);
+    char *p;
+
+    if (!fn)
+        return -1;
+
+    /* V4L2 timestamps are CLOCK_MONOTONIC; anything else is taken as now */
+    now_mono = fname_clock_us(CLOCK_MONOTONIC);
+    capture_us = now_mono;
+    if (timestamp && (timestamp->tv_sec || timestamp->tv_usec)) {
+        capture_us = (int64_t)timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+        if (capture_us > now_mono || now_mono - capture_us >= 10000000)
+            capture_us = now_mono;
+    }
+    wall_us = capture_us + fn->mono_to_real_us;
+    if (wall_us / 1000000 != fn->second) {
+        /* follow wall clock steps at second boundaries */
+        fn->mono_to_real_us = fname_clock_us(CLOCK_REALTIME) - fname_clock_us(CLOCK_MONOTONIC);
+        wall_us = capture_us + fn->mono_to_real_us;
+        if (wall_us / 1000000 != fn->second && fname_set_second(fn, wall_us / 1000000) < 0)
+            return -1;
+    }
+
+    /* usec, '-', up to 10 digits of sequence, '.', ext and NUL */
+    if (fn->head_len + 6 + 1 + 10 + 1 + ext_len + 1 > FNAME_MAX)
+        return -1;
+    memcpy(name, fn->head, fn->head_len);
+    p = fname_put_digits(name + fn->head_len, (uint32_t)(wall_us % 1000000), 6);
+    *p++ = '-';
+    p = fname_put_digits(p, sequence, 6);
+    *p++ = '.';
+    memcpy(p, ext, ext_len + 1);
+    return (int32_t)(p + ext_len - name);
+}
+
+int32_t fname_parse(const char *arg, int32_t *shard)
+{
+    if (!strcmp(arg, "h"))
+        *shard = FNAME_SHARD_HOUR;
+    else if (!strcmp(arg, "m"))
+        *shard = FNAME_SHARD_MINUTE;
+    else
+        return -1;
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __FNAME_H__
+#define __FNAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Per-frame file names: <prefix>-YYYYMMDD-HHMMSS.<usec>-<sequence>.<ext>,
+ * from the V4L2 buffer timestamp (carried over to wall clock) and sequence
+ * number, so any frame rate gets distinct names. The prefix and the date
+ * part are formatted when the second changes, only the digits after them
+ * are rendered per frame. With sharding the files go to YYYYMMDD/HH or
+ * YYYYMMDD/HH/MM directories next to the prefix, created as they come up.
+ */
+#define FNAME_MAX               (256)
+
+#define FNAME_SHARD_NONE        (0)
+#define FNAME_SHARD_HOUR        (1)
+#define FNAME_SHARD_MINUTE      (2)
+
+struct fname;
+
+struct fname *fname_create(const char *prefix, int32_t shard);
+void fname_destroy(struct fname *fn);
+
+/*
+ * Name of one frame in name (FNAME_MAX bytes), timestamp may be NULL for
+ * the current time. Returns the length, -1 when the directory cannot be
+ * created or the name does not fit.
+ */
+int32_t fname_frame(struct fname *fn, char *name, const struct timeval *timestamp,
+        uint32_t sequence, const char *ext);
+
+/* Parse the -s argument: "h" hourly or "m" per minute directories. */
+int32_t fname_parse(const char *arg, int32_t *shard);
+
+#endif
@@ -0,0 +1,426 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "framepool.h"
+
+/* in front of every pool buffer, keeps the data FRAMEPOOL_ALIGN aligned */
+struct framepool_buf {
+    struct framepool_buf *next;
+    int32_t class;
+    int32_t mapped;
+    unsigned char pad[FRAMEPOOL_ALIGN - sizeof(void *) - 2 * sizeof(int32_t)];
+};
+
+struct framepool_mapping {
+    void *ptr;                  /* what the caller got */
+    void *base;                 /* what to munmap */
+    size_t len;
+    int32_t kind;               /* FRAMEPOOL_HUGE_* backing it got */
+};
+
+struct framepool_arena {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+};
+
+static pthread_mutex_t framepool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct framepool_buf *framepool_free[FRAMEPOOL_CLASSES];
+static int32_t framepool_ready;
+static int32_t framepool_huge;
+static struct framepool_mapping framepool_maps[FRAMEPOOL_MAPS_MAX];
+
+static struct {
+    uint64_t gets;
+    uint64_t misses;            /* gets that went to the heap after init */
+    uint64_t bytes;             /* held by the pool, idle or in use */
+    uint64_t arena_misses;
+    uint64_t maps;
+    uint64_t maps_hugetlb;
+    uint64_t maps_thp;
+} framepool_stats;
+
+#ifdef FRAMEPOOL_COUNT_MALLOC
+/* glibc: interpose the allocator and count every call */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t framepool_mallocs;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&framepool_mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&framepool_mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&framepool_mallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    __atomic_add_fetch(&framepool_mallocs, 1, __ATOMIC_RELAXED);
+    p = __libc_memalign(alignment, size);
+    if (!p)
+        return 12;              /* ENOMEM */
+    *memptr = p;
+    return 0;
+}
+#endif
+
+void framepool_set_huge(int32_t mode)
+{
+    pthread_mutex_lock(&framepool_lock);
+    framepool_huge = mode;
+    pthread_mutex_unlock(&framepool_lock);
+}
+
+int32_t framepool_parse_huge(const char *arg, int32_t *mode)
+{
+    if (!*arg)
+        *mode = FRAMEPOOL_HUGE_TLB;
+    else if (!strcmp(arg, "t"))
+        *mode = FRAMEPOOL_HUGE_THP;
+    else
+        return -1;
+    return 0;
+}
+
+/* under framepool_lock */
+static void *framepool_map_locked(size_t size)
+{
+    size_t len = (size + FRAMEPOOL_HUGE_SIZE - 1) & ~(size_t)(FRAMEPOOL_HUGE_SIZE - 1);
+    unsigned char *base = MAP_FAILED, *ptr;
+    int32_t i, kind = FRAMEPOOL_HUGE_OFF;
+
+    for (i = 0; i < FRAMEPOOL_MAPS_MAX && framepool_maps[i].ptr; i++)
+        ;
+    if (i == FRAMEPOOL_MAPS_MAX || !size)
+        return NULL;
+
+    if (FRAMEPOOL_HUGE_TLB == framepool_huge) {
+        /* needs pages reserved in /proc/sys/vm/nr_hugepages */
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        ptr = base;
+        if (base != MAP_FAILED) {
+            framepool_stats.maps_hugetlb++;
+            kind = FRAMEPOOL_HUGE_TLB;
+        }
+    }
+    if (base == MAP_FAILED && FRAMEPOOL_HUGE_OFF != framepool_huge) {
+        /* one huge page of slack to align the start */
+        len += FRAMEPOOL_HUGE_SIZE;
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        ptr = (unsigned char *)(((uintptr_t)base + FRAMEPOOL_HUGE_SIZE - 1) &
+                                ~(uintptr_t)(FRAMEPOOL_HUGE_SIZE - 1));
+        if (!madvise(ptr, len - FRAMEPOOL_HUGE_SIZE, MADV_HUGEPAGE)) {
+            framepool_stats.maps_thp++;
+            kind = FRAMEPOOL_HUGE_THP;
+        }
+    }
+    if (base == MAP_FAILED) {
+        len = (size + 4095) & ~(size_t)4095;
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        ptr = base;
+    }
+
+    framepool_maps[i].ptr = ptr;
+    framepool_maps[i].base = base;
+    framepool_maps[i].len = len;
+    framepool_maps[i].kind = kind;
+    framepool_stats.maps++;
+    framepool_stats.bytes += len;
+    return ptr;
+}
+
+static void framepool_unmap_locked(void *ptr)
+{
+    int32_t i;
+
+    for (i = 0; i < FRAMEPOOL_MAPS_MAX; i++) {
+        if (framepool_maps[i].ptr == ptr) {
+            munmap(framepool_maps[i].base, framepool_maps[i].len);
+            framepool_stats.bytes -= framepool_maps[i].len;
+            memset(&framepool_maps[i], 0, sizeof(framepool_maps[i]));
+            return;
+        }
+    }
+}
+
+int32_t framepool_map_kind(void *ptr)
+{
+    int32_t i, kind = -1;
+
+    pthread_mutex_lock(&framepool_lock);
+    for (i = 0; i < FRAMEPOOL_MAPS_MAX; i++)
+        if (ptr && framepool_maps[i].ptr == ptr)
+            kind = framepool_maps[i].kind;
+    pthread_mutex_unlock(&framepool_lock);
+    return kind;
+}
+
+void *framepool_map(size_t size)
+{
+    void *ptr;
+
+    pthread_mutex_lock(&framepool_lock);
+    ptr = framepool_map_locked(size);
+    pthread_mutex_unlock(&framepool_lock);
+    return ptr;
+}
+
+void framepool_unmap(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    pthread_mutex_lock(&framepool_lock);
+    framepool_unmap_locked(ptr);
+    pthread_mutex_unlock(&framepool_lock);
+}
+
+static int32_t framepool_class(size_t size)
+{
+    int32_t class = 0;
+
+    while (class < FRAMEPOOL_CLASSES &&
+           ((size_t)1 << (class + FRAMEPOOL_MIN_SHIFT)) < size)
+        class++;
+    return class < FRAMEPOOL_CLASSES ? class : -1;
+}
+
+/* under framepool_lock */
+static struct framepool_buf *framepool_alloc_class(int32_t class)
+{
+    struct framepool_buf *buf;
+    size_t size = ((size_t)1 << (class + FRAMEPOOL_MIN_SHIFT)) + sizeof(*buf);
+
+    if (FRAMEPOOL_HUGE_OFF != framepool_huge && size > FRAMEPOOL_HUGE_SIZE) {
+        buf = (struct framepool_buf *)framepool_map_locked(size);
+        if (buf) {
+            buf->class = class;
+            buf->mapped = 1;
+            return buf;
+        }
+    }
+    if (posix_memalign((void **)&buf, FRAMEPOOL_ALIGN, size))
+        return NULL;
+    buf->class = class;
+    buf->mapped = 0;
+    framepool_stats.bytes += size;
+    return buf;
+}
+
+int32_t framepool_init(int32_t width, int32_t height)
+{
+    size_t sizes[2];
+    int32_t i, j;
+
+    sizes[0] = (size_t)width * height * 2;
+    sizes[1] = (size_t)width * height * 3;
+
+    pthread_mutex_lock(&framepool_lock);
+    for (i = 0; i < 2; i++) {
+        int32_t class = framepool_class(sizes[i]);
+        int32_t idle = 0;
+        struct framepool_buf *buf;
+
+        if (class < 0)
+            goto err;
+        for (buf = framepool_free[class]; buf; buf = buf->next)
+            idle++;
+        for (j = idle; j < FRAMEPOOL_PRIME; j++) {
+            buf = framepool_alloc_class(class);
+            if (!buf)
+                goto err;
+            buf->next = framepool_free[class];
+            framepool_free[class] = buf;
+        }
+    }
+    framepool_ready = 1;
+    pthread_mutex_unlock(&framepool_lock);
+    return 0;
+
+err:
+    pthread_mutex_unlock(&framepool_lock);
+    return -1;
+}
+
+void framepool_cleanup(void)
+{
+    int32_t i;
+
+    pthread_mutex_lock(&framepool_lock);
+    for (i = 0; i < FRAMEPOOL_CLASSES; i++) {
+        while (framepool_free[i]) {
+            struct framepool_buf *buf = framepool_free[i];
+
+            framepool_free[i] = buf->next;
+            if (buf->mapped) {
+                framepool_unmap_locked(buf);
+                continue;
+            }
+            framepool_stats.bytes -= ((size_t)1 << (i + FRAMEPOOL_MIN_SHIFT)) + sizeof(*buf);
+            free(buf);
+        }
+    }
+    framepool_ready = 0;
+    pthread_mutex_unlock(&framepool_lock);
+}
+
+void *framepool_get(size_t size)
+{
+    struct framepool_buf *buf;
+    int32_t class = framepool_class(size);
+
+    if (class < 0)
+        return NULL;
+
+    pthread_mutex_lock(&framepool_lock);
+    framepool_stats.gets++;
+    buf = framepool_free[class];
+    if (buf) {
+        framepool_free[class] = buf->next;
+    } else {
+        if (framepool_ready)
+            framepool_stats.misses++;
+        buf = framepool_alloc_class(class);
+    }
+    pthread_mutex_unlock(&framepool_lock);
+
+    return buf ? buf + 1 : NULL;
+}
+
+void framepool_put(void *data)
+{
+    struct framepool_buf *buf;
+
+    if (!data)
+        return;
+
+    buf = (struct framepool_buf *)data - 1;
+    pthread_mutex_lock(&framepool_lock);
+    buf->next = framepool_free[buf->class];
+    framepool_free[buf->class] = buf;
+    pthread_mutex_unlock(&framepool_lock);
+}
+
+uint64_t framepool_heap_allocs(void)
+{
+#ifdef FRAMEPOOL_COUNT_MALLOC
+    return __atomic_load_n(&framepool_mallocs, __ATOMIC_RELAXED);
+#else
+    uint64_t allocs;
+
+    pthread_mutex_lock(&framepool_lock);
+    allocs = framepool_stats.misses + framepool_stats.arena_misses;
+    pthread_mutex_unlock(&framepool_lock);
+    return allocs;
+#endif
+}
+
+void framepool_print_stats(void)
+{
+    pthread_mutex_lock(&framepool_lock);
+    fprintf(stderr, "Frame pool: %llu gets, %llu bytes held, %llu pool misses, "
+            "%llu arena overflows, %llu mappings (%llu hugetlb, %llu thp)\n",
+            (unsigned long long)framepool_stats.gets,
+            (unsigned long long)framepool_stats.bytes,
+            (unsigned long long)framepool_stats.misses,
+            (unsigned long long)framepool_stats.arena_misses,
+            (unsigned long long)framepool_stats.maps,
+            (unsigned long long)framepool_stats.maps_hugetlb,
+            (unsigned long long)framepool_stats.maps_thp);
+    pthread_mutex_unlock(&framepool_lock);
+}
+
+struct framepool_arena *framepool_arena_create(size_t size)
+{
+    struct framepool_arena *arena;
+
+    arena = (struct framepool_arena *)calloc(1, sizeof(struct framepool_arena));
+    if (!arena)
+        return NULL;
+    size = (size + FRAMEPOOL_ALIGN - 1) & ~(size_t)(FRAMEPOOL_ALIGN - 1);
+    if (posix_memalign((void **)&arena->base, FRAMEPOOL_ALIGN, size)) {
+        free(arena);
+        return NULL;
+    }
+    arena->size = size;
+    return arena;
+}
+
+void framepool_arena_destroy(struct framepool_arena *arena)
+{
+    if (!arena)
+        return;
+
+    free(arena->base);
+    free(arena);
+}
+
+void *framepool_arena_alloc(struct framepool_arena *arena, size_t size)
+{
+    void *p;
+
+    size = (size + FRAMEPOOL_ALIGN - 1) & ~(size_t)(FRAMEPOOL_ALIGN - 1);
+    if (!arena || size > arena->size - arena->used) {
+        pthread_mutex_lock(&framepool_lock);
+        framepool_stats.arena_misses++;
+        pthread_mutex_unlock(&framepool_lock);
+        return NULL;
+    }
+    p = arena->base + arena->used;
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    return p;
+}
+
+void framepool_arena_reset(struct framepool_arena *arena)
+{
+    if (arena)
+        arena->used = 0;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __FRAMEPOOL_H__
+#define __FRAMEPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Frame sized buffers for the capture loop. Buffers come in power of two
+ * size classes from 4 KiB up, are handed out from per-class free lists
+ * and go back on framepool_put(), so a steady stream of frames reuses the
+ * same memory instead of going through malloc/free on every frame.
+ * framepool_init() primes the classes the negotiated frame size needs.
+ *
+ * Arenas are bump allocators for per-frame scratch of one stage, sized
+ * once and reset instead of freed.
+ *
+ * Large buffers (frames, capture buffers) are mapped with framepool_map():
+ * with hugepages set they are backed by MAP_HUGETLB pages, or by
+ * transparent huge pages (madvise MADV_HUGEPAGE) when none are reserved,
+ * so a full frame pass touches a handful of TLB entries instead of
+ * thousands. Pool classes of a huge page and up are mapped the same way.
+ *
+ * framepool_heap_allocs() counts the heap allocations made by the pool
+ * and the arenas after init. Built with -DFRAMEPOOL_COUNT_MALLOC (make
+ * ALLOC_DEBUG=1) it counts every malloc/calloc/realloc of the process,
+ * libraries included.
+ */
+#define FRAMEPOOL_MIN_SHIFT     (12)
+#define FRAMEPOOL_CLASSES       (20)        /* 4 KiB .. 2 GiB */
+#define FRAMEPOOL_PRIME         (2)         /* buffers primed per class at init */
+#define FRAMEPOOL_ALIGN         (64)
+#define FRAMEPOOL_HUGE_SIZE     (2 * 1024 * 1024)
+#define FRAMEPOOL_MAPS_MAX      (64)        /* live framepool_map() mappings */
+
+#define FRAMEPOOL_HUGE_OFF      (0)
+#define FRAMEPOOL_HUGE_THP      (1)         /* transparent huge pages only */
+#define FRAMEPOOL_HUGE_TLB      (2)         /* MAP_HUGETLB, then THP */
+
+/* Prime the pool for width x height YUYV and RGB frames. */
+int32_t framepool_init(int32_t width, int32_t height);
+/* Free every idle buffer. */
+void framepool_cleanup(void);
+
+/* Before framepool_init() and the capture buffers; -L argument "[t]". */
+void framepool_set_huge(int32_t mode);
+int32_t framepool_parse_huge(const char *arg, int32_t *mode);
+
+/* Zeroed, page aligned (huge page aligned when backed so), NULL on failure. */
+void *framepool_map(size_t size);
+void framepool_unmap(void *ptr);
+/* FRAMEPOOL_HUGE_* backing of a mapping, -1 when ptr is not one. */
+int32_t framepool_map_kind(void *ptr);
+
+void *framepool_get(size_t size);
+void framepool_put(void *buf);
+
+uint64_t framepool_heap_allocs(void);
+void framepool_print_stats(void);
+
+struct framepool_arena;
+
+struct framepool_arena *framepool_arena_create(size_t size);
+void framepool_arena_destroy(struct framepool_arena *arena);
+/* FRAMEPOOL_ALIGN aligned, NULL once the arena is used up. */
+void *framepool_arena_alloc(struct framepool_arena *arena, size_t size);
+void framepool_arena_reset(struct framepool_arena *arena);
+
+#endif
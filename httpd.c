@@ -0,0 +1,574 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#define _GNU_SOURCE             /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "framepool.h"
+#include "httpd.h"
+
+#define HTTPD_REQ_MAX           (2048)
+#define HTTPD_HEAD_MAX          (256)
+#define HTTPD_EVENTS            (HTTPD_MAX_CLIENTS + 2)
+#define HTTPD_EV_LISTEN         (0)
+#define HTTPD_EV_WAKE           (1)
+#define HTTPD_EV_CLIENT         (2)     /* + client index */
+
+#define HTTPD_STATE_REQUEST     (0)     /* reading the request */
+#define HTTPD_STATE_STREAM      (1)
+#define HTTPD_STATE_SNAPSHOT    (2)     /* one frame, then close */
+#define HTTPD_STATE_CLOSING     (3)     /* error reply, then close */
+
+/* A published frame: part header, JPEG, CRLF, back to back. */
+struct httpd_frame {
+    int32_t refs;
+    uint64_t gen;
+    uint32_t sequence;          /* V4L2 capture order */
+    size_t hdr_len;
+    size_t jpeg_len;
+    size_t part_len;
+    unsigned char data[];
+};
+
+struct httpd_client {
+    int fd;
+    int32_t state;
+    int32_t want_out;           /* EPOLLOUT registered */
+    char req[HTTPD_REQ_MAX];
+    size_t req_len;
+    char head[HTTPD_HEAD_MAX];
+    size_t head_len, head_off;
+    struct httpd_frame *frame;  /* being written, one reference */
+    size_t off;
+    uint64_t last_gen;
+    int64_t progress_us;
+};
+
+struct httpd {
+    int fd;
+    int ep;
+    int wake;
+    pthread_t thread;
+    int32_t quit;
+    pthread_mutex_t lock;
+    struct httpd_frame *latest; /* one reference */
+    uint64_t gen;
+    int32_t nclients;
+    struct httpd_client clients[HTTPD_MAX_CLIENTS];
+    /* stats */
+    uint64_t published;
+    uint64_t published_bytes;
+    uint64_t connections;
+    uint64_t sent;
+    uint64_t sent_bytes;
+    uint64_t skipped;           /* frames slow viewers never got */
+    uint64_t late;              /* published after a newer capture */
+    uint64_t stalled;
+    int32_t max_clients;
+};
+
+static int64_t httpd_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void httpd_frame_put(struct httpd_frame *frame)
+{
+    if (frame && (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0))
+        framepool_put(frame);
+}
+
+/* The latest frame with a reference for the caller, NULL if none. */
+static struct httpd_frame *httpd_frame_latest(struct httpd *hs)
+{
+    struct httpd_frame *frame;
+
+    pthread_mutex_lock(&hs->lock);
+    frame = hs->latest;
+    if (frame)
+        __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hs->lock);
+    return frame;
+}
+
+static void httpd_interest(struct httpd *hs, struct httpd_client *c, int32_t out)
+{
+    struct epoll_event ev;
+
+    if (c->want_out == out)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    ev.data.u32 = HTTPD_EV_CLIENT + (c - hs->clients);
+    epoll_ctl(hs->ep, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = out;
+}
+
+static void httpd_close(struct httpd *hs, struct httpd_client *c)
+{
+    epoll_ctl(hs->ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    httpd_frame_put(c->frame);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    __atomic_sub_fetch(&hs->nclients, 1, __ATOMIC_RELAXED);
+}
+
+/* Hand the latest frame to a client that is free for one, 1 if it got one. */
+static int32_t httpd_next_frame(struct httpd *hs, struct httpd_client *c)
+{
+    struct httpd_frame *frame;
+
+    if (c->frame)
+        return 0;
+    frame = httpd_frame_latest(hs);
+    if (!frame)
+        return 0;
+    if (frame->gen <= c->last_gen) {
+        httpd_frame_put(frame);
+        return 0;
+    }
+    if (c->last_gen)
+        hs->skipped += frame->gen - c->last_gen - 1;
+    c->last_gen = frame->gen;
+    c->frame = frame;
+    if (HTTPD_STATE_SNAPSHOT == c->state) {
+        c->off = frame->hdr_len;
+        c->head_len = snprintf(c->head, sizeof(c->head), "HTTP/1.0 200 OK\r\n"
+                "Content-Type: image/jpeg\r\nContent-Length: %zu\r\n"
+                "Cache-Control: no-cache\r\nConnection: close\r\n\r\n", frame->jpeg_len);
+        c->head_off = 0;
+    } else {
+        c->off = 0;
+    }
+    return 1;
+}
+
+/* Write what the client has pending, never blocks. */
+static void httpd_flush(struct httpd *hs, struct httpd_client *c)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t end;
+    ssize_t sent;
+    int32_t n;
+
+    for (;;) {
+        n = 0;
+        if (c->head_off < c->head_len) {
+            iov[n].iov_base = c->head + c->head_off;
+            iov[n++].iov_len = c->head_len - c->head_off;
+        }
+        end = 0;
+        if (c->frame) {
+            end = HTTPD_STATE_SNAPSHOT == c->state ?
+                c->frame->hdr_len + c->frame->jpeg_len : c->frame->part_len;
+            iov[n].iov_base = c->frame->data + c->off;
+            iov[n++].iov_len = end - c->off;
+        }
+        if (!n) {
+            if (HTTPD_STATE_CLOSING == c->state) {
+                httpd_close(hs, c);
+                return;
+            }
+            /* up to date, wait for the next frame */
+            if (!httpd_next_frame(hs, c)) {
+                httpd_interest(hs, c, 0);
+                return;
+            }
+            continue;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR)) {
+                httpd_interest(hs, c, 1);
+                return;
+            }
+            httpd_close(hs, c);
+            return;
+        }
+        c->progress_us = httpd_now_us();
+        hs->sent_bytes += sent;
+        if (c->head_off < c->head_len) {
+            size_t part = c->head_len - c->head_off;
+
+            if ((size_t)sent < part) {
+                c->head_off += sent;
+                continue;
+            }
+            c->head_off = c->head_len;
+            sent -= part;
+        }
+        if (c->frame) {
+            c->off += sent;
+            if (c->off == end) {
+                hs->sent++;
+                httpd_frame_put(c->frame);
+                c->frame = NULL;
+                if (HTTPD_STATE_SNAPSHOT == c->state) {
+                    httpd_close(hs, c);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void httpd_request(struct httpd *hs, struct httpd_client *c)
+{
+    char method[8] = { 0 }, path[64] = { 0 };
+    ssize_t len;
+
+    len = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, MSG_DONTWAIT);
+    if ((len == 0) || ((len < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+        httpd_close(hs, c);
+        return;
+    }
+    if (len < 0)
+        return;
+    c->req_len += len;
+    c->req[c->req_len] = '\0';
+    if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n")) {
+        if (c->req_len == sizeof(c->req) - 1)
+            httpd_close(hs, c);
+        return;
+    }
+
+    sscanf(c->req, "%7s %63s", method, path);
+    if (strcmp(method, "GET")) {
+        c->state = HTTPD_STATE_CLOSING;
+        c->head_len = snprintf(c->head, sizeof(c->head), "HTTP/1.0 405 Method Not Allowed\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    } else if (!strcmp(path, "/") || !strcmp(path, "/stream")) {
+        c->state = HTTPD_STATE_STREAM;
+        c->head_len = snprintf(c->head, sizeof(c->head), "HTTP/1.0 200 OK\r\n"
+                "Content-Type: multipart/x-mixed-replace; boundary=" HTTPD_BOUNDARY "\r\n"
+                "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+    } else if (!strcmp(path, "/snapshot") || !strcmp(path, "/snapshot.jpg")) {
+        /* the header goes out with the frame, it carries its length */
+        c->state = HTTPD_STATE_SNAPSHOT;
+    } else {
+        c->state = HTTPD_STATE_CLOSING;
+        c->head_len = snprintf(c->head, sizeof(c->head), "HTTP/1.0 404 Not Found\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    c->head_off = 0;
+    c->progress_us = httpd_now_us();
+    httpd_flush(hs, c);
+}
+
+static void httpd_accept(struct httpd *hs)
+{
+    struct epoll_event ev;
+    struct httpd_client *c;
+    int32_t i;
+    int fd;
+
+    while ((fd = accept4(hs->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (i = 0; i < HTTPD_MAX_CLIENTS; i++)
+            if (hs->clients[i].fd < 0)
+                break;
+        if (i == HTTPD_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        c = &hs->clients[i];
+        c->fd = fd;
+        c->progress_us = httpd_now_us();
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = HTTPD_EV_CLIENT + i;
+        if (epoll_ctl(hs->ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            c->fd = -1;
+            continue;
+        }
+        hs->connections++;
+        if (__atomic_add_fetch(&hs->nclients, 1, __ATOMIC_RELAXED) > hs->max_clients)
+            hs->max_clients = hs->nclients;
+    }
+}
+
+static void *httpd_thread(void *arg)
+{
+    struct httpd *hs = (struct httpd *)arg;
+    struct epoll_event evs[HTTPD_EVENTS];
+    struct httpd_client *c;
+    uint64_t count;
+    int64_t now;
+    int32_t i, n;
+
+    while (!__atomic_load_n(&hs->quit, __ATOMIC_ACQUIRE)) {
+        n = epoll_wait(hs->ep, evs, HTTPD_EVENTS, 200);
+        for (i = 0; i < n; i++) {
+            uint32_t id = evs[i].data.u32;
+
+            if (HTTPD_EV_LISTEN == id) {
+                httpd_accept(hs);
+                continue;
+            }
+            if (HTTPD_EV_WAKE == id) {
+                if (read(hs->wake, &count, sizeof(count)) < 0)
+                    continue;
+                /* clients that are done with their last frame take this one */
+                for (id = 0; id < HTTPD_MAX_CLIENTS; id++) {
+                    c = &hs->clients[id];
+                    if ((c->fd >= 0) && (HTTPD_STATE_REQUEST != c->state) && !c->want_out)
+                        httpd_flush(hs, c);
+                }
+                continue;
+            }
+            c = &hs->clients[id - HTTPD_EV_CLIENT];
+            if (c->fd < 0)
+                continue;
+            if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+                httpd_close(hs, c);
+                continue;
+            }
+            if (evs[i].events & EPOLLIN) {
+                if (HTTPD_STATE_REQUEST == c->state) {
+                    httpd_request(hs, c);
+                } else {
+                    char drain[256];
+                    ssize_t len = recv(c->fd, drain, sizeof(drain), MSG_DONTWAIT);
+
+                    if ((len == 0) || ((len < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+                        httpd_close(hs, c);
+                        continue;
+                    }
+                }
+            }
+            if ((c->fd >= 0) && (evs[i].events & EPOLLOUT))
+                httpd_flush(hs, c);
+        }
+
+        /* a viewer that takes nothing for this long is gone */
+        now = httpd_now_us();
+        for (i = 0; i < HTTPD_MAX_CLIENTS; i++) {
+            c = &hs->clients[i];
+            if ((c->fd >= 0) && (c->want_out || HTTPD_STATE_REQUEST == c->state) &&
+                (now - c->progress_us > HTTPD_STALL_MS * 1000LL)) {
+                hs->stalled++;
+                httpd_close(hs, c);
+            }
+        }
+    }
+    return NULL;
+}
+
+struct httpd *httpd_create(const char *arg)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    struct httpd *hs;
+    const char *colon = strrchr(arg, ':');
+    char host[64] = "0.0.0.0";
+    char *end;
+    long port;
+    int32_t i, on = 1;
+
+    if (colon) {
+        if ((size_t)(colon - arg) >= sizeof(host))
+            return NULL;
+        memcpy(host, arg, colon - arg);
+        host[colon - arg] = '\0';
+        arg = colon + 1;
+    }
+    port = strtol(arg, &end, 10);
+    if ((end == arg) || *end || (port <= 0) || (port > 65535))
+        return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        return NULL;
+
+    hs = calloc(1, sizeof(*hs));
+    if (!hs)
+        return NULL;
+    for (i = 0; i < HTTPD_MAX_CLIENTS; i++)
+        hs->clients[i].fd = -1;
+    hs->ep = hs->wake = -1;
+    hs->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (hs->fd < 0)
+        goto fail;
+    setsockopt(hs->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((bind(hs->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(hs->fd, HTTPD_MAX_CLIENTS) < 0)) {
+        fprintf(stderr, "httpd: unable to listen on %s:%ld (%d)\n", host, port, errno);
+        goto fail;
+    }
+    hs->ep = epoll_create1(EPOLL_CLOEXEC);
+    hs->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((hs->ep < 0) || (hs->wake < 0))
+        goto fail;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = HTTPD_EV_LISTEN;
+    if (epoll_ctl(hs->ep, EPOLL_CTL_ADD, hs->fd, &ev) < 0)
+        goto fail;
+    ev.data.u32 = HTTPD_EV_WAKE;
+    if (epoll_ctl(hs->ep, EPOLL_CTL_ADD, hs->wake, &ev) < 0)
+        goto fail;
+    pthread_mutex_init(&hs->lock, NULL);
+    if (pthread_create(&hs->thread, NULL, httpd_thread, hs)) {
+        pthread_mutex_destroy(&hs->lock);
+        goto fail;
+    }
+    return hs;
+
+fail:
+    if (hs->wake >= 0)
+        close(hs->wake);
+    if (hs->ep >= 0)
+        close(hs->ep);
+    if (hs->fd >= 0)
+        close(hs->fd);
+    free(hs);
+    return NULL;
+}
+
+void httpd_destroy(struct httpd *hs)
+{
+    uint64_t one = 1;
+    int32_t i;
+
+    if (!hs)
+        return;
+
+    __atomic_store_n(&hs->quit, 1, __ATOMIC_RELEASE);
+    if (write(hs->wake, &one, sizeof(one)) < 0)
+        fprintf(stderr, "httpd: unable to wake the server thread (%d)\n", errno);
+    pthread_join(hs->thread, NULL);
+    for (i = 0; i < HTTPD_MAX_CLIENTS; i++)
+        if (hs->clients[i].fd >= 0)
+            httpd_close(hs, &hs->clients[i]);
+    httpd_frame_put(hs->latest);
+    close(hs->wake);
+    close(hs->ep);
+    close(hs->fd);
+    pthread_mutex_destroy(&hs->lock);
+    free(hs);
+}
+
+int32_t httpd_clients(struct httpd *hs)
+{
+    return hs ? __atomic_load_n(&hs->nclients, __ATOMIC_RELAXED) : 0;
+}
+
+/* A frame captured before the latest one, the stream must not go back. */
+static int32_t httpd_frame_late(struct httpd *hs, uint32_t sequence)
+{
+    return hs->latest && ((int32_t)(sequence - hs->latest->sequence) <= 0);
+}
+
+int32_t httpd_publish(struct httpd *hs, const struct iovec *iov, int32_t iovcnt,
+        uint32_t sequence)
+{
+    struct httpd_frame *frame, *old;
+    char hdr[128];
+    size_t jpeg_len = 0, hdr_len, off;
+    uint64_t one = 1;
+    int32_t i;
+
+    if (!hs || !iov)
+        return -1;
+
+    /* saved frames come back from the encoder pool after newer ones */
+    pthread_mutex_lock(&hs->lock);
+    if (httpd_frame_late(hs, sequence)) {
+        hs->late++;
+        pthread_mutex_unlock(&hs->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&hs->lock);
+
+    for (i = 0; i < iovcnt; i++)
+        jpeg_len += iov[i].iov_len;
+    hdr_len = snprintf(hdr, sizeof(hdr), "--" HTTPD_BOUNDARY "\r\nContent-Type: image/jpeg\r\n"
+            "Content-Length: %zu\r\n\r\n", jpeg_len);
+    /* the only copy, every viewer writes from here */
+    frame = (struct httpd_frame *)framepool_get(sizeof(*frame) + hdr_len + jpeg_len + 2);
+    if (!frame)
+        return -1;
+    frame->refs = 1;
+    frame->sequence = sequence;
+    frame->hdr_len = hdr_len;
+    frame->jpeg_len = jpeg_len;
+    frame->part_len = hdr_len + jpeg_len + 2;
+    memcpy(frame->data, hdr, hdr_len);
+    off = hdr_len;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(frame->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    memcpy(frame->data + off, "\r\n", 2);
+
+    pthread_mutex_lock(&hs->lock);
+    if (httpd_frame_late(hs, sequence)) {
+        hs->late++;
+        pthread_mutex_unlock(&hs->lock);
+        framepool_put(frame);
+        return -1;
+    }
+    frame->gen = ++hs->gen;
+    old = hs->latest;
+    hs->latest = frame;
+    hs->published++;
+    hs->published_bytes += jpeg_len;
+    pthread_mutex_unlock(&hs->lock);
+    httpd_frame_put(old);
+    if (write(hs->wake, &one, sizeof(one)) < 0)
+        return -1;
+    return 0;
+}
+
+void httpd_print_stats(struct httpd *hs)
+{
+    if (!hs)
+        return;
+
+    fprintf(stderr, "HTTP server: %llu frames published (%llu bytes), %llu connections, "
+            "max %d viewers, %llu frames / %llu bytes sent, %llu skipped by slow viewers, "
+            "%llu stalled viewers dropped, %llu late frames dropped\n",
+            (unsigned long long)hs->published, (unsigned long long)hs->published_bytes,
+            (unsigned long long)hs->connections, hs->max_clients,
+            (unsigned long long)hs->sent, (unsigned long long)hs->sent_bytes,
+            (unsigned long long)hs->skipped, (unsigned long long)hs->stalled,
+            (unsigned long long)hs->late);
+}
@@ -0,0 +1,62 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef __HTTPD_H__
+#define __HTTPD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * MJPEG over HTTP. One epoll thread serves:
+ *
+ *   GET /            multipart/x-mixed-replace stream (also /stream)
+ *   GET /snapshot    the latest JPEG (also /snapshot.jpg)
+ *
+ * httpd_publish() copies a JPEG once into a refcounted buffer that already
+ * holds its multipart part header. It becomes the latest frame and every
+ * client writes straight from it. A client still busy with an older frame
+ * skips to the latest when done, so a slow viewer drops frames instead of
+ * queueing them. A client whose socket makes no progress for
+ * HTTPD_STALL_MS is disconnected. The capture thread never waits on a
+ * client. Frames are published in capture order: one whose V4L2 sequence
+ * is not newer than the latest frame's (a saved frame the encoder pool
+ * finished after streamed ones) is dropped.
+ */
+#define HTTPD_MAX_CLIENTS       (32)
+#define HTTPD_STALL_MS          (5000)
+#define HTTPD_BOUNDARY          "camcapframe"
+
+struct httpd;
+
+/* arg is "[addr:]port", all addresses when addr is left out. */
+struct httpd *httpd_create(const char *arg);
+void httpd_destroy(struct httpd *hs);
+
+/* Viewers connected right now, nothing needs encoding while it is 0. */
+int32_t httpd_clients(struct httpd *hs);
+/* Make a JPEG (any number of pieces) the latest frame, 0 if published. */
+int32_t httpd_publish(struct httpd *hs, const struct iovec *iov, int32_t iovcnt,
+        uint32_t sequence);
+
+void httpd_print_stats(struct httpd *hs);
+
+#endif
@@ -0,0 +1,211 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fastjpeg.h"
+#include "huffopt.h"
+
+/*
+ * Everything but the published tables belongs to the thread feeding the
+ * frames; the lock only guards tables and generation, which the encoder
+ * threads poll.
+ */
+struct huffopt {
+    struct fastjpeg *fast;      /* counts and re-codes frames */
+    int32_t learn_frames;
+    int32_t period;
+
+    int32_t learning;
+    int32_t learned;            /* frames in stats */
+    uint32_t frames;
+    uint32_t since_build;
+    struct fastjpeg_stats stats;
+    struct fastjpeg_stats frame_stats;
+
+    pthread_mutex_t lock;
+    struct fastjpeg_tables tables;
+    uint32_t generation;        /* 0 until the first build */
+
+    /* statistics */
+    uint32_t builds;
+    uint32_t scene_changes;
+    uint64_t std_bits;          /* learn set cost, standard tables */
+    uint64_t opt_bits;          /* learn set cost, built tables */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+struct huffopt *huffopt_create(int32_t width, int32_t height,
+        int32_t learn_frames, int32_t period)
+{
+    struct huffopt *opt;
+
+    opt = (struct huffopt *)calloc(1, sizeof(struct huffopt));
+    if (!opt)
+        return NULL;
+
+    /* only the entropy coder is used, the quality does not matter */
+    opt->fast = fastjpeg_create(width, height, 75);
+    if (!opt->fast) {
+        free(opt);
+        return NULL;
+    }
+    opt->learn_frames = learn_frames > 0 ? learn_frames : HUFFOPT_LEARN_FRAMES;
+    opt->period = period > 0 ? period : 0;
+    opt->learning = 1;
+    pthread_mutex_init(&opt->lock, NULL);
+
+    return opt;
+}
+
+void huffopt_destroy(struct huffopt *opt)
+{
+    if (!opt)
+        return;
+
+    fastjpeg_destroy(opt->fast);
+    pthread_mutex_destroy(&opt->lock);
+    free(opt);
+}
+
+static void huffopt_build(struct huffopt *opt)
+{
+    struct fastjpeg_tables tables;
+
+    fastjpeg_build_tables(&opt->stats, &tables);
+    opt->std_bits = fastjpeg_tables_cost(&opt->stats, NULL);
+    opt->opt_bits = fastjpeg_tables_cost(&opt->stats, &tables);
+    fastjpeg_set_tables(opt->fast, &tables);
+
+    pthread_mutex_lock(&opt->lock);
+    opt->tables = tables;
+    opt->generation++;
+    pthread_mutex_unlock(&opt->lock);
+
+    opt->builds++;
+    opt->learning = 0;
+    opt->since_build = 0;
+}
+
+static void huffopt_learn(struct huffopt *opt)
+{
+    opt->learning = 1;
+    opt->learned = 0;
+    memset(&opt->stats, 0, sizeof(opt->stats));
+}
+
+/* A frame coding well above its own optimum means the scene changed. */
+static int32_t huffopt_scene_changed(struct huffopt *opt)
+{
+    struct fastjpeg_tables own;
+    uint64_t cost, best;
+
+    fastjpeg_build_tables(&opt->frame_stats, &own);
+    cost = fastjpeg_tables_cost(&opt->frame_stats, &opt->tables);
+    best = fastjpeg_tables_cost(&opt->frame_stats, &own);
+    return cost * 100 > best * (100 + HUFFOPT_SCENE_PCT);
+}
+
+void huffopt_feed(struct huffopt *opt, const unsigned char *jpeg, size_t size)
+{
+    if (!opt || !jpeg)
+        return;
+
+    opt->frames++;
+    if (!opt->learning) {
+        opt->since_build++;
+        if (opt->period && opt->since_build >= (uint32_t)opt->period) {
+            huffopt_learn(opt);
+        } else {
+            if (opt->since_build % HUFFOPT_CHECK_FRAMES)
+                return;
+            memset(&opt->frame_stats, 0, sizeof(opt->frame_stats));
+            if (fastjpeg_transcode(opt->fast, jpeg, size, &opt->frame_stats,
+                                   NULL, NULL) < 0 || !huffopt_scene_changed(opt))
+                return;
+            /* the checked frame starts the new statistics */
+            opt->scene_changes++;
+            huffopt_learn(opt);
+            opt->stats = opt->frame_stats;
+            if (++opt->learned >= opt->learn_frames)
+                huffopt_build(opt);
+            return;
+        }
+    }
+
+    if (fastjpeg_transcode(opt->fast, jpeg, size, &opt->stats, NULL, NULL) < 0)
+        return;
+    if (++opt->learned >= opt->learn_frames)
+        huffopt_build(opt);
+}
+
+int32_t huffopt_get_tables(struct huffopt *opt, struct fastjpeg_tables *tables,
+        uint32_t *generation)
+{
+    int32_t ret = 0;
+
+    if (!opt)
+        return 0;
+
+    pthread_mutex_lock(&opt->lock);
+    if (opt->generation != *generation) {
+        *tables = opt->tables;
+        *generation = opt->generation;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&opt->lock);
+    return ret;
+}
+
+int32_t huffopt_transcode(struct huffopt *opt, const unsigned char *jpeg,
+        size_t size, unsigned char **out, size_t *out_size)
+{
+    if (!opt)
+        return -1;
+
+    huffopt_feed(opt, jpeg, size);
+    if (!opt->builds)
+        return -1;
+    if (fastjpeg_transcode(opt->fast, jpeg, size, NULL, out, out_size) < 0)
+        return -1;
+    opt->bytes_in += size;
+    opt->bytes_out += *out_size;
+    return 0;
+}
+
+void huffopt_print_stats(struct huffopt *opt)
+{
+    if (!opt)
+        return;
+
+    fprintf(stderr, "Huffman tables: %u builds, %u scene changes",
+            opt->builds, opt->scene_changes);
+    if (opt->std_bits)
+        fprintf(stderr, ", last build %.1f%% smaller than the standard tables",
+                100.0 - opt->opt_bits * 100.0 / opt->std_bits);
+    fprintf(stderr, "\n");
+    if (opt->bytes_in)
+        fprintf(stderr, "  MJPEG re-coded: %llu -> %llu bytes (%.1f%%)\n",
+                (unsigned long long)opt->bytes_in, (unsigned long long)opt->bytes_out,
+                opt->bytes_out * 100.0 / opt->bytes_in);
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __HUFFOPT_H__
+#define __HUFFOPT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fastjpeg.h"
+
+/*
+ * Per-stream optimized Huffman tables. Symbol statistics are gathered from
+ * the first frames of the stream, turned into tables once, and then used
+ * by the encoders (jpegenc) or to re-code MJPEG frames from the camera.
+ * The tables are rebuilt every period frames, and earlier when a sampled
+ * frame codes much worse with them than with its own optimal tables.
+ */
+#define HUFFOPT_LEARN_FRAMES    (10)
+#define HUFFOPT_CHECK_FRAMES    (30)    /* scene change check interval */
+#define HUFFOPT_SCENE_PCT       (8)     /* cost over the frame's optimum */
+
+struct huffopt;
+
+/* period 0 rebuilds on scene changes only */
+struct huffopt *huffopt_create(int32_t width, int32_t height,
+        int32_t learn_frames, int32_t period);
+void huffopt_destroy(struct huffopt *opt);
+
+/* Account one coded frame of the stream, in capture order. */
+void huffopt_feed(struct huffopt *opt, const unsigned char *jpeg, size_t size);
+
+/*
+ * Copy the current tables if they are newer than *generation, which is
+ * updated. Returns 1 when tables were copied. Safe from any thread.
+ */
+int32_t huffopt_get_tables(struct huffopt *opt, struct fastjpeg_tables *tables,
+        uint32_t *generation);
+
+/*
+ * Feed a baseline JPEG frame and re-code it with the current tables.
+ * Returns -1 while no tables are built or the frame cannot be re-coded,
+ * the caller then keeps the original.
+ */
+int32_t huffopt_transcode(struct huffopt *opt, const unsigned char *jpeg,
+        size_t size, unsigned char **out, size_t *out_size);
+
+void huffopt_print_stats(struct huffopt *opt);
+
+#endif
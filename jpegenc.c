@@ -0,0 +1,323 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "threadpool.h"
+#include "fastjpeg.h"
+#include "huffopt.h"
+#include "jpegenc.h"
+
+struct jpegenc {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jpeg_destination_mgr dest;
+
+    unsigned char *out;         /* growable output buffer */
+    size_t out_size;
+    size_t out_used;
+    int32_t out_error;
+
+    unsigned char *planes;      /* deinterleaved Y, Cb, Cr */
+    unsigned char *y, *cb, *cr;
+    int32_t width;
+    int32_t height;
+    int32_t y_stride;           /* padded to whole MCUs */
+    int32_t quality;
+
+    struct fastjpeg *fast;      /* set for JPEGENC_BACKEND_FAST */
+
+    struct huffopt *huffopt;
+    uint32_t huff_generation;
+};
+
+struct jpegenc_planes_job {
+    struct jpegenc *enc;
+    unsigned char *yuyv;
+};
+
+/* Split packed YUYV rows into the Y, Cb and Cr planes libjpeg expects for
+   4:2:2 raw data, replicating the right edge into the MCU padding. */
+static void jpegenc_rows_to_planes(void *arg, int32_t row_start, int32_t row_end)
+{
+    struct jpegenc_planes_job *job = (struct jpegenc_planes_job *)arg;
+    struct jpegenc *enc = job->enc;
+    int32_t width = enc->width & ~1;
+    int32_t c_stride = enc->y_stride >> 1;
+    int32_t x, row;
+
+    for (row = row_start; row < row_end; row++) {
+        unsigned char *yuyv = job->yuyv + (size_t)row * enc->width * 2;
+        unsigned char *py = enc->y + (size_t)row * enc->y_stride;
+        unsigned char *pcb = enc->cb + (size_t)row * c_stride;
+        unsigned char *pcr = enc->cr + (size_t)row * c_stride;
+
+        for (x = 0; x < width; x += 2) {
+            *(py++) = yuyv[0];
+            *(pcb++) = yuyv[1];
+            *(py++) = yuyv[2];
+            *(pcr++) = yuyv[3];
+            yuyv += 4;
+        }
+        for (x = width; x < enc->y_stride; x += 2) {
+            py[0] = py[1] = py[-1];
+            *pcb = pcb[-1];
+            *pcr = pcr[-1];
+            py += 2;
+            pcb++;
+            pcr++;
+        }
+    }
+}
+
+/* destination manager writing into enc->out, doubling it when full */
+static void jpegenc_init_destination(j_compress_ptr cinfo)
+{
+    struct jpegenc *enc = (struct jpegenc *)cinfo->client_data;
+
+    enc->dest.next_output_byte = enc->out;
+    enc->dest.free_in_buffer = enc->out_size;
+    enc->out_error = 0;
+}
+
+static boolean jpegenc_empty_output_buffer(j_compress_ptr cinfo)
+{
+    struct jpegenc *enc = (struct jpegenc *)cinfo->client_data;
+    size_t new_size = enc->out_size * 2;
+    unsigned char *out;
+
+    out = (unsigned char *)realloc(enc->out, new_size);
+    if (!out) {
+        /* keep going over the old buffer, the frame is reported failed */
+        enc->out_error = 1;
+        enc->dest.next_output_byte = enc->out;
+        enc->dest.free_in_buffer = enc->out_size;
+        return TRUE;
+    }
+    enc->dest.next_output_byte = out + enc->out_size;
+    enc->dest.free_in_buffer = new_size - enc->out_size;
+    enc->out = out;
+    enc->out_size = new_size;
+    return TRUE;
+}
+
+static void jpegenc_term_destination(j_compress_ptr cinfo)
+{
+    struct jpegenc *enc = (struct jpegenc *)cinfo->client_data;
+
+    enc->out_used = enc->out_size - enc->dest.free_in_buffer;
+}
+
+struct jpegenc *jpegenc_create(int32_t width, int32_t height, int32_t quality,
+        int32_t backend)
+{
+    struct jpegenc *enc;
+    int32_t c_stride;
+
+    if (width <= 0 || height <= 0)
+        return NULL;
+
+    enc = (struct jpegenc *)calloc(1, sizeof(struct jpegenc));
+    if (!enc)
+        return NULL;
+
+    if (JPEGENC_BACKEND_FAST == backend) {
+        enc->fast = fastjpeg_create(width, height, quality);
+        if (!enc->fast) {
+            free(enc);
+            return NULL;
+        }
+        enc->width = width;
+        enc->height = height;
+        enc->quality = quality;
+        return enc;
+    }
+
+    enc->width = width;
+    enc->height = height;
+    enc->y_stride = (width + 15) & ~15;
+    c_stride = enc->y_stride >> 1;
+    enc->planes = (unsigned char *)malloc((size_t)enc->y_stride * height * 2);
+    /* one byte per pixel holds nearly every frame, grown on demand */
+    enc->out_size = (size_t)width * height;
+    enc->out = (unsigned char *)malloc(enc->out_size);
+    if (!enc->planes || !enc->out) {
+        free(enc->planes);
+        free(enc->out);
+        free(enc);
+        return NULL;
+    }
+    enc->y = enc->planes;
+    enc->cb = enc->y + (size_t)enc->y_stride * height;
+    enc->cr = enc->cb + (size_t)c_stride * height;
+
+    enc->cinfo.err = jpeg_std_error(&enc->jerr);
+    jpeg_create_compress(&enc->cinfo);
+    enc->cinfo.client_data = enc;
+    enc->dest.init_destination = jpegenc_init_destination;
+    enc->dest.empty_output_buffer = jpegenc_empty_output_buffer;
+    enc->dest.term_destination = jpegenc_term_destination;
+    enc->cinfo.dest = &enc->dest;
+
+    enc->cinfo.image_width = width;
+    enc->cinfo.image_height = height;
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&enc->cinfo);
+
+    /* feed 4:2:2 planes directly, libjpeg does no color conversion */
+    enc->cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    enc->cinfo.do_fancy_downsampling = FALSE;
+#endif
+    enc->cinfo.comp_info[0].h_samp_factor = 2;
+    enc->cinfo.comp_info[0].v_samp_factor = 1;
+    enc->cinfo.comp_info[1].h_samp_factor = 1;
+    enc->cinfo.comp_info[1].v_samp_factor = 1;
+    enc->cinfo.comp_info[2].h_samp_factor = 1;
+    enc->cinfo.comp_info[2].v_samp_factor = 1;
+
+    jpegenc_set_quality(enc, quality);
+
+    return enc;
+}
+
+void jpegenc_destroy(struct jpegenc *enc)
+{
+    if (!enc)
+        return;
+
+    if (enc->fast) {
+        fastjpeg_destroy(enc->fast);
+        free(enc);
+        return;
+    }
+    jpeg_destroy_compress(&enc->cinfo);
+    free(enc->planes);
+    free(enc->out);
+    free(enc);
+}
+
+int32_t jpegenc_set_quality(struct jpegenc *enc, int32_t quality)
+{
+    if (!enc)
+        return -1;
+
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+    if (quality != enc->quality) {
+        if (enc->fast)
+            fastjpeg_set_quality(enc->fast, quality);
+        else
+            jpeg_set_quality(&enc->cinfo, quality, TRUE);
+        enc->quality = quality;
+    }
+    return 0;
+}
+
+int32_t jpegenc_get_quality(struct jpegenc *enc)
+{
+    return enc ? enc->quality : -1;
+}
+
+void jpegenc_set_huffopt(struct jpegenc *enc, struct huffopt *opt)
+{
+    if (!enc)
+        return;
+
+    enc->huffopt = opt;
+    enc->huff_generation = 0;
+}
+
+/* libjpeg keeps using whatever is in its table slots, and writes them */
+static void jpegenc_update_tables(struct jpegenc *enc)
+{
+    struct fastjpeg_tables tables;
+    int32_t t;
+
+    if (!huffopt_get_tables(enc->huffopt, &tables, &enc->huff_generation))
+        return;
+    if (enc->fast) {
+        fastjpeg_set_tables(enc->fast, &tables);
+        return;
+    }
+    for (t = 0; t < 2; t++) {
+        JHUFF_TBL *dc = enc->cinfo.dc_huff_tbl_ptrs[t];
+        JHUFF_TBL *ac = enc->cinfo.ac_huff_tbl_ptrs[t];
+
+        memcpy(dc->bits, tables.bits[t * 2], sizeof(dc->bits));
+        memcpy(dc->huffval, tables.vals[t * 2], sizeof(dc->huffval));
+        memcpy(ac->bits, tables.bits[t * 2 + 1], sizeof(ac->bits));
+        memcpy(ac->huffval, tables.vals[t * 2 + 1], sizeof(ac->huffval));
+    }
+}
+
+int32_t jpegenc_encode_yuyv(struct jpegenc *enc, unsigned char *yuyv,
+        unsigned char **out, size_t *size)
+{
+    JSAMPROW y_rows[DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    struct jpegenc_planes_job job;
+    int32_t c_stride;
+
+    if (!enc || !yuyv)
+        return -1;
+    if (enc->huffopt)
+        jpegenc_update_tables(enc);
+    if (enc->fast)
+        return fastjpeg_encode_yuyv(enc->fast, yuyv, out, size);
+    c_stride = enc->y_stride >> 1;
+
+    job.enc = enc;
+    job.yuyv = yuyv;
+    threadpool_parallel_for(threadpool_get_default(), enc->height,
+                            jpegenc_rows_to_planes, &job);
+
+    jpeg_start_compress(&enc->cinfo, TRUE);
+    while (enc->cinfo.next_scanline < enc->cinfo.image_height) {
+        int32_t i;
+
+        for (i = 0; i < DCTSIZE; i++) {
+            int32_t row = enc->cinfo.next_scanline + i;
+
+            /* repeat the last line to fill the final MCU row */
+            if (row >= enc->height)
+                row = enc->height - 1;
+            y_rows[i] = enc->y + (size_t)row * enc->y_stride;
+            cb_rows[i] = enc->cb + (size_t)row * c_stride;
+            cr_rows[i] = enc->cr + (size_t)row * c_stride;
+        }
+        jpeg_write_raw_data(&enc->cinfo, planes, DCTSIZE);
+    }
+    jpeg_finish_compress(&enc->cinfo);
+
+    if (enc->out_error) {
+        fprintf(stderr, "Not enough memory for the JPEG frame\n");
+        return -1;
+    }
+
+    *out = enc->out;
+    *size = enc->out_used;
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __JPEGENC_H__
+#define __JPEGENC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Long-lived YUYV -> JPEG encoder. The libjpeg context, quality tables,
+ * plane buffer and output buffer are set up once and reused for every
+ * frame; the compressed frame stays in the encoder's memory buffer until
+ * the next call.
+ */
+#define JPEGENC_BACKEND_LIBJPEG     (0)
+#define JPEGENC_BACKEND_FAST        (1)     /* in-tree fastjpeg encoder */
+
+struct jpegenc;
+struct huffopt;
+
+struct jpegenc *jpegenc_create(int32_t width, int32_t height, int32_t quality,
+        int32_t backend);
+void jpegenc_destroy(struct jpegenc *enc);
+
+int32_t jpegenc_set_quality(struct jpegenc *enc, int32_t quality);
+int32_t jpegenc_get_quality(struct jpegenc *enc);
+
+/* Pick up the stream's optimized Huffman tables whenever they change. */
+void jpegenc_set_huffopt(struct jpegenc *enc, struct huffopt *opt);
+
+/* Encode one packed YUYV frame, *out points into the encoder's buffer. */
+int32_t jpegenc_encode_yuyv(struct jpegenc *enc, unsigned char *yuyv,
+        unsigned char **out, size_t *size);
+
+#endif
@@ -0,0 +1,301 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#define _GNU_SOURCE             /* vmsplice(), F_SETPIPE_SZ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "framepool.h"
+#include "dwrite.h"
+#include "pipeout.h"
+
+#define PIPEOUT_WAIT_MS         (1)
+#define PIPEOUT_PAGE            (4096)
+
+struct pipeout_slot {
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+    size_t off;                 /* bytes in the pipe */
+    uint64_t end;               /* stream offset past the slot, once all in */
+};
+
+struct pipeout {
+    int fd;
+    struct dwrite *dw;          /* plain writes when vmsplice is out */
+    int32_t vmsplice;
+    int32_t blocking;
+    int32_t failed;
+    int32_t nslots;
+    int32_t head;               /* slot the next frame goes to */
+    int32_t inuse;              /* slots before head the pipe may still read */
+    int32_t unsent;             /* the last of those, not all in the pipe yet */
+    uint64_t sent;              /* stream bytes handed to the pipe */
+    struct pipeout_slot slots[PIPEOUT_MAX_SLOTS];
+
+    /* statistics */
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t waits;
+};
+
+/* hand over what the pipe takes now, 0 or -1 once the output is gone */
+static int32_t pipeout_pump(struct pipeout *po)
+{
+    struct pipeout_slot *s;
+    struct iovec iov;
+    ssize_t len;
+
+    while (po->unsent > 0) {
+        s = &po->slots[(po->head - po->unsent + po->nslots) % po->nslots];
+        iov.iov_base = s->buf + s->off;
+        iov.iov_len = s->len - s->off;
+        if (po->vmsplice) {
+            len = vmsplice(po->fd, &iov, 1, SPLICE_F_NONBLOCK);
+            if (len < 0) {
+                if (errno == EAGAIN)
+                    return 0;
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EINVAL) || (errno == ENOSYS)) {
+                    /* not a pipe after all, write from here on */
+                    po->vmsplice = 0;
+                    continue;
+                }
+                po->failed = 1;
+                return -1;
+            }
+        } else {
+            if (dwrite_writev(po->dw, &iov, 1) < 0) {
+                po->failed = 1;
+                return -1;
+            }
+            len = iov.iov_len;
+        }
+        s->off += len;
+        po->sent += len;
+        if (s->off == s->len) {
+            s->end = po->sent;
+            po->unsent--;
+        }
+    }
+    return 0;
+}
+
+/* slots the reader is done with are free again */
+static void pipeout_reclaim(struct pipeout *po)
+{
+    struct pipeout_slot *s;
+    uint64_t consumed = po->sent;
+    int pending = 0;
+
+    if (po->vmsplice && (ioctl(po->fd, FIONREAD, &pending) == 0))
+        consumed -= pending;
+    while (po->inuse > po->unsent) {
+        s = &po->slots[(po->head - po->inuse + po->nslots) % po->nslots];
+        if (s->end > consumed)
+            break;
+        po->inuse--;
+    }
+}
+
+struct pipeout *pipeout_create(int fd, int32_t slots, size_t slot_size)
+{
+    struct pipeout *po;
+    struct stat st;
+    int32_t i;
+
+    if (slots <= 0)
+        slots = PIPEOUT_DEFAULT_SLOTS;
+    if (slots > PIPEOUT_MAX_SLOTS)
+        slots = PIPEOUT_MAX_SLOTS;
+
+    po = (struct pipeout *)calloc(1, sizeof(struct pipeout));
+    if (!po)
+        return NULL;
+    po->fd = fd;
+    po->nslots = slots;
+    po->dw = dwrite_fdopen(fd);
+    if (!po->dw) {
+        free(po);
+        return NULL;
+    }
+    /* a reader going away must end the capture, not kill it */
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((fstat(fd, &st) == 0) && S_ISFIFO(st.st_mode)) {
+        po->vmsplice = 1;
+        /* room for a whole frame keeps a fast reader from ever waiting */
+        if (slot_size && (fcntl(fd, F_SETPIPE_SZ, (int)slot_size) < 0))
+            fcntl(fd, F_SETPIPE_SZ, 1024 * 1024);   /* unprivileged maximum */
+    }
+
+    for (i = 0; i < slots; i++) {
+        po->slots[i].cap = (slot_size + PIPEOUT_PAGE - 1) & ~(size_t)(PIPEOUT_PAGE - 1);
+        if (!po->slots[i].cap)
+            continue;
+        po->slots[i].buf = framepool_map(po->slots[i].cap);
+        if (!po->slots[i].buf) {
+            po->slots[i].cap = 0;
+            pipeout_destroy(po);
+            return NULL;
+        }
+    }
+    return po;
+}
+
+void pipeout_destroy(struct pipeout *po)
+{
+    struct pollfd pfd;
+    int32_t i;
+
+    if (!po)
+        return;
+
+    /* the pipe keeps its own references, only the queue needs to go in */
+    pfd.fd = po->fd;
+    pfd.events = POLLOUT;
+    while (!po->failed && (po->unsent > 0) && (pipeout_pump(po) == 0) && (po->unsent > 0))
+        poll(&pfd, 1, 100);
+    for (i = 0; i < po->nslots; i++)
+        if (po->slots[i].buf)
+            framepool_unmap(po->slots[i].buf);
+    dwrite_close(po->dw);
+    free(po);
+}
+
+void pipeout_set_blocking(struct pipeout *po, int32_t blocking)
+{
+    if (po)
+        po->blocking = blocking;
+}
+
+int32_t pipeout_begin(struct pipeout *po, size_t size, unsigned char **buf)
+{
+    struct pipeout_slot *s;
+    struct pollfd pfd;
+
+    if (!po || po->failed)
+        return -1;
+
+    if (pipeout_pump(po) < 0)
+        return -1;
+    pipeout_reclaim(po);
+    if (po->inuse == po->nslots) {
+        if (!po->blocking) {
+            po->dropped++;
+            return 1;
+        }
+        po->waits++;
+        pfd.fd = po->fd;
+        pfd.events = POLLOUT;
+        while (po->inuse == po->nslots) {
+            poll(&pfd, 1, PIPEOUT_WAIT_MS);
+            if (pipeout_pump(po) < 0)
+                return -1;
+            pipeout_reclaim(po);
+        }
+    }
+
+    s = &po->slots[po->head];
+    if (s->cap < size) {
+        /* free: the pipe is done with it */
+        if (s->buf)
+            framepool_unmap(s->buf);
+        s->cap = (size + PIPEOUT_PAGE - 1) & ~(size_t)(PIPEOUT_PAGE - 1);
+        s->buf = framepool_map(s->cap);
+        if (!s->buf) {
+            s->cap = 0;
+            po->dropped++;
+            return 1;
+        }
+    }
+    s->len = size;
+    s->off = 0;
+    *buf = s->buf;
+    return 0;
+}
+
+int32_t pipeout_commit(struct pipeout *po)
+{
+    if (!po || po->failed)
+        return -1;
+
+    po->frames++;
+    po->bytes += po->slots[po->head].len;
+    po->head = (po->head + 1) % po->nslots;
+    po->inuse++;
+    po->unsent++;
+    return pipeout_pump(po);
+}
+
+int32_t pipeout_writev(struct pipeout *po, const struct iovec *iov, int32_t iovcnt)
+{
+    unsigned char *buf;
+    size_t size = 0;
+    int32_t i, ret;
+
+    if (!po || po->failed)
+        return -1;
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    if (!po->vmsplice && !po->unsent) {
+        /* nothing to gain from a slot, the write copies anyway */
+        if (dwrite_writev(po->dw, iov, iovcnt) < 0) {
+            po->failed = 1;
+            return -1;
+        }
+        po->frames++;
+        po->bytes += size;
+        po->sent += size;
+        return 0;
+    }
+
+    ret = pipeout_begin(po, size, &buf);
+    if (ret)
+        return ret;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
+    }
+    return pipeout_commit(po);
+}
+
+void pipeout_print_stats(struct pipeout *po)
+{
+    if (!po)
+        return;
+
+    fprintf(stderr, "Pipe output (%s): %llu frames, %llu bytes, %llu dropped, %llu waits for the reader\n",
+            po->vmsplice ? "vmsplice" : "write",
+            (unsigned long long)po->frames, (unsigned long long)po->bytes,
+            (unsigned long long)po->dropped, (unsigned long long)po->waits);
+}
@@ -0,0 +1,77 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef __PIPEOUT_H__
+#define __PIPEOUT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Frame stream to a pipe (cam_cap -o - | ffmpeg ...). Frames are put in
+ * one of a few page aligned slots and vmspliced into the pipe, so the
+ * kernel maps the slot pages instead of copying them. A slot is refilled
+ * only once the reader has consumed all of it (bytes spliced minus
+ * FIONREAD), the pipe still references the pages until then. Readers that
+ * splice the pipe onward (tee, pv) keep references past that point; use a
+ * file output for those.
+ *
+ * The capture loop never waits on the reader: splices are non-blocking,
+ * what does not fit stays queued in its slot, and a frame that finds every
+ * slot still in the pipe is dropped whole, the same policy as -W. With
+ * blocking set (burst flush) it waits for a slot instead.
+ *
+ * When the descriptor is not a pipe, or the kernel refuses vmsplice, frames
+ * are written with plain blocking writes.
+ *
+ * Only frames built in place with pipeout_begin() save a copy (-f4, whose
+ * planes are split straight into the slot). pipeout_writev() copies the
+ * frame into a slot, so -f0 JPEG and -f3 YUYV still cost one memcpy, as a
+ * write() would. Splicing the capture buffer itself would hold it out of
+ * the V4L2 queue until the reader catches up. What pipeout_writev() buys
+ * is the non-blocking drop policy.
+ */
+#define PIPEOUT_DEFAULT_SLOTS   (4)
+#define PIPEOUT_MAX_SLOTS       (32)
+
+struct pipeout;
+
+/* slot_size is the expected frame size, slots grow for bigger frames. */
+struct pipeout *pipeout_create(int fd, int32_t slots, size_t slot_size);
+/* Waits until every queued frame is in the pipe. */
+void pipeout_destroy(struct pipeout *po);
+
+/* Wait for a slot rather than drop, for output that is not live. */
+void pipeout_set_blocking(struct pipeout *po, int32_t blocking);
+
+/*
+ * A frame of size bytes is built in place: *buf is its slot, filled by the
+ * caller and handed over with pipeout_commit(). 0 with a slot, 1 if the
+ * frame is dropped, -1 once the reader is gone (EPIPE).
+ */
+int32_t pipeout_begin(struct pipeout *po, size_t size, unsigned char **buf);
+int32_t pipeout_commit(struct pipeout *po);
+/* begin, copy and commit in one call, same returns; no copy is saved. */
+int32_t pipeout_writev(struct pipeout *po, const struct iovec *iov, int32_t iovcnt);
+
+void pipeout_print_stats(struct pipeout *po);
+
+#endif
@@ -0,0 +1,475 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "framepool.h"
+#include "pretrig.h"
+
+#define PRETRIG_REC_FILLER      (0xffffffffU)   /* rest of the buffer is unused */
+#define PRETRIG_CMD_MAX         (64)
+#define PRETRIG_REC_STALE       (0x1)   /* history too old to go out */
+
+/*
+ * Records sit back to back in the buffer, 8 byte aligned. One that does
+ * not fit before the end starts over at offset 0, behind a filler header
+ * (or nothing, when less than a header is left). Positions are byte counts
+ * since creation, tail <= written <= queued <= head:
+ *
+ *  [tail, written)    already handed to the sink, free to evict
+ *  [written, queued)  event frames waiting for the writer thread
+ *  [queued, head)     pre-trigger history
+ */
+struct pretrig_rec {
+    uint32_t size;
+    uint32_t flags;
+    uint32_t sequence;
+    uint32_t state;             /* PRETRIG_REC_* */
+    int64_t capture_us;
+};
+
+struct pretrig {
+    unsigned char *ring;
+    uint64_t cap;
+    uint64_t tail, written, queued, head;
+    int64_t pre_us, post_us;
+    int32_t recording;
+    int64_t until_us;
+    int32_t triggered;
+    int32_t quit;
+    int ctl_fd;
+    char ctl_path[PRETRIG_PATH_MAX];
+    pretrig_sink sink;
+    void *arg;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* stats */
+    uint64_t frames;
+    uint64_t events;
+    uint64_t flushed;
+    uint64_t flushed_bytes;
+    uint64_t dropped;
+    uint64_t max_used;
+    uint64_t max_queued;
+};
+
+static volatile sig_atomic_t pretrig_signalled;
+
+static void pretrig_sigusr1(int sig)
+{
+    pretrig_signalled = 1;
+}
+
+static uint64_t pretrig_rec_len(uint64_t size)
+{
+    return sizeof(struct pretrig_rec) + ((size + 7) & ~7ULL);
+}
+
+/* The record at *pos, which is moved past a filler first. */
+static struct pretrig_rec *pretrig_rec_at(struct pretrig *pt, uint64_t *pos)
+{
+    uint64_t left = pt->cap - *pos % pt->cap;
+    struct pretrig_rec *rec = (struct pretrig_rec *)(pt->ring + *pos % pt->cap);
+
+    if (left < sizeof(*rec) || PRETRIG_REC_FILLER == rec->size)
+        *pos += left;
+    return (struct pretrig_rec *)(pt->ring + *pos % pt->cap);
+}
+
+/* Drop the oldest record, 0 when it is still waiting to be written. */
+static int32_t pretrig_evict(struct pretrig *pt)
+{
+    uint64_t pos = pt->tail;
+    struct pretrig_rec *rec;
+
+    if (pt->tail >= pt->head)
+        return 0;
+    if ((pt->tail >= pt->written) && (pt->written < pt->queued))
+        return 0;
+    rec = pretrig_rec_at(pt, &pos);
+    pos += pretrig_rec_len(rec->size);
+    /* history nobody queued: the write cursors move along */
+    if (pt->tail == pt->written) {
+        pt->written = pos;
+        pt->queued = pos;
+    }
+    pt->tail = pos;
+    return 1;
+}
+
+static void *pretrig_writer(void *arg)
+{
+    struct pretrig *pt = (struct pretrig *)arg;
+    struct pretrig_frame frame;
+    struct pretrig_rec *rec;
+    uint64_t pos;
+
+    pthread_mutex_lock(&pt->lock);
+    for (;;) {
+        while ((pt->written == pt->queued) && !pt->quit)
+            pthread_cond_wait(&pt->cond, &pt->lock);
+        if (pt->written == pt->queued)
+            break;
+        pos = pt->written;
+        rec = pretrig_rec_at(pt, &pos);
+        if (rec->state & PRETRIG_REC_STALE) {
+            pt->written = pos + pretrig_rec_len(rec->size);
+            continue;
+        }
+        pthread_mutex_unlock(&pt->lock);
+
+        /* the capture thread never evicts past written, no lock needed */
+        frame.data = (const unsigned char *)(rec + 1);
+        frame.size = rec->size;
+        frame.timestamp.tv_sec = rec->capture_us / 1000000;
+        frame.timestamp.tv_usec = rec->capture_us % 1000000;
+        frame.sequence = rec->sequence;
+        frame.flags = rec->flags;
+        pt->sink(pt->arg, &frame);
+
+        pthread_mutex_lock(&pt->lock);
+        pt->written = pos + pretrig_rec_len(rec->size);
+        pt->flushed++;
+        pt->flushed_bytes += frame.size;
+        if (pt->written == pt->queued)
+            pthread_cond_broadcast(&pt->cond);
+    }
+    pthread_mutex_unlock(&pt->lock);
+    return NULL;
+}
+
+/*
+ * History behind a queue the writer is still busy with cannot be evicted,
+ * so it may reach back further than pre_ms; an event skips that part.
+ */
+static void pretrig_mark_stale(struct pretrig *pt, int64_t capture_us)
+{
+    uint64_t pos = pt->queued;
+    struct pretrig_rec *rec;
+
+    while (pos < pt->head) {
+        rec = pretrig_rec_at(pt, &pos);
+        if (rec->capture_us >= capture_us - pt->pre_us)
+            break;
+        rec->state |= PRETRIG_REC_STALE;
+        pos += pretrig_rec_len(rec->size);
+    }
+}
+
+static int pretrig_ctl_open(struct pretrig *pt, const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "pretrig: control socket path too long: %s\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "pretrig: unable to create the control socket (%d)\n", errno);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "pretrig: unable to bind %s (%d)\n", path, errno);
+        close(fd);
+        return -1;
+    }
+    strcpy(pt->ctl_path, path);
+    return fd;
+}
+
+/* Commands queued on the control socket since the last frame. */
+static void pretrig_ctl_poll(struct pretrig *pt)
+{
+    char cmd[PRETRIG_CMD_MAX];
+    ssize_t len;
+
+    while ((len = recv(pt->ctl_fd, cmd, sizeof(cmd) - 1, MSG_DONTWAIT)) >= 0) {
+        while ((len > 0) && ((cmd[len - 1] == '\n') || (cmd[len - 1] == '\r')))
+            len--;
+        cmd[len] = '\0';
+        if (!strcmp(cmd, "trigger"))
+            pt->triggered = 1;
+        else
+            fprintf(stderr, "pretrig: unknown command \"%s\"\n", cmd);
+    }
+}
+
+struct pretrig *pretrig_create(uint64_t bytes, int32_t pre_ms, int32_t post_ms,
+        const char *ctl_path, pretrig_sink sink, void *arg)
+{
+    struct pretrig *pt;
+    struct sigaction sa;
+
+    if (!sink || (bytes < 2 * sizeof(struct pretrig_rec)) || (pre_ms < 0) || (post_ms < 0))
+        return NULL;
+    pt = calloc(1, sizeof(*pt));
+    if (!pt)
+        return NULL;
+    pt->ctl_fd = -1;
+    pt->cap = bytes & ~7ULL;
+    pt->pre_us = (int64_t)pre_ms * 1000;
+    pt->post_us = (int64_t)post_ms * 1000;
+    pt->sink = sink;
+    pt->arg = arg;
+    pt->ring = framepool_map(pt->cap);
+    if (!pt->ring) {
+        fprintf(stderr, "pretrig: unable to map a %llu byte ring\n",
+                (unsigned long long)pt->cap);
+        free(pt);
+        return NULL;
+    }
+    if (ctl_path && *ctl_path) {
+        pt->ctl_fd = pretrig_ctl_open(pt, ctl_path);
+        if (pt->ctl_fd < 0) {
+            framepool_unmap(pt->ring);
+            free(pt);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&pt->lock, NULL);
+    pthread_cond_init(&pt->cond, NULL);
+    if (pthread_create(&pt->thread, NULL, pretrig_writer, pt)) {
+        fprintf(stderr, "pretrig: unable to start the writer thread\n");
+        pthread_cond_destroy(&pt->cond);
+        pthread_mutex_destroy(&pt->lock);
+        if (pt->ctl_fd >= 0) {
+            close(pt->ctl_fd);
+            unlink(pt->ctl_path);
+        }
+        framepool_unmap(pt->ring);
+        free(pt);
+        return NULL;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pretrig_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    return pt;
+}
+
+void pretrig_destroy(struct pretrig *pt)
+{
+    if (!pt)
+        return;
+
+    pthread_mutex_lock(&pt->lock);
+    pt->quit = 1;
+    pthread_cond_broadcast(&pt->cond);
+    pthread_mutex_unlock(&pt->lock);
+    pthread_join(pt->thread, NULL);
+    signal(SIGUSR1, SIG_DFL);
+
+    if (pt->ctl_fd >= 0) {
+        close(pt->ctl_fd);
+        unlink(pt->ctl_path);
+    }
+    pthread_cond_destroy(&pt->cond);
+    pthread_mutex_destroy(&pt->lock);
+    framepool_unmap(pt->ring);
+    free(pt);
+}
+
+int32_t pretrig_push(struct pretrig *pt, const unsigned char *data, size_t size,
+        const struct timeval *timestamp, uint32_t sequence, uint32_t flags)
+{
+    struct pretrig_rec *rec;
+    uint64_t len, left, pos;
+    int64_t capture_us;
+
+    if (!pt)
+        return -1;
+
+    if (pretrig_signalled) {
+        pretrig_signalled = 0;
+        pt->triggered = 1;
+    }
+    if (pt->ctl_fd >= 0)
+        pretrig_ctl_poll(pt);
+    capture_us = timestamp ? (int64_t)timestamp->tv_sec * 1000000 + timestamp->tv_usec : 0;
+    len = pretrig_rec_len(size);
+    pos = 0;
+
+    pthread_mutex_lock(&pt->lock);
+    pt->frames++;
+    /* history older than the pre-trigger window */
+    while (!pt->recording && (pt->tail < pt->head)) {
+        uint64_t oldest = pt->tail;
+
+        if (pretrig_rec_at(pt, &oldest)->capture_us >= capture_us - pt->pre_us)
+            break;
+        if (!pretrig_evict(pt))
+            break;
+    }
+    if (len + sizeof(*rec) <= pt->cap) {
+        left = pt->cap - pt->head % pt->cap;
+        pos = pt->head + (left < len ? left : 0);
+        /* bounded by bytes: room comes from the oldest frames */
+        while ((pos + len - pt->tail > pt->cap) && pretrig_evict(pt))
+            ;
+    }
+    if ((len + sizeof(*rec) > pt->cap) || (pos + len - pt->tail > pt->cap)) {
+        /* the writer has not caught up with the event */
+        pt->dropped++;
+        pthread_mutex_unlock(&pt->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&pt->lock);
+
+    /* [head, pos + len) is free and out of the writer's reach */
+    if ((pos != pt->head) && (pt->cap - pt->head % pt->cap >= sizeof(*rec)))
+        ((struct pretrig_rec *)(pt->ring + pt->head % pt->cap))->size = PRETRIG_REC_FILLER;
+    rec = (struct pretrig_rec *)(pt->ring + pos % pt->cap);
+    rec->size = size;
+    rec->flags = flags;
+    rec->sequence = sequence;
+    rec->state = 0;
+    rec->capture_us = capture_us;
+    memcpy(rec + 1, data, size);
+
+    pthread_mutex_lock(&pt->lock);
+    pt->head = pos + len;
+    if (pt->triggered) {
+        pt->triggered = 0;
+        if (!pt->recording) {
+            pt->events++;
+            pretrig_mark_stale(pt, capture_us);
+        }
+        pt->recording = 1;
+        pt->until_us = capture_us + pt->post_us;
+    } else if (pt->recording && (capture_us > pt->until_us)) {
+        pt->recording = 0;
+    }
+    if (pt->recording) {
+        /* the history and this frame go out */
+        pt->queued = pt->head;
+        pthread_cond_broadcast(&pt->cond);
+    }
+    if (pt->head - pt->tail > pt->max_used)
+        pt->max_used = pt->head - pt->tail;
+    if (pt->queued - pt->written > pt->max_queued)
+        pt->max_queued = pt->queued - pt->written;
+    pthread_mutex_unlock(&pt->lock);
+    return 0;
+}
+
+void pretrig_flush(struct pretrig *pt)
+{
+    if (!pt)
+        return;
+
+    pthread_mutex_lock(&pt->lock);
+    while (pt->written != pt->queued)
+        pthread_cond_wait(&pt->cond, &pt->lock);
+    pthread_mutex_unlock(&pt->lock);
+}
+
+void pretrig_trigger(struct pretrig *pt)
+{
+    pretrig_signalled = 1;
+}
+
+static int32_t pretrig_parse_ms(const char *arg, char **end, int32_t *ms)
+{
+    double sec = strtod(arg, end);
+
+    if ((*end == arg) || (sec < 0) || (sec > 86400))
+        return -1;
+    *ms = (int32_t)(sec * 1000);
+    return 0;
+}
+
+int32_t pretrig_parse(const char *arg, int32_t *pre_ms, int32_t *post_ms,
+        uint64_t *bytes)
+{
+    char *end = (char *)arg;
+    unsigned long long value;
+
+    *pre_ms = PRETRIG_DEFAULT_MS;
+    *bytes = PRETRIG_DEFAULT_BYTES;
+    if (*end && (*end != ':') && (*end != ',') &&
+        (pretrig_parse_ms(arg, &end, pre_ms) < 0))
+        return -1;
+    *post_ms = *pre_ms;
+    if ((*end == ':') && (pretrig_parse_ms(end + 1, &end, post_ms) < 0))
+        return -1;
+    if (*end == ',') {
+        arg = end + 1;
+        value = strtoull(arg, &end, 10);
+        if (end == arg)
+            return -1;
+        switch (*end) {
+        case 'k':
+        case 'K':
+            value *= 1000;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            value *= 1000000;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            value *= 1000000000;
+            end++;
+            break;
+        default:
+            break;
+        }
+        *bytes = value;
+    }
+    if (*end)
+        return -1;
+    return 0;
+}
+
+void pretrig_print_stats(struct pretrig *pt)
+{
+    if (!pt)
+        return;
+
+    pthread_mutex_lock(&pt->lock);
+    fprintf(stderr, "Pre-trigger ring (%llu bytes, %.1f s + %.1f s): %llu frames, %llu events, "
+            "%llu frames / %llu bytes written, %llu dropped, peak %llu bytes held, "
+            "%llu bytes queued\n",
+            (unsigned long long)pt->cap, pt->pre_us / 1000000.0,
+            pt->post_us / 1000000.0, (unsigned long long)pt->frames,
+            (unsigned long long)pt->events, (unsigned long long)pt->flushed,
+            (unsigned long long)pt->flushed_bytes, (unsigned long long)pt->dropped,
+            (unsigned long long)pt->max_used, (unsigned long long)pt->max_queued);
+    pthread_mutex_unlock(&pt->lock);
+}
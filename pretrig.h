@@ -0,0 +1,76 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef __PRETRIG_H__
+#define __PRETRIG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Pre-trigger event capture. Compressed frames go into a byte-bounded
+ * ring holding at most the last pre_ms of capture. A trigger (SIGUSR1,
+ * pretrig_trigger() or "trigger" sent to the control socket) queues the
+ * ring plus every frame of the next post_ms to a writer thread, which
+ * hands them in capture order to the sink; a trigger during an event
+ * extends it. Capture never waits on the sink: frames that find the
+ * ring full of still unwritten data are dropped and counted.
+ */
+#define PRETRIG_DEFAULT_BYTES   (64ULL * 1000000)
+#define PRETRIG_DEFAULT_MS      (10 * 1000)
+#define PRETRIG_PATH_MAX        (108)   /* sun_path */
+
+struct pretrig_frame {
+    const unsigned char *data;
+    size_t size;
+    struct timeval timestamp;
+    uint32_t sequence;
+    uint32_t flags;
+};
+
+/* Called on the writer thread, data is only valid during the call. */
+typedef void (*pretrig_sink)(void *arg, const struct pretrig_frame *frame);
+
+struct pretrig;
+
+/* ctl_path may be NULL for SIGUSR1 only. Installs the SIGUSR1 handler. */
+struct pretrig *pretrig_create(uint64_t bytes, int32_t pre_ms, int32_t post_ms,
+        const char *ctl_path, pretrig_sink sink, void *arg);
+/* Writes whatever is still queued, then stops the writer thread. */
+void pretrig_destroy(struct pretrig *pt);
+
+/* Copy one frame into the ring, 0 if kept, 1 if dropped, -1 on error. */
+int32_t pretrig_push(struct pretrig *pt, const unsigned char *data, size_t size,
+        const struct timeval *timestamp, uint32_t sequence, uint32_t flags);
+
+/* Wait until every queued frame went to the sink. */
+void pretrig_flush(struct pretrig *pt);
+
+/* Start (or extend) an event at the next pushed frame. */
+void pretrig_trigger(struct pretrig *pt);
+
+/* Parse the -p argument "[pre s][:post s][,bytes[k|M|G]]". */
+int32_t pretrig_parse(const char *arg, int32_t *pre_ms, int32_t *post_ms,
+        uint64_t *bytes);
+
+void pretrig_print_stats(struct pretrig *pt);
+
+#endif
@@ -0,0 +1,262 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "qoi.h"
+
+#define QOI_OP_INDEX    (0x00)  /* 00xxxxxx */
+#define QOI_OP_DIFF     (0x40)  /* 01xxxxxx */
+#define QOI_OP_LUMA     (0x80)  /* 10xxxxxx */
+#define QOI_OP_RUN      (0xc0)  /* 11xxxxxx */
+#define QOI_OP_RGB      (0xfe)
+#define QOI_OP_RGBA     (0xff)
+#define QOI_MASK_2      (0xc0)
+
+#define QOI_HASH(r, g, b, a)    (((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) & 63)
+
+static const unsigned char qoi_padding[QOI_PADDING_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+struct qoienc {
+    int32_t width;
+    int32_t height;
+    unsigned char *rgb;         /* converted frame */
+    unsigned char *out;         /* worst case sized */
+    size_t out_size;
+};
+
+static void qoi_write32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t qoi_read32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+struct qoienc *qoienc_create(int32_t width, int32_t height)
+{
+    struct qoienc *enc;
+    size_t pixels = (size_t)width * height;
+
+    if (width <= 0 || height <= 0 || (width & 1))
+        return NULL;
+
+    enc = (struct qoienc *)calloc(1, sizeof(struct qoienc));
+    if (!enc)
+        return NULL;
+
+    enc->width = width;
+    enc->height = height;
+    /* QOI_OP_RGB for every pixel is the worst case */
+    enc->out_size = QOI_HEADER_SIZE + pixels * 4 + QOI_PADDING_SIZE;
+    enc->rgb = (unsigned char *)malloc(pixels * 3);
+    enc->out = (unsigned char *)malloc(enc->out_size);
+    if (!enc->rgb || !enc->out) {
+        qoienc_destroy(enc);
+        return NULL;
+    }
+
+    return enc;
+}
+
+void qoienc_destroy(struct qoienc *enc)
+{
+    if (!enc)
+        return;
+
+    free(enc->rgb);
+    free(enc->out);
+    free(enc);
+}
+
+int32_t qoienc_encode_rgb(struct qoienc *enc, const unsigned char *rgb,
+        unsigned char **out, size_t *size)
+{
+    uint32_t index[64];
+    const unsigned char *px = rgb, *end;
+    unsigned char *p;
+    unsigned char pr = 0, pg = 0, pb = 0;
+    int32_t run = 0;
+
+    if (!enc || !rgb)
+        return -1;
+
+    p = enc->out;
+    memcpy(p, "qoif", 4);
+    qoi_write32(p + 4, enc->width);
+    qoi_write32(p + 8, enc->height);
+    p[12] = 3;                  /* channels */
+    p[13] = 0;                  /* sRGB with linear alpha */
+    p += QOI_HEADER_SIZE;
+
+    /* entries hold r | g << 8 | b << 16 | a << 24, a is always 255 here so
+       the zeroed start state never matches, as in the reference encoder */
+    memset(index, 0, sizeof(index));
+    end = rgb + (size_t)enc->width * enc->height * 3;
+    for (; px < end; px += 3) {
+        unsigned char r = px[0], g = px[1], b = px[2];
+        uint32_t v = r | g << 8 | b << 16 | 0xff000000u;
+        int32_t hash;
+
+        if (r == pr && g == pg && b == pb) {
+            if (++run == 62) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            *p++ = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        hash = QOI_HASH(r, g, b, 255);
+        if (index[hash] == v) {
+            *p++ = QOI_OP_INDEX | hash;
+        } else {
+            signed char vr = r - pr, vg = g - pg, vb = b - pb;
+            signed char vg_r = vr - vg, vg_b = vb - vg;
+
+            index[hash] = v;
+            if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                *p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+            } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                       vg_b > -9 && vg_b < 8) {
+                *p++ = QOI_OP_LUMA | (vg + 32);
+                *p++ = (vg_r + 8) << 4 | (vg_b + 8);
+            } else {
+                p[0] = QOI_OP_RGB;
+                p[1] = r;
+                p[2] = g;
+                p[3] = b;
+                p += 4;
+            }
+        }
+        pr = r;
+        pg = g;
+        pb = b;
+    }
+    if (run)
+        *p++ = QOI_OP_RUN | (run - 1);
+
+    memcpy(p, qoi_padding, QOI_PADDING_SIZE);
+    p += QOI_PADDING_SIZE;
+
+    *out = enc->out;
+    *size = p - enc->out;
+    return 0;
+}
+
+int32_t qoienc_encode_yuyv(struct qoienc *enc, unsigned char *yuyv,
+        unsigned char **out, size_t *size)
+{
+    if (!enc || !yuyv)
+        return -1;
+
+    /* the conversion runs over the default pool, the QOI pass is serial */
+    utils_yuv422p_to_rgb24(yuyv, enc->rgb, enc->width, enc->height);
+    return qoienc_encode_rgb(enc, enc->rgb, out, size);
+}
+
+unsigned char *qoi_decode(const unsigned char *data, size_t size,
+        int32_t *width, int32_t *height)
+{
+    unsigned char index[64][4];
+    unsigned char *rgb, *px, *end;
+    const unsigned char *p, *chunks_end;
+    unsigned char r = 0, g = 0, b = 0, a = 255;
+    uint32_t w, h;
+    int32_t run = 0;
+
+    if (!data || size < QOI_HEADER_SIZE + QOI_PADDING_SIZE || memcmp(data, "qoif", 4))
+        return NULL;
+    w = qoi_read32(data + 4);
+    h = qoi_read32(data + 8);
+    if (!w || !h || w > 32768 || h > 32768 || (data[12] != 3 && data[12] != 4)) {
+        fprintf(stderr, "Unsupported QOI image %ux%u, %d channels\n", w, h, data[12]);
+        return NULL;
+    }
+
+    rgb = (unsigned char *)malloc((size_t)w * h * 3);
+    if (!rgb)
+        return NULL;
+
+    memset(index, 0, sizeof(index));
+    p = data + QOI_HEADER_SIZE;
+    chunks_end = data + size - QOI_PADDING_SIZE;
+    end = rgb + (size_t)w * h * 3;
+    for (px = rgb; px < end; px += 3) {
+        if (run > 0) {
+            run--;
+        } else if (p < chunks_end) {
+            int32_t b1 = *p++;
+
+            if (QOI_OP_RGB == b1) {
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                p += 3;
+            } else if (QOI_OP_RGBA == b1) {
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                a = p[3];
+                p += 4;
+            } else if (QOI_OP_INDEX == (b1 & QOI_MASK_2)) {
+                r = index[b1][0];
+                g = index[b1][1];
+                b = index[b1][2];
+                a = index[b1][3];
+            } else if (QOI_OP_DIFF == (b1 & QOI_MASK_2)) {
+                r += ((b1 >> 4) & 3) - 2;
+                g += ((b1 >> 2) & 3) - 2;
+                b += (b1 & 3) - 2;
+            } else if (QOI_OP_LUMA == (b1 & QOI_MASK_2)) {
+                int32_t b2 = *p++;
+                int32_t vg = (b1 & 0x3f) - 32;
+
+                r += vg - 8 + ((b2 >> 4) & 0x0f);
+                g += vg;
+                b += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+            index[QOI_HASH(r, g, b, a)][0] = r;
+            index[QOI_HASH(r, g, b, a)][1] = g;
+            index[QOI_HASH(r, g, b, a)][2] = b;
+            index[QOI_HASH(r, g, b, a)][3] = a;
+        }
+        px[0] = r;
+        px[1] = g;
+        px[2] = b;
+    }
+
+    *width = w;
+    *height = h;
+    return rgb;
+}
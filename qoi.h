@@ -0,0 +1,51 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __QOI_H__
+#define __QOI_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Lossless frame output in the QOI format (https://qoiformat.org): RGB,
+ * 3 channels, sRGB. The YUYV frame is converted with the same tables as
+ * the BMP/PNM outputs, so a decoded file is bit exact with those, at a
+ * fraction of the size. The encoder keeps its RGB and output buffers
+ * between frames.
+ */
+#define QOI_HEADER_SIZE         (14)
+#define QOI_PADDING_SIZE        (8)
+
+struct qoienc;
+
+struct qoienc *qoienc_create(int32_t width, int32_t height);
+void qoienc_destroy(struct qoienc *enc);
+
+/* *out points into the encoder and stays valid until the next call. */
+int32_t qoienc_encode_yuyv(struct qoienc *enc, unsigned char *yuyv,
+        unsigned char **out, size_t *size);
+int32_t qoienc_encode_rgb(struct qoienc *enc, const unsigned char *rgb,
+        unsigned char **out, size_t *size);
+
+/* Decode a QOI image to packed RGB, the caller frees the result. */
+unsigned char *qoi_decode(const unsigned char *data, size_t size,
+        int32_t *width, int32_t *height);
+
+#endif
@@ -0,0 +1,151 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ratectl.h"
+
+/* weight of the newest frame in the moving averages */
+#define RATECTL_ALPHA           (0.25)
+
+static int64_t ratectl_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double ratectl_avg(double avg, double value, uint32_t frames)
+{
+    if (frames <= 1)
+        return value;
+    return avg + RATECTL_ALPHA * (value - avg);
+}
+
+void ratectl_init(struct ratectl *rc, int32_t mode, int64_t target,
+        int32_t quality, int32_t q_min, int32_t hold_frames)
+{
+    memset(rc, 0, sizeof(struct ratectl));
+    rc->mode = target > 0 ? mode : RATECTL_MODE_NONE;
+    rc->target = target;
+    rc->q_max = quality;
+    rc->q_min = q_min < quality ? q_min : quality;
+    rc->quality = quality;
+    rc->hold_frames = hold_frames > 0 ? hold_frames : 0;
+}
+
+int32_t ratectl_update(struct ratectl *rc, size_t bytes, int64_t encode_us)
+{
+    int64_t now = ratectl_now_us();
+    double measured, ratio;
+    int32_t step = 0;
+
+    rc->frames++;
+    rc->avg_bytes = ratectl_avg(rc->avg_bytes, (double)bytes, rc->frames);
+    rc->avg_encode_us = ratectl_avg(rc->avg_encode_us, (double)encode_us, rc->frames);
+    if (rc->last_us)
+        rc->avg_interval_us = ratectl_avg(rc->avg_interval_us,
+                (double)(now - rc->last_us), rc->frames - 1);
+    rc->last_us = now;
+
+    if (RATECTL_MODE_NONE == rc->mode)
+        return rc->quality;
+    if (rc->hold > 0) {
+        rc->hold--;
+        return rc->quality;
+    }
+
+    switch (rc->mode) {
+    case RATECTL_MODE_BYTES:
+        /* the frame rate is only known after two frames */
+        if (rc->avg_interval_us <= 0)
+            return rc->quality;
+        measured = rc->avg_bytes * 1000000.0 / rc->avg_interval_us;
+        break;
+    case RATECTL_MODE_TIME:
+        measured = rc->avg_encode_us;
+        break;
+    default:
+        return rc->quality;
+    }
+
+    ratio = measured / (double)rc->target;
+    if (ratio > 1.0 + RATECTL_DEADBAND_PCT / 100.0)
+        step = ratio > 1.5 ? -5 : (ratio > 1.25 ? -2 : -1);
+    else if (ratio < 1.0 - RATECTL_DEADBAND_PCT / 100.0)
+        step = ratio < 0.5 ? 3 : 1;
+
+    if (step) {
+        int32_t quality = rc->quality + step;
+
+        if (quality < rc->q_min)
+            quality = rc->q_min;
+        if (quality > rc->q_max)
+            quality = rc->q_max;
+        if (quality != rc->quality) {
+            rc->quality = quality;
+            rc->hold = rc->hold_frames;
+        }
+    }
+
+    return rc->quality;
+}
+
+int32_t ratectl_parse(const char *arg, int32_t *mode, int64_t *target)
+{
+    char *end = NULL;
+    long long value;
+
+    switch (arg[0]) {
+    case 'b':
+        *mode = RATECTL_MODE_BYTES;
+        break;
+    case 't':
+        *mode = RATECTL_MODE_TIME;
+        break;
+    default:
+        return -1;
+    }
+
+    value = strtoll(arg + 1, &end, 10);
+    if (value <= 0 || end == arg + 1)
+        return -1;
+    switch (*end) {
+    case 'k':
+    case 'K':
+        value *= 1000;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1000000;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end)
+        return -1;
+    *target = value;
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __RATECTL_H__
+#define __RATECTL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * JPEG quality controller. Tracks the compressed size (or encode time) of
+ * the previous frames and moves the encoder quality one frame at a time to
+ * hold a byte rate or an encode time budget. A dead band and a hold period
+ * after every change keep it from oscillating.
+ */
+
+#define RATECTL_MODE_NONE       (0)
+#define RATECTL_MODE_BYTES      (1)     /* target bytes per second */
+#define RATECTL_MODE_TIME       (2)     /* target encode us per frame */
+
+#define RATECTL_Q_MIN           (20)
+#define RATECTL_DEADBAND_PCT    (10)
+
+struct ratectl {
+    int32_t mode;
+    int64_t target;
+    int32_t q_min;
+    int32_t q_max;
+    int32_t quality;
+    int32_t hold_frames;        /* frames to wait for a change to show up, 0 inline */
+    int32_t hold;
+
+    double avg_bytes;           /* moving averages per frame */
+    double avg_encode_us;
+    double avg_interval_us;
+    int64_t last_us;
+    uint32_t frames;
+};
+
+void ratectl_init(struct ratectl *rc, int32_t mode, int64_t target,
+        int32_t quality, int32_t q_min, int32_t hold_frames);
+
+/*
+ * Feed the result of one encoded frame, returns the quality to use for the
+ * next frame.
+ */
+int32_t ratectl_update(struct ratectl *rc, size_t bytes, int64_t encode_us);
+
+/* Parse "b<bytes/s>" or "t<us/frame>", returns -1 on bad input. */
+int32_t ratectl_parse(const char *arg, int32_t *mode, int64_t *target);
+
+#endif
@@ -0,0 +1,229 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "rawout.h"
+#include "dwrite.h"
+#include "pipeout.h"
+
+#define RAWOUT_FRAME_TAG        "FRAME\n"
+#define RAWOUT_PREALLOC_STEP    (256ULL * 1024 * 1024)
+
+struct rawout {
+    struct dwrite *dw;
+    struct pipeout *pipe;       /* "-": stdout */
+    int32_t format;
+    int32_t width;
+    int32_t height;
+    size_t frame_size;          /* packed YUYV bytes */
+    unsigned char *planes;      /* Y4M: Y, then Cb, then Cr */
+
+    /* statistics */
+    uint64_t frames;
+    uint64_t bytes;
+    int64_t write_us;
+    int32_t failed;
+};
+
+static int64_t rawout_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct rawout *rawout_create(const char *path, int32_t format, int32_t width,
+        int32_t height, uint32_t fps_num, uint32_t fps_den)
+{
+    struct rawout *out;
+    char header[128];
+    struct iovec iov;
+
+    if ((RAWOUT_FMT_YUYV != format && RAWOUT_FMT_Y4M != format) ||
+        width <= 0 || height <= 0 || (width & 1))
+        return NULL;
+
+    out = (struct rawout *)calloc(1, sizeof(struct rawout));
+    if (!out)
+        return NULL;
+
+    out->format = format;
+    out->width = width;
+    out->height = height;
+    out->frame_size = (size_t)width * height * 2;
+
+    if ((RAWOUT_FMT_Y4M == format) && strcmp(path, "-")) {
+        out->planes = (unsigned char *)malloc(out->frame_size);
+        if (!out->planes) {
+            free(out);
+            return NULL;
+        }
+    }
+
+    if (!strcmp(path, "-"))
+        out->pipe = pipeout_create(STDOUT_FILENO, PIPEOUT_DEFAULT_SLOTS,
+                                   out->frame_size + sizeof(RAWOUT_FRAME_TAG) - 1);
+    else
+        out->dw = dwrite_open(path, 0, RAWOUT_PREALLOC_STEP);
+    if (!out->dw && !out->pipe) {
+        free(out->planes);
+        free(out);
+        return NULL;
+    }
+
+    if (RAWOUT_FMT_Y4M == format) {
+        if (!fps_num || !fps_den) {
+            fps_num = 30;
+            fps_den = 1;
+        }
+        iov.iov_base = header;
+        iov.iov_len = snprintf(header, sizeof(header),
+                               "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C422\n",
+                               width, height, fps_num, fps_den);
+        if ((out->pipe ? pipeout_writev(out->pipe, &iov, 1) :
+             dwrite_writev(out->dw, &iov, 1)) < 0) {
+            fprintf(stderr, "Unable to write Y4M header to %s\n", path);
+            rawout_destroy(out);
+            return NULL;
+        }
+        out->bytes += iov.iov_len;
+    }
+
+    return out;
+}
+
+void rawout_destroy(struct rawout *out)
+{
+    if (!out)
+        return;
+
+    pipeout_destroy(out->pipe);
+    dwrite_close(out->dw);
+    free(out->planes);
+    free(out);
+}
+
+void rawout_set_blocking(struct rawout *out, int32_t blocking)
+{
+    if (out)
+        pipeout_set_blocking(out->pipe, blocking);
+}
+
+/* packed Y0 Cb Y1 Cr to planar 4:2:2 */
+static void rawout_split_planes(struct rawout *out, unsigned char *y,
+        const unsigned char *yuyv)
+{
+    size_t pixels = (size_t)out->width * out->height, i;
+    unsigned char *cb = y + pixels;
+    unsigned char *cr = cb + pixels / 2;
+
+    for (i = 0; i < pixels / 2; i++) {
+        y[2 * i] = yuyv[4 * i];
+        cb[i] = yuyv[4 * i + 1];
+        y[2 * i + 1] = yuyv[4 * i + 2];
+        cr[i] = yuyv[4 * i + 3];
+    }
+}
+
+int32_t rawout_write_frame(struct rawout *out, const unsigned char *yuyv)
+{
+    struct iovec iov[2];
+    int32_t iovcnt = 0;
+    int64_t start;
+
+    if (!out || !yuyv || out->failed)
+        return -1;
+
+    start = rawout_now_us();
+    if (out->pipe) {
+        unsigned char *buf;
+        int32_t ret;
+
+        if (RAWOUT_FMT_Y4M == out->format) {
+            /* planes are split straight into the pipe slot */
+            ret = pipeout_begin(out->pipe, out->frame_size + sizeof(RAWOUT_FRAME_TAG) - 1, &buf);
+            if (!ret) {
+                memcpy(buf, RAWOUT_FRAME_TAG, sizeof(RAWOUT_FRAME_TAG) - 1);
+                rawout_split_planes(out, buf + sizeof(RAWOUT_FRAME_TAG) - 1, yuyv);
+                ret = pipeout_commit(out->pipe);
+            }
+        } else {
+            iov[0].iov_base = (void *)yuyv;
+            iov[0].iov_len = out->frame_size;
+            ret = pipeout_writev(out->pipe, iov, 1);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Raw video output failed (%s)\n", strerror(errno));
+            out->failed = 1;
+            return -1;
+        }
+        out->write_us += rawout_now_us() - start;
+        if (ret)
+            return 0;   /* dropped, the reader is behind */
+        out->frames++;
+        out->bytes += out->frame_size +
+            (RAWOUT_FMT_Y4M == out->format ? sizeof(RAWOUT_FRAME_TAG) - 1 : 0);
+        return 0;
+    }
+
+    if (RAWOUT_FMT_Y4M == out->format) {
+        rawout_split_planes(out, out->planes, yuyv);
+        iov[iovcnt].iov_base = RAWOUT_FRAME_TAG;
+        iov[iovcnt++].iov_len = sizeof(RAWOUT_FRAME_TAG) - 1;
+        iov[iovcnt].iov_base = out->planes;
+    } else {
+        iov[iovcnt].iov_base = (void *)yuyv;
+    }
+    iov[iovcnt++].iov_len = out->frame_size;
+
+    if (dwrite_writev(out->dw, iov, iovcnt) < 0 || dwrite_frame_end(out->dw) < 0) {
+        fprintf(stderr, "Raw video output failed (%s)\n", strerror(errno));
+        out->failed = 1;
+        return -1;
+    }
+    out->write_us += rawout_now_us() - start;
+    out->frames++;
+    out->bytes += out->frame_size +
+        (RAWOUT_FMT_Y4M == out->format ? sizeof(RAWOUT_FRAME_TAG) - 1 : 0);
+
+    return 0;
+}
+
+void rawout_print_stats(struct rawout *out)
+{
+    uint64_t frames;
+
+    if (!out)
+        return;
+
+    frames = out->frames ? out->frames : 1;
+    fprintf(stderr, "Raw %s output: %llu frames, %llu bytes, write %lld us/frame\n",
+            RAWOUT_FMT_Y4M == out->format ? "Y4M" : "YUYV",
+            (unsigned long long)out->frames, (unsigned long long)out->bytes,
+            (long long)(out->write_us / frames));
+    pipeout_print_stats(out->pipe);
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __RAWOUT_H__
+#define __RAWOUT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Uncompressed video stream output. RAWOUT_FMT_YUYV appends the packed
+ * YUYV frames back to back (ffmpeg -f rawvideo -pix_fmt yuyv422), and
+ * RAWOUT_FMT_Y4M writes a YUV4MPEG2 C422 stream whose planes are split out
+ * of the packed frame into a buffer allocated once. A path of "-" streams
+ * to stdout through a pipeout (see pipeout.h): frames the reader is not
+ * ready for are dropped rather than stalling the capture.
+ */
+#define RAWOUT_FMT_YUYV         (0)
+#define RAWOUT_FMT_Y4M          (1)
+
+struct rawout;
+
+struct rawout *rawout_create(const char *path, int32_t format, int32_t width,
+        int32_t height, uint32_t fps_num, uint32_t fps_den);
+void rawout_destroy(struct rawout *out);
+
+/* Stdout only: wait for the reader instead of dropping frames. */
+void rawout_set_blocking(struct rawout *out, int32_t blocking);
+
+/* Write one packed YUYV frame, -1 once the output is gone (e.g. EPIPE). */
+int32_t rawout_write_frame(struct rawout *out, const unsigned char *yuyv);
+
+void rawout_print_stats(struct rawout *out);
+
+#endif
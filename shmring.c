@@ -0,0 +1,336 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/videodev2.h>
+
+#include "shmring.h"
+
+#define SHMRING_PAGE            (4096)
+
+struct shmring {
+    int fd;
+    int32_t writer;
+    unsigned char *base;
+    size_t len;
+    struct shmring_header *hdr;
+    char name[SHMRING_NAME_MAX];
+    struct shmring_slot *claimed;
+    uint64_t gen;
+    /* stats */
+    uint64_t bytes;
+    uint64_t planes;
+};
+
+static size_t shmring_round(size_t size)
+{
+    return (size + SHMRING_PAGE - 1) & ~(size_t)(SHMRING_PAGE - 1);
+}
+
+static struct shmring_slot *shmring_slot(struct shmring *sr, uint64_t gen)
+{
+    return (struct shmring_slot *)(sr->base + sr->hdr->header_size +
+            (size_t)((gen - 1) % sr->hdr->nslots) * sr->hdr->slot_bytes);
+}
+
+/* shm_open() wants one leading slash */
+static void shmring_name(char *dst, const char *name)
+{
+    snprintf(dst, SHMRING_NAME_MAX, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+struct shmring *shmring_create(const char *name, int32_t slots, int32_t width,
+        int32_t height, size_t jpeg_max, int32_t plane)
+{
+    struct shmring *sr;
+    size_t plane_max = plane ? (size_t)width * (height + 8) * 2 : 0;
+    size_t slot_bytes;
+
+    if (!name || !*name || (strlen(name) + 2 > SHMRING_NAME_MAX))
+        return NULL;
+    if ((slots < 2) || (slots > SHMRING_MAX_SLOTS) || (width <= 0) || (height <= 0))
+        return NULL;
+    slot_bytes = shmring_round(sizeof(struct shmring_slot) + jpeg_max + plane_max);
+    if (slot_bytes > UINT32_MAX)
+        return NULL;
+    sr = calloc(1, sizeof(*sr));
+    if (!sr)
+        return NULL;
+    sr->writer = 1;
+    shmring_name(sr->name, name);
+    sr->len = SHMRING_PAGE + slot_bytes * slots;
+
+    sr->fd = shm_open(sr->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sr->fd < 0) {
+        fprintf(stderr, "shmring: unable to create %s (%d)\n", sr->name, errno);
+        free(sr);
+        return NULL;
+    }
+    if (ftruncate(sr->fd, sr->len) < 0) {
+        fprintf(stderr, "shmring: unable to size %s to %zu bytes (%d)\n",
+                sr->name, sr->len, errno);
+        goto fail;
+    }
+    sr->base = mmap(NULL, sr->len, PROT_READ | PROT_WRITE, MAP_SHARED, sr->fd, 0);
+    if (MAP_FAILED == sr->base) {
+        sr->base = NULL;
+        fprintf(stderr, "shmring: unable to map %s (%d)\n", sr->name, errno);
+        goto fail;
+    }
+    sr->hdr = (struct shmring_header *)sr->base;
+    sr->hdr->header_size = SHMRING_PAGE;
+    sr->hdr->slot_bytes = slot_bytes;
+    sr->hdr->nslots = slots;
+    sr->hdr->jpeg_max = jpeg_max;
+    sr->hdr->plane_max = plane_max;
+    sr->hdr->width = width;
+    sr->hdr->height = height;
+    sr->hdr->plane_format = V4L2_PIX_FMT_YUYV;
+    sr->hdr->writer_pid = getpid();
+    /* readers check the magic last */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(sr->hdr->magic, SHMRING_MAGIC, sizeof(sr->hdr->magic));
+    return sr;
+
+fail:
+    close(sr->fd);
+    shm_unlink(sr->name);
+    free(sr);
+    return NULL;
+}
+
+struct shmring *shmring_open(const char *name)
+{
+    struct shmring *sr;
+    struct stat st;
+
+    if (!name || !*name || (strlen(name) + 2 > SHMRING_NAME_MAX))
+        return NULL;
+    sr = calloc(1, sizeof(*sr));
+    if (!sr)
+        return NULL;
+    shmring_name(sr->name, name);
+    sr->fd = shm_open(sr->name, O_RDONLY, 0);
+    if (sr->fd < 0)
+        goto fail;
+    if ((fstat(sr->fd, &st) < 0) || (st.st_size < SHMRING_PAGE))
+        goto fail;
+    sr->len = st.st_size;
+    sr->base = mmap(NULL, sr->len, PROT_READ, MAP_SHARED, sr->fd, 0);
+    if (MAP_FAILED == sr->base) {
+        sr->base = NULL;
+        goto fail;
+    }
+    sr->hdr = (struct shmring_header *)sr->base;
+    if (memcmp(sr->hdr->magic, SHMRING_MAGIC, sizeof(sr->hdr->magic)) ||
+        (sr->hdr->nslots < 1) ||
+        ((size_t)sr->hdr->header_size + (size_t)sr->hdr->slot_bytes * sr->hdr->nslots > sr->len))
+        goto fail;
+    return sr;
+
+fail:
+    if (sr->base)
+        munmap(sr->base, sr->len);
+    if (sr->fd >= 0)
+        close(sr->fd);
+    free(sr);
+    return NULL;
+}
+
+void shmring_destroy(struct shmring *sr)
+{
+    if (!sr)
+        return;
+
+    munmap(sr->base, sr->len);
+    close(sr->fd);
+    /* readers keep their mapping, new ones find nothing */
+    if (sr->writer)
+        shm_unlink(sr->name);
+    free(sr);
+}
+
+int32_t shmring_begin(struct shmring *sr, unsigned char **jpeg, unsigned char **plane)
+{
+    struct shmring_slot *slot;
+
+    if (!sr || !sr->writer)
+        return -1;
+
+    slot = shmring_slot(sr, sr->gen + 1);
+    /* odd: readers of the frame this slot held now fail validation */
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    sr->claimed = slot;
+    *jpeg = (unsigned char *)(slot + 1);
+    *plane = sr->hdr->plane_max ? *jpeg + sr->hdr->jpeg_max : NULL;
+    return 0;
+}
+
+int32_t shmring_commit(struct shmring *sr, size_t jpeg_size, size_t plane_size,
+        const struct timeval *timestamp, uint32_t sequence, uint32_t flags)
+{
+    struct shmring_slot *slot;
+
+    if (!sr || !sr->claimed)
+        return -1;
+
+    slot = sr->claimed;
+    sr->claimed = NULL;
+    sr->gen++;
+    slot->gen = sr->gen;
+    slot->sequence = sequence;
+    slot->capture_us = timestamp ?
+        (int64_t)timestamp->tv_sec * 1000000 + timestamp->tv_usec : 0;
+    slot->jpeg_size = jpeg_size <= sr->hdr->jpeg_max ? jpeg_size : 0;
+    slot->plane_size = plane_size <= sr->hdr->plane_max ? plane_size : 0;
+    slot->flags = flags;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&sr->hdr->latest, sr->gen, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&sr->hdr->notify, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &sr->hdr->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    sr->bytes += slot->jpeg_size + slot->plane_size;
+    sr->planes += slot->plane_size > 0;
+    return 0;
+}
+
+size_t shmring_jpeg_max(struct shmring *sr)
+{
+    return sr ? sr->hdr->jpeg_max : 0;
+}
+
+const struct shmring_header *shmring_info(struct shmring *sr)
+{
+    return sr ? sr->hdr : NULL;
+}
+
+int32_t shmring_wait(struct shmring *sr, uint64_t gen, int32_t timeout_ms)
+{
+    struct timespec ts;
+    uint32_t notify;
+
+    if (!sr)
+        return -1;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    for (;;) {
+        /* notify first: a frame published after this load wakes the wait */
+        notify = __atomic_load_n(&sr->hdr->notify, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sr->hdr->latest, __ATOMIC_ACQUIRE) > gen)
+            return 0;
+        if ((syscall(SYS_futex, &sr->hdr->notify, FUTEX_WAIT, notify,
+                     timeout_ms >= 0 ? &ts : NULL, NULL, 0) < 0) && (errno == ETIMEDOUT))
+            return __atomic_load_n(&sr->hdr->latest, __ATOMIC_ACQUIRE) > gen ? 0 : 1;
+    }
+}
+
+int32_t shmring_latest(struct shmring *sr, struct shmring_frame *frame)
+{
+    const struct shmring_slot *slot;
+    const unsigned char *data;
+    uint64_t gen;
+
+    if (!sr || !frame)
+        return -1;
+
+    gen = __atomic_load_n(&sr->hdr->latest, __ATOMIC_ACQUIRE);
+    if (!gen)
+        return 1;
+    slot = shmring_slot(sr, gen);
+    frame->seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (frame->seq & 1)
+        return -1;
+    data = (const unsigned char *)(slot + 1);
+    frame->slot = slot;
+    frame->gen = slot->gen;
+    frame->jpeg = data;
+    frame->jpeg_size = slot->jpeg_size;
+    frame->plane = data + sr->hdr->jpeg_max;
+    frame->plane_size = slot->plane_size;
+    frame->timestamp.tv_sec = slot->capture_us / 1000000;
+    frame->timestamp.tv_usec = slot->capture_us % 1000000;
+    frame->sequence = slot->sequence;
+    frame->flags = slot->flags;
+    if ((frame->gen != gen) || !shmring_valid(sr, frame))
+        return -1;
+    if (!frame->plane_size)
+        frame->plane = NULL;
+    return 0;
+}
+
+int32_t shmring_valid(struct shmring *sr, const struct shmring_frame *frame)
+{
+    if (!sr || !frame || !frame->slot)
+        return 0;
+    /* everything read from the slot before the counter is read again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->slot->seq, __ATOMIC_RELAXED) == frame->seq;
+}
+
+int32_t shmring_parse(const char *arg, char *name, int32_t *slots, int32_t *plane)
+{
+    const char *comma = strchr(arg, ',');
+    size_t len = comma ? (size_t)(comma - arg) : strlen(arg);
+    char *end;
+
+    *slots = SHMRING_DEFAULT_SLOTS;
+    *plane = 0;
+    if (!len || (len + 2 > SHMRING_NAME_MAX))
+        return -1;
+    memcpy(name, arg, len);
+    name[len] = '\0';
+    while (comma) {
+        arg = comma + 1;
+        comma = strchr(arg, ',');
+        if ((arg[0] == 'p') && ((arg[1] == ',') || !arg[1])) {
+            *plane = 1;
+            continue;
+        }
+        *slots = strtol(arg, &end, 10);
+        if ((end == arg) || ((*end != ',') && *end) ||
+            (*slots < 2) || (*slots > SHMRING_MAX_SLOTS))
+            return -1;
+    }
+    return 0;
+}
+
+void shmring_print_stats(struct shmring *sr)
+{
+    if (!sr)
+        return;
+
+    fprintf(stderr, "Shared memory /dev/shm%s (%u slots of %u bytes): %llu frames, "
+            "%llu with a plane, %llu bytes published\n", sr->name, sr->hdr->nslots,
+            sr->hdr->slot_bytes, (unsigned long long)sr->gen,
+            (unsigned long long)sr->planes, (unsigned long long)sr->bytes);
+}
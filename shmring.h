@@ -0,0 +1,117 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Latest-frame publisher in POSIX shared memory, for local consumers that
+ * would otherwise each need the camera. /dev/shm/<name> holds a header
+ * page and a ring of slots. Every slot carries the camera's compressed
+ * bytes (MJPEG input) and/or a YUYV plane (YUYV input, or decoded MJPEG
+ * when asked), written in place.
+ *
+ * Each slot is a seqlock: its counter is odd while the publisher writes.
+ * header->latest is the generation of the newest complete frame, and
+ * header->notify is a futex word bumped after every frame. Readers map the
+ * file read-only, use the frame where it lies, then check that the slot
+ * was not reused meanwhile. They have nslots - 1 frame periods to do so.
+ * Readers link shmring.c as well; host byte order.
+ */
+#define SHMRING_MAGIC           "CAMSHM01"
+#define SHMRING_DEFAULT_SLOTS   (4)
+#define SHMRING_MAX_SLOTS       (64)
+#define SHMRING_NAME_MAX        (64)
+
+#define SHMRING_FLAG_NO_DHT     (0x1)   /* camera MJPEG, Huffman tables implied */
+
+struct shmring_header {
+    char magic[8];
+    uint32_t header_size;       /* slot 0 starts here */
+    uint32_t slot_bytes;        /* slot stride */
+    uint32_t nslots;
+    uint32_t jpeg_max;
+    uint32_t plane_max;
+    uint32_t width;
+    uint32_t height;
+    uint32_t plane_format;      /* V4L2 fourcc of the plane, YUYV */
+    uint32_t notify;            /* futex word */
+    uint32_t writer_pid;
+    uint64_t latest;            /* newest complete generation, 0 before the first */
+};
+
+struct shmring_slot {
+    uint32_t seq;               /* seqlock */
+    uint32_t sequence;          /* V4L2 buffer sequence */
+    uint64_t gen;
+    int64_t capture_us;         /* V4L2 timestamp, CLOCK_MONOTONIC */
+    uint32_t jpeg_size;         /* bytes right after this header */
+    uint32_t plane_size;        /* bytes at jpeg_max after this header */
+    uint32_t flags;
+    uint8_t reserved[28];
+};
+
+/* A frame as seen by a reader, pointing into the mapping. */
+struct shmring_frame {
+    uint64_t gen;
+    const unsigned char *jpeg;
+    size_t jpeg_size;
+    const unsigned char *plane;
+    size_t plane_size;
+    struct timeval timestamp;
+    uint32_t sequence;
+    uint32_t flags;
+    const struct shmring_slot *slot;
+    uint32_t seq;
+};
+
+struct shmring;
+
+/* Publisher. plane reserves room for a width x height YUYV plane. */
+struct shmring *shmring_create(const char *name, int32_t slots, int32_t width,
+        int32_t height, size_t jpeg_max, int32_t plane);
+void shmring_destroy(struct shmring *sr);
+/* Claim the next slot, *plane is NULL when the ring has no planes. */
+int32_t shmring_begin(struct shmring *sr, unsigned char **jpeg, unsigned char **plane);
+/* Publish the claimed slot and wake waiting readers. */
+int32_t shmring_commit(struct shmring *sr, size_t jpeg_size, size_t plane_size,
+        const struct timeval *timestamp, uint32_t sequence, uint32_t flags);
+size_t shmring_jpeg_max(struct shmring *sr);
+
+/* Parse the -Z argument "<name>[,slots][,p]". */
+int32_t shmring_parse(const char *arg, char *name, int32_t *slots, int32_t *plane);
+void shmring_print_stats(struct shmring *sr);
+
+/* Reader. */
+struct shmring *shmring_open(const char *name);
+const struct shmring_header *shmring_info(struct shmring *sr);
+/* Wait for a generation newer than gen, 0 when there is one, 1 on timeout. */
+int32_t shmring_wait(struct shmring *sr, uint64_t gen, int32_t timeout_ms);
+/* The newest frame, 0 if found, 1 if nothing is published yet, -1 if it
+   was overwritten while being looked up (try again). */
+int32_t shmring_latest(struct shmring *sr, struct shmring_frame *frame);
+/* 1 while the frame's slot still holds it, call after using the data. */
+int32_t shmring_valid(struct shmring *sr, const struct shmring_frame *frame);
+
+#endif
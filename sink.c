@@ -0,0 +1,270 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framepool.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "sink.h"
+
+struct sink_node {
+    const char *name;
+    uint32_t needs;
+    sink_write_fn write;
+    void *arg;
+    /* statistics */
+    uint64_t frames;
+    uint64_t skipped;           /* nothing decoded to give it */
+    int64_t us;
+};
+
+struct sink_graph {
+    int32_t width;
+    int32_t height;
+    unsigned char *rgb;
+    unsigned char *thumb;
+    int32_t nsinks;
+    struct sink_node sinks[SINK_MAX];
+    /* statistics */
+    uint64_t frames;
+    uint64_t rgb_frames;
+    int64_t rgb_us;
+    uint64_t thumb_frames;
+    int64_t thumb_us;
+};
+
+struct sink_thumb_job {
+    const unsigned char *src;
+    unsigned char *dst;
+    int32_t width;              /* source */
+    int32_t thumb_width;
+};
+
+static int64_t sink_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sink_thumb_size(int32_t width, int32_t height, int32_t *thumb_width,
+        int32_t *thumb_height)
+{
+    /* YUYV needs an even width */
+    *thumb_width = (width / SINK_THUMB_DIV) & ~1;
+    *thumb_height = height / SINK_THUMB_DIV;
+    if (*thumb_width < 2)
+        *thumb_width = 2;
+    if (*thumb_height < 1)
+        *thumb_height = 1;
+}
+
+/* box filter: every output pixel pair averages a 2 x DIV by DIV source block */
+static void sink_thumb_rows(void *arg, int32_t row_start, int32_t row_end)
+{
+    struct sink_thumb_job *job = (struct sink_thumb_job *)arg;
+    size_t stride = (size_t)job->width * 2;
+    int32_t row, pair, dy, dx;
+    uint32_t y0, y1, u, v;
+
+    for (row = row_start; row < row_end; row++) {
+        const unsigned char *src = job->src + (size_t)row * SINK_THUMB_DIV * stride;
+        unsigned char *dst = job->dst + (size_t)row * job->thumb_width * 2;
+
+        for (pair = 0; pair < job->thumb_width / 2; pair++) {
+            y0 = y1 = u = v = 0;
+            for (dy = 0; dy < SINK_THUMB_DIV; dy++) {
+                /* DIV source pairs per output pixel, 2 DIV per output pair */
+                const unsigned char *p = src + dy * stride + (size_t)pair * SINK_THUMB_DIV * 4;
+
+                for (dx = 0; dx < SINK_THUMB_DIV; dx++, p += 4) {
+                    if (dx < SINK_THUMB_DIV / 2)
+                        y0 += p[0] + p[2];
+                    else
+                        y1 += p[0] + p[2];
+                    u += p[1];
+                    v += p[3];
+                }
+            }
+            dst[0] = y0 / (SINK_THUMB_DIV * SINK_THUMB_DIV);
+            dst[1] = u / (SINK_THUMB_DIV * SINK_THUMB_DIV);
+            dst[2] = y1 / (SINK_THUMB_DIV * SINK_THUMB_DIV);
+            dst[3] = v / (SINK_THUMB_DIV * SINK_THUMB_DIV);
+            dst += 4;
+        }
+    }
+}
+
+/* (re)size the intermediate buffers for width x height frames */
+static int32_t sink_graph_size(struct sink_graph *graph, int32_t width, int32_t height)
+{
+    uint32_t needs = sink_graph_needs(graph);
+    int32_t tw, th;
+
+    if ((graph->width == width) && (graph->height == height))
+        return 0;
+    if (graph->rgb)
+        framepool_unmap(graph->rgb);
+    if (graph->thumb)
+        framepool_unmap(graph->thumb);
+    graph->rgb = graph->thumb = NULL;
+    graph->width = graph->height = 0;
+    sink_thumb_size(width, height, &tw, &th);
+    if ((needs & SINK_NEED_RGB) &&
+        !(graph->rgb = framepool_map((size_t)width * height * 3)))
+        return -1;
+    if ((needs & SINK_NEED_THUMB) &&
+        !(graph->thumb = framepool_map((size_t)tw * th * 2)))
+        return -1;
+    graph->width = width;
+    graph->height = height;
+    return 0;
+}
+
+/* buffers come with the first frame, once every sink is in */
+struct sink_graph *sink_graph_create(void)
+{
+    return (struct sink_graph *)calloc(1, sizeof(struct sink_graph));
+}
+
+void sink_graph_destroy(struct sink_graph *graph)
+{
+    if (!graph)
+        return;
+
+    if (graph->rgb)
+        framepool_unmap(graph->rgb);
+    if (graph->thumb)
+        framepool_unmap(graph->thumb);
+    free(graph);
+}
+
+int32_t sink_graph_add(struct sink_graph *graph, const char *name, uint32_t needs,
+        sink_write_fn write, void *arg)
+{
+    struct sink_node *node;
+
+    if (!graph || !write || (graph->nsinks == SINK_MAX))
+        return -1;
+    node = &graph->sinks[graph->nsinks++];
+    memset(node, 0, sizeof(*node));
+    node->name = name;
+    node->needs = needs;
+    node->write = write;
+    node->arg = arg;
+    /* a new need means new buffers */
+    graph->width = graph->height = 0;
+    return 0;
+}
+
+uint32_t sink_graph_needs(struct sink_graph *graph)
+{
+    uint32_t needs = 0;
+    int32_t i;
+
+    if (!graph)
+        return 0;
+    for (i = 0; i < graph->nsinks; i++)
+        needs |= graph->sinks[i].needs;
+    return needs;
+}
+
+int32_t sink_graph_run(struct sink_graph *graph, struct sink_frame *frame)
+{
+    struct sink_node *node;
+    struct sink_thumb_job job;
+    int64_t start;
+    int32_t i, ret = 0;
+
+    if (!graph || !frame)
+        return -1;
+
+    graph->frames++;
+    frame->rgb = frame->thumb = NULL;
+    sink_thumb_size(frame->width, frame->height, &frame->thumb_width, &frame->thumb_height);
+    if (frame->yuyv && (sink_graph_size(graph, frame->width, frame->height) < 0)) {
+        fprintf(stderr, "sink: no memory for %dx%d intermediates\n",
+                frame->width, frame->height);
+        return -1;
+    }
+
+    for (i = 0; i < graph->nsinks; i++) {
+        node = &graph->sinks[i];
+        if (node->needs && !frame->yuyv) {
+            node->skipped++;
+            continue;
+        }
+        /* each intermediate once per frame, for the first sink that reads it */
+        if ((node->needs & SINK_NEED_RGB) && !frame->rgb) {
+            start = sink_now_us();
+            utils_yuv422p_to_rgb24(frame->yuyv, graph->rgb, frame->width, frame->height);
+            frame->rgb = graph->rgb;
+            graph->rgb_us += sink_now_us() - start;
+            graph->rgb_frames++;
+        }
+        if ((node->needs & SINK_NEED_THUMB) && !frame->thumb) {
+            start = sink_now_us();
+            job.src = frame->yuyv;
+            job.dst = graph->thumb;
+            job.width = frame->width;
+            job.thumb_width = frame->thumb_width;
+            threadpool_parallel_for(threadpool_get_default(), frame->thumb_height,
+                    sink_thumb_rows, &job);
+            frame->thumb = graph->thumb;
+            graph->thumb_us += sink_now_us() - start;
+            graph->thumb_frames++;
+        }
+
+        start = sink_now_us();
+        if (node->write(node->arg, frame) < 0)
+            ret = -1;
+        node->us += sink_now_us() - start;
+        node->frames++;
+    }
+    return ret;
+}
+
+void sink_graph_print_stats(struct sink_graph *graph)
+{
+    struct sink_node *node;
+    int32_t i;
+
+    if (!graph)
+        return;
+
+    fprintf(stderr, "Output graph: %llu frames, RGB %llu (%lld us/frame), thumbnail %llu (%lld us/frame)\n",
+            (unsigned long long)graph->frames,
+            (unsigned long long)graph->rgb_frames,
+            (long long)(graph->rgb_frames ? graph->rgb_us / (int64_t)graph->rgb_frames : 0),
+            (unsigned long long)graph->thumb_frames,
+            (long long)(graph->thumb_frames ? graph->thumb_us / (int64_t)graph->thumb_frames : 0));
+    for (i = 0; i < graph->nsinks; i++) {
+        node = &graph->sinks[i];
+        fprintf(stderr, "  %-10s %llu frames, %lld us/frame, %llu skipped\n", node->name,
+                (unsigned long long)node->frames,
+                (long long)(node->frames ? node->us / (int64_t)node->frames : 0),
+                (unsigned long long)node->skipped);
+    }
+}
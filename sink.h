@@ -0,0 +1,84 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef __SINK_H__
+#define __SINK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * Output graph: capture -> decode -> convert -> sinks. Each sink states
+ * which intermediate images it reads. The union decides whether a
+ * compressed frame is decoded at all (vdIn decode), and RGB and the
+ * thumbnail are computed on the first sink that asks for them in a frame,
+ * then shared read-only by the rest. One frame can thus go to a JPEG
+ * archive, a BMP and a thumbnail with a single decode and conversion.
+ *
+ * Sinks run in the order they were added, on the capture thread.
+ */
+#define SINK_MAX                (8)
+#define SINK_THUMB_DIV          (4)         /* thumbnail is 1/4 per side */
+
+#define SINK_NEED_YUYV          (1 << 0)    /* decoded packed YUYV */
+#define SINK_NEED_RGB           (1 << 1)    /* packed RGB24 */
+#define SINK_NEED_THUMB         (1 << 2)    /* YUYV scaled down by SINK_THUMB_DIV */
+
+struct sink_frame {
+    int32_t width;
+    int32_t height;
+    unsigned char *jpeg;        /* compressed capture, NULL for YUYV capture */
+    size_t jpeg_size;
+    unsigned char *yuyv;        /* NULL when compressed and nobody needs it */
+    const unsigned char *rgb;
+    const unsigned char *thumb;
+    int32_t thumb_width;
+    int32_t thumb_height;
+    const struct timeval *timestamp;
+    uint32_t sequence;
+};
+
+/* -1 ends the capture (the output is gone). */
+typedef int32_t (*sink_write_fn)(void *arg, const struct sink_frame *frame);
+
+struct sink_graph;
+
+struct sink_graph *sink_graph_create(void);
+void sink_graph_destroy(struct sink_graph *graph);
+
+int32_t sink_graph_add(struct sink_graph *graph, const char *name, uint32_t needs,
+        sink_write_fn write, void *arg);
+/* SINK_NEED_* union of every sink. */
+uint32_t sink_graph_needs(struct sink_graph *graph);
+/* Thumbnail size for width x height frames. */
+void sink_thumb_size(int32_t width, int32_t height, int32_t *thumb_width,
+        int32_t *thumb_height);
+
+/*
+ * Run every sink on one frame. The caller fills in the capture fields
+ * (jpeg and/or yuyv, size, timestamp), the rest is filled in on demand.
+ * -1 if a sink asked to stop.
+ */
+int32_t sink_graph_run(struct sink_graph *graph, struct sink_frame *frame);
+
+void sink_graph_print_stats(struct sink_graph *graph);
+
+#endif
@@ -0,0 +1,522 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#define _GNU_SOURCE             /* memfd_create(), accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "snapd.h"
+
+#define SNAPD_IOV_MAX           (8)
+
+static const char *snapd_req_names[SNAPD_REQ_TYPES] = {
+    "snap path", "snap data", "snap fd", "set", "stats"
+};
+
+struct snapd_client {
+    int fd;
+    int32_t pending;            /* req waits for its reply */
+    struct snapd_req req;
+    int64_t start_us;
+    int64_t recv_us;            /* last bytes received */
+    size_t len;
+    char line[SNAPD_LINE_MAX];
+    unsigned char *out;         /* reply bytes the socket did not take yet */
+    size_t out_size, out_len, out_off;
+    int out_fd;                 /* SCM_RIGHTS still to go with them */
+    int64_t progress_us;
+};
+
+struct snapd_stats {
+    uint64_t count;
+    uint64_t errors;
+    int64_t total_us;
+    int64_t max_us;
+    uint32_t hist[SNAPD_HIST_BUCKETS];
+};
+
+struct snapd {
+    int fd;
+    char path[108];             /* sun_path */
+    struct snapd_client clients[SNAPD_MAX_CLIENTS];
+    struct snapd_stats stats[SNAPD_REQ_TYPES];
+    uint64_t connections;
+    uint64_t dropped;
+    uint64_t queued;            /* replies finished by a later poll */
+};
+
+static int64_t snapd_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void snapd_close_client(struct snapd_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    c->pending = 0;
+    c->len = 0;
+    if (c->out_fd >= 0)
+        close(c->out_fd);
+    c->out_fd = -1;
+    free(c->out);
+    c->out = NULL;
+    c->out_size = c->out_len = c->out_off = 0;
+}
+
+/* One non-blocking sendmsg, the first byte carrying pass_fd when there is one. */
+static ssize_t snapd_sendmsg(struct snapd_client *c, struct iovec *iov, int32_t iovcnt,
+        int pass_fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if (pass_fd >= 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    return sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/*
+ * Send what the socket takes now; the rest is copied to the client's queue
+ * and finished by snapd_poll(), the capture loop never waits on a client.
+ */
+static int32_t snapd_send(struct snapd *sd, struct snapd_client *c,
+        struct iovec *iov, int32_t iovcnt, int pass_fd)
+{
+    size_t total = 0, skip, part;
+    unsigned char *grown;
+    ssize_t sent;
+    int32_t i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    sent = snapd_sendmsg(c, iov, iovcnt, pass_fd);
+    if (sent < 0) {
+        if ((errno != EAGAIN) && (errno != EINTR))
+            goto drop;
+        sent = 0;
+    }
+    c->progress_us = snapd_now_us();
+    if ((size_t)sent == total)
+        return 0;
+
+    if (total - sent > c->out_size) {
+        grown = (unsigned char *)realloc(c->out, total - sent);
+        if (!grown)
+            goto drop;
+        c->out = grown;
+        c->out_size = total - sent;
+    }
+    c->out_len = 0;
+    c->out_off = 0;
+    skip = sent;
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        part = iov[i].iov_len - skip;
+        memcpy(c->out + c->out_len, (char *)iov[i].iov_base + skip, part);
+        c->out_len += part;
+        skip = 0;
+    }
+    /* the fd goes with the first byte, the caller closes its own */
+    if (!sent && (pass_fd >= 0) && ((c->out_fd = fcntl(pass_fd, F_DUPFD_CLOEXEC, 0)) < 0))
+        goto drop;
+    sd->queued++;
+    return 0;
+drop:
+    sd->dropped++;
+    snapd_close_client(c);
+    return -1;
+}
+
+/* Continue a queued reply, never blocks; a client stuck for SNAPD_STALL_MS is dropped. */
+static void snapd_flush(struct snapd *sd, struct snapd_client *c)
+{
+    struct iovec iov;
+    ssize_t sent;
+
+    while (c->out_off < c->out_len) {
+        iov.iov_base = c->out + c->out_off;
+        iov.iov_len = c->out_len - c->out_off;
+        sent = snapd_sendmsg(c, &iov, 1, c->out_fd);
+        if (sent < 0) {
+            if (((errno != EAGAIN) && (errno != EINTR)) ||
+                (snapd_now_us() - c->progress_us > SNAPD_STALL_MS * 1000LL)) {
+                sd->dropped++;
+                snapd_close_client(c);
+            }
+            return;
+        }
+        if (c->out_fd >= 0) {
+            close(c->out_fd);
+            c->out_fd = -1;
+        }
+        c->out_off += sent;
+        c->progress_us = snapd_now_us();
+    }
+    c->out_len = c->out_off = 0;
+}
+
+static int32_t snapd_parse(struct snapd_req *req, char *line)
+{
+    char verb[16] = { 0 }, arg[32] = { 0 };
+    int32_t n;
+
+    memset(req, 0, sizeof(*req));
+    n = sscanf(line, "%15s %31s %d", verb, arg, &req->value);
+    if (n < 1)
+        return -1;
+    if (!strcmp(verb, "snap")) {
+        if ((n == 1) || !strcmp(arg, "path"))
+            req->type = SNAPD_REQ_SNAP_PATH;
+        else if (!strcmp(arg, "data"))
+            req->type = SNAPD_REQ_SNAP_DATA;
+        else if (!strcmp(arg, "fd"))
+            req->type = SNAPD_REQ_SNAP_FD;
+        else
+            return -1;
+        return 0;
+    }
+    if (!strcmp(verb, "set") && (n == 3)) {
+        req->type = SNAPD_REQ_SET;
+        strcpy(req->name, arg);
+        return 0;
+    }
+    if (!strcmp(verb, "stats")) {
+        req->type = SNAPD_REQ_STATS;
+        return 0;
+    }
+    return -1;
+}
+
+/* upper bound of the histogram bucket holding the pct-th percentile */
+static int64_t snapd_percentile(const struct snapd_stats *st, int32_t pct)
+{
+    uint64_t want = (st->count * pct + 99) / 100, seen = 0;
+    int32_t bucket;
+
+    for (bucket = 0; bucket < SNAPD_HIST_BUCKETS; bucket++) {
+        seen += st->hist[bucket];
+        if (seen >= want)
+            return 1LL << bucket;
+    }
+    return st->max_us;
+}
+
+static int32_t snapd_reply(struct snapd *sd, struct snapd_req *req, const char *text,
+        const struct iovec *data, int32_t datacnt, int pass_fd, int32_t failed)
+{
+    struct snapd_client *c = (struct snapd_client *)((char *)req -
+            offsetof(struct snapd_client, req));
+    struct snapd_stats *st = &sd->stats[req->type];
+    struct iovec iov[SNAPD_IOV_MAX];
+    int32_t i, ret, bucket = 0;
+    int64_t us;
+
+    if (!c->pending)
+        return -1;
+    iov[0].iov_base = (void *)text;
+    iov[0].iov_len = strlen(text);
+    for (i = 0; (i < datacnt) && (i + 1 < SNAPD_IOV_MAX); i++)
+        iov[i + 1] = data[i];
+    c->pending = 0;
+    ret = snapd_send(sd, c, iov, i + 1, pass_fd);
+
+    us = snapd_now_us() - c->start_us;
+    while (bucket < SNAPD_HIST_BUCKETS - 1 && (1LL << bucket) <= us)
+        bucket++;
+    st->count++;
+    st->errors += failed || (ret < 0);
+    st->total_us += us;
+    if (us > st->max_us)
+        st->max_us = us;
+    st->hist[bucket]++;
+    return ret;
+}
+
+int32_t snapd_reply_path(struct snapd *sd, struct snapd_req *req, const char *path)
+{
+    char text[SNAPD_LINE_MAX + 256];
+
+    snprintf(text, sizeof(text), "ok %s\n", path);
+    return snapd_reply(sd, req, text, NULL, 0, -1, 0);
+}
+
+int32_t snapd_reply_data(struct snapd *sd, struct snapd_req *req,
+        const struct iovec *iov, int32_t iovcnt)
+{
+    char text[32];
+    size_t size = 0;
+    int32_t i, ret;
+    int fd;
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    snprintf(text, sizeof(text), "ok %zu\n", size);
+    if (SNAPD_REQ_SNAP_FD != req->type)
+        return snapd_reply(sd, req, text, iov, iovcnt, -1, 0);
+
+    /* the client maps or reads it, no copy through the socket */
+    fd = memfd_create("cam_cap_snap", MFD_CLOEXEC);
+    if ((fd < 0) || (writev(fd, iov, iovcnt) != (ssize_t)size)) {
+        if (fd >= 0)
+            close(fd);
+        return snapd_reply_error(sd, req, "memfd");
+    }
+    lseek(fd, 0, SEEK_SET);
+    ret = snapd_reply(sd, req, text, NULL, 0, fd, 0);
+    close(fd);
+    return ret;
+}
+
+int32_t snapd_reply_ok(struct snapd *sd, struct snapd_req *req)
+{
+    return snapd_reply(sd, req, "ok\n", NULL, 0, -1, 0);
+}
+
+int32_t snapd_reply_error(struct snapd *sd, struct snapd_req *req, const char *reason)
+{
+    char text[SNAPD_LINE_MAX];
+
+    snprintf(text, sizeof(text), "err %s\n", reason);
+    return snapd_reply(sd, req, text, NULL, 0, -1, 1);
+}
+
+static void snapd_reply_stats(struct snapd *sd, struct snapd_req *req)
+{
+    struct snapd_stats all;
+    char text[SNAPD_LINE_MAX];
+    int32_t type, bucket;
+
+    memset(&all, 0, sizeof(all));
+    for (type = 0; type < SNAPD_REQ_STATS; type++) {
+        const struct snapd_stats *st = &sd->stats[type];
+
+        all.count += st->count;
+        all.total_us += st->total_us;
+        if (st->max_us > all.max_us)
+            all.max_us = st->max_us;
+        for (bucket = 0; bucket < SNAPD_HIST_BUCKETS; bucket++)
+            all.hist[bucket] += st->hist[bucket];
+    }
+    snprintf(text, sizeof(text), "ok %llu %lld %lld %lld %lld\n",
+             (unsigned long long)all.count,
+             (long long)(all.count ? all.total_us / (int64_t)all.count : 0),
+             (long long)snapd_percentile(&all, 50), (long long)snapd_percentile(&all, 99),
+             (long long)all.max_us);
+    snapd_reply(sd, req, text, NULL, 0, -1, 0);
+}
+
+struct snapd *snapd_create(const char *path)
+{
+    struct sockaddr_un addr;
+    struct snapd *sd;
+    int32_t i;
+
+    if (!path || (strlen(path) >= sizeof(addr.sun_path))) {
+        fprintf(stderr, "snapd: bad socket path %s\n", path ? path : "(null)");
+        return NULL;
+    }
+    sd = calloc(1, sizeof(*sd));
+    if (!sd)
+        return NULL;
+    for (i = 0; i < SNAPD_MAX_CLIENTS; i++)
+        sd->clients[i].fd = sd->clients[i].out_fd = -1;
+
+    sd->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd->fd < 0) {
+        fprintf(stderr, "snapd: unable to create the socket (%d)\n", errno);
+        free(sd);
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((bind(sd->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(sd->fd, SNAPD_MAX_CLIENTS) < 0)) {
+        fprintf(stderr, "snapd: unable to listen on %s (%d)\n", path, errno);
+        close(sd->fd);
+        free(sd);
+        return NULL;
+    }
+    strcpy(sd->path, path);
+    return sd;
+}
+
+void snapd_destroy(struct snapd *sd)
+{
+    int32_t i;
+
+    if (!sd)
+        return;
+
+    for (i = 0; i < SNAPD_MAX_CLIENTS; i++)
+        if (sd->clients[i].fd >= 0)
+            snapd_close_client(&sd->clients[i]);
+    close(sd->fd);
+    unlink(sd->path);
+    free(sd);
+}
+
+/*
+ * Parse the next buffered line of an idle client, reading more as needed.
+ * Requests wait while a reply is still queued, so replies stay in order.
+ */
+static void snapd_read(struct snapd *sd, struct snapd_client *c)
+{
+    char *nl;
+    ssize_t len;
+
+    while ((c->fd >= 0) && !c->pending && !c->out_len) {
+        nl = memchr(c->line, '\n', c->len);
+        if (!nl) {
+            if (c->len == sizeof(c->line)) {
+                /* no newline in a full buffer, not our protocol */
+                sd->dropped++;
+                snapd_close_client(c);
+                return;
+            }
+            len = recv(c->fd, c->line + c->len, sizeof(c->line) - c->len, MSG_DONTWAIT);
+            if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+                snapd_close_client(c);
+                return;
+            }
+            if (len < 0)
+                return;
+            c->len += len;
+            c->recv_us = snapd_now_us();
+            continue;
+        }
+        *nl = '\0';
+        if (nl > c->line && nl[-1] == '\r')
+            nl[-1] = '\0';
+        c->pending = 1;
+        /* when the line came in, it may have waited behind an earlier one */
+        c->start_us = c->recv_us;
+        if (snapd_parse(&c->req, c->line) < 0) {
+            c->req.type = SNAPD_REQ_STATS;
+            snapd_reply(sd, &c->req, "err bad request\n", NULL, 0, -1, 1);
+        } else if (SNAPD_REQ_STATS == c->req.type) {
+            snapd_reply_stats(sd, &c->req);
+        }
+        if (c->fd >= 0) {
+            c->len -= nl + 1 - c->line;
+            memmove(c->line, nl + 1, c->len);
+        }
+    }
+}
+
+int32_t snapd_poll(struct snapd *sd)
+{
+    struct snapd_client *c;
+    int32_t i, ready = 0;
+    int fd;
+
+    if (!sd)
+        return 0;
+
+    while ((fd = accept4(sd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        for (i = 0; i < SNAPD_MAX_CLIENTS; i++)
+            if (sd->clients[i].fd < 0)
+                break;
+        if (i == SNAPD_MAX_CLIENTS) {
+            close(fd);
+            sd->dropped++;
+            continue;
+        }
+        sd->clients[i].fd = fd;
+        sd->connections++;
+    }
+    for (i = 0; i < SNAPD_MAX_CLIENTS; i++) {
+        c = &sd->clients[i];
+        if ((c->fd >= 0) && c->out_len)
+            snapd_flush(sd, c);
+        snapd_read(sd, c);
+        ready += c->pending;
+    }
+    return ready;
+}
+
+struct snapd_req *snapd_next(struct snapd *sd)
+{
+    int32_t i;
+
+    if (!sd)
+        return NULL;
+    for (i = 0; i < SNAPD_MAX_CLIENTS; i++)
+        if (sd->clients[i].pending)
+            return &sd->clients[i].req;
+    return NULL;
+}
+
+void snapd_print_stats(struct snapd *sd)
+{
+    int32_t type;
+
+    if (!sd)
+        return;
+
+    fprintf(stderr, "Snapshot server %s: %llu connections, %llu dropped, %llu replies queued\n",
+            sd->path, (unsigned long long)sd->connections, (unsigned long long)sd->dropped,
+            (unsigned long long)sd->queued);
+    for (type = 0; type < SNAPD_REQ_TYPES; type++) {
+        const struct snapd_stats *st = &sd->stats[type];
+
+        if (!st->count)
+            continue;
+        fprintf(stderr, "  %-9s %llu requests, %llu errors, avg %lld us, p50 <%lld us, "
+                "p99 <%lld us, max %lld us\n", snapd_req_names[type],
+                (unsigned long long)st->count, (unsigned long long)st->errors,
+                (long long)(st->total_us / (int64_t)st->count),
+                (long long)snapd_percentile(st, 50), (long long)snapd_percentile(st, 99),
+                (long long)st->max_us);
+    }
+}
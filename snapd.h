@@ -0,0 +1,85 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+
+#ifndef __SNAPD_H__
+#define __SNAPD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Snapshot server for daemon mode. Clients connect to a UNIX stream
+ * socket and send one request per line:
+ *
+ *   snap [path]          save the next frame, reply "ok <path>"
+ *   snap data            reply "ok <size>" then the JPEG bytes
+ *   snap fd              reply "ok <size>" with a memfd holding the JPEG
+ *                        attached (SCM_RIGHTS)
+ *   set <name> <value>   brightness, contrast, saturation, gain, quality
+ *   stats                reply "ok <requests> <avg us> <p50> <p99> <max>"
+ *
+ * Errors are "err <reason>". The capture loop polls once per frame and
+ * answers from that frame, so a reply takes at most one frame period
+ * plus the encode. Latency is timed from the request arriving to the
+ * reply being handed to the socket. What the socket does not take is
+ * queued per client and sent by later polls; a client that takes nothing
+ * for SNAPD_STALL_MS is disconnected.
+ */
+#define SNAPD_MAX_CLIENTS       (16)
+#define SNAPD_STALL_MS          (5000)
+#define SNAPD_LINE_MAX          (128)
+#define SNAPD_HIST_BUCKETS      (26)    /* log2 us, up to ~33 s */
+
+#define SNAPD_REQ_SNAP_PATH     (0)
+#define SNAPD_REQ_SNAP_DATA     (1)
+#define SNAPD_REQ_SNAP_FD       (2)
+#define SNAPD_REQ_SET           (3)
+#define SNAPD_REQ_STATS         (4)
+#define SNAPD_REQ_TYPES         (5)
+
+struct snapd_req {
+    int32_t type;
+    char name[32];              /* SNAPD_REQ_SET */
+    int32_t value;
+};
+
+struct snapd;
+
+struct snapd *snapd_create(const char *path);
+void snapd_destroy(struct snapd *sd);
+
+/* Accept clients and read what they sent, never blocks. Number of
+   requests waiting for a reply. */
+int32_t snapd_poll(struct snapd *sd);
+/* Oldest request without a reply, NULL when there is none. Each one
+   gets exactly one snapd_reply_*() call. */
+struct snapd_req *snapd_next(struct snapd *sd);
+
+int32_t snapd_reply_path(struct snapd *sd, struct snapd_req *req, const char *path);
+/* JPEG bytes in-band, or in a memfd for SNAPD_REQ_SNAP_FD. */
+int32_t snapd_reply_data(struct snapd *sd, struct snapd_req *req,
+        const struct iovec *iov, int32_t iovcnt);
+int32_t snapd_reply_ok(struct snapd *sd, struct snapd_req *req);
+int32_t snapd_reply_error(struct snapd *sd, struct snapd_req *req, const char *reason);
+
+void snapd_print_stats(struct snapd *sd);
+
+#endif
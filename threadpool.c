@@ -0,0 +1,214 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+struct threadpool_worker {
+    struct threadpool *pool;
+    int32_t index;
+    pthread_t thread;
+};
+
+struct threadpool {
+    int32_t nthreads;
+    struct threadpool_worker workers[THREADPOOL_MAX_THREADS];
+
+    pthread_mutex_t submit_lock;   /* one job at a time */
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+
+    /* current job, protected by lock */
+    uint32_t generation;
+    int32_t pending;
+    int32_t quit;
+    threadpool_fn fn;
+    void *arg;
+    int32_t count;
+};
+
+static struct threadpool *default_pool = NULL;
+
+static void threadpool_band(int32_t count, int32_t nbands, int32_t band,
+        int32_t *start, int32_t *end)
+{
+    *start = (int32_t)(((int64_t)count * band) / nbands);
+    *end = (int32_t)(((int64_t)count * (band + 1)) / nbands);
+}
+
+static void *threadpool_worker_main(void *data)
+{
+    struct threadpool_worker *worker = (struct threadpool_worker *)data;
+    struct threadpool *pool = worker->pool;
+    uint32_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        threadpool_fn fn;
+        void *arg;
+        int32_t start, end;
+
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->job_cond, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        fn = pool->fn;
+        arg = pool->arg;
+        threadpool_band(pool->count, pool->nthreads, worker->index, &start, &end);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (start < end)
+            fn(arg, start, end);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct threadpool *threadpool_create(int32_t nthreads)
+{
+    struct threadpool *pool;
+    int32_t i;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > THREADPOOL_MAX_THREADS)
+        nthreads = THREADPOOL_MAX_THREADS;
+
+    pool = (struct threadpool *)calloc(1, sizeof(struct threadpool));
+    if (!pool)
+        return NULL;
+
+    pool->nthreads = nthreads;
+    pthread_mutex_init(&pool->submit_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    /* band 0 belongs to the submitting thread */
+    for (i = 1; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL,
+                           threadpool_worker_main, &pool->workers[i])) {
+            fprintf(stderr, "Unable to create pool thread %d\n", i);
+            pool->nthreads = i;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+    int32_t i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    if (default_pool == pool)
+        default_pool = NULL;
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit_lock);
+    free(pool);
+}
+
+int32_t threadpool_get_threads(struct threadpool *pool)
+{
+    return pool ? pool->nthreads : 1;
+}
+
+void threadpool_parallel_for(struct threadpool *pool, int32_t count,
+        threadpool_fn fn, void *arg)
+{
+    int32_t start, end;
+
+    if (count <= 0)
+        return;
+
+    if (!pool || pool->nthreads < 2 || count < 2 ||
+        pthread_mutex_trylock(&pool->submit_lock)) {
+        fn(arg, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->count = count;
+    pool->pending = pool->nthreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    threadpool_band(count, pool->nthreads, 0, &start, &end);
+    if (start < end)
+        fn(arg, start, end);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->submit_lock);
+}
+
+void threadpool_set_default(struct threadpool *pool)
+{
+    default_pool = pool;
+}
+
+struct threadpool *threadpool_get_default(void)
+{
+    return default_pool;
+}
+
+int32_t threadpool_online_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        return 1;
+    if (n > THREADPOOL_MAX_THREADS)
+        return THREADPOOL_MAX_THREADS;
+    return (int32_t)n;
+}
@@ -0,0 +1,57 @@
+/*******************************************************************************
+#             cam_cap: USB UVC Video Class Snapshot Software                #
+#                                                                             #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stdint.h>
+
+/*
+ * Persistent worker pool used to split per-frame passes (color conversion,
+ * decoder output, encoder input preparation) into row bands. Workers are
+ * created once and sleep between jobs, so no thread is created per frame.
+ */
+
+#define THREADPOOL_MAX_THREADS     (32)
+
+/* Process items [start, end) of a parallel_for job. */
+typedef void (*threadpool_fn)(void *arg, int32_t start, int32_t end);
+
+struct threadpool;
+
+struct threadpool *threadpool_create(int32_t nthreads);
+void threadpool_destroy(struct threadpool *pool);
+int32_t threadpool_get_threads(struct threadpool *pool);
+
+/*
+ * Run fn over [0, count) split into one contiguous band per thread and wait
+ * for all of them. The calling thread works on the first band. If pool is
+ * NULL, has a single thread or is already busy with another job (e.g. called
+ * concurrently from an encoder worker), fn runs inline over the whole range.
+ */
+void threadpool_parallel_for(struct threadpool *pool, int32_t count,
+        threadpool_fn fn, void *arg);
+
+/* Process wide pool used by the utils conversions, may be NULL. */
+void threadpool_set_default(struct threadpool *pool);
+struct threadpool *threadpool_get_default(void);
+
+int32_t threadpool_online_cpus(void);
+
+#endif
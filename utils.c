@@ -32,8 +32,13 @@
 #include <wait.h>
 #include <time.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "huffman.h"
 #include "bmp.h"
+#include "threadpool.h"
+#include "framepool.h"
+#include "dwrite.h"
 #include <assert.h>
 
 #define ISHIFT 11
@@ -238,7 +243,6 @@ nextbyte:
 	    break;
 
 	case M_DRI:
-	printf("find DRI \n");
 	    l = getword();
 	    info.dri = getword();
 	    break;
@@ -281,6 +285,105 @@ static int dec_checkmarker(void)
 }
 
 
+/* entropy decoded coefficients of one MCU, waiting for the idct */
+struct dec_mcu {
+    int dcts[6 * 64 + 16];
+    int max[6];
+};
+
+#define DEC_BATCH_MCU_ROWS 8
+
+struct dec_batch_job {
+    struct dec_mcu *mcus;
+    struct jpeg_decdata *decdata;
+    int mb;
+    int mcusx;
+    int first_row;
+    int xpitch, ypitch, pitch;
+    unsigned char *pic;
+    ftopict convert;
+};
+
+static struct dec_mcu *dec_mcus = NULL;
+static int dec_mcus_count = 0;
+
+/* per-frame decoder scratch, sized by jpeg_decode_init() */
+static struct framepool_arena *dec_arena = NULL;
+
+int jpeg_decode_init(int width, int height)
+{
+    size_t mcus = (size_t)((width + 7) / 8) * DEC_BATCH_MCU_ROWS;
+
+    (void)height;
+    framepool_arena_destroy(dec_arena);
+    dec_arena = framepool_arena_create(sizeof(struct jpeg_decdata) +
+                                       mcus * sizeof(struct dec_mcu) + 2 * FRAMEPOOL_ALIGN);
+    return dec_arena ? 0 : -1;
+}
+
+void jpeg_decode_cleanup(void)
+{
+    framepool_arena_destroy(dec_arena);
+    dec_arena = NULL;
+    free(dec_mcus);
+    dec_mcus = NULL;
+    dec_mcus_count = 0;
+}
+
+static int dec_batch_alloc(int count)
+{
+    struct dec_mcu *mcus;
+
+    if (count <= dec_mcus_count)
+	return 0;
+    mcus = (struct dec_mcu *) realloc(dec_mcus, count * sizeof(struct dec_mcu));
+    if (!mcus)
+	return -1;
+    dec_mcus = mcus;
+    dec_mcus_count = count;
+    return 0;
+}
+
+static void dec_idct_mcus(void *arg, int32_t start, int32_t end)
+{
+    struct dec_batch_job *job = (struct dec_batch_job *) arg;
+    struct jpeg_decdata *decdata = job->decdata;
+    int out[64 * 6];
+    int k;
+
+    for (k = start; k < end; k++) {
+	struct dec_mcu *mcu = job->mcus + k;
+	int mx = k % job->mcusx;
+	int my = job->first_row + k / job->mcusx;
+
+	switch (job->mb) {
+	case 6:
+	    idct(mcu->dcts, out, decdata->dquant[0], IFIX(128.5), mcu->max[0]);
+	    idct(mcu->dcts + 64, out + 64, decdata->dquant[0], IFIX(128.5), mcu->max[1]);
+	    idct(mcu->dcts + 128, out + 128, decdata->dquant[0], IFIX(128.5), mcu->max[2]);
+	    idct(mcu->dcts + 192, out + 192, decdata->dquant[0], IFIX(128.5), mcu->max[3]);
+	    idct(mcu->dcts + 256, out + 256, decdata->dquant[1], IFIX(0.5), mcu->max[4]);
+	    idct(mcu->dcts + 320, out + 320, decdata->dquant[2], IFIX(0.5), mcu->max[5]);
+	    break;
+	case 4:
+	    idct(mcu->dcts, out, decdata->dquant[0], IFIX(128.5), mcu->max[0]);
+	    idct(mcu->dcts + 64, out + 64, decdata->dquant[0], IFIX(128.5), mcu->max[1]);
+	    idct(mcu->dcts + 128, out + 256, decdata->dquant[1], IFIX(0.5), mcu->max[2]);
+	    idct(mcu->dcts + 192, out + 320, decdata->dquant[2], IFIX(0.5), mcu->max[3]);
+	    break;
+	case 3:
+	    idct(mcu->dcts, out, decdata->dquant[0], IFIX(128.5), mcu->max[0]);
+	    idct(mcu->dcts + 64, out + 256, decdata->dquant[1], IFIX(0.5), mcu->max[1]);
+	    idct(mcu->dcts + 128, out + 320, decdata->dquant[2], IFIX(0.5), mcu->max[2]);
+	    break;
+	case 1:
+	    idct(mcu->dcts, out, decdata->dquant[0], IFIX(128.5), mcu->max[0]);
+	    break;
+	}
+	job->convert(out, job->pic + my * job->ypitch + mx * job->xpitch, job->pitch);
+    }
+}
+
 int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 		int *height)
 {
@@ -288,14 +391,21 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
     int i, j, m, tac, tdc;
     int intwidth, intheight;
     int mcusx, mcusy, mx, my;
-    int ypitch ,xpitch,bpp,pitch,x,y;
+    int ypitch ,xpitch,bpp,pitch;
     int mb;
-    int max[6];
     ftopict convert;
+    struct dec_batch_job batch;
     int err = 0;
     int isInitHuffman = 0;
-    decdata = (struct jpeg_decdata *) malloc(sizeof(struct jpeg_decdata));
-    
+    int decdata_heap = 0;
+
+    framepool_arena_reset(dec_arena);
+    decdata = (struct jpeg_decdata *) framepool_arena_alloc(dec_arena, sizeof(struct jpeg_decdata));
+    if (!decdata) {
+	decdata = (struct jpeg_decdata *) malloc(sizeof(struct jpeg_decdata));
+	decdata_heap = 1;
+    }
+
     if (!decdata) {
 	err = -1;
 	goto error;
@@ -358,7 +468,6 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
     getword();
     info.ns = getbyte();
     if (!info.ns){
-    printf("info ns %d/n",info.ns);
 	err = ERR_NOT_YCBCR_221111;
 	goto error;
     }
@@ -389,7 +498,7 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
     m = getbyte();
 
     if (i != 0 || j != 63 || m != 0) {
-    	printf("hmm FW error,not seq DCT ??\n");
+    	fprintf(stderr, "hmm FW error,not seq DCT ??\n");
     }
    // printf("ext huffman table %d \n",isInitHuffman);
     if(!isInitHuffman) {
@@ -473,65 +582,43 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
     dscans[0].next = 2;
     dscans[1].next = 1;
     dscans[2].next = 0;	/* 4xx encoding */
-    for (my = 0,y=0; my < mcusy; my++,y+=ypitch) {
-	for (mx = 0,x=0; mx < mcusx; mx++,x+=xpitch) {
+
+    /* Huffman decoding is serial, so entropy decode a band of MCU rows
+       first and run the idct + YUYV conversion of the band on the pool. */
+    batch.mcus = (struct dec_mcu *) framepool_arena_alloc(dec_arena,
+	    (size_t) mcusx * DEC_BATCH_MCU_ROWS * sizeof(struct dec_mcu));
+    if (!batch.mcus) {
+	if (dec_batch_alloc(mcusx * DEC_BATCH_MCU_ROWS) < 0) {
+	    err = -1;
+	    goto error;
+	}
+	batch.mcus = dec_mcus;
+    }
+    batch.decdata = decdata;
+    batch.mb = mb;
+    batch.mcusx = mcusx;
+    batch.xpitch = xpitch;
+    batch.ypitch = ypitch;
+    batch.pitch = pitch;
+    batch.pic = *pic;
+    batch.convert = convert;
+    for (my = 0; my < mcusy; my += DEC_BATCH_MCU_ROWS) {
+	int rows = mcusy - my;
+	struct dec_mcu *mcu = batch.mcus;
+
+	if (rows > DEC_BATCH_MCU_ROWS)
+	    rows = DEC_BATCH_MCU_ROWS;
+	for (mx = 0; mx < rows * mcusx; mx++, mcu++) {
 	    if (info.dri && !--info.nm)
 		if (dec_checkmarker()) {
 		    err = ERR_WRONG_MARKER;
 		    goto error;
 		}
-	switch (mb){
-	    case 6: {
-		decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);
-		idct(decdata->dcts + 64, decdata->out + 64,
-		     decdata->dquant[0], IFIX(128.5), max[1]);
-		idct(decdata->dcts + 128, decdata->out + 128,
-		     decdata->dquant[0], IFIX(128.5), max[2]);
-		idct(decdata->dcts + 192, decdata->out + 192,
-		     decdata->dquant[0], IFIX(128.5), max[3]);
-		idct(decdata->dcts + 256, decdata->out + 256,
-		     decdata->dquant[1], IFIX(0.5), max[4]);
-		idct(decdata->dcts + 320, decdata->out + 320,
-		     decdata->dquant[2], IFIX(0.5), max[5]);
-	  
-	    } break;
-	    case 4:
-	    {
-		decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);
-		idct(decdata->dcts + 64, decdata->out + 64,
-		     decdata->dquant[0], IFIX(128.5), max[1]);
-		idct(decdata->dcts + 128, decdata->out + 256,
-		     decdata->dquant[1], IFIX(0.5), max[4]);
-		idct(decdata->dcts + 192, decdata->out + 320,
-		     decdata->dquant[2], IFIX(0.5), max[5]);
-	   	   
-	    }
-	    break;
-	    case 3:
-	    	 decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);		     
-		idct(decdata->dcts + 64, decdata->out + 256,
-		     decdata->dquant[1], IFIX(0.5), max[4]);
-		idct(decdata->dcts + 128, decdata->out + 320,
-		     decdata->dquant[2], IFIX(0.5), max[5]);
-	    
-		         
-	    break;
-	    case 1:
-	    	 decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);
-		  
-	    break;
-	    
-	} // switch enc411
-	convert(decdata->out,*pic+y+x,pitch); 
+	    decode_mcus(&in, mcu->dcts, mb, dscans, mcu->max);
 	}
+	batch.first_row = my;
+	threadpool_parallel_for(threadpool_get_default(), rows * mcusx,
+	        dec_idct_mcus, &batch);
     }
 
     m = dec_readmarker(&in);
@@ -539,11 +626,11 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 	err = ERR_NO_EOI;
 	goto error;
     }
-    if (decdata)
+    if (decdata_heap)
 	free(decdata);
     return 0;
   error:
-    if (decdata)
+    if (decdata_heap)
 	free(decdata);
     return err;
 }
@@ -995,14 +1082,20 @@ PREC *qout;
 
 /* translate YUV422Packed to rgb24 */
 
-unsigned int
-utils_yuv422p_to_rgb24(unsigned char *input_ptr, unsigned char * output_ptr, unsigned int image_width, unsigned int image_height)
+struct utils_rgb24_job {
+    unsigned char *input_ptr;
+    unsigned char *output_ptr;
+    unsigned int image_width;
+};
+
+static void utils_yuv422p_to_rgb24_rows(void *arg, int32_t row_start, int32_t row_end)
 {
+	struct utils_rgb24_job *job = (struct utils_rgb24_job *)arg;
 	unsigned int i, size;
 	unsigned char Y, Y1, U, V;
-	unsigned char *buff = input_ptr;
-	unsigned char *output_pt = output_ptr;
-	size = image_width * image_height /2;
+	unsigned char *buff = job->input_ptr + (size_t)row_start * job->image_width * 2;
+	unsigned char *output_pt = job->output_ptr + (size_t)row_start * job->image_width * 3;
+	size = job->image_width * (row_end - row_start) / 2;
 	for (i = size; i > 0; i--) {
 		/* bgr instead rgb ?? */
 		Y = buff[0] ;
@@ -1018,6 +1111,19 @@ utils_yuv422p_to_rgb24(unsigned char *input_ptr, unsigned char * output_ptr, uns
 		*output_pt++ = G_FROMYUV(Y1,U,V); //b
 		*output_pt++ = B_FROMYU(Y1,U); //v
 	}
+}
+
+unsigned int
+utils_yuv422p_to_rgb24(unsigned char *input_ptr, unsigned char * output_ptr, unsigned int image_width, unsigned int image_height)
+{
+	struct utils_rgb24_job job;
+
+	job.input_ptr = input_ptr;
+	job.output_ptr = output_ptr;
+	job.image_width = image_width;
+	/* rows are independent, split the frame in bands over the pool */
+	threadpool_parallel_for(threadpool_get_default(), image_height,
+	        utils_yuv422p_to_rgb24_rows, &job);
 	
 	return FOUR_TWO_TWO;
 } 
@@ -1191,59 +1297,66 @@ int32_t utils_is_huffman(unsigned char *buf)
     return 0;
 }
 
-void utils_get_picture_name (char *picture, const char *name_prefix, int32_t fmt)
+/* Frame size from the SOF0 marker, -1 when there is none. */
+int utils_jpeg_dims(const unsigned char *buf, int size, int *width, int *height)
 {
-    char temp[80] = { 0 };
-    char *myext[] = { "pnm", "jpg", "bmp" };
-    time_t curdate;
-    struct tm *tdate;
-    const char *tmp_prefix = NULL;
-    int32_t tmp_len = 0;
-    memset (temp, '\0', sizeof (temp));
-    time (&curdate);
-    tdate = localtime (&curdate);
-    tmp_len = strlen(name_prefix);
-    if (tmp_len == 0 || tmp_len > 20) {
-        tmp_prefix = "P";
-        tmp_len = 1;
-    } else {
-        tmp_prefix = name_prefix;
-    }
-    snprintf (temp, 25 + tmp_len, "%s-%02d_%02d_%04d-%02d_%02d_%02d.%s", tmp_prefix,
-        tdate->tm_mon + 1, tdate->tm_mday, tdate->tm_year + 1900,
-        tdate->tm_hour, tdate->tm_min, tdate->tm_sec, myext[fmt]);
+    int i;
 
-    memcpy (picture, temp, strlen(temp));
+    for (i = 2; i + 8 < size; i++) {
+        if (buf[i] == 0xff && buf[i + 1] == 0xc0) {
+            *height = (buf[i + 5] << 8) | buf[i + 6];
+            *width = (buf[i + 7] << 8) | buf[i + 8];
+            return 0;
+        }
+    }
+    return -1;
 }
 
-int utils_get_picture_mjpg(const char *name_prefix, unsigned char *buf, int32_t size)
+/* Second resolution; per-frame files are named by fname_frame() instead. */
+void utils_get_picture_name (char *picture, size_t size, const char *name_prefix, int32_t fmt)
 {
-    FILE *file;
-    unsigned char *ptdeb, *ptcur = buf;
-    int sizein;
-    char *name = NULL;
+    char *myext[] = { "pnm", "jpg", "bmp", "avi", "qoi" };
+    time_t curdate;
+    struct tm tdate;
 
-    name = calloc(80,1);
-    utils_get_picture_name(name, name_prefix, 1);
-    file = fopen(name, "wb");
-    if (file != NULL) {
-	    if(!utils_is_huffman(buf)) {
-	        ptdeb = ptcur = buf;
-	        while (((ptcur[0] << 8) | ptcur[1]) != 0xffc0)
-	    	    ptcur++;
-	        sizein = ptcur-ptdeb;
-	        fwrite(buf, sizein, 1, file);
-	        fwrite(dht_data, DHT_SIZE, 1, file);
-	        fwrite(ptcur, size - sizein, 1, file); 
-	    } else {
-	        fwrite(ptcur, size, 1, file); /* ptcur was uninit -wsr */
-	    }     
-	    fclose(file);
-	}
+    time (&curdate);
+    localtime_r (&curdate, &tdate);
+    snprintf (picture, size, "%s-%02d_%02d_%04d-%02d_%02d_%02d.%s",
+        *name_prefix ? name_prefix : "P",
+        tdate.tm_mon + 1, tdate.tm_mday, tdate.tm_year + 1900,
+        tdate.tm_hour, tdate.tm_min, tdate.tm_sec, myext[fmt]);
+}
 
-    if(name)
-	    free(name);
-    return 0;		
+/* the standard Huffman tables as complete DHT marker segments */
+const unsigned char *utils_get_dht(int *size)
+{
+    if (size)
+        *size = DHT_SIZE;
+    return dht_data;
+}
+
+/* The frame as iovecs, with the standard DHT spliced in before SOF0 when missing. */
+int utils_get_picture_jpg_iov(struct iovec *iov, unsigned char *buf, int32_t size)
+{
+    int32_t sof;
+
+    if (!utils_is_huffman(buf)) {
+        for (sof = 2; sof + 1 < size; sof++)
+            if (buf[sof] == 0xff && buf[sof + 1] == 0xc0)
+                break;
+        if (sof + 1 < size) {
+            iov[0].iov_base = buf;
+            iov[0].iov_len = sof;
+            iov[1].iov_base = (void *)dht_data;
+            iov[1].iov_len = DHT_SIZE;
+            iov[2].iov_base = buf + sof;
+            iov[2].iov_len = size - sof;
+            return 3;
+        }
+    }
+    iov[0].iov_base = buf;
+    iov[0].iov_len = size;
+    return 1;
 }
 
 int utils_get_picture_jpg(FILE *file, unsigned char *buf, int32_t size)
@@ -1274,9 +1387,10 @@ static int32_t utils_init_bmp_hdr(BITMAPFILE_t *bmp_file, uint32_t file_size, ui
         return -1;
     }
 
+    memset(bmp_file, 0, sizeof(BITMAPFILE_t));
     bmp_file->header.bfType = ('B' + ('M'<<8));
     bmp_file->header.bfSize = file_size;
-    bmp_file->header.bfOffBits = 54;
+    bmp_file->header.bfOffBits = UTILS_BMP_HDR_SIZE;
 
     bmp_file->info.biSize = 0x28;
     bmp_file->info.biWidth = img_width;
@@ -1284,72 +1398,106 @@ static int32_t utils_init_bmp_hdr(BITMAPFILE_t *bmp_file, uint32_t file_size, ui
     bmp_file->info.biPlanes = 1;
     bmp_file->info.biBitCount = img_bits;
     bmp_file->info.biCompression = 0;
-    bmp_file->info.biSizeImage = 0;
-    bmp_file->info.biClrUsed = 1 << img_bits;
+    bmp_file->info.biSizeImage = file_size - UTILS_BMP_HDR_SIZE;
+    /* no palette for true color */
+    bmp_file->info.biClrUsed = (img_bits <= 8) ? (1 << img_bits) : 0;
     bmp_file->info.biClrImportant = 0;
     bmp_file->info.biXPelsPerMeter = 2048;
     bmp_file->info.biYPelsPerMeter = 2048;
     return 0;
 }
 
-int utils_get_picture_bmp(const char *name_prefix, unsigned char *buf, int32_t width, int32_t height)
+struct utils_bmp_job {
+    unsigned char *input_ptr;
+    unsigned char *output_ptr;
+    unsigned int image_width;
+    unsigned int image_height;
+    size_t stride;
+};
+
+/* rows [row_start, row_end) of the file, bottom-up BGR with zeroed padding */
+static void utils_yuv422p_to_bmp_rows(void *arg, int32_t row_start, int32_t row_end)
 {
-    FILE *foutpict;
-    char *name = NULL;
-    BITMAPFILE_t *bmp_ptr = NULL;
+	struct utils_bmp_job *job = (struct utils_bmp_job *)arg;
+	unsigned char Y, Y1, U, V;
+	int32_t row;
+	unsigned int i;
+
+	for (row = row_start; row < row_end; row++) {
+		unsigned char *buff = job->input_ptr +
+		        (size_t)(job->image_height - 1 - row) * job->image_width * 2;
+		unsigned char *output_pt = job->output_ptr + (size_t)row * job->stride;
+
+		for (i = job->image_width / 2; i > 0; i--) {
+			Y = buff[0];
+			U = buff[1];
+			Y1 = buff[2];
+			V = buff[3];
+			buff += 4;
+			*output_pt++ = B_FROMYU(Y,U);
+			*output_pt++ = G_FROMYUV(Y,U,V);
+			*output_pt++ = R_FROMYV(Y,V);
+
+			*output_pt++ = B_FROMYU(Y1,U);
+			*output_pt++ = G_FROMYUV(Y1,U,V);
+			*output_pt++ = R_FROMYV(Y1,V);
+		}
+		memset(output_pt, 0, job->output_ptr + (size_t)(row + 1) * job->stride - output_pt);
+	}
+}
 
-    bmp_ptr = (BITMAPFILE_t *)malloc(sizeof(BITMAPFILE_t));
-    if (NULL == bmp_ptr) {
-        printf(" not enough memory for bmp header \n");
-    }
-    name = calloc(80,1);
-    utils_get_picture_name(name, name_prefix, 2);
-    utils_init_bmp_hdr(bmp_ptr, (sizeof(BITMAPFILE_t) + width * height * 3 * sizeof(char) - 4), width, height, 24);
-    bmp_ptr->data = (unsigned char *)malloc(width * height * 3 * sizeof(char));
-    if (bmp_ptr->data) {
-	    utils_yuv422p_to_rgb24(buf, bmp_ptr->data, width, height);
-    } else {
-	    printf(" no room to take a picture \n");
-        free(bmp_ptr);
-	    return 0;
-    }
+/*
+ * Packed YUYV to a 24-bit BMP image: one conversion pass into *rows, which
+ * is kept by the caller and only grown when the frame gets larger. hdr
+ * receives the UTILS_BMP_HDR_SIZE byte header; iov[0..1] describe the file.
+ */
+int utils_get_picture_bmp_iov(struct iovec *iov, unsigned char *hdr, unsigned char *buf,
+        int32_t width, int32_t height, unsigned char **rows, size_t *rows_size)
+{
+    BITMAPFILE_t bmp;
+    struct utils_bmp_job job;
+    size_t stride = ((size_t)width * 3 + 3) & ~(size_t)3;
+    size_t size = stride * height;
+
+    if (!hdr || !buf || !rows || !rows_size || width <= 0 || height <= 0 || (width & 1))
+        return -1;
 
-    if(name) {
-	    foutpict = fopen(name, "wb");
-	    fwrite(bmp_ptr, sizeof(BITMAPFILE_t) - 4, 1, foutpict);
-	    fwrite(bmp_ptr->data, sizeof (char), width * height * 3, foutpict);
-	    fclose(foutpict);
-	    free(name);
+    if (*rows_size < size) {
+        unsigned char *grown = (unsigned char *)realloc(*rows, size);
+
+        if (!grown) {
+            fprintf(stderr, "no room to take a picture\n");
+            return -1;
+        }
+        *rows = grown;
+        *rows_size = size;
     }
-    free(bmp_ptr->data);
-    free(bmp_ptr);
-    return 0;
+
+    job.input_ptr = buf;
+    job.output_ptr = *rows;
+    job.image_width = width;
+    job.image_height = height;
+    job.stride = stride;
+    threadpool_parallel_for(threadpool_get_default(), height,
+            utils_yuv422p_to_bmp_rows, &job);
+
+    /* header and info are packed back to back at the start of BITMAPFILE_t */
+    utils_init_bmp_hdr(&bmp, UTILS_BMP_HDR_SIZE + size, width, height, 24);
+    memcpy(hdr, &bmp, UTILS_BMP_HDR_SIZE);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = UTILS_BMP_HDR_SIZE;
+    iov[1].iov_base = *rows;
+    iov[1].iov_len = size;
+    return 2;
 }
 
-int utils_get_picture_yv2(const char *name_prefix, unsigned char *buf, int32_t width, int32_t height)
+/* An RGB24 frame as a binary PPM; hdr needs UTILS_PPM_HDR_SIZE bytes. */
+int utils_get_picture_ppm_iov(struct iovec *iov, char *hdr, const unsigned char *rgb,
+        int32_t width, int32_t height)
 {
-    FILE *foutpict;
-    unsigned char *picture = NULL;
-    char *name = NULL;
-
-    name = calloc(80,1);
-    utils_get_picture_name(name, name_prefix, 0);
-    picture = (unsigned char *)malloc(width * height * 3 * sizeof(char));
-    if (picture) {
-	    utils_yuv422p_to_rgb24(buf, picture, width, height);
-    } else {
-	    printf(" no room to take a picture \n");
-	    return 0;
-    }
-
-    if(name) {
-	    foutpict = fopen(name, "wb");
-	    fprintf(foutpict, "P6\n%d %d\n255\n", width, height);
-	    fwrite(picture, sizeof (char), width * height * 3, foutpict);
-	    fclose(foutpict);
-	    free(name);
-    }
-    free(picture);
-    picture = NULL;
-    return 0;
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = snprintf(hdr, UTILS_PPM_HDR_SIZE, "P6\n%d %d\n255\n", width, height);
+    iov[1].iov_base = (void *)rgb;
+    iov[1].iov_len = (size_t)width * height * 3;
+    return 2;
 }
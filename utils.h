@@ -25,6 +25,10 @@
 #define __UTILS_H__
 
 #include <stdio.h>
+#include <sys/uio.h>
+
+#define UTILS_BMP_HDR_SIZE (54)     /* BITMAPFILEHEADER + BITMAPINFOHEADER */
+#define UTILS_PPM_HDR_SIZE (32)     /* "P6\n<w> <h>\n255\n" */
 
 #define ERR_NO_SOI 1
 #define ERR_NOT_8BIT 2
@@ -42,16 +46,25 @@
 #define ERR_BAD_TABLES 14
 #define ERR_DEPTH_MISMATCH 15
 
+/* Scratch for decoding width x height frames without heap allocations. */
+int jpeg_decode_init(int width, int height);
+void jpeg_decode_cleanup(void);
 int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 		int *height);
-int utils_get_picture_mjpg(const char *name_prefix, unsigned char *buf,
-        int size);
-int utils_get_picture_yv2(const char *name_prefix, unsigned char *buf,
-        int width, int height);
-int utils_get_picture_bmp(const char *name_prefix, unsigned char *buf,
-        int width, int height);
-void utils_get_picture_name (char *picture, const char *name_prefix,
+int utils_get_picture_ppm_iov(struct iovec *iov, char *hdr,
+        const unsigned char *rgb, int width, int height);
+int utils_get_picture_bmp_iov(struct iovec *iov, unsigned char *hdr,
+        unsigned char *buf, int width, int height, unsigned char **rows,
+        size_t *rows_size);
+void utils_get_picture_name (char *picture, size_t size, const char *name_prefix,
         int fmt);
 int utils_get_picture_jpg(FILE *file, unsigned char *buf, int size);
+int utils_get_picture_jpg_iov(struct iovec *iov, unsigned char *buf, int size);
+int utils_is_huffman(unsigned char *buf);
+int utils_jpeg_dims(const unsigned char *buf, int size, int *width, int *height);
+const unsigned char *utils_get_dht(int *size);
+unsigned int utils_yuv422p_to_rgb24(unsigned char *input_ptr,
+        unsigned char *output_ptr, unsigned int image_width,
+        unsigned int image_height);
 
 #endif
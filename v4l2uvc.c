@@ -34,11 +34,13 @@
 #include "v4l2uvc.h"
 #include "cam_cap.h"
 #include "utils.h"
+#include "framepool.h"
 #include "time.h"
 
 static int debug = 0;
 
 static int init_v4l2 (struct vdIn *vd);
+static int init_userptr (struct vdIn *vd);
 
 int init_videoIn (struct vdIn *vd, char *device, int width, int height,
                   int formatIn, int formatOut, int grabmethod)
@@ -48,8 +50,8 @@ int init_videoIn (struct vdIn *vd, char *device, int width, int height,
         return -1;
     if (width == 0 || height == 0)
         return -1;
-    if (grabmethod < 0 || grabmethod > 1)
-        grabmethod = 1;		//mmap by default;
+    if (grabmethod < V4L2UVC_GRAB_READ || grabmethod > V4L2UVC_GRAB_USERPTR)
+        grabmethod = V4L2UVC_GRAB_MMAP;		//mmap by default;
     vd->videodevice = NULL;
     vd->status = NULL;
     vd->pictName = NULL;
@@ -64,23 +66,24 @@ int init_videoIn (struct vdIn *vd, char *device, int width, int height,
     vd->height = height;
     vd->formatIn = formatIn;
     vd->formatOut = formatOut;
+    vd->decode = (CAM_CAP_PIX_OUT_FMT_JPEG != formatOut);
     vd->grabmethod = grabmethod;
     if (init_v4l2 (vd) < 0) {
         fprintf (stderr, " Init v4L2 failed !! exit fatal \n");
         goto error;;
     }
-    /* alloc a temp buffer to reconstruct the pict */
+    /* alloc a temp buffer to reconstruct the pict, huge page backed if asked */
     vd->framesizeIn = (vd->width * vd->height << 1);
     switch (vd->formatIn) {
     case V4L2_PIX_FMT_MJPEG:
-        vd->tmpbuffer = (unsigned char *) calloc (1, (size_t) vd->framesizeIn);
+        vd->tmpbuffer = (unsigned char *) framepool_map ((size_t) vd->framesizeIn);
         if (!vd->tmpbuffer)
             goto error;
         vd->framebuffer =
-                (unsigned char *) calloc (1, (size_t) vd->width * (vd->height + 8) * 2);
+                (unsigned char *) framepool_map ((size_t) vd->width * (vd->height + 8) * 2);
         break;
     case V4L2_PIX_FMT_YUYV:
-        vd->framebuffer = (unsigned char *) calloc (1, (size_t) vd->framesizeIn);
+        vd->framebuffer = (unsigned char *) framepool_map ((size_t) vd->framesizeIn);
         break;
     default:
         fprintf (stderr, " should never arrive exit fatal !!\n");
@@ -91,6 +94,8 @@ int init_videoIn (struct vdIn *vd, char *device, int width, int height,
         goto error;
     return 0;
     error:
+    framepool_unmap (vd->tmpbuffer);
+    vd->tmpbuffer = NULL;
     free (vd->videodevice);
     free (vd->status);
     free (vd->pictName);
@@ -155,6 +160,12 @@ static int init_v4l2 (struct vdIn *vd)
         //vd->formatIn = vd->fmt.fmt.pix.pixelformat;
     }
     /* request buffers */
+    if (V4L2UVC_GRAB_USERPTR == vd->grabmethod) {
+        if (init_userptr (vd) == 0)
+            return 0;
+        fprintf (stderr, "USERPTR capture unavailable, using mmap\n");
+        vd->grabmethod = V4L2UVC_GRAB_MMAP;
+    }
     memset (&vd->rb, 0, sizeof (struct v4l2_requestbuffers));
     vd->rb.count = NB_BUFFER;
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -207,6 +218,47 @@ fatal:
     return -1;
 }
 
+/* The driver fills buffers of ours, huge page backed when enabled. */
+static int init_userptr (struct vdIn *vd)
+{
+    size_t length = (vd->fmt.fmt.pix.sizeimage + 4095) & ~(size_t) 4095;
+    int i;
+
+    memset (&vd->rb, 0, sizeof (struct v4l2_requestbuffers));
+    vd->rb.count = NB_BUFFER;
+    vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vd->rb.memory = V4L2_MEMORY_USERPTR;
+    if (ioctl (vd->fd, VIDIOC_REQBUFS, &vd->rb) < 0 || vd->rb.count < 2)
+        return -1;
+
+    for (i = 0; i < (int) vd->rb.count && i < NB_BUFFER; i++) {
+        vd->mem[i] = framepool_map (length);
+        if (!vd->mem[i])
+            goto err;
+        memset (&vd->buf, 0, sizeof (struct v4l2_buffer));
+        vd->buf.index = i;
+        vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        vd->buf.memory = V4L2_MEMORY_USERPTR;
+        vd->buf.m.userptr = (unsigned long) vd->mem[i];
+        vd->buf.length = length;
+        if (ioctl (vd->fd, VIDIOC_QBUF, &vd->buf) < 0) {
+            fprintf (stderr, "Unable to queue user buffer (%d).\n", errno);
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    for (i = 0; i < NB_BUFFER; i++) {
+        framepool_unmap (vd->mem[i]);
+        vd->mem[i] = NULL;
+    }
+    /* hand the (empty) queue back before switching to mmap */
+    vd->rb.count = 0;
+    ioctl (vd->fd, VIDIOC_REQBUFS, &vd->rb);
+    return -1;
+}
+
 static int video_enable (struct vdIn *vd)
 {
     int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -232,40 +284,155 @@ static int video_disable (struct vdIn *vd)
         return ret;
     }
     vd->isstreaming = 0;
+    /* STREAMOFF takes back every buffer, a held one included */
+    vd->held = 0;
+    return 0;
+}
+
+int uvcRelease (struct vdIn *vd)
+{
+    /* QBUF writes the struct back, vd->buf keeps describing the frame */
+    struct v4l2_buffer buf = vd->buf;
+
+    if (!vd->held)
+        return 0;
+    vd->held = 0;
+    if (vd->burst)
+        return 0;
+    if (ioctl (vd->fd, VIDIOC_QBUF, &buf) < 0) {
+        fprintf (stderr, "Unable to requeue buffer (%d).\n", errno);
+        vd->signalquit = 0;
+        return -1;
+    }
     return 0;
 }
 
 int uvcGrab (struct vdIn *vd)
 {
-#define HEADERFRAME1 0xaf
     int ret;
 
+    if (uvcRelease (vd) < 0)
+        goto err;
+    if (vd->burst) {
+        if (vd->burst_cur + 1 >= vd->burst_count) {
+            fprintf (stderr, "No frames left in the burst.\n");
+            goto err;
+        }
+        vd->burst_cur++;
+        vd->buf = vd->burst_buf[vd->burst_cur];
+        vd->held = 1;
+        vd->materialized = 0;
+        return 0;
+    }
     if (!vd->isstreaming)
         if (video_enable (vd))
             goto err;
     memset (&vd->buf, 0, sizeof (struct v4l2_buffer));
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->buf.memory = V4L2_MEMORY_MMAP;
+    vd->buf.memory = vd->rb.memory;
     ret = ioctl (vd->fd, VIDIOC_DQBUF, &vd->buf);
     if (ret < 0) {
         fprintf (stderr, "Unable to dequeue buffer (%d).\n", errno);
         goto err;
     }
+    vd->held = 1;
+    vd->materialized = 0;
+    return 0;
+    err:
+    vd->signalquit = 0;
+    return -1;
+}
+
+int uvcBurst (struct vdIn *vd, int frames)
+{
+    unsigned char *slot;
+    size_t size;
+    int i;
+
+    if (frames <= 0 || vd->burst)
+        return -1;
+    vd->burst_slot = ((size_t) vd->framesizeIn + 63) & ~(size_t) 63;
+    vd->burst_buf = (struct v4l2_buffer *) calloc ((size_t) frames, sizeof (struct v4l2_buffer));
+    slot = (unsigned char *) framepool_map (vd->burst_slot * frames);
+    if (!vd->burst_buf || !slot) {
+        fprintf (stderr, "Unable to allocate %d burst frames of %zu bytes.\n",
+                 frames, vd->burst_slot);
+        framepool_unmap (slot);
+        free (vd->burst_buf);
+        vd->burst_buf = NULL;
+        return -1;
+    }
+    /* fault the whole burst in now, not at sensor rate */
+    memset (slot, 0, vd->burst_slot * frames);
+
+    vd->burst_bytes = 0;
+    for (i = 0; i < frames; i++) {
+        if (uvcGrab (vd) < 0)
+            break;
+        size = vd->buf.bytesused;
+        if (size > (size_t) vd->framesizeIn)
+            size = vd->framesizeIn;
+        memcpy (slot + vd->burst_slot * i, vd->mem[vd->buf.index], size);
+        vd->burst_buf[i] = vd->buf;
+        vd->burst_buf[i].bytesused = size;
+        vd->burst_bytes += size;
+        if (uvcRelease (vd) < 0)
+            break;
+    }
+    /* nothing is dequeued from here on */
+    if (vd->isstreaming)
+        video_disable (vd);
+    vd->burst = slot;
+    vd->burst_count = i;
+    vd->burst_cur = -1;
+    return i == frames ? 0 : -1;
+}
+
+unsigned char *uvcFrameData (struct vdIn *vd)
+{
+    if (!vd->held)
+        return NULL;
+    if (vd->burst)
+        return vd->burst + vd->burst_slot * vd->burst_cur;
+    return (unsigned char *) vd->mem[vd->buf.index];
+}
+
+int uvcMaterialize (struct vdIn *vd)
+{
+#define HEADERFRAME1 0xaf
+    unsigned char *src;
+    int w, h;
+
+    if (vd->materialized)
+        return 0;
+    src = uvcFrameData (vd);
+    if (!src)
+        goto err;
     switch (vd->formatIn) {
     case V4L2_PIX_FMT_MJPEG:
         if(vd->buf.bytesused <= HEADERFRAME1) {
-            /* Prevent crash on empty image */
-            printf("Ignoring empty buffer ...\n");
-            return 0;
+            /* Prevent crash on empty image, tmpbuffer still holds the previous frame */
+            fprintf(stderr, "Ignoring empty buffer ...\n");
+            return uvcRelease (vd) < 0 ? -1 : UVC_FRAME_EMPTY;
         }
-        if (CAM_CAP_PIX_OUT_FMT_JPEG == vd->formatOut) {
-            memcpy(vd->tmpbuffer, vd->mem[vd->buf.index],vd->buf.bytesused);
+        if (!vd->decode) {
+            memcpy(vd->tmpbuffer, src, vd->buf.bytesused);
             vd->tmpbuf_byteused = vd->buf.bytesused;
         } else {
-            memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+            memcpy(vd->tmpbuffer, src, vd->buf.bytesused);
             vd->tmpbuf_byteused = vd->buf.bytesused;
+            /* jpeg_decode() would realloc() the mapped frame buffer on a size change */
+            if (utils_jpeg_dims(vd->tmpbuffer, vd->tmpbuf_byteused, &w, &h) == 0 &&
+                (w != vd->width || h != vd->height)) {
+                framepool_unmap(vd->framebuffer);
+                vd->framebuffer = (unsigned char *) framepool_map((size_t) w * (h + 8) * 2);
+                if (!vd->framebuffer)
+                    goto err;
+                vd->width = w;
+                vd->height = h;
+            }
             if (jpeg_decode(&vd->framebuffer, vd->tmpbuffer, &vd->width, &vd->height) < 0) {
-                printf("jpeg decode errors\n");
+                fprintf(stderr, "jpeg decode errors\n");
                 goto err;
             }
         }
@@ -274,24 +441,19 @@ int uvcGrab (struct vdIn *vd)
         break;
     case V4L2_PIX_FMT_YUYV:
         if (vd->buf.bytesused > vd->framesizeIn)
-            memcpy (vd->framebuffer, vd->mem[vd->buf.index],
-                    (size_t) vd->framesizeIn);
+            memcpy (vd->framebuffer, src, (size_t) vd->framesizeIn);
         else
-            memcpy (vd->framebuffer, vd->mem[vd->buf.index],
-                    (size_t) vd->buf.bytesused);
+            memcpy (vd->framebuffer, src, (size_t) vd->buf.bytesused);
         break;
     default:
         goto err;
         break;
     }
-    ret = ioctl (vd->fd, VIDIOC_QBUF, &vd->buf);
-    if (ret < 0) {
-        fprintf (stderr, "Unable to requeue buffer (%d).\n", errno);
-        goto err;
-    }
-
-    return 0;
+    vd->materialized = 1;
+    /* the frame lives in our buffers now, the driver can refill this one */
+    return uvcRelease (vd);
     err:
+    uvcRelease (vd);
     vd->signalquit = 0;
     return -1;
 }
@@ -306,14 +468,20 @@ int close_v4l2 (struct vdIn *vd)
     /* If the memory maps are not released the device will remain opened even
      after a call to close(); */
     for (i = 0; i < NB_BUFFER; i++) {
-        munmap (vd->mem[i], vd->buf.length);
+        if (V4L2_MEMORY_USERPTR == vd->rb.memory)
+            framepool_unmap (vd->mem[i]);
+        else if (vd->mem[i])
+            munmap (vd->mem[i], vd->buf.length);
     }
 
-    if (vd->tmpbuffer)
-        free (vd->tmpbuffer);
+    framepool_unmap (vd->tmpbuffer);
     vd->tmpbuffer = NULL;
-    free (vd->framebuffer);
+    framepool_unmap (vd->framebuffer);
     vd->framebuffer = NULL;
+    framepool_unmap (vd->burst);
+    vd->burst = NULL;
+    free (vd->burst_buf);
+    vd->burst_buf = NULL;
     free (vd->videodevice);
     free (vd->status);
     free (vd->pictName);
@@ -373,6 +541,23 @@ int v4l2GetControl (struct vdIn *vd, int control, int *out_val)
     return 0;
 }
 
+/* frames per second as fps_num / fps_den, from the streaming parameters */
+int v4l2GetFrameRate (struct vdIn *vd, unsigned int *fps_num, unsigned int *fps_den)
+{
+    struct v4l2_streamparm parm;
+
+    memset (&parm, 0, sizeof (struct v4l2_streamparm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl (vd->fd, VIDIOC_G_PARM, &parm) < 0)
+        return -1;
+    if (!parm.parm.capture.timeperframe.numerator ||
+        !parm.parm.capture.timeperframe.denominator)
+        return -1;
+    *fps_num = parm.parm.capture.timeperframe.denominator;
+    *fps_den = parm.parm.capture.timeperframe.numerator;
+    return 0;
+}
+
 int v4l2SetControl (struct vdIn *vd, int control, int value)
 {
     struct v4l2_control control_s;
@@ -28,6 +28,10 @@
 #include <linux/videodev2.h>
 
 #define NB_BUFFER 16
+
+#define V4L2UVC_GRAB_READ       0
+#define V4L2UVC_GRAB_MMAP       1
+#define V4L2UVC_GRAB_USERPTR    2   /* driver fills buffers mapped by us */
 #define DHT_SIZE 420
 
 //#define V4L2_CID_BACKLIGHT_COMPENSATION	(V4L2_CID_PRIVATE_BASE+0)
@@ -55,11 +59,20 @@ struct vdIn {
     int tmpbuf_byteused;
     unsigned char *framebuffer;
     int isstreaming;
+    int held;           /* buf is dequeued and still ours */
+    int materialized;   /* tmpbuffer/framebuffer hold buf's frame */
+    unsigned char *burst;               /* burst_count frames of burst_slot bytes */
+    struct v4l2_buffer *burst_buf;      /* their descriptors */
+    size_t burst_slot;
+    int burst_count;
+    int burst_cur;                      /* frame uvcGrab() handed out last */
+    unsigned long long burst_bytes;
     int grabmethod;
     int width;
     int height;
     int formatIn;
     int formatOut;
+    int decode;         /* MJPEG frames are decoded into framebuffer */
     int framesizeIn;
     int signalquit;
     int toggleAvi;
@@ -68,11 +81,32 @@ struct vdIn {
 
 int init_videoIn (struct vdIn *vd, char *device, int width, int height,
                   int formatIn, int formatOut, int grabmethod);
+/*
+ * uvcGrab() only dequeues: vd->buf describes the frame (index, size,
+ * timestamp, sequence) and nothing is copied. uvcMaterialize() copies
+ * and, with decode set, decodes it into tmpbuffer/framebuffer and
+ * gives the buffer back; uvcRelease() gives it back untouched. The next
+ * uvcGrab() releases a frame that was neither. uvcMaterialize() returns
+ * UVC_FRAME_EMPTY, with the buffer given back, for an MJPEG frame with no
+ * image: there is nothing to save.
+ */
+#define UVC_FRAME_EMPTY (1)
 int uvcGrab (struct vdIn *vd);
+int uvcMaterialize (struct vdIn *vd);
+/* The held frame where it lies (driver buffer or burst copy), vd->buf.bytesused long. */
+unsigned char *uvcFrameData (struct vdIn *vd);
+int uvcRelease (struct vdIn *vd);
+/*
+ * Capture frames into preallocated memory with only DQBUF, memcpy and
+ * QBUF per frame, then stop streaming. uvcGrab()/uvcMaterialize() hand
+ * the stored frames out afterwards, in order.
+ */
+int uvcBurst (struct vdIn *vd, int frames);
 int close_v4l2 (struct vdIn *vd);
 
 int v4l2GetControl (struct vdIn *vd, int control, int *out_val);
 int v4l2SetControl (struct vdIn *vd, int control, int value);
+int v4l2GetFrameRate (struct vdIn *vd, unsigned int *fps_num, unsigned int *fps_den);
 int v4l2QueryControl (struct vdIn *vd, int control, struct v4l2_queryctrl *query);
 int v4l2UpControl (struct vdIn *vd, int control);
 int v4l2DownControl (struct vdIn *vd, int control);